@@ -194,7 +194,7 @@ main(int argc, char **argv)
 /* =========================== End of File ================================ */
 EOF
 
-echo "[3/8] Writing udp_server.c (PDU C/D/F/E, 100B payload)"
+echo "[3/8] Writing udp_server.c (PDU C/D/F/E, 100B payload; reliable R/P/K; multi-client)"
 cat > udp_server.c <<'EOF'
 /*
  * ================================================================
@@ -203,26 +203,76 @@ cat > udp_server.c <<'EOF'
  * Copyright (c) 2025 Krish Patel. All Rights Reserved.
  * NOTICE: Sole property of Krish Patel. Generated by 768-lab4.sh.
  * Purpose: UDP File Download Server (PDU: 'C','D','F','E'; 100B data)
+ *          plus reliable mode (PDU: 'R','P','K'; windowed, SACK, paced);
+ *          concurrent clients are interleaved from one event loop
  * ================================================================
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 
 #define DATA_MAX 100
 
+/* Reliable mode: 'R' xid name -> 'P' xid seq flags payload ... <- 'K' xid cum sack seq */
+#define RDT_HDR        10          /* type + xid + seq + flags */
+#define RDT_MAX        1400        /* payload that fits a 1500-byte MTU */
+#define RDT_WIN        256         /* packets in flight, upper bound for cwnd */
+#define RDT_LAST       0x01
+#define RDT_DUPTHRESH  3
+#define RDT_INIT_CWND  4.0
+#define RDT_RTO_INIT   0.2
+#define RDT_RTO_MIN    0.02
+#define RDT_RTO_MAX    1.0
+#define RDT_MAX_TIMEOUTS 8
+#define RDT_QUANTUM    4           /* packets per session per round */
+#define LEGACY_BURST   8           /* legacy 'D' datagrams per session per round */
+#define MAX_SESSIONS   64          /* concurrent transfers */
+
 struct pdu { char type; char data[DATA_MAX]; };
 
+struct rdt_slot {
+    size_t len;
+    double sent;
+    int    retx, sacked, lost;
+    uint32_t retx_next;            /* session's next seq when last resent */
+    unsigned char pkt[RDT_HDR + RDT_MAX];
+};
+
 static void die(const char *msg) { perror(msg); exit(1); }
 
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put_u32(unsigned char *p, uint32_t v){ v = htonl(v); memcpy(p, &v, 4); }
+static uint32_t get_u32(const unsigned char *p){ uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+/* LAB4_DROP=<0..1> drops that fraction of outgoing datagrams, so loss can be
+ * exercised on localhost without netem; LAB4_DROP_SEED makes runs repeatable. */
+static ssize_t lossy_sendto(int s, const void *buf, size_t n, const struct sockaddr *to, socklen_t tl){
+    static double rate = -1.0;
+    if (rate < 0){
+        const char *e = getenv("LAB4_DROP"), *seed = getenv("LAB4_DROP_SEED");
+        rate = e ? atof(e) : 0.0;
+        srand(seed ? (unsigned)atoi(seed) : (unsigned)getpid());
+    }
+    if (rate > 0 && rand() / (RAND_MAX + 1.0) < rate) return (ssize_t)n;
+    return sendto(s, buf, n, 0, to, tl);
+}
+
 static const char* baseptr(const char *path){
     const char *p = path, *last = path;
     while (*p){ if (*p=='/' || *p=='\\') last = p+1; p++; }
@@ -237,8 +287,288 @@ static void basename_sanitized(const char *in, char *out, size_t outsz){
     out[n] = '\0';
 }
 
+static void send_err(int s, const struct sockaddr_in *cli, socklen_t clen, const char *msg){
+    struct pdu out;
+    out.type = 'E';
+    snprintf(out.data, DATA_MAX, "%s", msg);
+    lossy_sendto(s, &out, 1 + strlen(out.data), (const struct sockaddr*)cli, clen);
+}
+
+static FILE *open_requested(int s, const struct sockaddr_in *cli, socklen_t clen,
+                            const char *data, size_t name_len, char *fname, size_t fsz){
+    char fname_req[256];
+    struct stat st;
+    FILE *fp = NULL;
+    if (name_len >= sizeof(fname_req)) name_len = sizeof(fname_req) - 1;
+    memcpy(fname_req, data, name_len);
+    fname_req[name_len] = '\0';
+    basename_sanitized(fname_req, fname, fsz);
+
+    if (stat(fname, &st) < 0 || (fp = fopen(fname, "rb")) == NULL){
+        char msg[DATA_MAX];
+        snprintf(msg, sizeof(msg), "open %.90s", fname);
+        send_err(s, cli, clen, msg);
+        return NULL;
+    }
+    return fp;
+}
+
+/* One transfer in progress.  Sessions are keyed by client address (and the
+ * transfer id in reliable mode) and served round-robin from a single loop. */
+struct session {
+    int    in_use, reliable;
+    struct sockaddr_in cli;
+    socklen_t clen;
+    FILE  *fp;
+    uint32_t xid;
+    struct rdt_slot *win;
+    uint32_t base, next, end, recover;
+    double cwnd, ssthresh, srtt, rttvar, rto, next_tx;
+    int    in_recovery, timeouts;
+};
+
+static struct session sessions[MAX_SESSIONS];
+
+/* Recently finished reliable transfers, so retried requests are ignored. */
+static struct { struct sockaddr_in cli; uint32_t xid; } done_ring[MAX_SESSIONS];
+static int done_pos = 0;
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b){
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static struct session *find_session(const struct sockaddr_in *cli){
+    int i;
+    for (i = 0; i < MAX_SESSIONS; i++)
+        if (sessions[i].in_use && same_addr(&sessions[i].cli, cli)) return &sessions[i];
+    return NULL;
+}
+
+static void end_session(struct session *ss){
+    if (ss->reliable){
+        done_ring[done_pos].cli = ss->cli;
+        done_ring[done_pos].xid = ss->xid;
+        done_pos = (done_pos + 1) % MAX_SESSIONS;
+    }
+    if (ss->fp) fclose(ss->fp);
+    free(ss->win);
+    memset(ss, 0, sizeof(*ss));
+}
+
+static void start_session(int s, const struct sockaddr_in *cli, socklen_t clen,
+                          const unsigned char *req, size_t rn){
+    struct session *ss = find_session(cli);
+    uint32_t xid = 0;
+    int reliable = (req[0] == 'R'), i;
+    char fname[256];
+    FILE *fp;
+
+    if (reliable){
+        if (rn <= 5) return;
+        xid = get_u32(req + 1);
+        if (ss && ss->reliable && ss->xid == xid) return;      /* retried request */
+        for (i = 0; i < MAX_SESSIONS; i++)
+            if (done_ring[i].xid == xid && same_addr(&done_ring[i].cli, cli)) return;
+    }
+    if (ss) end_session(ss);                                  /* client moved on */
+    for (i = 0; i < MAX_SESSIONS && !ss; i++)
+        if (!sessions[i].in_use) ss = &sessions[i];
+    if (!ss){ send_err(s, cli, clen, "server busy"); return; }
+
+    fp = open_requested(s, cli, clen, (const char*)req + (reliable ? 5 : 1),
+                        rn - (reliable ? 5 : 1), fname, sizeof(fname));
+    if (!fp) return;
+    if (reliable && (ss->win = calloc(RDT_WIN, sizeof(*ss->win))) == NULL){
+        fclose(fp);
+        send_err(s, cli, clen, "server busy");
+        return;
+    }
+    ss->in_use = 1;
+    ss->reliable = reliable;
+    ss->cli = *cli;
+    ss->clen = clen;
+    ss->fp = fp;
+    ss->xid = xid;
+    ss->end = UINT32_MAX;
+    ss->cwnd = RDT_INIT_CWND;
+    ss->ssthresh = RDT_WIN;
+    ss->rto = RDT_RTO_INIT;
+}
+
+/* Legacy mode has no flow control: send up to LEGACY_BURST datagrams a turn. */
+static int legacy_turn(int s, struct session *ss){
+    struct pdu out;
+    int sent;
+    for (sent = 0; sent < LEGACY_BURST; sent++){
+        size_t n = fread(out.data, 1, DATA_MAX, ss->fp);
+        if (n < DATA_MAX){
+            if (ferror(ss->fp)){
+                send_err(s, &ss->cli, ss->clen, "read error");
+            } else {
+                out.type = 'F';
+                lossy_sendto(s, &out, 1 + n, (const struct sockaddr*)&ss->cli, ss->clen);
+            }
+            end_session(ss);
+            return sent + 1;
+        }
+        out.type = 'D';
+        lossy_sendto(s, &out, 1 + n, (const struct sockaddr*)&ss->cli, ss->clen);
+    }
+    return sent;
+}
+
+/* The client acks with the next sequence it needs (cum), a 32-bit map of
+ * what it already holds past that and the sequence that triggered the ack,
+ * used for RTT samples.  Holes with RDT_DUPTHRESH later packets sacked are
+ * marked for an immediate resend; so is a resend once RDT_DUPTHRESH packets
+ * sent after it are sacked.  cwnd follows slow start / AIMD. */
+static void rdt_on_ack(struct session *ss, const unsigned char *ack, double now){
+    uint32_t cum = get_u32(ack + 5), sack = get_u32(ack + 9), trig = get_u32(ack + 13);
+    uint32_t hi = 0, seq;
+    int loss = 0, i;
+
+    if (cum > ss->next || trig >= ss->next) return;
+    if (cum > ss->base){
+        /* Sample the RTT off the packet that triggered this ack (Karn: never a resend). */
+        struct rdt_slot *sl = &ss->win[trig % RDT_WIN];
+        uint32_t acked = cum - ss->base;
+        if (trig >= ss->base && !sl->retx){
+            double r = now - sl->sent;
+            if (ss->srtt == 0){ ss->srtt = r; ss->rttvar = r / 2; }
+            else {
+                ss->rttvar = 0.75 * ss->rttvar + 0.25 * (r > ss->srtt ? r - ss->srtt : ss->srtt - r);
+                ss->srtt = 0.875 * ss->srtt + 0.125 * r;
+            }
+            ss->rto = ss->srtt + 4 * ss->rttvar;
+            if (ss->rto < RDT_RTO_MIN) ss->rto = RDT_RTO_MIN;
+            if (ss->rto > RDT_RTO_MAX) ss->rto = RDT_RTO_MAX;
+        }
+        ss->base = cum;
+        ss->timeouts = 0;
+        if (ss->in_recovery && ss->base >= ss->recover) ss->in_recovery = 0;
+        if (!ss->in_recovery) ss->cwnd += (ss->cwnd < ss->ssthresh) ? acked : acked / ss->cwnd;
+        if (ss->cwnd > RDT_WIN) ss->cwnd = RDT_WIN;
+    }
+    for (i = 0; i < 32; i++){
+        if (!(sack & (1u << i))) continue;
+        seq = cum + 1 + (uint32_t)i;
+        if (seq >= ss->next) break;
+        ss->win[seq % RDT_WIN].sacked = 1;
+        hi = seq;
+    }
+    for (seq = ss->base; hi && seq + RDT_DUPTHRESH <= hi; seq++){
+        struct rdt_slot *sl = &ss->win[seq % RDT_WIN];
+        if (sl->sacked || sl->lost) continue;
+        if (!sl->retx || sl->retx_next + RDT_DUPTHRESH <= hi + 1){ sl->lost = 1; loss = 1; }
+    }
+    if (loss && !ss->in_recovery){
+        ss->ssthresh = ss->cwnd / 2 < 2 ? 2 : ss->cwnd / 2;
+        ss->cwnd = ss->ssthresh;
+        ss->in_recovery = 1;
+        ss->recover = ss->next;
+    }
+}
+
+/* Packets still in the network: sent, not sacked and not given up as lost.
+ * cwnd limits this rather than next - base, so new data keeps going out
+ * behind a resend and the sacks it earns show whether the resend got lost. */
+static uint32_t rdt_pipe(const struct session *ss){
+    uint32_t seq, n = 0;
+    for (seq = ss->base; seq < ss->next; seq++){
+        const struct rdt_slot *sl = &ss->win[seq % RDT_WIN];
+        if (!sl->sacked && !sl->lost) n++;
+    }
+    return n;
+}
+
+/* One turn of the sliding-window sender: RTO check, then up to RDT_QUANTUM
+ * packets (holes first, then new data while the pipe is under cwnd), paced
+ * at srtt/cwnd.
+ * next_tx advances by one gap per packet, so a turn that comes late may
+ * catch up, but by no more than RDT_QUANTUM packets. */
+static int rdt_turn(int s, struct session *ss, double now){
+    uint32_t seq;
+    int sent = 0;
+    double gap;
+
+    if (ss->base == ss->end){ end_session(ss); return 0; }
+
+    if (ss->base < ss->next && now - ss->win[ss->base % RDT_WIN].sent > ss->rto){
+        if (++ss->timeouts > RDT_MAX_TIMEOUTS){
+            fprintf(stderr, "reliable transfer to %s:%u abandoned\n",
+                    inet_ntoa(ss->cli.sin_addr), (unsigned)ntohs(ss->cli.sin_port));
+            end_session(ss);
+            return 0;
+        }
+        for (seq = ss->base; seq < ss->next; seq++){
+            struct rdt_slot *sl = &ss->win[seq % RDT_WIN];
+            if (!sl->sacked) sl->lost = 1;
+        }
+        ss->win[ss->base % RDT_WIN].sent = now;
+        ss->ssthresh = ss->cwnd / 2 < 2 ? 2 : ss->cwnd / 2;
+        ss->cwnd = 1;
+        ss->in_recovery = 0;
+        ss->rto = ss->rto * 2 > RDT_RTO_MAX ? RDT_RTO_MAX : ss->rto * 2;
+    }
+
+    gap = ss->srtt > 0 ? ss->srtt / ss->cwnd : 0;
+    if (ss->next_tx < now - RDT_QUANTUM * gap) ss->next_tx = now - RDT_QUANTUM * gap;
+    while (sent < RDT_QUANTUM && now >= ss->next_tx){
+        struct rdt_slot *tx = NULL;
+        for (seq = ss->base; seq < ss->next; seq++){
+            struct rdt_slot *sl = &ss->win[seq % RDT_WIN];
+            if (sl->lost && !sl->sacked){ tx = sl; break; }
+        }
+        if (!tx && ss->next < ss->end && ss->next - ss->base < RDT_WIN &&
+            rdt_pipe(ss) < (uint32_t)ss->cwnd){
+            struct rdt_slot *sl = &ss->win[ss->next % RDT_WIN];
+            size_t n = fread(sl->pkt + RDT_HDR, 1, RDT_MAX, ss->fp);
+            int c;
+            if (ferror(ss->fp)){ send_err(s, &ss->cli, ss->clen, "read error"); end_session(ss); return sent; }
+            if (n == RDT_MAX && (c = getc(ss->fp)) != EOF) ungetc(c, ss->fp);
+            else ss->end = ss->next + 1;
+            sl->pkt[0] = 'P';
+            put_u32(sl->pkt + 1, ss->xid);
+            put_u32(sl->pkt + 5, ss->next);
+            sl->pkt[9] = (ss->next + 1 == ss->end) ? RDT_LAST : 0;
+            sl->len = RDT_HDR + n;
+            sl->retx = sl->sacked = sl->lost = 0;
+            tx = sl;
+            ss->next++;
+        }
+        if (!tx) break;
+        if (tx->lost){ tx->retx = 1; tx->lost = 0; tx->retx_next = ss->next; }
+        tx->sent = now;
+        lossy_sendto(s, tx->pkt, tx->len, (const struct sockaddr*)&ss->cli, ss->clen);
+        ss->next_tx += gap;
+        sent++;
+    }
+    return sent;
+}
+
+/* Earliest time a reliable session needs the loop back without an ack. */
+static double rdt_deadline(const struct session *ss){
+    double t = 1e300;
+    if (ss->base < ss->next) t = ss->win[ss->base % RDT_WIN].sent + ss->rto;
+    if (ss->next_tx < t) t = ss->next_tx;
+    return t;
+}
+
+static void handle_datagram(int s, const unsigned char *buf, ssize_t rn,
+                            const struct sockaddr_in *cli, socklen_t clen){
+    struct session *ss;
+    if (rn <= 0) return;
+    if (buf[0] == 'C' || buf[0] == 'R'){
+        start_session(s, cli, clen, buf, (size_t)rn);
+    } else if (buf[0] == 'K' && rn >= 17){
+        ss = find_session(cli);
+        if (ss && ss->reliable && get_u32(buf + 1) == ss->xid) rdt_on_ack(ss, buf, now_sec());
+    }
+}
+
 int main(int argc, char **argv){
     int port = (argc >= 2) ? atoi(argv[1]) : 32501;
+    int rr = 0;
 
     int s = socket(AF_INET, SOCK_DGRAM, 0);
     if (s < 0) die("socket");
@@ -254,53 +584,47 @@ int main(int argc, char **argv){
     fprintf(stderr, "UDP file server listening on %d\n", port);
 
     for(;;){
-        struct pdu req;
-        struct sockaddr_in cli;
-        socklen_t clen = sizeof(cli);
-        ssize_t rn = recvfrom(s, &req, sizeof(req), 0, (struct sockaddr*)&cli, &clen);
-        if (rn <= 0) continue;
-        if (req.type != 'C') continue;
-
-        char fname_req[256];
-        size_t name_len = (rn > 1) ? (size_t)(rn - 1) : 0;
-        if (name_len >= sizeof(fname_req)) name_len = sizeof(fname_req) - 1;
-        memcpy(fname_req, req.data, name_len);
-        fname_req[name_len] = '\0';
-
-        char fname[256];
-        basename_sanitized(fname_req, fname, sizeof(fname));
-
-        struct stat st;
-        struct pdu out;
-        FILE *fp = NULL;
-
-        if (stat(fname, &st) < 0 || (fp = fopen(fname, "rb")) == NULL){
-            out.type = 'E';
-            snprintf(out.data, DATA_MAX, "open %s", fname);
-            sendto(s, &out, 1 + strlen(out.data), 0, (struct sockaddr*)&cli, clen);
-            if (fp) fclose(fp);
-            continue;
-        }
+        double now, wake = 1e300;
+        int i, active = 0, sent = 0;
+        fd_set rf;
+        struct timeval tv, *tvp = NULL;
 
+        /* Requests and acks for every session, whatever is queued. */
         for(;;){
-            size_t n = fread(out.data, 1, DATA_MAX, fp);
-            if (n < DATA_MAX){
-                if (ferror(fp)){
-                    out.type = 'E';
-                    strncpy(out.data, "read error", DATA_MAX-1);
-                    out.data[DATA_MAX-1] = '\0';
-                    sendto(s, &out, 1 + strlen(out.data), 0, (struct sockaddr*)&cli, clen);
-                } else {
-                    out.type = 'F';
-                    sendto(s, &out, 1 + n, 0, (struct sockaddr*)&cli, clen);
-                }
-                break;
-            } else {
-                out.type = 'D';
-                sendto(s, &out, 1 + n, 0, (struct sockaddr*)&cli, clen);
-            }
+            unsigned char buf[1 + 4 + 256];
+            struct sockaddr_in cli;
+            socklen_t clen = sizeof(cli);
+            ssize_t rn = recvfrom(s, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&cli, &clen);
+            if (rn < 0) break;
+            handle_datagram(s, buf, rn, &cli, clen);
         }
-        fclose(fp);
+
+        /* One turn per session, starting where the last round left off. */
+        now = now_sec();
+        for (i = 0; i < MAX_SESSIONS; i++){
+            struct session *ss = &sessions[(rr + i) % MAX_SESSIONS];
+            if (!ss->in_use) continue;
+            sent += ss->reliable ? rdt_turn(s, ss, now) : legacy_turn(s, ss);
+            if (!ss->in_use) continue;
+            active++;
+            if (!ss->reliable) wake = now;
+            else if (rdt_deadline(ss) < wake) wake = rdt_deadline(ss);
+        }
+        rr = (rr + 1) % MAX_SESSIONS;
+        if (sent) continue;
+
+        /* Nothing could go out: sleep until a pacer or RTO is due or a datagram lands. */
+        if (active){
+            double wait = wake - now;
+            if (wait < 0) wait = 0;
+            if (wait > RDT_RTO_MAX) wait = RDT_RTO_MAX;
+            tv.tv_sec = (time_t)wait;
+            tv.tv_usec = (suseconds_t)((wait - (double)tv.tv_sec) * 1e6);
+            tvp = &tv;
+        }
+        FD_ZERO(&rf);
+        FD_SET(s, &rf);
+        select(s + 1, &rf, NULL, NULL, tvp);
     }
     return 0;
 }
@@ -308,7 +632,7 @@ int main(int argc, char **argv){
 /* =========================== End of File ================================ */
 EOF
 
-echo "[4/8] Writing udp_client.c (interactive + one-shot, dir-safe output)"
+echo "[4/8] Writing udp_client.c (interactive + one-shot, dir-safe output, -r reliable)"
 cat > udp_client.c <<'EOF'
 /*
  * ================================================================
@@ -317,13 +641,17 @@ cat > udp_client.c <<'EOF'
  * Copyright (c) 2025 Krish Patel. All Rights Reserved.
  * NOTICE: Sole property of Krish Patel. Generated by 768-lab4.sh.
  * Purpose: UDP File Download Client (PDU: 'C','D','F','E'; 100B data)
+ *          plus reliable mode with -r (PDU: 'R','P','K'; out-of-order reassembly)
  * ================================================================
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -331,13 +659,48 @@ cat > udp_client.c <<'EOF'
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 
 #define DATA_MAX 100
 
+/* Reliable mode; must match udp_server.c */
+#define RDT_HDR         10
+#define RDT_MAX         1400
+#define RDT_LAST        0x01
+#define RDT_REQ_TRIES   10
+#define RDT_REQ_WAIT_MS 300
+#define RDT_IDLE_MS     5000
+#define RDT_LINGER_MS   500
+
 struct pdu { char type; char data[DATA_MAX]; };
 
 static void die(const char *m){ perror(m); exit(1); }
 
+static void put_u32(unsigned char *p, uint32_t v){ v = htonl(v); memcpy(p, &v, 4); }
+static uint32_t get_u32(const unsigned char *p){ uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+/* LAB4_DROP=<0..1> drops that fraction of outgoing datagrams (see udp_server.c). */
+static ssize_t lossy_send(int sd, const void *buf, size_t n){
+    static double rate = -1.0;
+    if (rate < 0){
+        const char *e = getenv("LAB4_DROP"), *seed = getenv("LAB4_DROP_SEED");
+        rate = e ? atof(e) : 0.0;
+        srand(seed ? (unsigned)atoi(seed) + 1u : (unsigned)getpid());
+    }
+    if (rate > 0 && rand() / (RAND_MAX + 1.0) < rate) return (ssize_t)n;
+    return send(sd, buf, n, 0);
+}
+
+static int wait_readable(int sd, int ms){
+    fd_set rf;
+    struct timeval tv;
+    FD_ZERO(&rf);
+    FD_SET(sd, &rf);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return select(sd + 1, &rf, NULL, NULL, &tv) > 0;
+}
+
 static void trim_nl(char *s){
     size_t n = strlen(s);
     if (n && s[n-1] == '\n') s[n-1] = '\0';
@@ -381,7 +744,7 @@ static int send_filename(int sd, const char *name){
     strncpy(req.data, name, DATA_MAX-1);
     req.data[DATA_MAX-1] = '\0';
     size_t n = strlen(req.data);
-    return (int)write(sd, &req, 1 + n);
+    return (int)lossy_send(sd, &req, 1 + n);
 }
 
 static int recv_pdu(int sd, struct pdu *out){
@@ -442,9 +805,108 @@ fail:
     return -1;
 }
 
+static void send_ack(int sd, uint32_t xid, uint32_t cum, uint32_t trig, const unsigned char *got, size_t gotcap){
+    unsigned char ack[17];
+    uint32_t sack = 0;
+    int i;
+    for (i = 0; i < 32; i++){
+        size_t seq = (size_t)cum + 1 + (size_t)i;
+        if (seq < gotcap && got[seq]) sack |= 1u << i;
+    }
+    ack[0] = 'K';
+    put_u32(ack + 1, xid);
+    put_u32(ack + 5, cum);
+    put_u32(ack + 9, sack);
+    put_u32(ack + 13, trig);
+    lossy_send(sd, ack, sizeof(ack));
+}
+
+/* Reliable download: every 'P' lands at seq * RDT_MAX in the output file, so
+ * out-of-order packets need no reassembly buffer beyond the "got" bitmap. */
+static int download_reliable(int sd, const char *remote, const char *out_hint){
+    static uint32_t counter = 0;
+    char local[512];
+    unsigned char req[5 + DATA_MAX], pkt[RDT_HDR + RDT_MAX + 16];
+    unsigned char *got = NULL;
+    size_t gotcap = 0, n;
+    uint32_t xid, cum = 0, end = UINT32_MAX;
+    int fd = -1, tries = 0, rc = -1;
+
+    build_local_path(remote, out_hint, local, sizeof(local));
+
+    xid = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ ++counter;
+    n = strlen(remote);
+    if (n > DATA_MAX - 1) n = DATA_MAX - 1;
+    req[0] = 'R';
+    put_u32(req + 1, xid);
+    memcpy(req + 5, remote, n);
+    if (lossy_send(sd, req, 5 + n) < 0){ perror("send filename"); return -1; }
+
+    for(;;){
+        ssize_t rn;
+        uint32_t seq;
+        if (!wait_readable(sd, fd >= 0 ? RDT_IDLE_MS : RDT_REQ_WAIT_MS)){
+            if (fd >= 0){ fprintf(stderr, "Transfer stalled\n"); goto done; }
+            if (++tries >= RDT_REQ_TRIES){ fprintf(stderr, "No response from server\n"); goto done; }
+            lossy_send(sd, req, 5 + n);
+            continue;
+        }
+        rn = recv(sd, pkt, sizeof(pkt), 0);
+        if (rn < 0){ perror("recv"); goto done; }
+        if (rn >= 1 && pkt[0] == 'E'){
+            int payload = (int)rn - 1;
+            if (payload > DATA_MAX) payload = DATA_MAX;
+            fprintf(stderr, "Server error: %.*s\n", payload, (const char*)pkt + 1);
+            goto done;
+        }
+        if (rn < RDT_HDR || pkt[0] != 'P' || get_u32(pkt + 1) != xid) continue;
+        seq = get_u32(pkt + 5);
+
+        if (fd < 0){
+            fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0){ perror("open output"); goto done; }
+        }
+        if (pkt[9] & RDT_LAST) end = seq + 1;
+        if (seq >= cum && !(seq < gotcap && got[seq])){
+            size_t len = (size_t)rn - RDT_HDR;
+            if (seq >= gotcap){
+                size_t ncap = gotcap ? gotcap : 1024;
+                unsigned char *ng;
+                while (ncap <= seq) ncap *= 2;
+                ng = realloc(got, ncap);
+                if (!ng){ perror("realloc"); goto done; }
+                memset(ng + gotcap, 0, ncap - gotcap);
+                got = ng;
+                gotcap = ncap;
+            }
+            if (pwrite(fd, pkt + RDT_HDR, len, (off_t)seq * RDT_MAX) != (ssize_t)len){ perror("pwrite"); goto done; }
+            got[seq] = 1;
+            while (cum < gotcap && got[cum]) cum++;
+        }
+        send_ack(sd, xid, cum, seq, got, gotcap);
+        if (cum == end) break;
+    }
+
+    /* Stay around briefly so a lost final ack is answered when the server resends. */
+    while (wait_readable(sd, RDT_LINGER_MS)){
+        ssize_t rn = recv(sd, pkt, sizeof(pkt), 0);
+        if (rn >= RDT_HDR && pkt[0] == 'P' && get_u32(pkt + 1) == xid)
+            send_ack(sd, xid, cum, get_u32(pkt + 5), got, gotcap);
+    }
+    printf("Downloaded to %s\n", local);
+    rc = 0;
+
+done:
+    if (fd >= 0){ close(fd); if (rc != 0) remove(local); }
+    free(got);
+    return rc;
+}
+
 int main(int argc, char **argv){
+    int reliable = 0;
+    if (argc >= 2 && !strcmp(argv[1], "-r")){ reliable = 1; argv[1] = argv[0]; argv++; argc--; }
     if (argc != 3 && argc != 5){
-        fprintf(stderr, "usage:\n  %s HOST PORT                # interactive\n  %s HOST PORT REMOTE OUTPUT  # one-shot (OUTPUT may be a directory)\n",
+        fprintf(stderr, "usage:\n  %s [-r] HOST PORT                # interactive\n  %s [-r] HOST PORT REMOTE OUTPUT  # one-shot (OUTPUT may be a directory)\n  -r: reliable windowed transfer\n",
                 argv[0], argv[0]);
         return 1;
     }
@@ -461,8 +923,14 @@ int main(int argc, char **argv){
 
     if (connect(sd, (struct sockaddr*)&sin, sizeof(sin)) < 0) die("connect");
 
+    int (*download)(int, const char*, const char*) = reliable ? download_reliable : download_one;
+    if (reliable){
+        int rcvbuf = 1 << 20;
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
     if (argc == 5){
-        return download_one(sd, argv[3], argv[4]) == 0 ? 0 : 1;
+        return download(sd, argv[3], argv[4]) == 0 ? 0 : 1;
     }
 
     for(;;){
@@ -475,7 +943,7 @@ int main(int argc, char **argv){
         printf("Save as (file path or directory, blank = same name): ");
         if (!fgets(out_hint, sizeof(out_hint), stdin)) break; trim_nl(out_hint);
 
-        (void)download_one(sd, remote, out_hint[0] ? out_hint : NULL);
+        (void)download(sd, remote, out_hint[0] ? out_hint : NULL);
     }
     return 0;
 }
@@ -537,6 +1005,8 @@ TXT
 for i in $(seq 1 200); do
   printf "[%03d] The quick brown fox jumps over the lazy dog. Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n" "$i" >> sample.txt
 done
+# Multi-MB binary payload for the reliable-mode loss test
+head -c 2000000 /dev/urandom > sample.bin
 
 echo "[8/8] Running local tests"
 
@@ -574,6 +1044,52 @@ else
 fi
 quiet_kill_and_wait "$fs_pid"; fs_pid=""
 
+# --- Reliable mode under 10% injected loss each way (localhost:32502) ---
+LAB4_DROP=0.1 ./udp_server 32502 >/tmp/udp_srv_r.log 2>&1 &
+fs_pid=$!
+sleep 1
+
+LAB4_DROP=0.1 ./udp_client -r 127.0.0.1 32502 sample.bin downloads/ >/tmp/udp_cli_r.log 2>&1 || {
+  echo "Reliable client run: FAIL"
+  sed -n '1,120p' /tmp/udp_cli_r.log || true
+  exit 30
+}
+
+if cmp -s sample.bin downloads/sample.bin; then
+  echo "Reliable download test (10% loss): PASS (downloads/sample.bin matches)"
+else
+  echo "Reliable download test: FAIL – files differ"
+  sed -n '1,120p' /tmp/udp_srv_r.log || true
+  exit 31
+fi
+quiet_kill_and_wait "$fs_pid"; fs_pid=""
+
+# --- Concurrent clients on one server (localhost:32503): 3 reliable + 1 legacy ---
+./udp_server 32503 >/tmp/udp_srv_m.log 2>&1 &
+fs_pid=$!
+sleep 1
+
+mkdir -p downloads/multi
+cli_pids=()
+for i in 1 2 3; do
+  LAB4_DROP=0.1 ./udp_client -r 127.0.0.1 32503 sample.bin "downloads/multi/sample$i.bin" >"/tmp/udp_cli_m$i.log" 2>&1 &
+  cli_pids+=("$!")
+done
+./udp_client 127.0.0.1 32503 sample.txt downloads/multi/ >/tmp/udp_cli_m0.log 2>&1 &
+cli_pids+=("$!")
+multi_ok=1
+for pid in "${cli_pids[@]}"; do wait "$pid" || multi_ok=0; done
+for i in 1 2 3; do cmp -s sample.bin "downloads/multi/sample$i.bin" || multi_ok=0; done
+cmp -s sample.txt downloads/multi/sample.txt || multi_ok=0
+if [[ $multi_ok -eq 1 ]]; then
+  echo "Concurrent download test: PASS (4 clients served at once)"
+else
+  echo "Concurrent download test: FAIL"
+  sed -n '1,120p' /tmp/udp_srv_m.log || true
+  exit 32
+fi
+quiet_kill_and_wait "$fs_pid"; fs_pid=""
+
 echo
 echo "All local tests PASSED ✅"
 echo
@@ -585,5 +1101,7 @@ echo
 echo "  # Terminal B"
 echo "  ./time_client 127.0.0.1 32500"
 echo "  ./udp_client 127.0.0.1 32501 sample.txt downloads/"
+echo "  ./udp_client -r 127.0.0.1 32501 sample.bin downloads/   # reliable mode"
+echo "  # Loss testing without netem: LAB4_DROP=0.1 on either side"
 echo
 echo "Banner: Built and owned by Krish Patel (KrishAdmin) — https://krishadmin.com"
@@ -5,8 +5,12 @@
 # 3) ./P2P_Project.sh build     # builds server and peer binaries into p2p_project/bin
 # 4) ./P2P_Project.sh start     # starts the directory server on UDP 15000, logs to p2p_project/logs
 # 5) ./P2P_Project.sh peer Bob  # launches a peer named "Bob" in p2p_project/peers/Bob
-# 6) ./P2P_Project.sh stop      # stops server and any peers started via this script
-# 7) ./P2P_Project.sh clean     # cleans workspace
+# 6) ./P2P_Project.sh daemon Amy # headless peer "Amy", commands on p2p_project/peers/Amy/control.sock
+# 7) ./P2P_Project.sh shards 3  # instead of start: 3 index shards on UDP 15000-15002; run again to add more
+# 8) ./P2P_Project.sh stop      # stops server and any peers started via this script
+# 9) ./P2P_Project.sh clean     # cleans workspace
+# 10) TRACE=1 ./P2P_Project.sh build  # same build with tracing probes; run with
+#     P2P_TRACE_DIR=/tmp/tr, then p2p_project/bin/trace_decode /tmp/tr/*.trace > trace.json
 #
 # ================================================================
 # Project: COE768 Peer-To-Peer Project - Localhost Bootstrap
@@ -45,7 +49,7 @@ typedef unsigned short u16;
 #define UDP_BUFLEN   512
 #define NAME_LEN     50
 #define MAX_PEERS    100
-#define MAX_CONTENT  100
+#define MAX_CONTENT  65536   /* per peer */
 
 #define T_REG      'R'
 #define T_SEARCH   'S'
@@ -56,10 +60,29 @@ typedef unsigned short u16;
 #define T_ACK      'A'
 #define T_ERR      'E'
 #define T_BYE      'B'
+#define T_SYNC     'V'   /* "since\0epoch\0seq\0", then cursor -> one sync page */
+#define T_DELTA    'W'   /* sync page, ask for the next */
+#define T_DELTAEND 'X'   /* last sync page */
+#define T_MAP      'H'   /* "" -> "version\0count\0ip:port\0..." shard map */
+#define T_MOVED    'G'   /* name belongs to another shard, refetch the map */
+#define T_MAPSET   'I'   /* index to index: newer map, then the sender's ip:port */
+#define T_JOIN     'J'   /* index to index: "ip:port" joins the ring */
+#define T_HANDOFF  'K'   /* index to index: "version\0asker\0page\0" -> entries it now owns */
+#define T_RELEASE  'L'   /* index to index: same, after the last page: drop what was sent */
+#define T_REGN     'U'   /* "peer\0port\0name\0name\0..." many registrations */
+#define T_DEREGN   'Y'   /* "peer\0name\0name\0..." many removals */
 
 #define T_REQ      'D'
 #define T_CHUNK    'C'
 #define T_FINAL    'Z'
+#define T_ZCHUNK   'P'   /* piece of a compressed block, see below */
+
+/* A T_REQ is "name\0" optionally followed by "prio\0" and "lz\0".  With
+   "lz" the host may send a block as T_ZCHUNK frames carrying u16 raw
+   length, u16 packed length and the lz.h data, raw length at most
+   ZBLOCK_MAX.  Blocks start on a frame boundary; T_FINAL still ends the
+   transfer. */
+#define ZBLOCK_MAX 8192
 
 #pragma pack(push, 1)
 typedef struct {
@@ -81,6 +104,7 @@ EOF
   cat > "${SRC_DIR}/directory_server.c" <<'EOF'
 /* Watermark: Krish Patel (KrishAdmin) — directory_server.c */
 /* Watermark: https://krishadmin.com */
+#define _XOPEN_SOURCE 600
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -89,30 +113,143 @@ EOF
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "protocol.h"
+#include "shard.h"
+#include "trace.h"
 
 #ifndef INDEX_PORT
 #define INDEX_PORT 15000
 #endif
 
+/* Catalog changes kept for delta sync; older replicas get a snapshot. */
+#ifndef CATALOG_LOG_LEN
+#define CATALOG_LOG_LEN 1024
+#endif
+
+/* Index-to-index requests are resent every MESH_RETRY_MS, MESH_TRIES times.
+   A pull that runs out of tries waits MESH_BACKOFF_MS, doubling up to
+   MESH_BACKOFF_MAX_MS, and starts another round. */
+#define MESH_RETRY_MS       200
+#define MESH_TRIES          25
+#define MESH_BACKOFF_MS     1000
+#define MESH_BACKOFF_MAX_MS 30000
+
 typedef struct {
     char  name[NAME_LEN + 1];
     char  ip[INET_ADDRSTRLEN];
     u16   tcp_port;
     int   ncontent;
-    char  contents[MAX_CONTENT][NAME_LEN + 1];
-    int   sent_count[MAX_CONTENT];
+    int   cap;                       /* room in contents / sent_count */
+    char  (*contents)[NAME_LEN + 1];
+    int   *sent_count;
+    int   *index;                    /* hash of contents: position + 1, 0 empty */
+    int   nindex;                    /* power of two, 2 * cap */
     int   in_use;
 } Peer;
 
+typedef struct {
+    unsigned long version;
+    char  op;                        /* '+' registered, '-' removed */
+    char  content[NAME_LEN + 1];
+    char  peer[NAME_LEN + 1];
+} CatalogChange;
+
+/* Builds the T_DELTA / T_DELTAEND page answering one T_SYNC. */
+typedef struct {
+    char  kind;                      /* 'D' delta, 'S' snapshot */
+    unsigned long from, to;
+    unsigned long seq;               /* echoed so the client can match it */
+    int   bytes;
+    UdpPDU page;
+} SyncWriter;
+
+/* One entry of the sorted catalog copy snapshot pages are cut from. */
+typedef struct {
+    char  content[NAME_LEN + 1];
+    char  peer[NAME_LEN + 1];
+} SnapEntry;
+
+/* An index-to-index request awaiting its reply on the mesh socket. */
+typedef struct {
+    int    active;
+    UdpPDU req;
+    struct sockaddr_in to;
+    int    tries;
+    double deadline;
+} MeshCall;
+
+/* One entry handed to another shard; port 0 forwards a removal. */
+typedef struct {
+    char  peer[NAME_LEN + 1];
+    char  ip[INET_ADDRSTRLEN];
+    u16   port;
+    char  gone;                      /* removed here before it was cut */
+    char  content[NAME_LEN + 1];
+} HandoffRec;
+
+/* What one shard is pulling from here: the entries it owns, sorted by
+   (peer, content) when it asked for page 0.  Pages are cut from the front
+   as they are asked for and never recut, so a resent page is the same
+   page.  Entries removed here meanwhile are skipped if not yet cut, or
+   follow in a later page as removal records. */
+typedef struct {
+    int   active;
+    HandoffRec *recs;
+    int   nrecs, cap;
+    int   nsnap;                     /* recs[0, nsnap) is the sorted snapshot */
+    int   cut;                       /* recs[0, cut) went into pages */
+    int   npages;
+    int   *pagestart;                /* npages + 1 entries, the last is cut */
+} Handoff;
+
+/* A removal seen here while a pull runs, so the pull does not bring the
+   entry back.  An empty content stands for every entry of the peer. */
+typedef struct {
+    char  peer[NAME_LEN + 1];        /* empty: any peer at ip */
+    char  ip[INET_ADDRSTRLEN];
+    char  content[NAME_LEN + 1];
+} Tomb;
+
 static Peer peers[MAX_PEERS];
 static int  npeers = 0;
 static FILE *glog = NULL;
 
+static unsigned long catalog_epoch = 0;
+static unsigned long catalog_version = 0;
+static CatalogChange catalog_log[CATALOG_LOG_LEN];
+static int  catalog_log_count = 0;
+static SnapEntry *syncSnap = NULL;     /* sorted by (content, peer) */
+static int  nSyncSnap = 0, capSyncSnap = 0;
+static unsigned long syncSnapVersion = 0;
+static int  syncSnapBuilt = 0;
+
+/* Sharded mode (--self): this index owns the names that hash to it. */
+static ShardMap smap;                  /* n == 0: unsharded, owns every name */
+static char self_addr[SHARD_ADDR_LEN];
+static int  self_shard = -1;
+static int  mesh = -1;                 /* sends index-to-index requests */
+static MeshCall joinCall;
+static MeshCall pushCall[MAX_SHARDS];
+static MeshCall pullCall;
+static int  pullPending[MAX_SHARDS];
+static int  pullSavedPage[MAX_SHARDS]; /* where a deferred pull resumes */
+static int  pullSavedReleasing[MAX_SHARDS];
+static double pullRetryAt[MAX_SHARDS]; /* mono_ms() a deferred pull may go on */
+static int  pullBackoff[MAX_SHARDS];   /* ms; 0 until a round goes unanswered */
+static int  pullTarget = -1;
+static int  pullPage = 0;
+static int  pullReleasing = 0;
+static Handoff handoffs[MAX_SHARDS];   /* by the asker's shard number */
+static Tomb *tombs = NULL;
+static int  ntombs = 0, tombcap = 0;
+static int  *tombIndex = NULL;         /* position + 1, 0 empty */
+static int  ntombIndex = 0;            /* power of two, 2 * tombcap */
+
 static void mklogdir_if_missing(const char *dir) {
     struct stat st;
     if (stat(dir, &st) == -1) {
@@ -179,12 +316,89 @@ static int first_free_peer_slot(void) {
     for (i = 0; i < MAX_PEERS; i++) if (!peers[i].in_use) return i;
     return -1;
 }
+static unsigned long name_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619UL; }
+    return h;
+}
+
+/* Linear probing: the slot holding content, or the empty slot ending its run. */
+static int peer_slot(const Peer *p, const char *content) {
+    int mask = p->nindex - 1;
+    int i = (int)(name_hash(content) & (unsigned long)mask);
+    while (p->index[i] && strcmp(p->contents[p->index[i] - 1], content) != 0) i = (i + 1) & mask;
+    return i;
+}
+
 static int find_content_index_in_peer(const Peer *p, const char *content) {
-    int i;
-    for (i = 0; i < p->ncontent; i++) {
-        if (strcmp(p->contents[i], content) == 0) return i;
+    if (p->nindex == 0) return -1;
+    return p->index[peer_slot(p, content)] - 1;
+}
+
+static int name_ptr_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int peer_grow(Peer *p) {
+    int ncap = p->cap ? p->cap * 2 : 16, i;
+    char (*nc)[NAME_LEN + 1] = realloc(p->contents, (size_t)ncap * sizeof(*nc));
+    int *ns, *ni;
+    if (!nc) return 0;
+    p->contents = nc;
+    ns = (int *)realloc(p->sent_count, (size_t)ncap * sizeof(int));
+    if (!ns) return 0;
+    p->sent_count = ns;
+    ni = (int *)calloc((size_t)ncap * 2, sizeof(int));
+    if (!ni) return 0;
+    free(p->index);
+    p->index = ni;
+    p->nindex = ncap * 2;
+    p->cap = ncap;
+    for (i = 0; i < p->ncontent; i++) p->index[peer_slot(p, p->contents[i])] = i + 1;
+    return 1;
+}
+
+static int peer_add_content(Peer *p, const char *content) {
+    if (p->ncontent == p->cap && !peer_grow(p)) return 0;
+    strncpy(p->contents[p->ncontent], content, NAME_LEN);
+    p->contents[p->ncontent][NAME_LEN] = '\0';
+    p->sent_count[p->ncontent] = 0;
+    p->index[peer_slot(p, p->contents[p->ncontent])] = p->ncontent + 1;
+    p->ncontent++;
+    return 1;
+}
+
+/* Removes contents[ci]: empties its slot, shifts back later entries of the
+   probe run that may no longer be reached, then moves the last entry into
+   position ci so removal stays O(1). */
+static void peer_remove_content(Peer *p, int ci) {
+    int mask = p->nindex - 1, last = p->ncontent - 1;
+    int i = peer_slot(p, p->contents[ci]), j = i;
+    p->index[i] = 0;
+    while (1) {
+        int k;
+        j = (j + 1) & mask;
+        if (!p->index[j]) break;
+        k = (int)(name_hash(p->contents[p->index[j] - 1]) & (unsigned long)mask);
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            p->index[i] = p->index[j];
+            p->index[j] = 0;
+            i = j;
+        }
     }
-    return -1;
+    if (ci != last) {
+        p->index[peer_slot(p, p->contents[last])] = ci + 1;
+        memcpy(p->contents[ci], p->contents[last], sizeof(p->contents[ci]));
+        p->sent_count[ci] = p->sent_count[last];
+    }
+    p->ncontent--;
+}
+
+static void peer_free(Peer *p) {
+    free(p->contents);
+    free(p->sent_count);
+    free(p->index);
+    memset(p, 0, sizeof(*p));
 }
 
 static int parse_fields(const char *buf, size_t buflen, const char **out, int max_out) {
@@ -207,6 +421,7 @@ static void send_err(int sock, const struct sockaddr_in *cli, socklen_t clen, co
     p.type = T_ERR;
     sprintf(p.data, "%s", msg);
     sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)cli, clen);
+    TRACE_MARK(TR_REPLY, T_ERR, NULL);
 }
 static void send_ack(int sock, const struct sockaddr_in *cli, socklen_t clen, const char *msg) {
     UdpPDU p;
@@ -214,14 +429,795 @@ static void send_ack(int sock, const struct sockaddr_in *cli, socklen_t clen, co
     p.type = T_ACK;
     sprintf(p.data, "%s", msg ? msg : "OK");
     sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)cli, clen);
+    TRACE_MARK(TR_REPLY, T_ACK, NULL);
+}
+
+static void catalog_note(char op, const char *content, const char *peer) {
+    CatalogChange *c;
+    catalog_version++;
+    c = &catalog_log[catalog_version % CATALOG_LOG_LEN];
+    c->version = catalog_version;
+    c->op = op;
+    strncpy(c->content, content, NAME_LEN);
+    c->content[NAME_LEN] = '\0';
+    strncpy(c->peer, peer, NAME_LEN);
+    c->peer[NAME_LEN] = '\0';
+    if (catalog_log_count < CATALOG_LOG_LEN) catalog_log_count++;
+}
+
+static void sync_header(SyncWriter *w) {
+    memset(&w->page, 0, sizeof(w->page));
+    w->bytes = sprintf(w->page.data, "%c %lu %lu %lu %lu",
+                       w->kind, catalog_epoch, w->from, w->to, w->seq) + 1;
+}
+
+/* Appends one record; returns 0 when the page has no room for it. */
+static int sync_add(SyncWriter *w, char op, const char *content, const char *peer) {
+    int clen = (int)strlen(content) + 1;
+    int plen = (int)strlen(peer) + 1;
+    if (w->bytes + 1 + clen + plen > UDP_BUFLEN) return 0;
+    w->page.data[w->bytes++] = op;
+    memcpy(w->page.data + w->bytes, content, clen);
+    w->bytes += clen;
+    memcpy(w->page.data + w->bytes, peer, plen);
+    w->bytes += plen;
+    return 1;
+}
+
+static int snap_cmp(const void *a, const void *b) {
+    const SnapEntry *x = (const SnapEntry *)a, *y = (const SnapEntry *)b;
+    int c = strcmp(x->content, y->content);
+    return c ? c : strcmp(x->peer, y->peer);
+}
+
+/* Re-sorts the catalog copy if the catalog changed since it was made. */
+static int sync_snapshot(void) {
+    int total = 0, i, j;
+    if (syncSnapBuilt && syncSnapVersion == catalog_version) return 1;
+    for (i = 0; i < MAX_PEERS; i++) if (peers[i].in_use) total += peers[i].ncontent;
+    if (total > capSyncSnap) {
+        SnapEntry *ns = (SnapEntry *)realloc(syncSnap, (size_t)total * sizeof(*ns));
+        if (!ns) return 0;
+        syncSnap = ns;
+        capSyncSnap = total;
+    }
+    nSyncSnap = 0;
+    for (i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].in_use) continue;
+        for (j = 0; j < peers[i].ncontent; j++, nSyncSnap++) {
+            memcpy(syncSnap[nSyncSnap].content, peers[i].contents[j], sizeof(syncSnap[0].content));
+            memcpy(syncSnap[nSyncSnap].peer, peers[i].name, sizeof(syncSnap[0].peer));
+        }
+    }
+    qsort(syncSnap, (size_t)nSyncSnap, sizeof(*syncSnap), snap_cmp);
+    syncSnapVersion = catalog_version;
+    syncSnapBuilt = 1;
+    return 1;
+}
+
+/* One page of a catalog sync.  A first T_SYNC, "since\0epoch\0seq\0",
+   gets the changes after since when the log still holds them, otherwise
+   (log wrapped, index restarted, or since == 0) a snapshot.  The client
+   asks for every next page, adding "kind\0to\0" and where the last page
+   ended: the version for a delta, "content\0peer\0" for a snapshot, so
+   a lost page is simply asked for again.  T_DELTAEND ends the range.
+   Snapshot pages are cut from the catalog as it is then, so the client
+   catches up with the changes since the version of its first page. */
+static void send_sync(int sock, const struct sockaddr_in *cli, socklen_t clen, const char **f, int nf) {
+    SyncWriter w;
+    unsigned long oldest = catalog_version - (unsigned long)catalog_log_count + 1;
+    unsigned long since = strtoul(f[0], NULL, 10), epoch = strtoul(f[1], NULL, 10), v;
+    char kind = nf >= 5 ? f[3][0] : 0;
+    int i = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.seq = nf >= 3 ? strtoul(f[2], NULL, 10) : 0;
+    if (kind == 0) {
+        int delta = since != 0 && epoch == catalog_epoch && since <= catalog_version && since + 1 >= oldest;
+        kind = delta ? 'D' : 'S';
+        v = since;
+        w.to = catalog_version;
+    } else {
+        if (epoch != catalog_epoch || (kind == 'D' ? nf < 6 : nf < 7)) { send_err(sock, cli, clen, "Sync expired"); return; }
+        w.to = strtoul(f[4], NULL, 10);
+        v = strtoul(f[5], NULL, 10);
+        if (kind == 'D' && (w.to > catalog_version || v > w.to || v + 1 < oldest)) { send_err(sock, cli, clen, "Sync expired"); return; }
+    }
+    w.kind = kind;
+    if (kind == 'D') {
+        w.from = since;
+        sync_header(&w);
+        for (; v < w.to; v++) {
+            const CatalogChange *c = &catalog_log[(v + 1) % CATALOG_LOG_LEN];
+            if (!sync_add(&w, c->op, c->content, c->peer)) break;
+        }
+        w.page.type = v == w.to ? T_DELTAEND : T_DELTA;
+    } else {
+        if (!sync_snapshot()) { send_err(sock, cli, clen, "Out of memory"); return; }
+        w.to = syncSnapVersion;
+        if (nf >= 7 && f[3][0]) {
+            /* first entry after (content, peer) */
+            SnapEntry key;
+            int lo = 0, hi = nSyncSnap;
+            strncpy(key.content, f[5], NAME_LEN);
+            key.content[NAME_LEN] = '\0';
+            strncpy(key.peer, f[6], NAME_LEN);
+            key.peer[NAME_LEN] = '\0';
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (snap_cmp(&syncSnap[mid], &key) <= 0) lo = mid + 1;
+                else hi = mid;
+            }
+            i = lo;
+        }
+        sync_header(&w);
+        for (; i < nSyncSnap; i++) if (!sync_add(&w, '+', syncSnap[i].content, syncSnap[i].peer)) break;
+        w.page.type = i == nSyncSnap ? T_DELTAEND : T_DELTA;
+    }
+    sendto(sock, &w.page, sizeof(w.page), 0, (const struct sockaddr *)cli, clen);
+}
+
+/* Adds content for a peer (creating the peer on first use); msg gets the
+   reply text.  Shared by T_REG and by entries handed over from a shard. */
+static int register_entry(const char *peerName, const char *ip, int tcp_port, const char *contentName,
+                          char *msg, const char *why) {
+    int idx, freei, cidx;
+    Peer *p;
+    char logb[256];
+
+    idx = find_peer_by_name(peerName);
+    if (idx >= 0) {
+        if (strcmp(peers[idx].ip, ip) != 0) { strcpy(msg, "Peer name already in use"); return 0; }
+        cidx = find_content_index_in_peer(&peers[idx], contentName);
+        if (cidx >= 0) { strcpy(msg, "Content already registered by this peer"); return 0; }
+        if (peers[idx].ncontent >= MAX_CONTENT || !peer_add_content(&peers[idx], contentName)) {
+            strcpy(msg, "Peer content table full");
+            return 0;
+        }
+        peers[idx].tcp_port = (u16)tcp_port;
+        catalog_note('+', contentName, peerName);
+        sprintf(msg, "Registered content '%s' for peer '%s'", contentName, peerName);
+        sprintf(logb, "%s existing name=%s ip=%s tcp=%d content=%s", why, peerName, ip, tcp_port, contentName);
+        log_msg(logb);
+    } else {
+        freei = first_free_peer_slot();
+        if (freei < 0) { strcpy(msg, "Peer table full"); return 0; }
+        p = &peers[freei];
+        memset(p, 0, sizeof(*p));
+        p->in_use = 1;
+        strncpy(p->name, peerName, NAME_LEN);
+        p->name[NAME_LEN] = '\0';
+        strncpy(p->ip, ip, sizeof(p->ip) - 1);
+        p->tcp_port = (u16)tcp_port;
+        if (!peer_add_content(p, contentName)) { peer_free(p); strcpy(msg, "Out of memory"); return 0; }
+        npeers++;
+        catalog_note('+', contentName, peerName);
+        sprintf(msg, "Peer '%s' registered with content '%s'", peerName, contentName);
+        sprintf(logb, "%s new name=%s ip=%s tcp=%d content=%s", why, peerName, ip, tcp_port, contentName);
+        log_msg(logb);
+    }
+    return 1;
+}
+
+/* Drops one content of a peer; returns 1 when that was its last one and
+   the peer is gone too. */
+static void handoff_forget(const char *peer, const char *content);
+
+static int remove_entry(int pi, int ci, const char *why) {
+    Peer *p = &peers[pi];
+    char logb[256];
+
+    if (strcmp(why, "HANDOFF") != 0) handoff_forget(p->name, p->contents[ci]);
+    catalog_note('-', p->contents[ci], p->name);
+    sprintf(logb, "%s peer %s removed content '%s'", why, p->name, p->contents[ci]);
+    peer_remove_content(p, ci);
+
+    if (p->ncontent == 0) {
+        sprintf(logb, "%s peer %s removed entirely", why, p->name);
+        log_msg(logb);
+        peer_free(p);
+        npeers--;
+        return 1;
+    }
+    log_msg(logb);
+    return 0;
+}
+
+/* ---- Sharding ---- */
+
+static double mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static int owns(const char *content) {
+    return smap.n == 0 || shard_owner(&smap, content) == self_shard;
+}
+
+/* A name that moved to another shard stays here until that shard has
+   pulled and released it; SEARCH keeps being answered for it till then. */
+static int held_here(const char *content) {
+    int i;
+    for (i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use && find_content_index_in_peer(&peers[i], content) >= 0) return 1;
+    }
+    return 0;
+}
+
+static int shard_map_encode(const ShardMap *m, char *buf) {
+    int off = sprintf(buf, "%lu", m->version) + 1, i;
+    off += sprintf(buf + off, "%d", m->n) + 1;
+    for (i = 0; i < m->n; i++) off += sprintf(buf + off, "%s", m->addr[i]) + 1;
+    return off;
+}
+
+static int shard_find(const ShardMap *m, const char *addr) {
+    int i;
+    for (i = 0; i < m->n; i++) if (strcmp(m->addr[i], addr) == 0) return i;
+    return -1;
+}
+
+static void send_map(int sock, const struct sockaddr_in *cli, socklen_t clen) {
+    UdpPDU p;
+    memset(&p, 0, sizeof(p));
+    p.type = T_MAP;
+    shard_map_encode(&smap, p.data);
+    sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)cli, clen);
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void mesh_send(MeshCall *c) {
+    sendto(mesh, &c->req, sizeof(c->req), 0, (struct sockaddr *)&c->to, sizeof(c->to));
+    c->tries++;
+    c->deadline = mono_ms() + MESH_RETRY_MS;
+}
+
+/* Sets up a request to shard `addr` without sending it; data is len
+   bytes of payload.  Returns 0 if addr does not parse. */
+static int mesh_prepare(MeshCall *c, const char *addr, char type, const char *data, int len) {
+    memset(c, 0, sizeof(*c));
+    if (!shard_addr_parse(addr, &c->to)) return 0;
+    c->active = 1;
+    c->req.type = type;
+    memcpy(c->req.data, data, (size_t)len);
+    return 1;
+}
+
+/* Starts a request to shard `addr`. */
+static void mesh_call(MeshCall *c, const char *addr, char type, const char *data, int len) {
+    if (mesh_prepare(c, addr, type, data, len)) mesh_send(c);
+}
+
+/* T_MAPSET carries the map, then who sends it. */
+static void push_map(int i) {
+    char buf[UDP_BUFLEN];
+    int len = shard_map_encode(&smap, buf);
+    len += sprintf(buf + len, "%s", self_addr) + 1;
+    mesh_call(&pushCall[i], smap.addr[i], T_MAPSET, buf, len);
+}
+
+/* Index-to-index requests are only taken from a shard in map m, coming
+   from that shard's IP (the mesh socket is bound to its --self address).
+   This is a source-address check, not authentication: anyone who can
+   send from a shard's IP passes it. */
+static int from_shard(const ShardMap *m, const char *addr, const struct sockaddr_in *cli) {
+    struct sockaddr_in sa;
+    return shard_find(m, addr) >= 0 && shard_addr_parse(addr, &sa) && sa.sin_addr.s_addr == cli->sin_addr.s_addr;
+}
+
+/* A T_MAPSET is taken from a shard in the current map, or before this
+   shard has one, from the shard it asked to join. */
+static int map_sender_ok(const char *sender, const struct sockaddr_in *cli) {
+    struct sockaddr_in sa;
+    if (strcmp(sender, self_addr) == 0) return 0;
+    if (smap.n > 0) return from_shard(&smap, sender, cli);
+    return shard_addr_parse(sender, &sa) && same_addr(&sa, &joinCall.to) && sa.sin_addr.s_addr == cli->sin_addr.s_addr;
+}
+
+/* Asks for page pullPage (or the release) now, or when `at` comes. */
+static void pull_request_at(double at) {
+    char buf[UDP_BUFLEN];
+    int len = sprintf(buf, "%lu", smap.version) + 1;
+    len += sprintf(buf + len, "%s", self_addr) + 1;
+    len += sprintf(buf + len, "%d", pullPage) + 1;
+    if (!mesh_prepare(&pullCall, smap.addr[pullTarget], pullReleasing ? T_RELEASE : T_HANDOFF, buf, len)) return;
+    if (at > mono_ms()) pullCall.deadline = at;
+    else mesh_send(&pullCall);
+}
+
+static void pull_request(void) {
+    pull_request_at(0);
+}
+
+/* Removals seen while pulling, hashed on content (or on the peer name for
+   a whole peer) like a peer's contents. */
+static const char *tomb_key(const Tomb *t) {
+    return t->content[0] ? t->content : t->peer;
+}
+
+static int tomb_slot(const char *key, int want_content, const char *peer, const char *ip, const char *content) {
+    int mask = ntombIndex - 1;
+    int i = (int)(name_hash(key) & (unsigned long)mask);
+    while (tombIndex[i]) {
+        const Tomb *t = &tombs[tombIndex[i] - 1];
+        if (want_content ? (strcmp(t->content, content) == 0 && strcmp(t->ip, ip) == 0 &&
+                            (!t->peer[0] || strcmp(t->peer, peer) == 0))
+                         : (!t->content[0] && strcmp(t->peer, peer) == 0)) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Records that peer (at ip) dropped content, or everything when content
+   is NULL.  Only while a pull runs; returns 1 if recorded. */
+static int tomb_add(const char *peer, const char *ip, const char *content) {
+    Tomb *t;
+    if (pullTarget < 0) return 0;
+    if (ntombs == tombcap) {
+        int ncap = tombcap ? tombcap * 2 : 64, i;
+        Tomb *nt = (Tomb *)realloc(tombs, (size_t)ncap * sizeof(*nt));
+        int *ni;
+        if (!nt) return 0;
+        tombs = nt;
+        ni = (int *)calloc((size_t)ncap * 2, sizeof(int));
+        if (!ni) return 0;
+        free(tombIndex);
+        tombIndex = ni;
+        ntombIndex = ncap * 2;
+        tombcap = ncap;
+        for (i = 0; i < ntombs; i++) {
+            t = &tombs[i];
+            tombIndex[tomb_slot(tomb_key(t), t->content[0] != 0, t->peer, t->ip, t->content)] = i + 1;
+        }
+    }
+    t = &tombs[ntombs];
+    memset(t, 0, sizeof(*t));
+    strncpy(t->peer, peer ? peer : "", NAME_LEN);
+    strncpy(t->ip, ip ? ip : "", sizeof(t->ip) - 1);
+    strncpy(t->content, content ? content : "", NAME_LEN);
+    tombIndex[tomb_slot(tomb_key(t), t->content[0] != 0, t->peer, t->ip, t->content)] = ++ntombs;
+    return 1;
+}
+
+static int tomb_covers(const char *peer, const char *ip, const char *content) {
+    if (ntombs == 0) return 0;
+    return tombIndex[tomb_slot(content, 1, peer, ip, content)] || tombIndex[tomb_slot(peer, 0, peer, ip, content)];
+}
+
+static void tomb_clear(void) {
+    free(tombs);
+    free(tombIndex);
+    tombs = NULL;
+    tombIndex = NULL;
+    ntombs = tombcap = ntombIndex = 0;
+}
+
+/* Pulls, one shard at a time, the entries this shard owns under the new
+   map, then tells that shard to drop them.  A shard that stopped answering
+   stays pending: the others go first, then its pull resumes where it was
+   once its backoff runs out. */
+static void pull_next(void) {
+    double now = mono_ms();
+    int i, wait = -1;
+    pullCall.active = 0;
+    pullTarget = -1;
+    for (i = 0; i < smap.n; i++) {
+        if (!pullPending[i]) continue;
+        if (pullRetryAt[i] <= now) { pullTarget = i; break; }
+        if (wait < 0 || pullRetryAt[i] < pullRetryAt[wait]) wait = i;
+    }
+    if (pullTarget < 0) pullTarget = wait;
+    if (pullTarget < 0) { tomb_clear(); return; }
+    pullPage = pullSavedPage[pullTarget];
+    pullReleasing = pullSavedReleasing[pullTarget];
+    pull_request_at(pullRetryAt[pullTarget]);
+}
+
+/* The shard pulled from went MESH_TRIES sends without answering: set its
+   pull aside for a while and go on with the others. */
+static void pull_defer(void) {
+    int t = pullTarget;
+    char logb[160];
+    pullBackoff[t] = pullBackoff[t] ? pullBackoff[t] * 2 : MESH_BACKOFF_MS;
+    if (pullBackoff[t] > MESH_BACKOFF_MAX_MS) pullBackoff[t] = MESH_BACKOFF_MAX_MS;
+    pullRetryAt[t] = mono_ms() + pullBackoff[t];
+    pullSavedPage[t] = pullPage;
+    pullSavedReleasing[t] = pullReleasing;
+    sprintf(logb, "Handoff from %s not answering, retrying in %d ms", smap.addr[t], pullBackoff[t]);
+    log_msg(logb);
+    pull_next();
+}
+
+static void handoff_free(Handoff *h) {
+    free(h->recs);
+    free(h->pagestart);
+    memset(h, 0, sizeof(*h));
+}
+
+static void shard_install(const ShardMap *m) {
+    char logb[128];
+    int i;
+    for (i = 0; i < MAX_SHARDS; i++) handoff_free(&handoffs[i]);
+    smap = *m;
+    self_shard = shard_find(&smap, self_addr);
+    sprintf(logb, "Shard map v%lu installed, %d shard(s), this is shard %d", smap.version, smap.n, self_shard);
+    log_msg(logb);
+    printf("%s\n", logb);
+    for (i = 0; i < MAX_SHARDS; i++) {
+        pullPending[i] = i < smap.n && i != self_shard && self_shard >= 0;
+        pullSavedPage[i] = pullSavedReleasing[i] = pullBackoff[i] = 0;
+        pullRetryAt[i] = 0;
+        if (i >= smap.n) pushCall[i].active = 0;
+    }
+    pull_next();
+}
+
+/* T_JOIN from a new shard: grow the ring, install, and push it to all. */
+static void shard_join(const char *addr) {
+    ShardMap m = smap;
+    int i;
+    if (shard_find(&m, addr) >= 0 || m.n >= MAX_SHARDS) return;
+    strcpy(m.addr[m.n++], addr);
+    m.version++;
+    shard_map_build(&m);
+    shard_install(&m);
+    for (i = 0; i < smap.n; i++) if (i != self_shard) push_map(i);
+}
+
+static int handoff_rec_cmp(const void *a, const void *b) {
+    const HandoffRec *x = (const HandoffRec *)a, *y = (const HandoffRec *)b;
+    int c = strcmp(x->peer, y->peer);
+    return c ? c : strcmp(x->content, y->content);
+}
+
+static int handoff_push(Handoff *h, const char *peer, const char *ip, u16 port, const char *content) {
+    HandoffRec *r;
+    if (h->nrecs == h->cap) {
+        int ncap = h->cap ? h->cap * 2 : 64;
+        HandoffRec *nr = (HandoffRec *)realloc(h->recs, (size_t)ncap * sizeof(*nr));
+        if (!nr) return 0;
+        h->recs = nr;
+        h->cap = ncap;
+    }
+    r = &h->recs[h->nrecs++];
+    memset(r, 0, sizeof(*r));
+    strcpy(r->peer, peer);
+    strcpy(r->ip, ip);
+    r->port = port;
+    strcpy(r->content, content);
+    return 1;
+}
+
+/* Snapshot of the entries shard `want` owns, taken on its page 0. */
+static int handoff_start(Handoff *h, int want) {
+    int i, j;
+    handoff_free(h);
+    h->active = 1;
+    h->pagestart = (int *)calloc(1, sizeof(int));
+    if (!h->pagestart) { handoff_free(h); return 0; }
+    for (i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].in_use) continue;
+        for (j = 0; j < peers[i].ncontent; j++) {
+            if (shard_owner(&smap, peers[i].contents[j]) != want) continue;
+            if (!handoff_push(h, peers[i].name, peers[i].ip, peers[i].tcp_port, peers[i].contents[j])) { handoff_free(h); return 0; }
+        }
+    }
+    qsort(h->recs, (size_t)h->nrecs, sizeof(*h->recs), handoff_rec_cmp);
+    h->nsnap = h->nrecs;
+    return 1;
+}
+
+/* Called before an entry leaves this index other than by a release. */
+static void handoff_forget(const char *peer, const char *content) {
+    HandoffRec key, *r;
+    Handoff *h;
+    if (smap.n == 0) return;
+    h = &handoffs[shard_owner(&smap, content)];
+    if (!h->active) return;
+    strcpy(key.peer, peer);
+    strcpy(key.content, content);
+    r = (HandoffRec *)bsearch(&key, h->recs, (size_t)h->nsnap, sizeof(*h->recs), handoff_rec_cmp);
+    if (!r) return;
+    if (r - h->recs >= h->cut) r->gone = 1;
+    else handoff_push(h, r->peer, r->ip, 0, r->content);
+}
+
+static int handoff_reclen(const HandoffRec *r) {
+    char port[8];
+    return (int)(strlen(r->peer) + strlen(r->ip) + strlen(r->content)) + sprintf(port, "%u", (unsigned)r->port) + 4;
+}
+
+/* Cuts the next page from what is left. */
+static int handoff_cut(Handoff *h) {
+    int *np = (int *)realloc(h->pagestart, (size_t)(h->npages + 2) * sizeof(int));
+    int used = 0;
+    if (!np) return 0;
+    h->pagestart = np;
+    while (h->cut < h->nrecs) {
+        const HandoffRec *r = &h->recs[h->cut];
+        if (!r->gone) {
+            int rlen = handoff_reclen(r);
+            if (used + rlen > UDP_BUFLEN - 24) break;
+            used += rlen;
+        }
+        h->cut++;
+    }
+    h->pagestart[++h->npages] = h->cut;
+    return 1;
+}
+
+static int handoff_left(const Handoff *h) {
+    int i;
+    for (i = h->cut; i < h->nrecs; i++) if (!h->recs[i].gone) return 1;
+    return 0;
+}
+
+/* Forgets what shard `want` has pulled: the records that went out in
+   pages, nothing cut later. */
+static void handoff_release(int want) {
+    Handoff *h = &handoffs[want];
+    int i;
+    for (i = 0; i < h->cut; i++) {
+        const HandoffRec *r = &h->recs[i];
+        int pi, ci;
+        if (r->gone || r->port == 0) continue;
+        pi = find_peer_by_name(r->peer);
+        ci = pi >= 0 && strcmp(peers[pi].ip, r->ip) == 0 ? find_content_index_in_peer(&peers[pi], r->content) : -1;
+        if (ci >= 0) remove_entry(pi, ci, "HANDOFF");
+    }
+    handoff_free(h);
+}
+
+/* T_HANDOFF / T_RELEASE from shard `want`, which has every page before
+   `pageno`.  Answers with page `pageno` ("pageno\0last\0" then
+   "peer\0ip\0port\0content\0" records) or, on a release with nothing
+   left to send, drops what was sent and acks. */
+static void serve_handoff(int sock, const struct sockaddr_in *cli, socklen_t clen, int want, int pageno, int release) {
+    Handoff *h = &handoffs[want];
+    UdpPDU out;
+    int off, i;
+
+    memset(&out, 0, sizeof(out));
+    if (want == self_shard) { send_err(sock, cli, clen, "Cannot hand off to itself"); return; }
+    if (!h->active && !release && pageno == 0 && !handoff_start(h, want)) { send_err(sock, cli, clen, "Out of memory"); return; }
+    if (!h->active && release) {
+        out.type = T_ACK;
+        out.data[0] = T_RELEASE;
+        sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+        return;
+    }
+    if (!h->active || pageno < 0 || pageno > h->npages) { send_err(sock, cli, clen, "No such handoff page"); return; }
+    if (pageno == h->npages) {
+        if (release && !handoff_left(h)) {
+            handoff_release(want);
+            out.type = T_ACK;
+            out.data[0] = T_RELEASE;
+            sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+            return;
+        }
+        if (!handoff_cut(h)) { send_err(sock, cli, clen, "Out of memory"); return; }
+    }
+    out.type = T_HANDOFF;
+    off = sprintf(out.data, "%d", pageno) + 1;
+    off += sprintf(out.data + off, "%d", pageno == h->npages - 1 && !handoff_left(h)) + 1;
+    for (i = h->pagestart[pageno]; i < h->pagestart[pageno + 1]; i++) {
+        const HandoffRec *r = &h->recs[i];
+        if (r->gone) continue;
+        off += sprintf(out.data + off, "%s", r->peer) + 1;
+        off += sprintf(out.data + off, "%s", r->ip) + 1;
+        off += sprintf(out.data + off, "%u", (unsigned)r->port) + 1;
+        off += sprintf(out.data + off, "%s", r->content) + 1;
+    }
+    sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+}
+
+/* Takes one page of a pull: registers its entries unless a removal of
+   them was seen here meanwhile, and applies forwarded removals. */
+static void pull_page(const UdpPDU *in) {
+    const char *f[4];
+    char msg[160];
+    int off, last;
+
+    if (parse_fields(in->data, sizeof(in->data), f, 2) < 2 || atoi(f[0]) != pullPage) return;
+    last = atoi(f[1]);
+    off = (int)(f[1] - in->data) + (int)strlen(f[1]) + 1;
+    while (off < UDP_BUFLEN && in->data[off] != '\0') {
+        if (parse_fields(in->data + off, (size_t)(UDP_BUFLEN - off), f, 4) < 4) break;
+        if (atoi(f[2]) == 0) {
+            int pi = find_peer_by_name(f[0]);
+            int ci = pi >= 0 && strcmp(peers[pi].ip, f[1]) == 0 ? find_content_index_in_peer(&peers[pi], f[3]) : -1;
+            if (ci >= 0) remove_entry(pi, ci, "HANDOFF");
+        } else if (!tomb_covers(f[0], f[1], f[3])) {
+            register_entry(f[0], f[1], atoi(f[2]), f[3], msg, "HANDOFF");
+        }
+        off = (int)(f[3] - in->data) + (int)strlen(f[3]) + 1;
+    }
+    pullPage++;
+    pullReleasing = last;
+    pullBackoff[pullTarget] = 0;
+    pull_request();
+}
+
+/* Replies arriving on the mesh socket. */
+static void mesh_receive(void) {
+    UdpPDU in;
+    struct sockaddr_in from;
+    socklen_t flen = sizeof(from);
+    ShardMap m;
+    int i;
+
+    memset(&in, 0, sizeof(in));
+    if (recvfrom(mesh, &in, sizeof(in), 0, (struct sockaddr *)&from, &flen) < 0) return;
+    if (joinCall.active && same_addr(&from, &joinCall.to) && in.type == T_ACK && in.data[0] == T_JOIN) joinCall.active = 0;
+    for (i = 0; i < smap.n; i++) {
+        if (pushCall[i].active && same_addr(&from, &pushCall[i].to) && in.type == T_ACK && in.data[0] == T_MAPSET) pushCall[i].active = 0;
+    }
+    if (!pullCall.active || !same_addr(&from, &pullCall.to)) return;
+    if (in.type == T_HANDOFF) pull_page(&in);
+    else if (in.type == T_ACK && in.data[0] == T_RELEASE && pullReleasing) { pullPending[pullTarget] = 0; pull_next(); }
+    else if (in.type == T_ERR) {
+        char logb[UDP_BUFLEN + 64];
+        sprintf(logb, "Handoff from %s refused: %.*s", smap.addr[pullTarget], UDP_BUFLEN - 1, in.data);
+        log_msg(logb);
+        pullPending[pullTarget] = 0;
+        pull_next();
+    }
+    else if (in.type == T_MAP && shard_map_decode(&m, in.data, UDP_BUFLEN) && shard_find(&m, self_addr) >= 0) {
+        /* The other side has a different map: take it if newer, else send ours. */
+        if (m.version > smap.version) shard_install(&m);
+        else if (!pushCall[pullTarget].active) push_map(pullTarget);
+    }
+}
+
+static void mesh_timers(void) {
+    double now = mono_ms();
+    char logb[128];
+    int i;
+    if (joinCall.active && now >= joinCall.deadline) {
+        if (joinCall.tries < MESH_TRIES) mesh_send(&joinCall);
+        else { joinCall.active = 0; log_msg("Join got no answer"); fprintf(stderr, "Join got no answer\n"); }
+    }
+    for (i = 0; i < smap.n; i++) {
+        if (!pushCall[i].active || now < pushCall[i].deadline) continue;
+        if (pushCall[i].tries < MESH_TRIES) mesh_send(&pushCall[i]);
+        else { pushCall[i].active = 0; sprintf(logb, "Shard %s did not take map v%lu", smap.addr[i], smap.version); log_msg(logb); }
+    }
+    if (pullCall.active && now >= pullCall.deadline) {
+        if (pullCall.tries < MESH_TRIES) mesh_send(&pullCall);
+        else pull_defer();
+    }
+}
+
+/* Runs mesh traffic and retries until a PDU is waiting on the index socket. */
+static void wait_index_socket(int s) {
+    while (1) {
+        fd_set rfds;
+        struct timeval tv;
+        double next = -1, now;
+        int i, maxfd = s;
+        MeshCall *calls[MAX_SHARDS + 2];
+        int ncalls = 0;
+
+        if (mesh < 0) return;
+        calls[ncalls++] = &joinCall;
+        calls[ncalls++] = &pullCall;
+        for (i = 0; i < smap.n; i++) calls[ncalls++] = &pushCall[i];
+        now = mono_ms();
+        for (i = 0; i < ncalls; i++) {
+            double left;
+            if (!calls[i]->active) continue;
+            left = calls[i]->deadline - now;
+            if (left < 0) left = 0;
+            if (next < 0 || left < next) next = left;
+        }
+        FD_ZERO(&rfds);
+        FD_SET(s, &rfds);
+        FD_SET(mesh, &rfds);
+        if (mesh > maxfd) maxfd = mesh;
+        if (next >= 0) {
+            tv.tv_sec = (long)(next / 1000);
+            tv.tv_usec = (long)((next - (double)tv.tv_sec * 1000) * 1000);
+        }
+        if (select(maxfd + 1, &rfds, NULL, NULL, next >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            return;
+        }
+        if (FD_ISSET(mesh, &rfds)) mesh_receive();
+        mesh_timers();
+        if (FD_ISSET(s, &rfds)) return;
+    }
+}
+
+/* T_REGN / T_DEREGN: many names in one PDU.  The T_ACK carries
+   "done\0failed\0", the names another shard owns for the peer to send
+   there, an empty string, then the names that failed.  Repeats count as
+   done, so a batch whose reply was lost can simply be sent again. */
+static void handle_batch(int sock, const UdpPDU *in, const struct sockaddr_in *cli, socklen_t clen, const char *cip) {
+    const char *f[2];
+    int hdr = in->type == T_REGN ? 2 : 1;
+    int off, done = 0, failed = 0, mlen = 0, flen = 0, n, tcp_port = 0;
+    char moved[UDP_BUFLEN], failn[UDP_BUFLEN];
+    char msg[160];
+    UdpPDU out;
+
+    if (parse_fields(in->data, sizeof(in->data), f, hdr) < hdr) { send_err(sock, cli, clen, "Malformed batch PDU"); return; }
+    if (strlen(f[0]) == 0 || strlen(f[0]) > NAME_LEN) { send_err(sock, cli, clen, "Name too long or empty"); return; }
+    if (hdr == 2) {
+        tcp_port = atoi(f[1]);
+        if (tcp_port <= 0 || tcp_port > 65535) { send_err(sock, cli, clen, "Invalid TCP port"); return; }
+    }
+    off = (int)(f[hdr - 1] - in->data) + (int)strlen(f[hdr - 1]) + 1;
+    TRACE_MARK(TR_PARSE, hdr, NULL);
+    TRACE_BEGIN(TR_LOOKUP, 0, NULL);
+    while (off < UDP_BUFLEN && in->data[off] != '\0') {
+        const char *name = in->data + off;
+        int pi, ci, nlen;
+        if (!memchr(name, '\0', (size_t)(UDP_BUFLEN - off))) break;
+        nlen = (int)strlen(name);
+        off += nlen + 1;
+        if (nlen > NAME_LEN) { failed++; continue; }
+        if (!owns(name)) {
+            if (mlen + flen + nlen + 2 <= UDP_BUFLEN - 32) { memcpy(moved + mlen, name, (size_t)nlen + 1); mlen += nlen + 1; }
+            continue;
+        }
+        pi = find_peer_by_name(f[0]);
+        ci = pi >= 0 && strcmp(peers[pi].ip, cip) == 0 ? find_content_index_in_peer(&peers[pi], name) : -1;
+        if ((pi >= 0 && strcmp(peers[pi].ip, cip) != 0) ||
+            (in->type == T_REGN && ci < 0 && !register_entry(f[0], cip, tcp_port, name, msg, "REG"))) {
+            failed++;
+            if (mlen + flen + nlen + 2 <= UDP_BUFLEN - 32) { memcpy(failn + flen, name, (size_t)nlen + 1); flen += nlen + 1; }
+            continue;
+        }
+        if (in->type == T_DEREGN) {
+            tomb_add(f[0], cip, name);
+            if (ci >= 0) remove_entry(pi, ci, "DEREG");
+        }
+        done++;
+    }
+    TRACE_END(TR_LOOKUP, done);
+    memset(&out, 0, sizeof(out));
+    out.type = T_ACK;
+    n = sprintf(out.data, "%d", done) + 1;
+    n += sprintf(out.data + n, "%d", failed) + 1;
+    memcpy(out.data + n, moved, (size_t)mlen);
+    memcpy(out.data + n + mlen + 1, failn, (size_t)flen);
+    sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+    TRACE_MARK(TR_REPLY, T_ACK, NULL);
+}
+
+/* Content name a REG / SEARCH / DEREG is about, for the ownership check. */
+static const char *pdu_content(const UdpPDU *in) {
+    const char *f[2];
+    int want = in->type == T_REG ? 2 : 1;
+    if (parse_fields(in->data, sizeof(in->data), f, want) < want) return NULL;
+    return f[want - 1];
 }
 
 int main(int argc, char **argv) {
     int port = (argc >= 2) ? atoi(argv[1]) : INDEX_PORT;
-    int s;
+    int s, i;
     struct sockaddr_in srv;
+    const char *join = NULL;
 
     memset(peers, 0, sizeof(peers));
+    memset(&smap, 0, sizeof(smap));
+    catalog_epoch = (unsigned long)time((time_t*)0);
+
+    /* [port] [--self ip:port [--join ip:port]] */
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--self") == 0 && i + 1 < argc && strlen(argv[i + 1]) < SHARD_ADDR_LEN) strcpy(self_addr, argv[++i]);
+        else if (strcmp(argv[i], "--join") == 0 && i + 1 < argc) join = argv[++i];
+        else break;
+    }
+    if (i < argc || (join && !self_addr[0]) || (self_addr[0] && !shard_addr_parse(self_addr, &srv))) {
+        fprintf(stderr, "Usage: %s [port] [--self ip:port [--join ip:port]]\n", argv[0]);
+        exit(1);
+    }
 
     s = socket(AF_INET, SOCK_DGRAM, 0);
     if (s < 0) { perror("socket"); exit(1); }
@@ -237,9 +1233,32 @@ int main(int argc, char **argv) {
     }
 
     open_log_file(port);
+    TRACE_OPEN("directory_server");
     printf("Index server listening on UDP port %d\n", port);
     log_msg("Listening for peers");
 
+    if (self_addr[0]) {
+        struct sockaddr_in ma;
+        mesh = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mesh < 0) { perror("socket"); exit(1); }
+        /* Other shards check that mesh traffic comes from this IP. */
+        shard_addr_parse(self_addr, &ma);
+        ma.sin_port = 0;
+        if (bind(mesh, (struct sockaddr *)&ma, sizeof(ma)) < 0) { perror("bind --self address"); exit(1); }
+        if (join) {
+            mesh_call(&joinCall, join, T_JOIN, self_addr, (int)strlen(self_addr) + 1);
+            if (!joinCall.active) { fprintf(stderr, "Bad --join address %s\n", join); exit(1); }
+        } else {
+            ShardMap m;
+            memset(&m, 0, sizeof(m));
+            m.version = 1;
+            m.n = 1;
+            strcpy(m.addr[0], self_addr);
+            shard_map_build(&m);
+            shard_install(&m);
+        }
+    }
+
     while (1) {
         UdpPDU in;
         UdpPDU out;
@@ -253,26 +1272,39 @@ int main(int argc, char **argv) {
         memset(&cli, 0, sizeof(cli));
         memset(cip, 0, sizeof(cip));
 
+        TRACE_END(TR_PDU, 0);
+        wait_index_socket(s);
         n = recvfrom(s, &in, sizeof(in), 0, (struct sockaddr *)&cli, &clen);
         if (n < 0) { perror("recvfrom"); continue; }
+        TRACE_BEGIN(TR_PDU, in.type, pdu_content(&in));
 
         strcpy(cip, inet_ntoa(cli.sin_addr));
 
+        /* Index-to-index PDUs mean nothing to an index run without --self. */
+        if (!self_addr[0] && (in.type == T_MAPSET || in.type == T_JOIN || in.type == T_HANDOFF || in.type == T_RELEASE)) continue;
+
+        if (in.type == T_REG || in.type == T_SEARCH || in.type == T_DEREG) {
+            const char *contentName = pdu_content(&in);
+            if (contentName && !owns(contentName) && !(in.type == T_SEARCH && held_here(contentName))) {
+                memset(&out, 0, sizeof(out));
+                out.type = T_MOVED;
+                sprintf(out.data, "%lu", smap.version);
+                sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+                continue;
+            }
+        }
+
         if (in.type == T_REG) {
             const char *fields[3];
             int nf;
             const char *peerName;
             const char *contentName;
             const char *portStr;
-            int tcp_port;
-            int idx;
-            int freei;
-            Peer *p;
-            int cidx;
+            int tcp_port, ok;
             char msg[160];
-            char logb[256];
 
             nf = parse_fields(in.data, sizeof(in.data), fields, 3);
+            TRACE_MARK(TR_PARSE, nf, NULL);
             if (nf < 3) { send_err(s, &cli, clen, "Malformed R PDU"); continue; }
 
             peerName = fields[0];
@@ -287,44 +1319,11 @@ int main(int argc, char **argv) {
             tcp_port = atoi(portStr);
             if (tcp_port <= 0 || tcp_port > 65535) { send_err(s, &cli, clen, "Invalid TCP port"); continue; }
 
-            idx = find_peer_by_name(peerName);
-            if (idx >= 0) {
-                if (strcmp(peers[idx].ip, cip) != 0) {
-                    send_err(s, &cli, clen, "Peer name already in use");
-                    continue;
-                }
-                if (peers[idx].ncontent >= MAX_CONTENT) { send_err(s, &cli, clen, "Peer content table full"); continue; }
-                cidx = find_content_index_in_peer(&peers[idx], contentName);
-                if (cidx >= 0) { send_err(s, &cli, clen, "Content already registered by this peer"); continue; }
-                strncpy(peers[idx].contents[peers[idx].ncontent], contentName, NAME_LEN);
-                peers[idx].contents[peers[idx].ncontent][NAME_LEN] = '\0';
-                peers[idx].sent_count[peers[idx].ncontent] = 0;
-                peers[idx].ncontent++;
-                peers[idx].tcp_port = (u16)tcp_port;
-                sprintf(msg, "Registered content '%s' for peer '%s'", contentName, peerName);
-                send_ack(s, &cli, clen, msg);
-                sprintf(logb, "REG existing name=%s ip=%s tcp=%d content=%s", peerName, cip, tcp_port, contentName);
-                log_msg(logb);
-            } else {
-                freei = first_free_peer_slot();
-                if (freei < 0) { send_err(s, &cli, clen, "Peer table full"); continue; }
-                p = &peers[freei];
-                memset(p, 0, sizeof(*p));
-                p->in_use = 1;
-                strncpy(p->name, peerName, NAME_LEN);
-                p->name[NAME_LEN] = '\0';
-                strncpy(p->ip, cip, sizeof(p->ip) - 1);
-                p->tcp_port = (u16)tcp_port;
-                p->ncontent = 1;
-                strncpy(p->contents[0], contentName, NAME_LEN);
-                p->contents[0][NAME_LEN] = '\0';
-                p->sent_count[0] = 0;
-                npeers++;
-                sprintf(msg, "Peer '%s' registered with content '%s'", peerName, contentName);
-                send_ack(s, &cli, clen, msg);
-                sprintf(logb, "REG new name=%s ip=%s tcp=%d content=%s", peerName, cip, tcp_port, contentName);
-                log_msg(logb);
-            }
+            TRACE_BEGIN(TR_LOOKUP, 0, NULL);
+            ok = register_entry(peerName, cip, tcp_port, contentName, msg, "REG");
+            TRACE_END(TR_LOOKUP, ok);
+            if (!ok) { send_err(s, &cli, clen, msg); continue; }
+            send_ack(s, &cli, clen, msg);
         }
         else if (in.type == T_SEARCH) {
             const char *fields[1];
@@ -336,6 +1335,7 @@ int main(int argc, char **argv) {
             int i;
 
             nf = parse_fields(in.data, sizeof(in.data), fields, 1);
+            TRACE_MARK(TR_PARSE, nf, NULL);
             if (nf < 1) { send_err(s, &cli, clen, "Malformed S PDU"); continue; }
             contentName = fields[0];
             if (strlen(contentName) == 0 || strlen(contentName) > NAME_LEN) {
@@ -343,6 +1343,7 @@ int main(int argc, char **argv) {
                 continue;
             }
 
+            TRACE_BEGIN(TR_LOOKUP, 0, NULL);
             for (i = 0; i < MAX_PEERS; i++) {
                 if (!peers[i].in_use) continue;
                 {
@@ -357,6 +1358,7 @@ int main(int argc, char **argv) {
                     }
                 }
             }
+            TRACE_END(TR_LOOKUP, best_peer);
             if (best_peer < 0) {
                 send_err(s, &cli, clen, "Content not found");
             } else {
@@ -373,6 +1375,7 @@ int main(int argc, char **argv) {
                 plen = (int)strlen(pbuf) + 1;
                 memcpy(out.data + off, pbuf, plen);
                 sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+                TRACE_MARK(TR_REPLY, T_SEARCH, NULL);
 
                 if (best_content_idx >= 0 &&
                     peers[best_peer].sent_count[best_content_idx] < 0x7fffffff) {
@@ -388,44 +1391,25 @@ int main(int argc, char **argv) {
             int nf;
             const char *contentName;
             int pi;
-            Peer *p;
             int ci;
-            int k;
-            char logb[256];
+            int gone = 0;
 
             nf = parse_fields(in.data, sizeof(in.data), fields, 1);
+            TRACE_MARK(TR_PARSE, nf, NULL);
             if (nf < 1) { send_err(s, &cli, clen, "Malformed T PDU"); continue; }
             contentName = fields[0];
 
+            TRACE_BEGIN(TR_LOOKUP, 0, NULL);
             pi = find_peer_by_ip(cip);
-            if (pi < 0) { send_err(s, &cli, clen, "You are not registered"); continue; }
-
-            p = &peers[pi];
-            ci = find_content_index_in_peer(p, contentName);
-            if (ci < 0) { send_err(s, &cli, clen, "Content not hosted by you"); continue; }
-
-            for (k = ci + 1; k < p->ncontent; k++) {
-                strcpy(p->contents[k - 1], p->contents[k]);
-                p->sent_count[k - 1] = p->sent_count[k];
-            }
-            if (p->ncontent > 0) {
-                memset(p->contents[p->ncontent - 1], 0, sizeof(p->contents[p->ncontent - 1]));
-                p->sent_count[p->ncontent - 1] = 0;
-                p->ncontent--;
-            }
-
-            if (p->ncontent == 0) {
-                sprintf(logb, "DEREG peer %s removed entirely", p->name);
-                log_msg(logb);
-                memset(p, 0, sizeof(*p));
-                p->in_use = 0;
-                npeers--;
-                send_ack(s, &cli, clen, "Content removed and peer de-registered");
-            } else {
-                sprintf(logb, "DEREG peer %s removed content '%s'", p->name, contentName);
-                log_msg(logb);
-                send_ack(s, &cli, clen, "Content de-registered");
-            }
+            ci = pi >= 0 ? find_content_index_in_peer(&peers[pi], contentName) : -1;
+            if (ci >= 0) gone = remove_entry(pi, ci, "DEREG");
+            TRACE_END(TR_LOOKUP, ci);
+            /* mid-pull the entry may still be on its way from the old owner */
+            if (tomb_add(NULL, cip, contentName) && ci < 0) send_ack(s, &cli, clen, "Content de-registered");
+            else if (pi < 0) send_err(s, &cli, clen, "You are not registered");
+            else if (ci < 0) send_err(s, &cli, clen, "Content not hosted by you");
+            else if (gone) send_ack(s, &cli, clen, "Content removed and peer de-registered");
+            else send_ack(s, &cli, clen, "Content de-registered");
         }
         else if (in.type == T_BYE) {
             const char *fields[1];
@@ -436,11 +1420,17 @@ int main(int argc, char **argv) {
             if (nf < 1) { send_err(s, &cli, clen, "Malformed B PDU"); continue; }
             peerName = fields[0];
             pi = find_peer_by_name(peerName);
+            tomb_add(peerName, NULL, NULL);
             if (pi >= 0) {
                 char logb[128];
+                int k;
+                for (k = 0; k < peers[pi].ncontent; k++) {
+                    handoff_forget(peers[pi].name, peers[pi].contents[k]);
+                    catalog_note('-', peers[pi].contents[k], peers[pi].name);
+                }
                 sprintf(logb, "BYE peer %s removed", peers[pi].name);
                 log_msg(logb);
-                memset(&peers[pi], 0, sizeof(peers[pi]));
+                peer_free(&peers[pi]);
                 npeers--;
                 send_ack(s, &cli, clen, "Peer removed");
             } else {
@@ -448,29 +1438,23 @@ int main(int argc, char **argv) {
             }
         }
         else if (in.type == T_LIST) {
-            char uniq[MAX_PEERS * MAX_CONTENT][NAME_LEN + 1];
-            int  ucount = 0;
+            const char **uniq;
+            int  ucount = 0, total = 0;
             int  i, j, k;
             int  bytes;
             UdpPDU page;
 
-            memset(uniq, 0, sizeof(uniq));
-
+            /* Every name once: collect, sort, drop repeats. */
+            for (i = 0; i < MAX_PEERS; i++) if (peers[i].in_use) total += peers[i].ncontent;
+            uniq = (const char **)malloc((size_t)(total ? total : 1) * sizeof(*uniq));
+            if (!uniq) { send_err(s, &cli, clen, "Out of memory"); continue; }
             for (i = 0; i < MAX_PEERS; i++) {
                 if (!peers[i].in_use) continue;
-                for (j = 0; j < peers[i].ncontent; j++) {
-                    const char *nm = peers[i].contents[j];
-                    int seen = 0;
-                    for (k = 0; k < ucount; k++) {
-                        if (strcmp(uniq[k], nm) == 0) { seen = 1; break; }
-                    }
-                    if (!seen && ucount < (int)(sizeof(uniq) / sizeof(uniq[0]))) {
-                        strncpy(uniq[ucount], nm, NAME_LEN);
-                        uniq[ucount][NAME_LEN] = '\0';
-                        ucount++;
-                    }
-                }
+                for (j = 0; j < peers[i].ncontent; j++) uniq[ucount++] = peers[i].contents[j];
             }
+            qsort(uniq, (size_t)ucount, sizeof(*uniq), name_ptr_cmp);
+            for (i = 0, k = 0; i < ucount; i++) if (k == 0 || strcmp(uniq[k - 1], uniq[i]) != 0) uniq[k++] = uniq[i];
+            ucount = k;
 
             if (ucount == 0) {
                 memset(&page, 0, sizeof(page));
@@ -518,6 +1502,60 @@ int main(int argc, char **argv) {
                 page.type = T_LISTEND;
                 sendto(s, &page, sizeof(page), 0, (struct sockaddr *)&cli, clen);
             }
+            free(uniq);
+        }
+        else if (in.type == T_SYNC) {
+            const char *fields[7];
+            int nf = parse_fields(in.data, sizeof(in.data), fields, 7);
+            if (nf < 2) { send_err(s, &cli, clen, "Malformed V PDU"); continue; }
+            send_sync(s, &cli, clen, fields, nf);
+        }
+        else if (in.type == T_REGN || in.type == T_DEREGN) {
+            handle_batch(s, &in, &cli, clen, cip);
+        }
+        else if (in.type == T_MAP) {
+            send_map(s, &cli, clen);
+        }
+        else if (in.type == T_MAPSET) {
+            ShardMap m;
+            char enc[UDP_BUFLEN];
+            const char *sender;
+            int len;
+            if (!shard_map_decode(&m, in.data, UDP_BUFLEN)) { send_err(s, &cli, clen, "Malformed I PDU"); continue; }
+            len = shard_map_encode(&m, enc);
+            sender = in.data + len;
+            if (len >= UDP_BUFLEN || !memchr(sender, '\0', (size_t)(UDP_BUFLEN - len)) || !map_sender_ok(sender, &cli) ||
+                shard_find(&m, sender) < 0 || shard_find(&m, self_addr) < 0) {
+                char logb[128];
+                sprintf(logb, "Ignored map v%lu from %s", m.version, cip);
+                log_msg(logb);
+                continue;
+            }
+            if (m.version > smap.version) shard_install(&m);
+            out.type = T_ACK;
+            out.data[0] = T_MAPSET;
+            sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+        }
+        else if (in.type == T_JOIN) {
+            const char *fields[1];
+            struct sockaddr_in ja;
+            if (parse_fields(in.data, sizeof(in.data), fields, 1) < 1 || strlen(fields[0]) >= SHARD_ADDR_LEN ||
+                !shard_addr_parse(fields[0], &ja)) { send_err(s, &cli, clen, "Malformed J PDU"); continue; }
+            if (ja.sin_addr.s_addr != cli.sin_addr.s_addr) continue;
+            if (smap.n == 0) { send_err(s, &cli, clen, "Index is not sharded"); continue; }
+            if (smap.n >= MAX_SHARDS && shard_find(&smap, fields[0]) < 0) { send_err(s, &cli, clen, "Shard map full"); continue; }
+            out.type = T_ACK;
+            out.data[0] = T_JOIN;
+            sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+            if (shard_find(&smap, fields[0]) < 0) shard_join(fields[0]);
+            else push_map(shard_find(&smap, fields[0]));
+        }
+        else if (in.type == T_HANDOFF || in.type == T_RELEASE) {
+            const char *fields[3];
+            if (parse_fields(in.data, sizeof(in.data), fields, 3) < 3) { send_err(s, &cli, clen, in.type == T_HANDOFF ? "Malformed K PDU" : "Malformed L PDU"); continue; }
+            if (strtoul(fields[0], NULL, 10) != smap.version) { send_map(s, &cli, clen); continue; }
+            if (!from_shard(&smap, fields[1], &cli)) continue;
+            serve_handoff(s, &cli, clen, shard_find(&smap, fields[1]), atoi(fields[2]), in.type == T_RELEASE);
         }
         else {
             send_err(s, &cli, clen, "Unknown PDU type");
@@ -531,7 +1569,7 @@ EOF
   cat > "${SRC_DIR}/peer_node.c" <<'EOF'
 /* Watermark: Krish Patel (KrishAdmin) — peer_node.c */
 /* Watermark: https://krishadmin.com */
-#define _POSIX_C_SOURCE 200112L
+#define _XOPEN_SOURCE 600
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -540,32 +1578,223 @@ EOF
 #include <ctype.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <dirent.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include "protocol.h"
+#include "shard.h"
+#include "trace.h"
+#include "lz.h"
 
 #ifndef INDEX_PORT
 #define INDEX_PORT 15000
 #endif
 
+/* Concurrent downloads served by the hosting loop. */
+#ifndef HOST_MAX_CONN
+#define HOST_MAX_CONN 32
+#endif
+/* Open descriptors kept by the hosting loop for popular content; one per
+   connection at most, so never smaller than HOST_MAX_CONN. */
+#ifndef HOST_FD_CACHE
+#define HOST_FD_CACHE HOST_MAX_CONN
+#endif
+/* Seconds a cached descriptor is trusted before the path is re-stat()ed. */
+#ifndef HOST_REVALIDATE_SEC
+#define HOST_REVALIDATE_SEC 2
+#endif
+#define HOST_READ_BLOCK  (UDP_BUFLEN * 16)   /* also the unit compressed, <= ZBLOCK_MAX */
+#define HOST_FRAME_MAX   ((int)(sizeof(char) + sizeof(u16)) + UDP_BUFLEN)
+#define CONTENT_INIT     256   /* first contentList allocation, doubles as needed */
+
+/* Compressed transfers.  A block goes out packed only if that saves an
+   eighth; after LZ_MISS_LIMIT blocks in a row that do not, the next
+   LZ_SKIP_BLOCKS go raw untried, and one more miss after that skips
+   again.  P2P_COMPRESS=0 turns it off. */
+#define LZ_MISS_LIMIT  4
+#define LZ_SKIP_BLOCKS 16
+#define ZHDR_LEN       ((int)(2 * sizeof(u16)))
+#define ZBUF_LEN       (ZHDR_LEN + LZ_BOUND(ZBLOCK_MAX))
+
+/* How long a REG/DEREG/SEARCH round trip waits for the index. */
+#ifndef INDEX_TIMEOUT_MS
+#define INDEX_TIMEOUT_MS 3000
+#endif
+
+/* T_REGN / T_DEREGN names per PDU stop here so the T_ACK, which may echo
+   all of them back as moved, still fits. */
+#define BATCH_PAYLOAD (UDP_BUFLEN - 32)
+
+/* Shared directory (-s): inotify events are coalesced and flushed to the
+   index once nothing has changed for WATCH_QUIET_MS, or WATCH_MAX_MS after
+   the first one at the latest.  Names the index did not take are tried
+   again WATCH_RETRY_MS later. */
+#define WATCH_QUIET_MS 250
+#define WATCH_MAX_MS   1000
+#define WATCH_RETRY_MS 5000
+/* Catalog sync asks for one page at a time, again every SYNC_RETRY_MS up
+   to SYNC_TRIES times; it starts over at most SYNC_ROUNDS times when the
+   index no longer has the changes it was reading. */
+#define SYNC_RETRY_MS 500
+#define SYNC_TRIES    6
+#define SYNC_ROUNDS   4
+/* Daemon mode: control connections, downloads in flight, command size. */
+#define CTL_MAX_CLIENTS 16
+#define CTL_MAX_WORKERS 16
+#define CTL_BUF         1024
+#define CTL_TAG_LEN     31
+/* "content : host, host, ..." with every peer hosting it. */
+#define REPLICA_LINE_MAX (NAME_LEN + 3 + MAX_PEERS * (NAME_LEN + 2))
+
+/* Upload priority classes a downloader may ask for; DRR weights below. */
+#define PRIO_HIGH    0
+#define PRIO_NORMAL  1
+#define PRIO_BULK    2
+#define PRIO_CLASSES 3
+
+typedef struct {
+    char   name[NAME_LEN + 1];
+    int    fd;
+    int    refs;             /* connections streaming from it */
+    dev_t  dev;
+    ino_t  ino;
+    time_t checked;
+    unsigned long used;
+} HostFile;
+
+/* Bytes per second with a small burst; rate <= 0 means unlimited. */
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+} TokenBucket;
+
+/* One (content, host) pair of the local catalog replica. */
+typedef struct {
+    char op;                          /* '+' / '-' while a sync is pending */
+    char content[NAME_LEN + 1];
+    char peer[NAME_LEN + 1];
+    int  shard;                       /* index shard it was synced from */
+} CatalogEntry;
+
+#define CONN_FREE 0
+#define CONN_REQ  1
+#define CONN_SEND 2
+
+/* A control connection, or the batch file (in = file, out = stdout). */
+typedef struct {
+    int  in, out;              /* -1 when the slot is free */
+    long id;                   /* never reused, workers report to it */
+    char buf[CTL_BUF];
+    int  len;
+    int  eof;
+    int  stalled;              /* a command waits for a free worker */
+    int  waiting;              /* WAIT until its commands finish */
+    char wtag[CTL_TAG_LEN + 1];
+} CtlClient;
+
+/* A forked command, so the index round trip or download never blocks the
+   loop.  It writes "* " reply lines and "=" lines replaying its shard map
+   and replica changes, then one "OK ..." / "ERR ..." line, and exits. */
+typedef struct {
+    pid_t pid;                 /* 0 when the slot is free */
+    int   fd;
+    char  kind;                /* 'G' GET, 'R' REG, 'T' DEREG, 'S' SEARCH, 'O' LIST,
+                                  'W' share flush (no client) */
+    long  owner;
+    unsigned long gen;         /* replicaGen when it was forked */
+    char  tag[CTL_TAG_LEN + 1];
+    char  name[NAME_LEN + 1];  /* LIST: the filter */
+    char  line[REPLICA_LINE_MAX + 64];
+    int   len;
+    char  result[2 * UDP_BUFLEN];
+} CtlWorker;
+
+typedef struct {
+    int      fd;
+    int      state;
+    char     cip[INET_ADDRSTRLEN];
+    char     req[HOST_FRAME_MAX + 1];
+    int      req_got;
+    HostFile *hf;
+    off_t    off;                     /* file offset of block[] */
+    char     block[HOST_READ_BLOCK];
+    int      blen, bpos;
+    char     frame[HOST_FRAME_MAX];
+    int      flen, fsent;
+    int      last;                    /* frame[] is the final one */
+    int      blocked;                 /* socket buffer full, wait for writable */
+    int      throttled;               /* out of tokens */
+    int      prio;
+    long     deficit;
+    TokenBucket tb;
+    int      lz;                      /* downloader takes T_ZCHUNK */
+    int      zmiss, zskip;            /* adaptive bypass, see LZ_MISS_LIMIT */
+    char     zbuf[ZBUF_LEN];          /* packed block being framed */
+    int      zlen, zpos;
+    long     zraw, zsent;             /* bytes packed and what they became */
+} HostConn;
+
 static char peerName[NAME_LEN + 1];
-static char contentList[MAX_CONTENT][NAME_LEN + 1];
-static int  nContent = 0;
+static char (*contentList)[NAME_LEN + 1] = NULL;
+static int  nContent = 0, contentCap = 0;
+static int *contentSet = NULL;      /* contentList index + 1, 0 = empty */
+static int  contentSetSize = 0;     /* power of two, 2 * contentCap */
+
+static HostFile fileCache[HOST_FD_CACHE];
+static unsigned long fileCacheTick = 0;
+
+static HostConn hostConns[HOST_MAX_CONN];
+static int  hostRR = 0;             /* slot host_schedule() serves first */
+static int  hostRRFed = 0;          /* it already got this round's quantum */
+static TokenBucket hostBucket;
+static const int prioWeight[PRIO_CLASSES] = { 4, 2, 1 };
+
+/* Parent -> hosting child: "+name\n" / "-name\n" as contentList changes. */
+static int  host_ctl[2] = { -1, -1 };
+static char host_ctl_buf[4 * (NAME_LEN + 2)];
+static int  host_ctl_len = 0;
+
+/* Local replica of the index catalog, kept current with T_SYNC deltas. */
+static CatalogEntry *replica = NULL;
+static int  nReplica = 0, capReplica = 0;
+static int  *replicaSet = NULL;       /* hash of replica: position + 1, 0 empty */
+static int  replicaSetSize = 0;       /* power of two, 2 * capReplica */
+static unsigned long replicaGen = 0;  /* bumped whenever the replica is dropped */
+static unsigned long replicaVersion[MAX_SHARDS];   /* per shard; [0] unsharded */
+static unsigned long replicaEpoch[MAX_SHARDS];
 
 static int  udp_sock = -1;
 static struct sockaddr_in index_addr;
 static socklen_t index_addrlen;
+static ShardMap shardMap;                  /* n == 0: everything goes to index_addr */
+static struct sockaddr_in shardAddr[MAX_SHARDS];
 
 static int  tcp_listen = -1;
 static u16  listen_port = 0;
 static pid_t host_pid = -1;
 
+static CtlClient ctlClients[CTL_MAX_CLIENTS];
+static CtlWorker ctlWorkers[CTL_MAX_WORKERS];
+static long ctlNextId = 1;
+static int  ctl_listen = -1;
+static const char *ctl_path = NULL;
+static int  ctl_out = 1;                       /* stdout before logs moved to stderr */
+static volatile sig_atomic_t ctl_stop = 0;
+static int  ctl_worker = -1;                   /* in a command worker: pipe to the daemon */
+
 static void die(const char *msg) { perror(msg); exit(1); }
 
 static void print_menu(void) {
@@ -573,6 +1802,7 @@ static void print_menu(void) {
     printf("  R : Register content\n");
     printf("  D : Download content\n");
     printf("  O : List available content (content : hosts)\n");
+    printf("  L : Search the local catalog copy (no network)\n");
     printf("  T : De register content\n");
     printf("  Q : Quit (de register all)\n");
     printf("Choice: ");
@@ -590,6 +1820,167 @@ static int recv_n(int fd, void *buf, size_t len) {
     return 1;
 }
 
+static unsigned long name_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619UL; }
+    return h;
+}
+
+/* contentSet slot holding name, or the empty slot where it would go. */
+static unsigned long content_slot(const char *name) {
+    unsigned long mask = (unsigned long)contentSetSize - 1, slot = name_hash(name) & mask;
+    while (contentSet[slot] && strcmp(contentList[contentSet[slot] - 1], name) != 0) slot = (slot + 1) & mask;
+    return slot;
+}
+
+static int content_find(const char *name) {
+    if (!contentSetSize) return -1;
+    return contentSet[content_slot(name)] - 1;
+}
+
+static int content_grow(void) {
+    int cap = contentCap ? contentCap * 2 : CONTENT_INIT, i;
+    char (*list)[NAME_LEN + 1] = realloc(contentList, (size_t)cap * sizeof(*list));
+    int *set;
+    if (!list) return 0;
+    contentList = list;
+    set = calloc((size_t)cap * 2, sizeof(*set));
+    if (!set) return 0;
+    free(contentSet);
+    contentSet = set;
+    contentSetSize = cap * 2;
+    contentCap = cap;
+    for (i = 0; i < nContent; i++) contentSet[content_slot(contentList[i])] = i + 1;
+    return 1;
+}
+
+static void host_file_forget(const char *name);
+
+/* Keeps a forked hosting loop's copy of contentList in step with ours. */
+static void host_notify(char op, const char *name) {
+    char line[NAME_LEN + 3];
+    int n;
+    if (host_pid <= 0 || host_ctl[1] < 0) return;
+    n = sprintf(line, "%c%.*s\n", op, NAME_LEN, name);
+    if (write(host_ctl[1], line, (size_t)n) < 0) perror("write(host ctl)");
+}
+
+static int content_add(const char *name) {
+    if (content_find(name) >= 0) return 1;
+    if (nContent >= MAX_CONTENT) return 0;
+    if (nContent == contentCap && !content_grow()) return 0;
+    memset(contentList[nContent], 0, sizeof(contentList[nContent]));
+    strncpy(contentList[nContent], name, sizeof(contentList[nContent]) - 1);
+    contentSet[content_slot(contentList[nContent])] = nContent + 1;
+    nContent++;
+    host_notify('+', name);
+    return 1;
+}
+
+/* Backward-shift delete keeps every probe run unbroken, then the last
+   entry moves into the freed contentList position. */
+static void content_remove(const char *name) {
+    unsigned long mask = (unsigned long)contentSetSize - 1, hole, j;
+    int pos = content_find(name);
+    if (pos < 0) return;
+    host_file_forget(name);
+    host_notify('-', name);
+    hole = j = content_slot(name);
+    for (;;) {
+        unsigned long home;
+        j = (j + 1) & mask;
+        if (!contentSet[j]) break;
+        home = name_hash(contentList[contentSet[j] - 1]) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            contentSet[hole] = contentSet[j];
+            hole = j;
+        }
+    }
+    contentSet[hole] = 0;
+    nContent--;
+    if (pos != nContent) {
+        memcpy(contentList[pos], contentList[nContent], sizeof(contentList[pos]));
+        contentSet[content_slot(contentList[pos])] = pos + 1;
+    }
+    memset(contentList[nContent], 0, sizeof(contentList[nContent]));
+}
+
+static void host_file_close(HostFile *hf) {
+    if (hf->fd >= 0) close(hf->fd);
+    memset(hf, 0, sizeof(*hf));
+    hf->fd = -1;
+}
+
+static void host_file_init(void) {
+    int i;
+    memset(fileCache, 0, sizeof(fileCache));
+    for (i = 0; i < HOST_FD_CACHE; i++) fileCache[i].fd = -1;
+}
+
+/* Entries still being streamed are only unlinked from the name lookup and
+   closed by host_file_put() once the last connection finishes. */
+static void host_file_forget(const char *name) {
+    int i;
+    for (i = 0; i < HOST_FD_CACHE; i++) {
+        if (fileCache[i].fd >= 0 && strcmp(fileCache[i].name, name) == 0) {
+            if (fileCache[i].refs > 0) fileCache[i].name[0] = '\0';
+            else host_file_close(&fileCache[i]);
+        }
+    }
+}
+
+static void host_file_put(HostFile *hf) {
+    if (--hf->refs == 0 && hf->name[0] == '\0') host_file_close(hf);
+}
+
+/* Returns an open descriptor for name from the LRU, opening it on a miss;
+   release it with host_file_put().  A hit only goes back to the path once
+   every HOST_REVALIDATE_SEC, and the entry is dropped when the path now
+   names a different inode. */
+static HostFile *host_file_get(const char *name) {
+    struct stat st;
+    time_t now = time((time_t*)0);
+    HostFile *hf = NULL;
+    int i, fd;
+
+    for (i = 0; i < HOST_FD_CACHE; i++) {
+        if (fileCache[i].fd >= 0 && strcmp(fileCache[i].name, name) == 0) { hf = &fileCache[i]; break; }
+    }
+    if (hf) {
+        if (now - hf->checked < HOST_REVALIDATE_SEC ||
+            (stat(name, &st) == 0 && st.st_dev == hf->dev && st.st_ino == hf->ino)) {
+            hf->checked = now;
+            hf->used = ++fileCacheTick;
+            hf->refs++;
+            return hf;
+        }
+        if (hf->refs > 0) hf->name[0] = '\0';
+        else host_file_close(hf);
+    }
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) { close(fd); return NULL; }
+
+    hf = NULL;
+    for (i = 0; i < HOST_FD_CACHE; i++) {
+        if (fileCache[i].fd < 0) { hf = &fileCache[i]; break; }
+        if (fileCache[i].refs == 0 && (!hf || fileCache[i].used < hf->used)) hf = &fileCache[i];
+    }
+    if (!hf) { close(fd); return NULL; }
+    host_file_close(hf);
+    strncpy(hf->name, name, NAME_LEN);
+    hf->fd = fd;
+    hf->dev = st.st_dev;
+    hf->ino = st.st_ino;
+    hf->checked = now;
+    hf->used = ++fileCacheTick;
+    hf->refs = 1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    return hf;
+}
+
 static void create_udp_and_index(const char *host, int port) {
     struct hostent *he;
     udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -632,60 +2023,496 @@ static void send_tcp_err(int cs, const char *msg) {
     send(cs, &err, tosend, 0);
 }
 
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* "256k", "10m" or plain bytes per second; unset or 0 means unlimited. */
+static double parse_rate(const char *s) {
+    char *end;
+    double v;
+    if (!s || !*s) return 0;
+    v = strtod(s, &end);
+    if (*end == 'k' || *end == 'K') v *= 1024;
+    else if (*end == 'm' || *end == 'M') v *= 1024 * 1024;
+    return v > 0 ? v : 0;
+}
+
+static void bucket_init(TokenBucket *b, double rate, double now) {
+    b->rate = rate;
+    b->burst = rate / 20;
+    if (b->burst < 4 * HOST_FRAME_MAX) b->burst = 4 * HOST_FRAME_MAX;
+    b->tokens = b->burst;
+    b->last = now;
+}
+
+static void bucket_refill(TokenBucket *b, double now) {
+    if (b->rate <= 0) return;
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+}
+
+/* Seconds until n bytes may go out, 0 if they may go now. */
+static double bucket_wait(const TokenBucket *b, int n) {
+    if (b->rate <= 0 || b->tokens >= n) return 0;
+    return (n - b->tokens) / b->rate;
+}
+
+static void bucket_take(TokenBucket *b, int n) {
+    if (b->rate > 0) b->tokens -= n;
+}
+
+static void host_conn_close(HostConn *c) {
+    if (c->state == CONN_SEND) TRACE_ASYNC(TR_UPLOAD, 'e', (long)(c - hostConns), c->off + c->bpos, NULL);
+    if (c->zraw) printf("Upload to %s: %ld bytes packed into %ld\n", c->cip, c->zraw, c->zsent);
+    if (c->fd >= 0) close(c->fd);
+    if (c->hf) host_file_put(c->hf);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void host_conn_fail(HostConn *c, const char *msg) {
+    send_tcp_err(c->fd, msg);
+    host_conn_close(c);
+}
+
+/* P2P_COMPRESS=0 turns compression off on either side. */
+static int compress_enabled(void) {
+    const char *e = getenv("P2P_COMPRESS");
+    return !e || strcmp(e, "0") != 0;
+}
+
+/* Names of formats that are compressed already; those always go raw. */
+static int packed_format(const char *name) {
+    static const char *ext[] = {
+        "gz", "tgz", "bz2", "xz", "zst", "zip", "7z", "rar", "jar",
+        "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "m4a", "mkv",
+        "avi", "mov", "webm", "ogg", "flac", "pdf", NULL
+    };
+    const char *dot = strrchr(name, '.');
+    int i, k;
+    if (!dot) return 0;
+    for (i = 0; ext[i]; i++) {
+        for (k = 0; ext[i][k] && tolower((unsigned char)dot[1 + k]) == ext[i][k]; k++) {}
+        if (!ext[i][k] && !dot[1 + k]) return 1;
+    }
+    return 0;
+}
+
+/* Packs block[] into zbuf[] unless the bypass says not to try or it
+   would not save an eighth; returns 1 when zbuf[] holds the block. */
+static int host_conn_pack(HostConn *c) {
+    u16 raw = (u16)c->blen, packed;
+    int zl;
+    if (c->zskip > 0) { c->zskip--; return 0; }
+    zl = lz_compress((const unsigned char *)c->block, c->blen, (unsigned char *)c->zbuf + ZHDR_LEN, ZBUF_LEN - ZHDR_LEN);
+    if (zl == 0 || zl > c->blen - c->blen / 8) {
+        if (++c->zmiss >= LZ_MISS_LIMIT) { c->zmiss = LZ_MISS_LIMIT - 1; c->zskip = LZ_SKIP_BLOCKS; }
+        return 0;
+    }
+    c->zmiss = 0;
+    packed = (u16)zl;
+    memcpy(c->zbuf, &raw, sizeof(raw));
+    memcpy(c->zbuf + sizeof(raw), &packed, sizeof(packed));
+    c->zlen = ZHDR_LEN + zl;
+    c->zpos = 0;
+    c->bpos = c->blen;
+    c->zraw += c->blen;
+    c->zsent += c->zlen;
+    return 1;
+}
+
+/* Builds the next frame from the connection's block buffer, refilling it
+   from the cached descriptor.  A frame shorter than UDP_BUFLEN is final,
+   and a file that is a multiple of UDP_BUFLEN ends with an empty T_FINAL. */
+static int host_conn_next_frame(HostConn *c) {
+    TcpPDU *f = (TcpPDU *)c->frame;
+    int flen;
+    if (c->bpos == c->blen && c->zpos == c->zlen) {
+        ssize_t nr;
+        c->off += c->blen;
+        c->bpos = c->blen = 0;
+        c->zpos = c->zlen = 0;
+        nr = pread(c->hf->fd, c->block, sizeof(c->block), c->off);
+        if (nr < 0) { perror("pread"); return 0; }
+        c->blen = (int)nr;
+        if (c->lz && c->blen > 0) host_conn_pack(c);
+    }
+    if (c->zpos < c->zlen) {
+        flen = c->zlen - c->zpos;
+        if (flen > UDP_BUFLEN) flen = UDP_BUFLEN;
+        f->type = T_ZCHUNK;
+        f->len  = (u16)flen;
+        memcpy(f->data, c->zbuf + c->zpos, (size_t)flen);
+        c->zpos += flen;
+        c->flen = (int)(sizeof(char) + sizeof(u16)) + flen;
+        c->fsent = 0;
+        c->last = 0;
+        return 1;
+    }
+    flen = c->blen - c->bpos;
+    if (flen > UDP_BUFLEN) flen = UDP_BUFLEN;
+    f->type = (flen < UDP_BUFLEN) ? T_FINAL : T_CHUNK;
+    f->len  = (u16)flen;
+    if (flen) memcpy(f->data, c->block + c->bpos, (size_t)flen);
+    c->bpos += flen;
+    c->flen = (int)(sizeof(char) + sizeof(u16)) + flen;
+    c->fsent = 0;
+    c->last = (f->type == T_FINAL);
+    return 1;
+}
+
+/* Request: T_REQ, u16 len, "name\0" with an optional "prio\0" field after it. */
+static void host_conn_read_req(HostConn *c) {
+    char hdr_type;
+    u16 hdr_len;
+    const char *reqname, *field, *end;
+    ssize_t r;
+    int want = (int)(sizeof(char) + sizeof(u16));
+
+    if (c->req_got >= want) {
+        memcpy(&hdr_len, c->req + 1, sizeof(hdr_len));
+        want += hdr_len;
+    }
+    r = recv(c->fd, c->req + c->req_got, (size_t)(want - c->req_got), 0);
+    if (r <= 0) { host_conn_close(c); return; }
+    c->req_got += (int)r;
+    if (c->req_got == (int)(sizeof(char) + sizeof(u16))) {
+        hdr_type = c->req[0];
+        memcpy(&hdr_len, c->req + 1, sizeof(hdr_len));
+        if (hdr_type != T_REQ || hdr_len == 0 || hdr_len > UDP_BUFLEN) { host_conn_fail(c, "Bad request"); return; }
+        return;
+    }
+    if (c->req_got < want) return;
+
+    c->req[c->req_got] = '\0';
+    reqname = c->req + sizeof(char) + sizeof(u16);
+    end = c->req + c->req_got;
+    field = reqname + strlen(reqname) + 1;
+    c->prio = PRIO_NORMAL;
+    if (field < end && *field) {
+        int p = atoi(field);
+        if (p >= PRIO_HIGH && p < PRIO_CLASSES) c->prio = p;
+    }
+    if (field < end) field += strlen(field) + 1;
+    c->lz = field < end && strcmp(field, "lz") == 0 && compress_enabled() && !packed_format(reqname);
+    printf("Incoming download from %s for '%s'\n", c->cip, reqname);
+
+    if (content_find(reqname) < 0) { host_conn_fail(c, "Content not hosted here"); return; }
+    c->hf = host_file_get(reqname);
+    if (!c->hf) { host_conn_fail(c, "File open failed"); return; }
+
+    bucket_init(&c->tb, parse_rate(getenv("P2P_CONN_CAP")), mono_now());
+    c->state = CONN_SEND;
+    c->deficit = 0;
+    TRACE_ASYNC(TR_UPLOAD, 'b', (long)(c - hostConns), c->prio, reqname);
+}
+
+static void host_accept(void) {
+    struct sockaddr_in cli;
+    socklen_t clen = sizeof(cli);
+    HostConn *c = NULL;
+    int cs, i;
+
+    memset(&cli, 0, sizeof(cli));
+    cs = accept(tcp_listen, (struct sockaddr *)&cli, &clen);
+    if (cs < 0) { perror("accept"); return; }
+    for (i = 0; i < HOST_MAX_CONN && !c; i++) if (hostConns[i].state == CONN_FREE) c = &hostConns[i];
+    if (!c) { send_tcp_err(cs, "Host busy"); close(cs); return; }
+    fcntl(cs, F_SETFL, fcntl(cs, F_GETFL, 0) | O_NONBLOCK);
+    memset(c, 0, sizeof(*c));
+    c->fd = cs;
+    c->state = CONN_REQ;
+    strcpy(c->cip, inet_ntoa(cli.sin_addr));
+}
+
+static void host_read_ctl(void) {
+    ssize_t r = read(host_ctl[0], host_ctl_buf + host_ctl_len, sizeof(host_ctl_buf) - (size_t)host_ctl_len);
+    char *line, *nl;
+    if (r <= 0) { close(host_ctl[0]); host_ctl[0] = -1; return; }
+    host_ctl_len += (int)r;
+    line = host_ctl_buf;
+    while ((nl = memchr(line, '\n', (size_t)(host_ctl_buf + host_ctl_len - line))) != NULL) {
+        *nl = '\0';
+        if (line[0] == '+') content_add(line + 1);
+        else if (line[0] == '-') content_remove(line + 1);
+        line = nl + 1;
+    }
+    host_ctl_len -= (int)(line - host_ctl_buf);
+    memmove(host_ctl_buf, line, (size_t)host_ctl_len);
+}
+
+/* Deficit round robin over the active downloads.  Each turn a connection's
+   deficit grows by one frame times its class weight and it may send while
+   the deficit, its own bucket (P2P_CONN_CAP) and the global bucket
+   (P2P_UPLOAD_CAP) all cover the next frame.  When the global bucket runs
+   dry the round stops there and resumes at that connection, without a new
+   quantum, once it refills; so the cap is shared by class weight. */
+static void host_schedule(void) {
+    double now = mono_now();
+    int k, first = -1;
+
+    bucket_refill(&hostBucket, now);
+    for (k = 0; k < HOST_MAX_CONN; k++) {
+        int slot = (hostRR + k) % HOST_MAX_CONN;
+        HostConn *c = &hostConns[slot];
+        long quantum;
+        if (c->state != CONN_SEND || c->blocked) continue;
+        if (first < 0) first = slot;
+        quantum = (long)HOST_FRAME_MAX * prioWeight[c->prio];
+        bucket_refill(&c->tb, now);
+        c->throttled = 0;
+        if (k > 0 || !hostRRFed) c->deficit += quantum;
+        while (c->state == CONN_SEND) {
+            int need;
+            ssize_t w;
+            if (c->fsent == c->flen) {
+                if (c->flen && c->last) { host_conn_close(c); break; }
+                if (!host_conn_next_frame(c)) { host_conn_close(c); break; }
+            }
+            need = c->flen - c->fsent;
+            if (c->deficit < need) break;
+            if (bucket_wait(&hostBucket, need) > 0) {
+                c->throttled = 1;
+                TRACE_ASYNC(TR_THROTTLE, 'n', (long)(c - hostConns), need, NULL);
+                hostRR = slot;
+                hostRRFed = 1;
+                for (k = 0; k < HOST_MAX_CONN; k++) if (hostConns[k].state == CONN_SEND) hostConns[k].throttled = 1;
+                return;
+            }
+            if (bucket_wait(&c->tb, need) > 0) {
+                c->throttled = 1;
+                TRACE_ASYNC(TR_THROTTLE, 'n', (long)(c - hostConns), need, NULL);
+                break;
+            }
+            w = send(c->fd, c->frame + c->fsent, (size_t)need, 0);
+            if (w < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    c->blocked = 1;
+                    TRACE_ASYNC(TR_BLOCKED, 'n', (long)(c - hostConns), need, NULL);
+                }
+                else host_conn_close(c);
+                break;
+            }
+            TRACE_ASYNC(TR_FRAME, 'n', (long)(c - hostConns), (long)w, NULL);
+            c->fsent += (int)w;
+            c->deficit -= (long)w;
+            bucket_take(&hostBucket, (int)w);
+            bucket_take(&c->tb, (int)w);
+        }
+        if (c->deficit > 2 * quantum) c->deficit = 2 * quantum;
+    }
+    if (first >= 0) hostRR = (first + 1) % HOST_MAX_CONN;
+    hostRRFed = 0;
+}
+
+/* Adds the hosting sockets to the sets and returns how long select() may
+   sleep in seconds: 0 when a download can move now, -1 for no limit. */
+static double host_fill_fds(fd_set *rfds, fd_set *wfds, int *maxfd) {
+    double wait = -1;
+    int i, nfree = 0;
+    for (i = 0; i < HOST_MAX_CONN; i++) {
+        HostConn *c = &hostConns[i];
+        if (c->state == CONN_FREE) { nfree++; continue; }
+        if (c->fd > *maxfd) *maxfd = c->fd;
+        if (c->state == CONN_REQ) { FD_SET(c->fd, rfds); continue; }
+        if (c->blocked) { FD_SET(c->fd, wfds); continue; }
+        if (c->throttled) {
+            int need = c->flen - c->fsent;
+            double t = bucket_wait(&hostBucket, need);
+            if (bucket_wait(&c->tb, need) > t) t = bucket_wait(&c->tb, need);
+            if (wait < 0 || t < wait) wait = t;
+        } else {
+            wait = 0;
+        }
+    }
+    if (nfree && tcp_listen >= 0) {
+        FD_SET(tcp_listen, rfds);
+        if (tcp_listen > *maxfd) *maxfd = tcp_listen;
+    }
+    if (host_ctl[0] >= 0) {
+        FD_SET(host_ctl[0], rfds);
+        if (host_ctl[0] > *maxfd) *maxfd = host_ctl[0];
+    }
+    return wait;
+}
+
+static void host_service(fd_set *rfds, fd_set *wfds) {
+    int i;
+    if (host_ctl[0] >= 0 && FD_ISSET(host_ctl[0], rfds)) host_read_ctl();
+    if (tcp_listen >= 0 && FD_ISSET(tcp_listen, rfds)) host_accept();
+    for (i = 0; i < HOST_MAX_CONN; i++) {
+        HostConn *c = &hostConns[i];
+        if (c->state == CONN_REQ && FD_ISSET(c->fd, rfds)) host_conn_read_req(c);
+        else if (c->state == CONN_SEND && c->blocked && FD_ISSET(c->fd, wfds)) c->blocked = 0;
+    }
+    host_schedule();
+}
+
+static void host_init(void) {
+    int i;
+    memset(hostConns, 0, sizeof(hostConns));
+    for (i = 0; i < HOST_MAX_CONN; i++) hostConns[i].fd = -1;
+    bucket_init(&hostBucket, parse_rate(getenv("P2P_UPLOAD_CAP")), mono_now());
+    signal(SIGPIPE, SIG_IGN);
+}
+
 static void hosting_loop(void) {
     printf("Content hosting started\n");
+    host_init();
     while (1) {
-        struct sockaddr_in cli; socklen_t clen = sizeof(cli); int cs;
-        char cip[INET_ADDRSTRLEN]; char hdr_type; u16 hdr_len; char reqname[UDP_BUFLEN+1];
-        int i, allowed, fd; char out_type; u16 out_len; char buf[UDP_BUFLEN]; ssize_t nr;
-
-        memset(&cli, 0, sizeof(cli));
-        cs = accept(tcp_listen, (struct sockaddr *)&cli, &clen);
-        if (cs < 0) { perror("accept"); continue; }
-        strcpy(cip, inet_ntoa(cli.sin_addr));
+        fd_set rfds, wfds;
+        struct timeval tv;
+        int maxfd = -1;
+        double wait;
 
-        if (!recv_n(cs, &hdr_type, sizeof(hdr_type)) || !recv_n(cs, &hdr_len, sizeof(hdr_len))) {
-            send_tcp_err(cs, "Bad request"); close(cs); continue;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        wait = host_fill_fds(&rfds, &wfds, &maxfd);
+        if (wait >= 0) {
+            tv.tv_sec = (long)wait;
+            tv.tv_usec = (long)((wait - (double)tv.tv_sec) * 1e6);
         }
-        if (hdr_type != T_REQ || hdr_len == 0 || hdr_len > UDP_BUFLEN) {
-            send_tcp_err(cs, "Bad request"); close(cs); continue;
+        if (select(maxfd + 1, &rfds, &wfds, NULL, wait >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
         }
-        memset(reqname, 0, sizeof(reqname));
-        if (!recv_n(cs, reqname, hdr_len)) { close(cs); continue; }
+        host_service(&rfds, &wfds);
+    }
+}
 
-        printf("Incoming download from %s for '%s'\n", cip, reqname);
+/* Forks the hosting loop once; contentList changes reach it over host_ctl. */
+static void start_hosting(void) {
+    ensure_tcp_listen();
+    if (host_pid > 0) return;
+    if (pipe(host_ctl) < 0) die("pipe");
+    host_pid = fork();
+    if (host_pid == 0) {
+        close(host_ctl[1]);
+        host_ctl[1] = -1;
+        TRACE_FORK();
+        hosting_loop();
+        _exit(0);
+    }
+    close(host_ctl[0]);
+    host_ctl[0] = -1;
+}
 
-        allowed = 0;
-        for (i = 0; i < nContent; i++) {
-            if (strcmp(contentList[i], reqname) == 0) { allowed = 1; break; }
-        }
-        if (!allowed) { send_tcp_err(cs, "Content not hosted here"); close(cs); continue; }
+static int wait_readable(int fd, int ms) {
+    fd_set rfds;
+    struct timeval tv;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return select(fd + 1, &rfds, NULL, NULL, &tv) > 0;
+}
 
-        fd = open(reqname, O_RDONLY);
-        if (fd < 0) { send_tcp_err(cs, "File open failed"); close(cs); continue; }
+static int shard_count(void) { return shardMap.n ? shardMap.n : 1; }
 
-        while (1) {
-            nr = read(fd, buf, sizeof(buf));
-            if (nr < 0) { perror("read"); break; }
-            if (nr == 0) {
-                out_type = T_FINAL; out_len = 0;
-                send(cs, &out_type, sizeof(out_type), 0);
-                send(cs, &out_len, sizeof(out_len), 0);
-                break;
-            }
-            out_type = (nr < (ssize_t)sizeof(buf)) ? T_FINAL : T_CHUNK;
-            out_len = (u16)nr;
-            send(cs, &out_type, sizeof(out_type), 0);
-            send(cs, &out_len, sizeof(out_len), 0);
-            if (out_len) send(cs, buf, out_len, 0);
-            if (out_type == T_FINAL) break;
-        }
-        close(fd);
-        close(cs);
+static const struct sockaddr_in *shard_addr(int k) { return shardMap.n ? &shardAddr[k] : &index_addr; }
+
+static int replica_reindex(void);
+static void write_all(int fd, const char *buf, size_t len);
+
+/* In a command worker, passes a shard map or replica change on to the
+   daemon so its copy follows. */
+static void worker_note(const char *fmt, ...) {
+    char line[2 * NAME_LEN + MAX_SHARDS * (SHARD_ADDR_LEN + 1) + 64];
+    va_list ap;
+    int n;
+    if (ctl_worker < 0) return;
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(line) - 1) return;
+    line[n++] = '\n';
+    write_all(ctl_worker, line, (size_t)n);
+}
+
+/* Installs map m.  A new version invalidates the per-shard replica. */
+static int shard_map_use(const ShardMap *m) {
+    char note[MAX_SHARDS * (SHARD_ADDR_LEN + 1) + 32];
+    int i, n;
+    for (i = 0; i < m->n; i++) if (!shard_addr_parse(m->addr[i], &shardAddr[i])) return 0;
+    if (m->version != shardMap.version) {
+        nReplica = 0;
+        replica_reindex();
+        memset(replicaVersion, 0, sizeof(replicaVersion));
+        memset(replicaEpoch, 0, sizeof(replicaEpoch));
+        replicaGen++;
+        n = sprintf(note, "=M\t%lu\t%d", m->version, m->n);
+        for (i = 0; i < m->n; i++) n += sprintf(note + n, "\t%s", m->addr[i]);
+        worker_note("%s", note);
+    }
+    shardMap = *m;
+    return 1;
+}
+
+/* Asks the index (or, failing that, any known shard) for the shard map.
+   An unsharded or older index leaves shardMap.n at 0. */
+static void fetch_shard_map(void) {
+    UdpPDU p, r;
+    ShardMap m;
+    int k;
+    for (k = -1; k < shardMap.n; k++) {
+        const struct sockaddr_in *to = k < 0 ? &index_addr : &shardAddr[k];
+        while (recv(udp_sock, &r, sizeof(r), MSG_DONTWAIT) > 0) {}
+        memset(&p, 0, sizeof(p));
+        p.type = T_MAP;
+        if (sendto(udp_sock, &p, sizeof(p), 0, (const struct sockaddr *)to, sizeof(*to)) < 0) continue;
+        if (!wait_readable(udp_sock, 1000)) continue;
+        memset(&r, 0, sizeof(r));
+        if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) continue;
+        if (r.type == T_ERR) return;
+        if (r.type != T_MAP || !shard_map_decode(&m, r.data, UDP_BUFLEN)) continue;
+        shard_map_use(&m);
+        return;
+    }
+}
+
+static int index_exchange(UdpPDU *p, UdpPDU *r, const char *content, char *msg) {
+    int tries;
+    for (tries = 0; tries < 2; tries++) {
+        const struct sockaddr_in *to = shardMap.n ? &shardAddr[shard_owner(&shardMap, content)] : &index_addr;
+        while (recv(udp_sock, r, sizeof(*r), MSG_DONTWAIT) > 0) {}
+        if (sendto(udp_sock, p, sizeof(*p), 0, (const struct sockaddr *)to, sizeof(*to)) < 0) {
+            sprintf(msg, "sendto: %s", strerror(errno));
+            return 0;
+        }
+        if (!wait_readable(udp_sock, INDEX_TIMEOUT_MS)) { strcpy(msg, "Index did not answer"); return 0; }
+        memset(r, 0, sizeof(*r));
+        if (recvfrom(udp_sock, r, sizeof(*r), 0, NULL, NULL) < 0) {
+            sprintf(msg, "recvfrom: %s", strerror(errno));
+            return 0;
+        }
+        r->data[UDP_BUFLEN - 1] = '\0';
+        if (r->type != T_MOVED) break;
+        fetch_shard_map();
     }
+    if (r->type == T_MOVED) { strcpy(msg, "Shard map keeps changing, try again"); return 0; }
+    strcpy(msg, r->data);
+    return r->type != T_ERR;
+}
+
+/* One request/reply with the index shard that owns content.  msg
+   (UDP_BUFLEN bytes) gets the reply text or what went wrong; returns 0
+   unless the index answered without T_ERR.  Stale replies from an earlier
+   timed-out request are dropped; T_MOVED refetches the map and retries. */
+static int index_request(UdpPDU *p, UdpPDU *r, const char *content, char *msg) {
+    int ok;
+    TRACE_BEGIN(TR_REQUEST, p->type, content);
+    ok = index_exchange(p, r, content, msg);
+    TRACE_END(TR_REQUEST, r->type);
+    return ok;
 }
 
-static int register_content_udp(const char *content) {
+static int register_content_udp(const char *content, char *msg) {
     UdpPDU p, r;
     int off = 0;
     int n1, n2, n3;
@@ -700,111 +2527,1224 @@ static int register_content_udp(const char *content) {
     sprintf(pbuf, "%u", (unsigned)listen_port);
     n3 = (int)strlen(pbuf) + 1;
 
-    if (n1 + n2 + n3 > UDP_BUFLEN) { fprintf(stderr, "Register payload too large\n"); return 0; }
+    if (n1 + n2 + n3 > UDP_BUFLEN) { strcpy(msg, "Register payload too large"); return 0; }
     memcpy(p.data + off, peerName, n1); off += n1;
     memcpy(p.data + off, content,  n2); off += n2;
     memcpy(p.data + off, pbuf,     n3);
-
-    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return 0; }
-    memset(&r, 0, sizeof(r));
-    if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); return 0; }
-    if (r.type == T_ERR) { printf("Register error: %s\n", r.data); return 0; }
-    printf("%s\n", r.data);
-    return 1;
+    return index_request(&p, &r, content, msg);
 }
 
-static int dereg_content_udp(const char *content) {
+static int dereg_content_udp(const char *content, char *msg) {
     UdpPDU p, r;
     memset(&p, 0, sizeof(p)); p.type = T_DEREG; sprintf(p.data, "%s", content);
-    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return 0; }
-    memset(&r, 0, sizeof(r));
-    if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); return 0; }
-    if (r.type == T_ERR) { printf("%s\n", r.data); return 0; }
-    printf("%s\n", r.data);
-    return 1;
+    return index_request(&p, &r, content, msg);
+}
+
+/* Registers (T_REGN) or de-registers (T_DEREGN) names in as few PDUs as
+   they fit in, one shard at a time.  A lost reply resends the PDU, which
+   the index treats as a repeat; a shard that stays silent gets nothing
+   more this time.  Names a shard does not own go again after the map is
+   refetched.  done (if not NULL) gets 1 for every name the index took.
+   Returns how many were not accepted. */
+static int index_batch(char type, char (*names)[NAME_LEN + 1], int n, char *done) {
+    int *todo, *owner, *again, sent[BATCH_PAYLOAD / 2];
+    char mark[BATCH_PAYLOAD / 2];
+    int ntodo = n, failed = 0, round, i, k;
+    char msg[UDP_BUFLEN];
+
+    if (done) memset(done, 0, (size_t)(n > 0 ? n : 0));
+    if (n <= 0) return 0;
+    todo = malloc((size_t)n * sizeof(int));
+    owner = malloc((size_t)n * sizeof(int));
+    again = malloc((size_t)n * sizeof(int));
+    if (!todo || !owner || !again) { free(todo); free(owner); free(again); return n; }
+    if (type == T_REGN) ensure_tcp_listen();
+    for (i = 0; i < n; i++) todo[i] = i;
+
+    for (round = 0; round < 3 && ntodo > 0; round++) {
+        int nagain = 0;
+        if (round) fetch_shard_map();
+        for (i = 0; i < ntodo; i++) owner[i] = shardMap.n ? shard_owner(&shardMap, names[todo[i]]) : 0;
+        for (k = 0; k < shard_count(); k++) {
+            int pos = 0, down = 0;
+            while (pos < ntodo) {
+                UdpPDU p, r;
+                const char *f;
+                int off, nsent = 0, tries, ok = 0, nfail, j;
+
+                memset(&p, 0, sizeof(p));
+                p.type = type;
+                off = sprintf(p.data, "%s", peerName) + 1;
+                if (type == T_REGN) off += sprintf(p.data + off, "%u", (unsigned)listen_port) + 1;
+                for (; pos < ntodo; pos++) {
+                    int len = (int)strlen(names[todo[pos]]) + 1;
+                    if (owner[pos] != k) continue;
+                    if (down) { failed++; continue; }
+                    if (off + len > BATCH_PAYLOAD) break;
+                    memcpy(p.data + off, names[todo[pos]], (size_t)len);
+                    off += len;
+                    sent[nsent++] = todo[pos];
+                }
+                if (!nsent) break;
+                for (tries = 0; tries < 3 && !ok; tries++) {
+                    memset(&r, 0, sizeof(r));
+                    ok = index_request(&p, &r, names[sent[0]], msg);
+                    if (r.type == T_ERR) break;
+                }
+                if (!ok || r.type != T_ACK) {
+                    printf("Batch %s: %s\n", type == T_REGN ? "register" : "de register", msg);
+                    failed += nsent;
+                    down = 1;
+                    continue;
+                }
+                /* "done\0failed\0", the moved names, "", then the failed
+                   names, each list in the order sent */
+                memset(mark, 0, sizeof(mark));
+                f = r.data + strlen(r.data) + 1;
+                nfail = atoi(f);
+                failed += nfail;
+                f += strlen(f) + 1;
+                for (j = 0; f < r.data + UDP_BUFLEN && *f; f += strlen(f) + 1) {
+                    while (j < nsent && strcmp(names[sent[j]], f) != 0) j++;
+                    if (j < nsent) { mark[j] = 1; again[nagain++] = sent[j++]; }
+                }
+                for (j = 0, f++; f < r.data + UDP_BUFLEN && *f; f += strlen(f) + 1) {
+                    while (j < nsent && strcmp(names[sent[j]], f) != 0) j++;
+                    if (j < nsent) { mark[j++] = 2; nfail--; }
+                }
+                /* an index that does not list its failures confirms nothing */
+                for (j = 0; done && nfail <= 0 && j < nsent; j++) if (!mark[j]) done[sent[j]] = 1;
+            }
+        }
+        memcpy(todo, again, (size_t)nagain * sizeof(int));
+        ntodo = nagain;
+    }
+    free(todo);
+    free(owner);
+    free(again);
+    return failed + ntodo;
 }
 
-static int search_udp(const char *content, char *out_ip, size_t iplen, u16 *out_port) {
+static int search_udp(const char *content, char *out_ip, size_t iplen, u16 *out_port, char *msg) {
     UdpPDU p, r;
     int i;
     memset(&p, 0, sizeof(p)); p.type = T_SEARCH; sprintf(p.data, "%s", content);
-    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return 0; }
-    memset(&r, 0, sizeof(r));
-    if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); return 0; }
-    if (r.type == T_ERR) { printf("%s\n", r.data); return 0; }
+    if (!index_request(&p, &r, content, msg)) return 0;
     i = 0;
     strncpy(out_ip, r.data, iplen - 1);
     out_ip[iplen - 1] = '\0';
     while (i < UDP_BUFLEN && r.data[i] != '\0') i++;
-    if (i >= UDP_BUFLEN) return 0;
+    if (i >= UDP_BUFLEN - 1) { strcpy(msg, "Bad search reply"); return 0; }
     i++;
     *out_port = (u16)atoi(&r.data[i]);
     return 1;
 }
 
-static int tcp_download(const char *server_ip, u16 server_port, const char *content) {
-    int cs;
-    struct sockaddr_in sa;
-    char hdr_type;
-    u16 hdr_len;
-    FILE *fp;
-    char rh_type;
-    u16 rh_len;
-    char buf[UDP_BUFLEN];
+static int catalog_push(CatalogEntry **arr, int *n, int *cap, char op, const char *content, const char *peer) {
+    CatalogEntry *e;
+    if (*n == *cap) {
+        int ncap = *cap ? *cap * 2 : 256;
+        CatalogEntry *na = (CatalogEntry *)realloc(*arr, (size_t)ncap * sizeof(**arr));
+        if (!na) return 0;
+        *arr = na;
+        *cap = ncap;
+    }
+    e = &(*arr)[(*n)++];
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    strncpy(e->content, content, NAME_LEN);
+    strncpy(e->peer, peer, NAME_LEN);
+    return 1;
+}
 
-    cs = socket(AF_INET, SOCK_STREAM, 0); if (cs < 0) { perror("socket"); return 0; }
-    memset(&sa, 0, sizeof(sa)); sa.sin_family = AF_INET; sa.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) != 1) { perror("inet_pton"); close(cs); return 0; }
-    if (connect(cs, (struct sockaddr *)&sa, sizeof(sa)) < 0) { perror("connect"); close(cs); return 0; }
+static unsigned long replica_hash(const char *content, const char *peer, int shard) {
+    return (name_hash(content) * 31 + name_hash(peer)) ^ (unsigned long)shard;
+}
 
-    hdr_type = T_REQ; hdr_len = (u16)(strlen(content) + 1);
-    if (send(cs, &hdr_type, sizeof(hdr_type), 0) < 0 ||
-        send(cs, &hdr_len, sizeof(hdr_len), 0) < 0 ||
-        send(cs, content, hdr_len, 0) < 0) { perror("send"); close(cs); return 0; }
+/* replicaSet slot holding (content, peer) from shard, or the empty slot
+   where it would go. */
+static unsigned long replica_slot(const char *content, const char *peer, int shard) {
+    unsigned long mask = (unsigned long)replicaSetSize - 1, slot = replica_hash(content, peer, shard) & mask;
+    while (replicaSet[slot]) {
+        const CatalogEntry *e = &replica[replicaSet[slot] - 1];
+        if (e->shard == shard && strcmp(e->content, content) == 0 && strcmp(e->peer, peer) == 0) break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
 
-    fp = fopen(content, "wb"); if (!fp) { perror("fopen"); close(cs); return 0; }
+static int replica_find(const char *content, const char *peer, int shard) {
+    if (!replicaSetSize) return -1;
+    return replicaSet[replica_slot(content, peer, shard)] - 1;
+}
 
-    while (1) {
-        if (!recv_n(cs, &rh_type, sizeof(rh_type)) || !recv_n(cs, &rh_len, sizeof(rh_len))) { perror("recv"); fclose(fp); close(cs); return 0; }
-        if (rh_type == T_ERR) {
-            if (rh_len > 0 && rh_len <= UDP_BUFLEN) {
-                if (!recv_n(cs, buf, rh_len)) perror("recv");
-                fwrite(buf, 1, rh_len, stdout); fputc('\n', stdout);
-            }
-            fclose(fp); close(cs); return 0;
-        }
-        if (rh_len > UDP_BUFLEN) { fprintf(stderr, "Bad length\n"); fclose(fp); close(cs); return 0; }
-        if (rh_len > 0) {
-            if (!recv_n(cs, buf, rh_len)) { perror("recv"); fclose(fp); close(cs); return 0; }
-            fwrite(buf, 1, rh_len, fp);
-        }
-        if (rh_type == T_FINAL) break;
+/* Rebuilds replicaSet after the replica moved around or grew; on failure
+   the old one is kept. */
+static int replica_reindex(void) {
+    int size = capReplica * 2, i;
+    if (size != replicaSetSize) {
+        int *set = calloc((size_t)(size ? size : 1), sizeof(*set));
+        if (!set) return 0;
+        free(replicaSet);
+        replicaSet = set;
+        replicaSetSize = size;
+    } else if (size) {
+        memset(replicaSet, 0, (size_t)size * sizeof(*replicaSet));
     }
-
-    fclose(fp);
-    close(cs);
-    printf("File '%s' received\n", content);
+    for (i = 0; i < nReplica; i++) replicaSet[replica_slot(replica[i].content, replica[i].peer, replica[i].shard)] = i + 1;
     return 1;
 }
 
-int main(int argc, char **argv) {
-    const char *host;
-    int c;
+static void replica_add(const char *content, const char *peer, int shard) {
+    int grow = nReplica == capReplica;
+    if (!catalog_push(&replica, &nReplica, &capReplica, ' ', content, peer)) return;
+    replica[nReplica - 1].shard = shard;
+    if (!grow) replicaSet[replica_slot(content, peer, shard)] = nReplica;
+    else if (!replica_reindex()) nReplica--;
+}
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <index_host> <peer_name>\n", argv[0]);
-        return 1;
+/* Backward-shift delete, then the last entry moves into position pos. */
+static void replica_del(int pos) {
+    unsigned long mask = (unsigned long)replicaSetSize - 1, hole, j;
+    hole = j = replica_slot(replica[pos].content, replica[pos].peer, replica[pos].shard);
+    for (;;) {
+        const CatalogEntry *e;
+        unsigned long home;
+        j = (j + 1) & mask;
+        if (!replicaSet[j]) break;
+        e = &replica[replicaSet[j] - 1];
+        home = replica_hash(e->content, e->peer, e->shard) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            replicaSet[hole] = replicaSet[j];
+            hole = j;
+        }
     }
-
-    host = argv[1];
-    memset(peerName, 0, sizeof(peerName));
-    strncpy(peerName, argv[2], sizeof(peerName) - 1);
-    if (strlen(peerName) == 0 || strlen(peerName) > NAME_LEN) {
-        fprintf(stderr, "Peer name must be 1..%d chars\n", NAME_LEN);
-        return 1;
+    replicaSet[hole] = 0;
+    nReplica--;
+    if (pos != nReplica) {
+        replica[pos] = replica[nReplica];
+        replicaSet[replica_slot(replica[pos].content, replica[pos].peer, replica[pos].shard)] = pos + 1;
     }
+}
 
-    create_udp_and_index(host, INDEX_PORT);
+static void replica_apply(const CatalogEntry *e, int shard) {
+    int i = replica_find(e->content, e->peer, shard);
+    if (e->op == '+' && i < 0) replica_add(e->content, e->peer, shard);
+    else if (e->op == '-' && i >= 0) replica_del(i);
+    worker_note("=%c\t%d\t%s\t%s", e->op, shard, e->content, e->peer);
+}
+
+/* Drops shard k's part of the replica ahead of a snapshot. */
+static void replica_clear(int k) {
+    int i;
+    for (i = nReplica - 1; i >= 0; i--) if (replica[i].shard == k) replica[i] = replica[--nReplica];
+    replica_reindex();
+    worker_note("=C\t%d", k);
+}
+
+/* Sends sync request p to shard k and waits for the page answering seq,
+   asking again when it does not come.  Returns the page type, T_ERR, or
+   0 when the shard stays silent. */
+static char sync_request(int k, const UdpPDU *p, unsigned long seq, UdpPDU *r) {
+    int tries;
+    for (tries = 0; tries < SYNC_TRIES; tries++) {
+        double deadline = mono_now() + SYNC_RETRY_MS / 1000.0, left;
+        if (sendto(udp_sock, p, sizeof(*p), 0, (const struct sockaddr *)shard_addr(k), sizeof(struct sockaddr_in)) < 0) { perror("sendto"); return 0; }
+        while ((left = deadline - mono_now()) > 0 && wait_readable(udp_sock, (int)(left * 1000) + 1)) {
+            char kind;
+            unsigned long epoch, from, to, rseq;
+            memset(r, 0, sizeof(*r));
+            if (recvfrom(udp_sock, r, sizeof(*r), 0, NULL, NULL) < 0) break;
+            r->data[UDP_BUFLEN - 1] = '\0';
+            if (r->type == T_ERR) return T_ERR;
+            if ((r->type == T_DELTA || r->type == T_DELTAEND) &&
+                sscanf(r->data, "%c %lu %lu %lu %lu", &kind, &epoch, &from, &to, &rseq) == 5 && rseq == seq) return r->type;
+        }
+    }
+    return 0;
+}
+
+/* Brings shard k's part of the replica up to date.  A round asks for the
+   changes since our version (or a snapshot) one page at a time, naming
+   where the last page ended, and stages the records until the last page
+   so a failed round leaves the replica as it was.  A snapshot is read
+   while the catalog keeps changing, so another round then catches up
+   from the version of its first page.  Returns 1 on success, 0 on
+   failure, -1 when the index does not know T_SYNC. */
+static int sync_shard(int k) {
+    UdpPDU p, r;
+    CatalogEntry *staged = NULL;
+    int nstaged = 0, capstaged = 0, ok = 0, round, i;
+    unsigned long seq = 0;
+
+    while (recv(udp_sock, &r, sizeof(r), MSG_DONTWAIT) > 0) {}
+    for (round = 0; round < SYNC_ROUNDS && ok == 0; round++) {
+        char kind = 0, type;
+        char lastContent[NAME_LEN + 1], lastPeer[NAME_LEN + 1];
+        unsigned long epoch = replicaEpoch[k], to = 0, cursor = 0;
+
+        nstaged = 0;
+        lastContent[0] = lastPeer[0] = '\0';
+        do {
+            char rkind;
+            unsigned long repoch, from, rto, rseq;
+            int off;
+
+            memset(&p, 0, sizeof(p));
+            p.type = T_SYNC;
+            off = sprintf(p.data, "%lu", replicaVersion[k]) + 1;
+            off += sprintf(p.data + off, "%lu", epoch) + 1;
+            off += sprintf(p.data + off, "%lu", ++seq) + 1;
+            if (kind) {
+                off += sprintf(p.data + off, "%c", kind) + 1;
+                off += sprintf(p.data + off, "%lu", to) + 1;
+                if (kind == 'D') sprintf(p.data + off, "%lu", cursor);
+                else {
+                    off += sprintf(p.data + off, "%s", lastContent) + 1;
+                    sprintf(p.data + off, "%s", lastPeer);
+                }
+            }
+            type = sync_request(k, &p, seq, &r);
+            if (type == 0 || type == T_ERR) break;
+            sscanf(r.data, "%c %lu %lu %lu %lu", &rkind, &repoch, &from, &rto, &rseq);
+            if (!kind) { kind = rkind; epoch = repoch; to = rto; cursor = from; }
+            off = (int)strlen(r.data) + 1;
+            while (off < UDP_BUFLEN && r.data[off] != '\0') {
+                char op = r.data[off++];
+                const char *content = r.data + off;
+                const char *peer;
+                off += (int)strlen(content) + 1;
+                if (off >= UDP_BUFLEN) break;
+                peer = r.data + off;
+                off += (int)strlen(peer) + 1;
+                catalog_push(&staged, &nstaged, &capstaged, op, content, peer);
+                cursor++;
+                strcpy(lastContent, content);
+                strcpy(lastPeer, peer);
+            }
+        } while (type == T_DELTA);
+
+        if (type == 0) { fprintf(stderr, "Catalog sync timed out\n"); break; }
+        if (type == T_ERR) { if (!kind) ok = -1; continue; }
+        if (kind == 'S') replica_clear(k);
+        for (i = 0; i < nstaged; i++) replica_apply(&staged[i], k);
+        replicaVersion[k] = to;
+        replicaEpoch[k] = epoch;
+        worker_note("=V\t%d\t%lu\t%lu", k, to, epoch);
+        if (kind == 'D') ok = 1;
+    }
+    free(staged);
+    return ok;
+}
+
+/* Syncs every shard of the current map and merges them in the replica.
+   Returns 1 when all synced, 0 if any failed, -1 for an unsharded index
+   without T_SYNC. */
+static int sync_catalog(void) {
+    int k, rc, ok = 1;
+    fetch_shard_map();
+    for (k = 0; k < shard_count(); k++) {
+        rc = sync_shard(k);
+        if (rc < 0 && !shardMap.n) return -1;
+        if (rc != 1) ok = 0;
+    }
+    return ok;
+}
+
+static int replica_cmp(const void *a, const void *b) {
+    const CatalogEntry *x = (const CatalogEntry *)a, *y = (const CatalogEntry *)b;
+    int c = strcmp(x->content, y->content);
+    return c ? c : strcmp(x->peer, y->peer);
+}
+
+/* Formats the next "content : host, host" line of the sorted replica for
+   entries whose content name contains filter (all when NULL), starting at
+   *pos.  Returns 0 when there are no more lines. */
+static int replica_line(int *pos, const char *filter, char *line, size_t len) {
+    int i = *pos;
+    size_t used;
+    while (i < nReplica && filter && !strstr(replica[i].content, filter)) i++;
+    if (i >= nReplica) { *pos = i; return 0; }
+    used = (size_t)sprintf(line, "%s : %s", replica[i].content, replica[i].peer);
+    for (i++; i < nReplica && strcmp(replica[i].content, replica[i - 1].content) == 0; i++) {
+        /* While a shard hands entries over, both old and new owner list them. */
+        if (strcmp(replica[i].peer, replica[i - 1].peer) == 0) continue;
+        if (used + strlen(replica[i].peer) + 3 > len) continue;
+        used += (size_t)sprintf(line + used, ", %s", replica[i].peer);
+    }
+    *pos = i;
+    return 1;
+}
+
+static void replica_sort(void) {
+    qsort(replica, (size_t)nReplica, sizeof(*replica), replica_cmp);
+    replica_reindex();
+}
+
+static void print_replica(const char *filter) {
+    char line[REPLICA_LINE_MAX + 1];
+    int pos = 0, shown = 0;
+    replica_sort();
+    while (replica_line(&pos, filter, line, sizeof(line))) { printf(" - %s\n", line); shown++; }
+    if (!shown) printf("(none)\n");
+}
+
+/* T_LIST fallback for an index without T_SYNC. */
+static void list_full_udp(void) {
+    UdpPDU p, r;
+    int i;
+    memset(&p, 0, sizeof(p)); p.type = T_LIST;
+    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return; }
+    while (1) {
+        if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); break; }
+        if (r.type == T_LISTEND && r.data[0] == '\0') { printf("(none)\n"); break; }
+        for (i = 0; i < UDP_BUFLEN; ) {
+            if (r.data[i] == '\0') break;
+            printf(" - %s\n", &r.data[i]);
+            while (i < UDP_BUFLEN && r.data[i] != '\0') i++;
+            if (i < UDP_BUFLEN && r.data[i] == '\0') i++;
+        }
+        if (r.type == T_LISTEND) break;
+    }
+}
+
+/* A download is written to ".name.part" and renamed once complete, so
+   neither the share watcher nor an uploader ever sees a partial file. */
+static void part_name(char *out, const char *content) {
+    sprintf(out, ".%s.part", content);
+}
+
+static int download_abort(int cs, FILE *fp, const char *part) {
+    if (fp) { fclose(fp); unlink(part); }
+    if (cs >= 0) close(cs);
+    return 0;
+}
+
+static int download_fail(char *msg, const char *what, int cs, FILE *fp, const char *part) {
+    sprintf(msg, "%s: %s", what, strerror(errno));
+    return download_abort(cs, fp, part);
+}
+
+/* Collects T_ZCHUNK frames in zbuf until the packed block is complete,
+   then writes it out expanded; returns 0 on a malformed block. */
+static int unpack_frame(char *zbuf, int *zgot, const char *data, int len, FILE *fp) {
+    unsigned char raw[ZBLOCK_MAX];
+    u16 rawlen, packed;
+    if (*zgot + len > ZBUF_LEN) return 0;
+    memcpy(zbuf + *zgot, data, (size_t)len);
+    *zgot += len;
+    if (*zgot < ZHDR_LEN) return 1;
+    memcpy(&rawlen, zbuf, sizeof(rawlen));
+    memcpy(&packed, zbuf + sizeof(rawlen), sizeof(packed));
+    if (rawlen > ZBLOCK_MAX || ZHDR_LEN + packed > ZBUF_LEN || *zgot > ZHDR_LEN + packed) return 0;
+    if (*zgot < ZHDR_LEN + packed) return 1;
+    if (lz_decompress((const unsigned char *)zbuf + ZHDR_LEN, packed, raw, rawlen) != rawlen) return 0;
+    fwrite(raw, 1, rawlen, fp);
+    *zgot = 0;
+    return 1;
+}
+
+/* Fetches content from a hosting peer into the current directory; msg
+   (UDP_BUFLEN bytes) says what happened either way. */
+static int tcp_fetch(const char *server_ip, u16 server_port, const char *content, char *msg) {
+    int cs;
+    struct sockaddr_in sa;
+    char hdr_type;
+    u16 hdr_len;
+    FILE *fp;
+    char rh_type;
+    u16 rh_len;
+    char buf[UDP_BUFLEN];
+    char part[NAME_LEN + 8];
+    char zbuf[ZBUF_LEN];
+    int zgot = 0;
+    const char *prio = getenv("P2P_DL_PRIO");
+
+    part_name(part, content);
+    cs = socket(AF_INET, SOCK_STREAM, 0); if (cs < 0) return download_fail(msg, "socket", -1, NULL, part);
+    memset(&sa, 0, sizeof(sa)); sa.sin_family = AF_INET; sa.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) != 1) { strcpy(msg, "Bad host address"); close(cs); return 0; }
+    if (connect(cs, (struct sockaddr *)&sa, sizeof(sa)) < 0) return download_fail(msg, "connect", cs, NULL, part);
+
+    /* "name\0", the upload class to ask for (P2P_DL_PRIO, normal by
+       default) and "lz\0" unless P2P_COMPRESS=0. */
+    hdr_type = T_REQ; hdr_len = (u16)(strlen(content) + 1);
+    memcpy(buf, content, hdr_len);
+    if (!(prio && *prio && strlen(prio) < 8)) prio = NULL;
+    hdr_len = (u16)(hdr_len + 1 + (prio ? sprintf(buf + hdr_len, "%s", prio) : sprintf(buf + hdr_len, "%d", PRIO_NORMAL)));
+    if (compress_enabled()) hdr_len = (u16)(hdr_len + 1 + sprintf(buf + hdr_len, "lz"));
+    if (send(cs, &hdr_type, sizeof(hdr_type), 0) < 0 ||
+        send(cs, &hdr_len, sizeof(hdr_len), 0) < 0 ||
+        send(cs, buf, hdr_len, 0) < 0) return download_fail(msg, "send", cs, NULL, part);
+
+    fp = fopen(part, "wb"); if (!fp) return download_fail(msg, "fopen", cs, NULL, part);
+
+    while (1) {
+        if (!recv_n(cs, &rh_type, sizeof(rh_type)) || !recv_n(cs, &rh_len, sizeof(rh_len))) return download_fail(msg, "recv", cs, fp, part);
+        if (rh_type == T_ERR) {
+            strcpy(msg, "Host refused");
+            if (rh_len > 0 && rh_len < UDP_BUFLEN && recv_n(cs, msg, rh_len)) msg[rh_len] = '\0';
+            return download_abort(cs, fp, part);
+        }
+        if (rh_len > UDP_BUFLEN) { strcpy(msg, "Bad length"); return download_abort(cs, fp, part); }
+        if (rh_len > 0) {
+            if (!recv_n(cs, buf, rh_len)) return download_fail(msg, "recv", cs, fp, part);
+            if (rh_type != T_ZCHUNK) fwrite(buf, 1, rh_len, fp);
+            else if (!unpack_frame(zbuf, &zgot, buf, rh_len, fp)) { strcpy(msg, "Bad compressed block"); return download_abort(cs, fp, part); }
+        }
+        TRACE_MARK(TR_CHUNK, rh_len, NULL);
+        if (rh_type == T_FINAL) break;
+    }
+    if (zgot) { strcpy(msg, "Transfer ended inside a compressed block"); return download_abort(cs, fp, part); }
+
+    if (fclose(fp) != 0) { download_fail(msg, "fclose", cs, NULL, part); unlink(part); return 0; }
+    if (rename(part, content) != 0) { download_fail(msg, "rename", cs, NULL, part); unlink(part); return 0; }
+    close(cs);
+    sprintf(msg, "File '%s' received", content);
+    return 1;
+}
+
+static int tcp_download(const char *server_ip, u16 server_port, const char *content, char *msg) {
+    int ok;
+    TRACE_BEGIN(TR_DOWNLOAD, server_port, content);
+    ok = tcp_fetch(server_ip, server_port, content, msg);
+    TRACE_END(TR_DOWNLOAD, ok);
+    return ok;
+}
+
+/* Sends the T_DEREG for everything hosted here and says T_BYE. */
+static void leave_index(void) {
+    UdpPDU bye;
+    int i, failed;
+    if (nContent > 0) {
+        failed = index_batch(T_DEREGN, contentList, nContent, NULL);
+        printf("De registered %d content(s)", nContent - failed);
+        if (failed) printf(", %d failed", failed);
+        printf("\n");
+    }
+    memset(&bye, 0, sizeof(bye)); bye.type = T_BYE;
+    strncpy(bye.data, peerName, sizeof(bye.data) - 1);
+    for (i = 0; i < shard_count(); i++) sendto(udp_sock, &bye, sizeof(bye), 0, (const struct sockaddr *)shard_addr(i), sizeof(struct sockaddr_in));
+}
+
+/* ---- Daemon mode: commands over a Unix socket or from a batch file ---- */
+
+static void ctl_on_signal(int sig) { (void)sig; ctl_stop = 1; }
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+static CtlClient *ctl_client(long id) {
+    int i;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) if (id && ctlClients[i].id == id) return &ctlClients[i];
+    return NULL;
+}
+
+static int ctl_downloads(long owner) {
+    int i, n = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid && ctlWorkers[i].kind == 'G' && (!owner || ctlWorkers[i].owner == owner)) n++;
+    return n;
+}
+
+/* Commands of owner still running in a worker. */
+static int ctl_pending(long owner) {
+    int i, n = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid && ctlWorkers[i].owner == owner) n++;
+    return n;
+}
+
+/* Every reply is one line, "[#tag ]OK text", "[#tag ]ERR text" or, ahead of
+   an OK, "[#tag ]* data".  A client that went away is skipped. */
+static void ctl_reply(long id, const char *tag, const char *status, const char *fmt, ...) {
+    CtlClient *cl = ctl_client(id);
+    char line[REPLICA_LINE_MAX + 2 * CTL_TAG_LEN];
+    int n = 0, i;
+    va_list ap;
+    if (!cl) return;
+    if (tag[0]) n = sprintf(line, "#%s ", tag);
+    n += sprintf(line + n, "%s ", status);
+    va_start(ap, fmt);
+    vsnprintf(line + n, sizeof(line) - (size_t)n - 1, fmt, ap);
+    va_end(ap);
+    for (i = n; line[i]; i++) if (line[i] == '\n' || line[i] == '\r') line[i] = ' ';
+    line[i++] = '\n';
+    write_all(cl->out, line, (size_t)i);
+}
+
+static CtlClient *ctl_open(int in, int out) {
+    int i;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        CtlClient *cl = &ctlClients[i];
+        if (cl->id) continue;
+        memset(cl, 0, sizeof(*cl));
+        cl->in = in;
+        cl->out = out;
+        cl->id = ctlNextId++;
+        return cl;
+    }
+    return NULL;
+}
+
+/* Frees a client once its input is done and nothing it started is pending. */
+static void ctl_release(CtlClient *cl) {
+    if (!cl->id || !cl->eof || cl->len || cl->stalled || cl->waiting || ctl_pending(cl->id)) return;
+    if (cl->in >= 0) close(cl->in);
+    if (cl->out >= 0 && cl->out != cl->in && cl->out != ctl_out) close(cl->out);
+    memset(cl, 0, sizeof(*cl));
+}
+
+static void ctl_listen_unix(const char *path) {
+    struct sockaddr_un a;
+    struct stat st;
+    if (strlen(path) >= sizeof(a.sun_path)) { fprintf(stderr, "Control socket path too long\n"); exit(1); }
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, path);
+    ctl_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl_listen < 0) die("socket(control)");
+    /* A socket left by an earlier run is replaced unless a daemon answers on it. */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(ctl_listen, (struct sockaddr *)&a, sizeof(a)) == 0) { fprintf(stderr, "%s is in use\n", path); exit(1); }
+        close(ctl_listen);
+        ctl_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (ctl_listen < 0) die("socket(control)");
+        unlink(path);
+    }
+    if (bind(ctl_listen, (struct sockaddr *)&a, sizeof(a)) < 0) die("bind(control)");
+    chmod(path, 0600);
+    if (listen(ctl_listen, CTL_MAX_CLIENTS) < 0) die("listen(control)");
+}
+
+static void ctl_accept(void) {
+    int cs = accept(ctl_listen, NULL, NULL);
+    if (cs < 0) { perror("accept(control)"); return; }
+    if (!ctl_open(cs, cs)) {
+        const char *busy = "ERR Too many control connections\n";
+        write_all(cs, busy, strlen(busy));
+        close(cs);
+    }
+}
+
+static int  watch_worker(char *msg);
+static void watch_note(const char *line);
+static void watch_done(void);
+
+/* LIST in a worker: syncs (its "=" lines bring the daemon's replica along)
+   and writes the matching catalog lines. */
+static int ctl_worker_list(const char *filter, char *msg) {
+    char line[REPLICA_LINE_MAX + 4];
+    int pos = 0, shown = 0, rc = sync_catalog();
+    if (rc != 1) { strcpy(msg, rc < 0 ? "Index does not support catalog sync" : "Catalog sync failed"); return 0; }
+    replica_sort();
+    line[0] = '*';
+    line[1] = ' ';
+    while (replica_line(&pos, filter[0] ? filter : NULL, line + 2, sizeof(line) - 3)) {
+        size_t n = strlen(line);
+        line[n++] = '\n';
+        write_all(ctl_worker, line, n);
+        shown++;
+    }
+    sprintf(msg, "%d entries from %d index shard(s)", shown, shard_count());
+    return 1;
+}
+
+/* Command worker: its own UDP socket for the index; a GET then fetches
+   over TCP and registers the file, so the daemon only has to host it. */
+static void ctl_worker_main(int fd, char kind, const char *name) {
+    char msg[2 * UDP_BUFLEN], rmsg[UDP_BUFLEN], ip[INET_ADDRSTRLEN], line[2 * UDP_BUFLEN + 8];
+    u16 port = 0;
+    int i, ok = 0;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    if (ctl_listen >= 0) close(ctl_listen);
+    if (tcp_listen >= 0) close(tcp_listen);
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (!ctlClients[i].id) continue;
+        if (ctlClients[i].in >= 0) close(ctlClients[i].in);
+        if (ctlClients[i].out != ctlClients[i].in && ctlClients[i].out != ctl_out) close(ctlClients[i].out);
+    }
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid) close(ctlWorkers[i].fd);
+    for (i = 0; i < HOST_MAX_CONN; i++) if (hostConns[i].fd >= 0) close(hostConns[i].fd);
+    ctl_worker = fd;
+
+    close(udp_sock);
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sock < 0) sprintf(msg, "socket: %s", strerror(errno));
+    else if (kind == 'R') ok = register_content_udp(name, msg);
+    else if (kind == 'T') ok = dereg_content_udp(name, msg);
+    else if (kind == 'O') ok = ctl_worker_list(name, msg);
+    else if (kind == 'W') ok = watch_worker(msg);
+    else if ((ok = search_udp(name, ip, sizeof(ip), &port, msg)) != 0) {
+        if (kind == 'S') sprintf(msg, "%s %u", ip, (unsigned)port);
+        else if (!tcp_download(ip, port, name, msg)) ok = 0;
+        else if (!register_content_udp(name, rmsg)) { ok = 0; sprintf(msg, "Downloaded %s but register failed: %s", name, rmsg); }
+        else sprintf(msg, "%s from %s:%u", name, ip, (unsigned)port);
+    }
+    sprintf(line, "%s %s\n", ok ? "OK" : "ERR", msg);
+    write_all(fd, line, strlen(line));
+    _exit(ok ? 0 : 1);
+}
+
+/* 1 when a command has to wait: every worker is busy, a LIST is already
+   running, or a command on the same name has not answered yet.  REG, DEREG
+   and GET also wait for a share flush, which may hold any name. */
+static int ctl_busy(char kind, const char *name) {
+    int i, idle = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) {
+        const CtlWorker *w = &ctlWorkers[i];
+        if (!w->pid) { idle = 1; continue; }
+        if (kind == 'O' ? w->kind == 'O' : (w->kind != 'O' && strcmp(w->name, name) == 0)) return 1;
+        if (w->kind == 'W' && (kind == 'R' || kind == 'T' || kind == 'G')) return 1;
+    }
+    return !idle;
+}
+
+/* Names a REG or GET in flight will add to contentList. */
+static int ctl_adding(void) {
+    int i, n = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid && (ctlWorkers[i].kind == 'R' || ctlWorkers[i].kind == 'G')) n++;
+    return n;
+}
+
+/* Forks the worker for a command ctl_busy() let through; 0 if it could
+   not (owner has been told). */
+static int ctl_spawn(long owner, const char *tag, char kind, const char *name) {
+    CtlWorker *w = NULL;
+    int i, fds[2];
+    pid_t pid;
+
+    for (i = 0; i < CTL_MAX_WORKERS && !w; i++) if (!ctlWorkers[i].pid) w = &ctlWorkers[i];
+    if (pipe(fds) < 0) { ctl_reply(owner, tag, "ERR", "pipe: %s", strerror(errno)); return 0; }
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        ctl_reply(owner, tag, "ERR", "fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        TRACE_FORK();
+        ctl_worker_main(fds[1], kind, name);
+    }
+    close(fds[1]);
+    memset(w, 0, sizeof(*w));
+    w->pid = pid;
+    w->fd = fds[0];
+    w->kind = kind;
+    w->owner = owner;
+    w->gen = replicaGen;
+    strcpy(w->tag, tag);
+    strcpy(w->name, name);
+    return 1;
+}
+
+static void ctl_drain(CtlClient *cl);
+
+/* Clients blocked on WAIT or on a worker slot get another go. */
+static void ctl_wake(void) {
+    int i;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        CtlClient *cl = &ctlClients[i];
+        if (!cl->id) continue;
+        if (cl->waiting && !ctl_pending(cl->id)) {
+            cl->waiting = 0;
+            ctl_reply(cl->id, cl->wtag, "OK", "Commands finished");
+        }
+        cl->stalled = 0;
+        ctl_drain(cl);
+    }
+}
+
+/* A "=" line from a worker: replays its shard map or replica change here.
+   Replica changes are dropped once this replica was reset after the fork,
+   unless the worker went through the same reset. */
+static void ctl_worker_note(CtlWorker *w, char *line) {
+    char *f[MAX_SHARDS + 4];
+    int n = 0, k;
+    char *p = line;
+    while (n < MAX_SHARDS + 4) {
+        f[n++] = p;
+        if ((p = strchr(p, '\t')) == NULL) break;
+        *p++ = '\0';
+    }
+    if (line[1] == 'M' && n >= 3) {
+        ShardMap m;
+        unsigned long gen = replicaGen;
+        memset(&m, 0, sizeof(m));
+        m.version = strtoul(f[1], NULL, 10);
+        m.n = atoi(f[2]);
+        if (m.n < 0 || m.n > MAX_SHARDS || n != m.n + 3) return;
+        for (k = 0; k < m.n; k++) {
+            if (strlen(f[k + 3]) >= SHARD_ADDR_LEN) return;
+            strcpy(m.addr[k], f[k + 3]);
+        }
+        shard_map_build(&m);
+        if (shard_map_use(&m) && w->gen == gen) w->gen = replicaGen;
+        return;
+    }
+    if (n < 2 || w->gen != replicaGen || (k = atoi(f[1])) < 0 || k >= MAX_SHARDS) return;
+    if (line[1] == 'C') replica_clear(k);
+    else if (line[1] == 'V' && n == 4) {
+        replicaVersion[k] = strtoul(f[2], NULL, 10);
+        replicaEpoch[k] = strtoul(f[3], NULL, 10);
+    } else if ((line[1] == '+' || line[1] == '-') && n == 4) {
+        CatalogEntry e;
+        memset(&e, 0, sizeof(e));
+        e.op = line[1];
+        strncpy(e.content, f[2], NAME_LEN);
+        strncpy(e.peer, f[3], NAME_LEN);
+        replica_apply(&e, k);
+    }
+}
+
+/* Reads what a worker wrote; at its end applies the result and replies. */
+static void ctl_worker_read(CtlWorker *w) {
+    ssize_t r = read(w->fd, w->line + w->len, sizeof(w->line) - 1 - (size_t)w->len);
+    const char *text;
+    char *start, *nl;
+    int ok;
+
+    if (r > 0) {
+        w->len += (int)r;
+        start = w->line;
+        while ((nl = memchr(start, '\n', (size_t)(w->line + w->len - start))) != NULL) {
+            *nl = '\0';
+            if (start[0] == '*' && start[1] == ' ' && w->kind == 'W') watch_note(start + 2);
+            else if (start[0] == '*' && start[1] == ' ') ctl_reply(w->owner, w->tag, "*", "%s", start + 2);
+            else if (start[0] == '=') ctl_worker_note(w, start);
+            else { strncpy(w->result, start, sizeof(w->result) - 1); w->result[sizeof(w->result) - 1] = '\0'; }
+            start = nl + 1;
+        }
+        w->len -= (int)(start - w->line);
+        memmove(w->line, start, (size_t)w->len);
+        if (w->len == (int)sizeof(w->line) - 1) w->len = 0;
+        return;
+    }
+    close(w->fd);
+    waitpid(w->pid, NULL, 0);
+    if (w->kind == 'W') {
+        memset(w, 0, sizeof(*w));
+        watch_done();
+        ctl_wake();
+        return;
+    }
+    ok = strncmp(w->result, "OK ", 3) == 0;
+    text = ok ? w->result + 3 : strncmp(w->result, "ERR ", 4) == 0 ? w->result + 4 : "Worker died";
+    if (!ok && w->kind == 'G') {
+        char part[NAME_LEN + 8];
+        part_name(part, w->name);
+        unlink(part);
+    }
+    if (ok && (w->kind == 'R' || w->kind == 'G') && !content_add(w->name)) { ok = 0; text = "Content table full"; }
+    if (ok && w->kind == 'T') content_remove(w->name);
+    ctl_reply(w->owner, w->tag, ok ? "OK" : "ERR", "%s", text);
+    memset(w, 0, sizeof(*w));
+    ctl_wake();
+}
+
+/* Runs one command line; returns 0 if it has to be retried later. */
+static int ctl_exec(CtlClient *cl, const char *text) {
+    char buf[CTL_BUF + 1], tag[CTL_TAG_LEN + 1], cmd[16], arg[CTL_BUF], extra[2];
+    char *line = buf;
+    int n, i;
+    long id = cl->id;
+
+    strcpy(buf, text);
+    tag[0] = '\0';
+    while (isspace((unsigned char)*line)) line++;
+    if (*line == '\0') return 1;
+    if (*line == '#') {
+        for (i = 0, line++; *line && !isspace((unsigned char)*line); line++) if (i < CTL_TAG_LEN) tag[i++] = *line;
+        tag[i] = '\0';
+    }
+    arg[0] = '\0';
+    n = sscanf(line, "%15s %1023s %1s", cmd, arg, extra);
+    if (n < 1) { ctl_reply(id, tag, "ERR", "Missing command"); return 1; }
+    for (i = 0; cmd[i]; i++) cmd[i] = (char)toupper((unsigned char)cmd[i]);
+    if (n == 3) { ctl_reply(id, tag, "ERR", "Too many arguments"); return 1; }
+    if (strlen(arg) > NAME_LEN) { ctl_reply(id, tag, "ERR", "Name longer than %d chars", NAME_LEN); return 1; }
+
+    if (strcmp(cmd, "REG") == 0 || strcmp(cmd, "DEREG") == 0 || strcmp(cmd, "SEARCH") == 0 || strcmp(cmd, "GET") == 0) {
+        if (n < 2) { ctl_reply(id, tag, "ERR", "%s needs a file name", cmd); return 1; }
+    }
+
+    /* Index commands and downloads run in workers and answer when done;
+       one on a name that already has a command running waits for it, so
+       a second GET of a name answers once the first has it hosted. */
+    if (strcmp(cmd, "REG") == 0 || strcmp(cmd, "DEREG") == 0 || strcmp(cmd, "SEARCH") == 0 ||
+        strcmp(cmd, "GET") == 0 || strcmp(cmd, "LIST") == 0) {
+        char kind = cmd[0] == 'D' ? 'T' : cmd[0] == 'L' ? 'O' : cmd[0];
+        struct stat st;
+        if (ctl_busy(kind, arg)) return 0;
+        if (kind == 'R' && (stat(arg, &st) != 0 || !S_ISREG(st.st_mode))) ctl_reply(id, tag, "ERR", "File not found in this directory, cannot host");
+        else if (kind == 'R' && content_find(arg) >= 0) ctl_reply(id, tag, "ERR", "Already registered locally");
+        else if (kind == 'G' && content_find(arg) >= 0) ctl_reply(id, tag, "ERR", "%s is already hosted here", arg);
+        else if ((kind == 'R' || kind == 'G') && nContent + ctl_adding() >= MAX_CONTENT) ctl_reply(id, tag, "ERR", "Content table full");
+        else ctl_spawn(id, tag, kind, arg);
+    }
+    else if (strcmp(cmd, "STATUS") == 0) {
+        int up = 0;
+        for (i = 0; i < HOST_MAX_CONN; i++) if (hostConns[i].state != CONN_FREE) up++;
+        ctl_reply(id, tag, "OK", "peer=%s port=%u hosted=%d downloads=%d uploads=%d shards=%d",
+                  peerName, (unsigned)listen_port, nContent, ctl_downloads(0), up, shard_count());
+    }
+    else if (strcmp(cmd, "WAIT") == 0) {
+        if (!ctl_pending(id)) ctl_reply(id, tag, "OK", "Commands finished");
+        else { cl->waiting = 1; strcpy(cl->wtag, tag); }
+    }
+    else if (strcmp(cmd, "QUIT") == 0) {
+        ctl_reply(id, tag, "OK", "Goodbye");
+        ctl_stop = 1;
+    }
+    else {
+        ctl_reply(id, tag, "ERR", "Unknown command %s", cmd);
+    }
+    return 1;
+}
+
+/* Runs the complete lines in a client's buffer until it has to wait. */
+static void ctl_drain(CtlClient *cl) {
+    while (cl->id && !cl->stalled && !cl->waiting && !ctl_stop) {
+        char *nl = memchr(cl->buf, '\n', (size_t)cl->len);
+        int used;
+        if (!nl) {
+            if (cl->len == CTL_BUF) { ctl_reply(cl->id, "", "ERR", "Command too long"); cl->len = 0; continue; }
+            if (!cl->eof || cl->len == 0) break;
+            cl->buf[cl->len++] = '\n';          /* last line without a newline */
+            continue;
+        }
+        *nl = '\0';
+        if (nl > cl->buf && nl[-1] == '\r') nl[-1] = '\0';
+        if (!ctl_exec(cl, cl->buf)) { *nl = '\n'; cl->stalled = 1; break; }
+        used = (int)(nl + 1 - cl->buf);
+        cl->len -= used;
+        memmove(cl->buf, cl->buf + used, (size_t)cl->len);
+    }
+    ctl_release(cl);
+}
+
+static void ctl_read(CtlClient *cl) {
+    ssize_t r = read(cl->in, cl->buf + cl->len, (size_t)(CTL_BUF - cl->len));
+    if (r <= 0) cl->eof = 1;
+    else cl->len += (int)r;
+    ctl_drain(cl);
+}
+
+/* ---- Shared directory ---- */
+
+static const char *share_dir = NULL;
+static int    watch_fd = -1;
+static char (*watchDirty)[NAME_LEN + 1] = NULL;   /* names to reconcile */
+static int    nDirty = 0, dirtyCap = 0;
+static int    watchRescan = 0;                    /* inotify queue overflowed */
+static double watchFirst, watchLast;              /* first / latest pending event */
+static double watchRetry = 0;                     /* no flush before this */
+/* The flush a 'W' worker is running: names to register (the first
+   nWatchSend are sent, the rest wait for room) and to de-register. */
+static char (*watchReg)[NAME_LEN + 1] = NULL, (*watchDereg)[NAME_LEN + 1] = NULL;
+static int    nWatchReg = 0, nWatchSend = 0, nWatchDereg = 0;
+static int    watchFlushing = 0;
+static int    watchAdded, watchRemoved;
+
+static void watch_mark(const char *name) {
+    if (name[0] == '.' || strlen(name) > NAME_LEN) return;
+    if (nDirty && strcmp(watchDirty[nDirty - 1], name) == 0) return;
+    if (nDirty == dirtyCap) {
+        int cap = dirtyCap ? dirtyCap * 2 : CONTENT_INIT;
+        char (*d)[NAME_LEN + 1] = realloc(watchDirty, (size_t)cap * sizeof(*d));
+        if (!d) { watchRescan = 1; return; }
+        watchDirty = d;
+        dirtyCap = cap;
+    }
+    strcpy(watchDirty[nDirty++], name);
+}
+
+/* Marks every file in the directory and everything registered, so the
+   next flush reconciles the whole share. */
+static void share_scan(void) {
+    DIR *d = opendir(".");
+    struct dirent *de;
+    int i;
+    if (!d) { perror(share_dir); return; }
+    while ((de = readdir(d)) != NULL) watch_mark(de->d_name);
+    closedir(d);
+    for (i = 0; i < nContent; i++) watch_mark(contentList[i]);
+}
+
+static int name_cmp(const void *a, const void *b) { return strcmp((const char *)a, (const char *)b); }
+
+/* Hands the names that changed to a 'W' worker: it de-registers files
+   that went away, then registers new regular files.  contentList only
+   changes for names the index acknowledged; the rest stay dirty and go
+   again after WATCH_RETRY_MS.  Names another worker is busy with are
+   left to it. */
+static void watch_flush(void) {
+    int i, j, idle = 0;
+
+    if (watchRescan) { watchRescan = 0; share_scan(); }
+    if (!nDirty || watchFlushing) return;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) idle |= !ctlWorkers[i].pid;
+    if (!idle) { watchRetry = mono_now() + WATCH_QUIET_MS / 1000.0; return; }
+    qsort(watchDirty, (size_t)nDirty, sizeof(watchDirty[0]), name_cmp);
+    watchReg = malloc((size_t)nDirty * sizeof(*watchReg));
+    watchDereg = malloc((size_t)nDirty * sizeof(*watchDereg));
+    if (!watchReg || !watchDereg) { free(watchReg); free(watchDereg); watchReg = watchDereg = NULL; watchRescan = 1; return; }
+    nWatchReg = nWatchDereg = 0;
+    for (i = 0; i < nDirty; i++) {
+        struct stat st;
+        int present, busy = 0;
+        if (i && strcmp(watchDirty[i], watchDirty[i - 1]) == 0) continue;
+        for (j = 0; j < CTL_MAX_WORKERS; j++) busy |= ctlWorkers[j].pid && strcmp(ctlWorkers[j].name, watchDirty[i]) == 0;
+        if (busy) continue;
+        present = stat(watchDirty[i], &st) == 0 && S_ISREG(st.st_mode);
+        if (present && content_find(watchDirty[i]) < 0) strcpy(watchReg[nWatchReg++], watchDirty[i]);
+        else if (!present && content_find(watchDirty[i]) >= 0) strcpy(watchDereg[nWatchDereg++], watchDirty[i]);
+    }
+    nDirty = 0;
+    nWatchSend = nWatchReg;
+    if (nWatchSend > MAX_CONTENT - nContent - ctl_adding()) nWatchSend = MAX_CONTENT - nContent - ctl_adding();   /* full: the rest wait */
+    if (nWatchSend < 0) nWatchSend = 0;
+    watchAdded = watchRemoved = 0;
+    watchFlushing = 1;
+    if (!nWatchReg && !nWatchDereg) watch_done();
+    else if (!ctl_spawn(0, "", 'W', "")) watch_done();
+}
+
+/* In the 'W' worker: the index round trips, reporting "+name" for each
+   name registered and "-name" for each one de-registered. */
+static int watch_worker(char *msg) {
+    char line[NAME_LEN + 8], *done = malloc((size_t)(nWatchReg > nWatchDereg ? nWatchReg : nWatchDereg) + 1);
+    int i, failed;
+
+    if (!done) { strcpy(msg, "Out of memory"); return 0; }
+    failed = index_batch(T_DEREGN, watchDereg, nWatchDereg, done);
+    for (i = 0; i < nWatchDereg; i++) {
+        if (!done[i]) continue;
+        sprintf(line, "* -%s\n", watchDereg[i]);
+        write_all(ctl_worker, line, strlen(line));
+    }
+    failed += index_batch(T_REGN, watchReg, nWatchSend, done);
+    for (i = 0; i < nWatchSend; i++) {
+        if (!done[i]) continue;
+        sprintf(line, "* +%s\n", watchReg[i]);
+        write_all(ctl_worker, line, strlen(line));
+    }
+    sprintf(msg, "%d not taken", failed);
+    free(done);
+    return 1;
+}
+
+/* A "+name" / "-name" line from the 'W' worker. */
+static void watch_note(const char *line) {
+    if (line[0] == '+' && content_add(line + 1)) watchAdded++;
+    else if (line[0] == '-' && content_find(line + 1) >= 0) { content_remove(line + 1); watchRemoved++; }
+}
+
+/* The flush ended: whatever did not get through is marked again. */
+static void watch_done(void) {
+    int i, before = nDirty, retry;
+    for (i = 0; i < nWatchReg; i++) if (content_find(watchReg[i]) < 0) watch_mark(watchReg[i]);
+    for (i = 0; i < nWatchDereg; i++) if (content_find(watchDereg[i]) >= 0) watch_mark(watchDereg[i]);
+    retry = nDirty - before;
+    if (retry) {
+        watchRetry = mono_now() + WATCH_RETRY_MS / 1000.0;
+        if (!before) watchFirst = watchLast = mono_now();
+    }
+    if (watchAdded || watchRemoved || retry) printf("Share %s: %d registered, %d de registered, %d to retry\n", share_dir, watchAdded, watchRemoved, retry);
+    free(watchReg);
+    free(watchDereg);
+    watchReg = watchDereg = NULL;
+    nWatchReg = nWatchSend = nWatchDereg = 0;
+    watchFlushing = 0;
+}
+
+/* Shutdown with a flush in flight: its names may be registered already,
+   so they are withdrawn with the rest. */
+static void watch_abort(void) {
+    int i;
+    for (i = 0; i < nWatchSend; i++) content_add(watchReg[i]);
+    nWatchReg = nWatchSend = 0;
+}
+
+static void watch_read(void) {
+    union { struct inotify_event ev; char buf[4096]; } u;
+    ssize_t r;
+    char *p;
+    double now = mono_now();
+    while ((r = read(watch_fd, u.buf, sizeof(u.buf))) > 0) {
+        for (p = u.buf; p < u.buf + r; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (!nDirty && !watchRescan) watchFirst = now;
+            if (ev->mask & IN_Q_OVERFLOW) watchRescan = 1;
+            else if (ev->len) watch_mark(ev->name);
+        }
+    }
+    watchLast = now;
+}
+
+/* Seconds until the pending changes are due, -1 if there are none. */
+static double watch_due(void) {
+    double now = mono_now(), t;
+    if ((!nDirty && !watchRescan) || watchFlushing) return -1;
+    t = watchLast + WATCH_QUIET_MS / 1000.0;
+    if (watchFirst + WATCH_MAX_MS / 1000.0 < t) t = watchFirst + WATCH_MAX_MS / 1000.0;
+    if (t < watchRetry) t = watchRetry;
+    return t > now ? t - now : 0;
+}
+
+/* Watches before scanning, so a file that lands mid-scan is not missed. */
+static void share_start(void) {
+    watch_fd = inotify_init();
+    if (watch_fd < 0) die("inotify_init");
+    fcntl(watch_fd, F_SETFL, fcntl(watch_fd, F_GETFL, 0) | O_NONBLOCK);
+    if (inotify_add_watch(watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) die("inotify_add_watch");
+    share_scan();
+    watch_flush();
+}
+
+/* Hosting, control clients and command workers share one select loop, so
+   registrations take effect for uploads at once and nothing ever sleeps:
+   every index round trip, share flushes included, runs in a worker.
+   Logs go to stderr; stdout carries only the batch file's replies. */
+static int daemon_main(const char *batch) {
+    struct sigaction sa;
+    char part[NAME_LEN + 8];
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ctl_on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    fflush(stdout);
+    ctl_out = dup(1);
+    if (ctl_out < 0 || dup2(2, 1) < 0) die("dup");
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    ensure_tcp_listen();
+    host_init();
+    if (ctl_path) ctl_listen_unix(ctl_path);
+    if (share_dir) share_start();
+    if (batch) {
+        int fd = strcmp(batch, "-") == 0 ? dup(0) : open(batch, O_RDONLY);
+        if (fd < 0) die(batch);
+        ctl_open(fd, ctl_out);
+    }
+    printf("Peer %s running headless%s%s%s%s\n", peerName, ctl_path ? ", control socket " : "", ctl_path ? ctl_path : "",
+           share_dir ? ", sharing " : "", share_dir ? share_dir : "");
+
+    while (!ctl_stop) {
+        fd_set rfds, wfds;
+        struct timeval tv;
+        int maxfd = -1;
+        double wait;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        wait = host_fill_fds(&rfds, &wfds, &maxfd);
+        if (watch_fd >= 0) {
+            double due = watch_due();
+            FD_SET(watch_fd, &rfds);
+            if (watch_fd > maxfd) maxfd = watch_fd;
+            if (due >= 0 && (wait < 0 || due < wait)) wait = due;
+        }
+        if (ctl_listen >= 0) { FD_SET(ctl_listen, &rfds); if (ctl_listen > maxfd) maxfd = ctl_listen; }
+        for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+            CtlClient *cl = &ctlClients[i];
+            if (!cl->id || cl->eof || cl->stalled || cl->waiting) continue;
+            FD_SET(cl->in, &rfds);
+            if (cl->in > maxfd) maxfd = cl->in;
+        }
+        for (i = 0; i < CTL_MAX_WORKERS; i++) {
+            if (!ctlWorkers[i].pid) continue;
+            FD_SET(ctlWorkers[i].fd, &rfds);
+            if (ctlWorkers[i].fd > maxfd) maxfd = ctlWorkers[i].fd;
+        }
+        if (wait >= 0) {
+            tv.tv_sec = (long)wait;
+            tv.tv_usec = (long)((wait - (double)tv.tv_sec) * 1e6);
+        }
+        if (select(maxfd + 1, &rfds, &wfds, NULL, wait >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+        }
+        for (i = 0; i < CTL_MAX_WORKERS; i++) {
+            if (ctlWorkers[i].pid && FD_ISSET(ctlWorkers[i].fd, &rfds)) ctl_worker_read(&ctlWorkers[i]);
+        }
+        for (i = 0; i < CTL_MAX_CLIENTS && !ctl_stop; i++) {
+            CtlClient *cl = &ctlClients[i];
+            if (cl->id && !cl->eof && !cl->stalled && !cl->waiting && FD_ISSET(cl->in, &rfds)) ctl_read(cl);
+        }
+        if (ctl_listen >= 0 && FD_ISSET(ctl_listen, &rfds)) ctl_accept();
+        if (watch_fd >= 0 && FD_ISSET(watch_fd, &rfds)) watch_read();
+        if (watch_due() == 0) watch_flush();
+        host_service(&rfds, &wfds);
+    }
+
+    /* Unfinished commands are told so; a REG or GET may have reached the
+       index already, so its name is withdrawn with the rest. */
+    for (i = 0; i < CTL_MAX_WORKERS; i++) {
+        CtlWorker *w = &ctlWorkers[i];
+        if (!w->pid) continue;
+        kill(w->pid, SIGTERM);
+        waitpid(w->pid, NULL, 0);
+        close(w->fd);
+        if (w->kind == 'G') { part_name(part, w->name); unlink(part); }
+        if (w->kind == 'R' || w->kind == 'G') content_add(w->name);
+        if (w->kind == 'W') watch_abort();
+        ctl_reply(w->owner, w->tag, "ERR", "Peer shutting down");
+    }
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (ctlClients[i].id && ctlClients[i].waiting) ctl_reply(ctlClients[i].id, ctlClients[i].wtag, "ERR", "Peer shutting down");
+    }
+    leave_index();
+    if (ctl_listen >= 0) { close(ctl_listen); unlink(ctl_path); }
+    printf("Goodbye\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *host;
+    const char *batch = NULL;
+    char msg[UDP_BUFLEN];
+    int c, i;
+
+    for (i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) ctl_path = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) batch = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) share_dir = argv[++i];
+        else break;
+    }
+    if (argc < 3 || i < argc) {
+        fprintf(stderr, "Usage: %s <index_host> <peer_name> [-c control_socket] [-b batch_file|-] [-s share_dir]\n", argv[0]);
+        return 1;
+    }
+
+    host = argv[1];
+    memset(peerName, 0, sizeof(peerName));
+    strncpy(peerName, argv[2], sizeof(peerName) - 1);
+    if (strlen(peerName) == 0 || strlen(peerName) > NAME_LEN) {
+        fprintf(stderr, "Peer name must be 1..%d chars\n", NAME_LEN);
+        return 1;
+    }
+
+    TRACE_OPEN(peerName);
+    if (share_dir && chdir(share_dir) < 0) die(share_dir);
+    host_file_init();
+    create_udp_and_index(host, INDEX_PORT);
+    fetch_shard_map();
+    if (ctl_path || batch || share_dir) return daemon_main(batch);
     print_menu();
 
     while (1) {
@@ -815,8 +3755,6 @@ int main(int argc, char **argv) {
         if (c == 'R' || c == 'r') {
             char fname[NAME_LEN + 2];
             int ch;
-            int i;
-            int dup = 0;
             struct stat st;
 
             memset(fname, 0, sizeof(fname));
@@ -830,20 +3768,13 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            for (i = 0; i < nContent; i++) if (strcmp(contentList[i], fname) == 0) dup = 1;
-            if (dup) { printf("Already registered locally\n"); print_menu_delayed(); continue; }
+            if (content_find(fname) >= 0) { printf("Already registered locally\n"); print_menu_delayed(); continue; }
 
-            if (!register_content_udp(fname)) { print_menu_delayed(); continue; }
+            if (!register_content_udp(fname, msg)) { printf("Register error: %s\n", msg); print_menu_delayed(); continue; }
+            printf("%s\n", msg);
 
-            if (nContent < MAX_CONTENT) {
-                strncpy(contentList[nContent], fname, sizeof(contentList[nContent]) - 1);
-                nContent++;
-            }
-            ensure_tcp_listen();
-            if (host_pid <= 0) {
-                host_pid = fork();
-                if (host_pid == 0) { hosting_loop(); _exit(0); }
-            }
+            content_add(fname);
+            start_hosting();
             print_menu_delayed();
         }
         else if (c == 'D' || c == 'd') {
@@ -851,8 +3782,6 @@ int main(int argc, char **argv) {
             char ip[INET_ADDRSTRLEN];
             u16 port;
             int ch;
-            int already = 0;
-            int i;
 
             memset(query, 0, sizeof(query));
             memset(ip, 0, sizeof(ip));
@@ -860,70 +3789,53 @@ int main(int argc, char **argv) {
             if (scanf("%50s", query) != 1) { printf("Input error\n"); print_menu_delayed(); continue; }
             while ((ch = getchar()) != '\n' && ch != EOF) {}
 
-            if (!search_udp(query, ip, sizeof(ip), &port)) { print_menu_delayed(); continue; }
-            if (!tcp_download(ip, port, query)) { print_menu_delayed(); continue; }
+            if (!search_udp(query, ip, sizeof(ip), &port, msg)) { printf("%s\n", msg); print_menu_delayed(); continue; }
+            c = tcp_download(ip, port, query, msg);
+            printf("%s\n", msg);
+            if (!c) { print_menu_delayed(); continue; }
 
-            for (i = 0; i < nContent; i++) if (strcmp(contentList[i], query) == 0) { already = 1; break; }
-            if (!already && nContent < MAX_CONTENT) {
-                strncpy(contentList[nContent], query, sizeof(contentList[nContent]) - 1);
-                nContent++;
-            }
-            if (!register_content_udp(query)) {
-            } else {
-                ensure_tcp_listen();
-                if (host_pid <= 0) { host_pid = fork(); if (host_pid == 0) { hosting_loop(); _exit(0); } }
-            }
+            content_add(query);
+            if (register_content_udp(query, msg)) { printf("%s\n", msg); start_hosting(); }
+            else printf("Register error: %s\n", msg);
             print_menu_delayed();
         }
         else if (c == 'O' || c == 'o') {
-            UdpPDU p, r;
-            int i;
-
-            memset(&p, 0, sizeof(p)); p.type = T_LIST;
-            if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) {
-                perror("sendto"); print_menu_delayed(); continue;
-            }
-            printf("\nAvailable content on network (content : hosts):\n");
-            while (1) {
-                if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); break; }
-                if (r.type == T_LISTEND && r.data[0] == '\0') { printf("(none)\n"); break; }
-                for (i = 0; i < UDP_BUFLEN; ) {
-                    if (r.data[i] == '\0') break;
-                    printf(" - %s\n", &r.data[i]);
-                    while (i < UDP_BUFLEN && r.data[i] != '\0') i++;
-                    if (i < UDP_BUFLEN && r.data[i] == '\0') i++;
-                }
-                if (r.type == T_LISTEND) break;
+            int rc = sync_catalog();
+            if (rc == 0) printf("Catalog sync failed, try again\n");
+            else {
+                printf("\nAvailable content on network (content : hosts):\n");
+                if (rc < 0) list_full_udp();
+                else print_replica(NULL);
             }
             print_menu_delayed();
         }
+        else if (c == 'L' || c == 'l') {
+            char query[NAME_LEN + 2];
+            int ch;
+
+            memset(query, 0, sizeof(query));
+            printf("Enter part of a content name: ");
+            if (scanf("%50s", query) != 1) { printf("Input error\n"); print_menu_delayed(); continue; }
+            while ((ch = getchar()) != '\n' && ch != EOF) {}
+            if (replicaEpoch[0] == 0) printf("(catalog not synced yet, use O first)\n");
+            print_replica(query);
+            print_menu_delayed();
+        }
         else if (c == 'T' || c == 't') {
             char fname[NAME_LEN + 2];
-            int ch, i, pos;
+            int ch;
 
             memset(fname, 0, sizeof(fname));
             printf("Enter file name to de register: ");
             if (scanf("%50s", fname) != 1) { printf("Input error\n"); print_menu_delayed(); continue; }
             while ((ch = getchar()) != '\n' && ch != EOF) {}
 
-            if (dereg_content_udp(fname)) {
-                pos = -1;
-                for (i = 0; i < nContent; i++) if (strcmp(contentList[i], fname) == 0) { pos = i; break; }
-                if (pos >= 0) {
-                    for (i = pos + 1; i < nContent; i++) strcpy(contentList[i - 1], contentList[i]);
-                    nContent--;
-                    if (nContent >= 0) memset(contentList[nContent], 0, sizeof(contentList[nContent]));
-                }
-            }
+            if (dereg_content_udp(fname, msg)) content_remove(fname);
+            printf("%s\n", msg);
             print_menu_delayed();
         }
         else if (c == 'Q' || c == 'q') {
-            int i;
-            UdpPDU bye;
-            for (i = nContent - 1; i >= 0; i--) dereg_content_udp(contentList[i]);
-            memset(&bye, 0, sizeof(bye)); bye.type = T_BYE;
-            strncpy(bye.data, peerName, sizeof(bye.data) - 1);
-            sendto(udp_sock, &bye, sizeof(bye), 0, (struct sockaddr *)&index_addr, index_addrlen);
+            leave_index();
             if (host_pid > 0) { kill(host_pid, SIGKILL); host_pid = -1; }
             if (tcp_listen != -1) close(tcp_listen);
             printf("Goodbye\n");
@@ -937,30 +3849,597 @@ int main(int argc, char **argv) {
     return 0;
 }
 /* Watermark: End of peer_node.c — KrishAdmin */
+EOF
+
+  cat > "${SRC_DIR}/shard.h" <<'EOF'
+#ifndef SHARD_H
+#define SHARD_H
+/* Watermark: Krish Patel (KrishAdmin) — shard.h */
+/* Watermark: https://krishadmin.com */
+
+/* Consistent hashing of content names onto index shards.  Every shard
+   puts SHARD_VNODES points on a 32-bit ring; a name belongs to the first
+   point at or after its own hash, so adding a shard only moves the names
+   that now land on its points. */
+
+#define MAX_SHARDS     16
+#define SHARD_VNODES   64
+#define SHARD_ADDR_LEN 24   /* "255.255.255.255:65535" */
+
+typedef struct {
+    unsigned long hash;
+    int shard;
+} ShardPoint;
+
+typedef struct {
+    unsigned long version;           /* 0: unsharded index */
+    int  n;
+    char addr[MAX_SHARDS][SHARD_ADDR_LEN];
+    ShardPoint ring[MAX_SHARDS * SHARD_VNODES];
+} ShardMap;
+
+/* FNV-1a with a final mix, so "host:port#1" and "#2" land far apart. */
+static unsigned long shard_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) { h ^= (unsigned char)*s++; h = (h * 16777619UL) & 0xffffffffUL; }
+    h ^= h >> 16; h = (h * 0x85ebca6bUL) & 0xffffffffUL;
+    h ^= h >> 13; h = (h * 0xc2b2ae35UL) & 0xffffffffUL;
+    h ^= h >> 16;
+    return h;
+}
+
+static int shard_point_cmp(const void *a, const void *b) {
+    const ShardPoint *x = (const ShardPoint *)a, *y = (const ShardPoint *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->shard - y->shard;
+}
+
+static void shard_map_build(ShardMap *m) {
+    char key[SHARD_ADDR_LEN + 8];
+    int i, v;
+    for (i = 0; i < m->n; i++) {
+        for (v = 0; v < SHARD_VNODES; v++) {
+            sprintf(key, "%s#%d", m->addr[i], v);
+            m->ring[i * SHARD_VNODES + v].hash = shard_hash(key);
+            m->ring[i * SHARD_VNODES + v].shard = i;
+        }
+    }
+    qsort(m->ring, (size_t)(m->n * SHARD_VNODES), sizeof(m->ring[0]), shard_point_cmp);
+}
+
+static int shard_owner(const ShardMap *m, const char *content) {
+    unsigned long h = shard_hash(content);
+    int lo = 0, hi = m->n * SHARD_VNODES;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return m->ring[lo == m->n * SHARD_VNODES ? 0 : lo].shard;
+}
+
+/* T_MAP payload: "version\0count\0ip:port\0..."; builds the ring. */
+static int shard_map_decode(ShardMap *m, const char *buf, int len) {
+    int off = 0, i;
+    memset(m, 0, sizeof(*m));
+    if (!memchr(buf, '\0', (size_t)len)) return 0;
+    m->version = strtoul(buf, NULL, 10);
+    off = (int)strlen(buf) + 1;
+    if (off >= len || !memchr(buf + off, '\0', (size_t)(len - off))) return 0;
+    m->n = atoi(buf + off);
+    off += (int)strlen(buf + off) + 1;
+    if (m->n < 0 || m->n > MAX_SHARDS) return 0;
+    for (i = 0; i < m->n; i++) {
+        size_t alen;
+        if (off >= len || !memchr(buf + off, '\0', (size_t)(len - off))) return 0;
+        alen = strlen(buf + off);
+        if (alen == 0 || alen >= SHARD_ADDR_LEN) return 0;
+        strcpy(m->addr[i], buf + off);
+        off += (int)alen + 1;
+    }
+    shard_map_build(m);
+    return 1;
+}
+
+static int shard_addr_parse(const char *addr, struct sockaddr_in *sa) {
+    char ip[SHARD_ADDR_LEN];
+    const char *colon = strrchr(addr, ':');
+    int port;
+    if (!colon || colon == addr || (size_t)(colon - addr) >= sizeof(ip)) return 0;
+    memcpy(ip, addr, (size_t)(colon - addr));
+    ip[colon - addr] = '\0';
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) return 0;
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons((unsigned short)port);
+    return inet_pton(AF_INET, ip, &sa->sin_addr) == 1;
+}
+
+#endif
+EOF
+
+  cat > "${SRC_DIR}/trace.h" <<'EOF'
+#ifndef TRACE_H
+#define TRACE_H
+/* Watermark: Krish Patel (KrishAdmin) — trace.h */
+/* Watermark: https://krishadmin.com */
+
+/* Flight-recorder tracing.  Built with -DP2P_TRACE (make TRACE=1) and run
+   with P2P_TRACE_DIR set, each process maps <dir>/<prog>-<pid>.trace and
+   appends fixed-size records to a ring in it: no syscalls, no locks, the
+   newest TRACE_RING events survive a crash.  trace_decode turns the files
+   into Chrome-trace JSON.  Without -DP2P_TRACE the TRACE_* macros expand
+   to nothing. */
+
+#define TRACE_MAGIC   "P2PTRC1"
+#define TRACE_RING    65536   /* records per process, power of two */
+#define TRACE_TAG_LEN 23
+
+/* Events; the names in trace_decode.c follow this order. */
+#define TR_PDU      0   /* index: one request, receive to reply (span) */
+#define TR_PARSE    1   /* index: fields parsed */
+#define TR_LOOKUP   2   /* index: table lookup or update (span) */
+#define TR_REPLY    3   /* index: reply sent */
+#define TR_REQUEST  4   /* peer: request/reply with an index shard (span) */
+#define TR_UPLOAD   5   /* peer: one download served (async, id = conn) */
+#define TR_FRAME    6   /* peer: frame handed to send(), arg = bytes */
+#define TR_BLOCKED  7   /* peer: socket buffer full */
+#define TR_THROTTLE 8   /* peer: rate limit reached */
+#define TR_DOWNLOAD 9   /* peer: tcp_download (span) */
+#define TR_CHUNK    10  /* peer: frame received, arg = bytes */
+#define TR_EVENTS   11
+
+typedef struct {
+    long sec, nsec;     /* CLOCK_MONOTONIC */
+    long id;            /* async events: which upload */
+    long arg;           /* PDU type, byte count, ... */
+    unsigned short ev;  /* TR_* */
+    char ph;            /* Chrome phase: B E i b e n */
+    char tag[TRACE_TAG_LEN + 1];   /* content name, truncated */
+} TraceRec;
+
+typedef struct {
+    char magic[8];
+    long pid;
+    long cap;
+    unsigned long head;            /* records written so far */
+    char prog[32];
+} TraceHdr;
+
+#ifdef P2P_TRACE
+#include <fcntl.h>
+#include <sys/mman.h>
+
+static TraceHdr *traceHdr = NULL;
+static TraceRec *traceRing = NULL;
+static char traceProg[32];
+static char traceDir[400];   /* absolute, so a child after chdir() agrees */
+
+/* Maps this process's trace file; a forked child calls it again so it
+   does not write into its parent's ring. */
+static void trace_open(const char *prog) {
+    char path[512], *c;
+    size_t size = sizeof(TraceHdr) + TRACE_RING * sizeof(TraceRec);
+    void *m;
+    int fd;
+
+    if (prog != traceProg) {
+        const char *dir = getenv("P2P_TRACE_DIR");
+        sprintf(traceProg, "%.31s", prog);
+        for (c = traceProg; *c; c++) if (*c == ' ' || *c == '/') *c = '_';
+        traceDir[0] = '\0';
+        if (dir && *dir && dir[0] != '/' && getcwd(traceDir, 200)) strcat(traceDir, "/");
+        if (dir) strncat(traceDir, dir, sizeof(traceDir) - strlen(traceDir) - 1);
+    }
+    if (traceHdr) munmap(traceHdr, size);
+    traceHdr = NULL;
+    traceRing = NULL;
+    if (!traceDir[0]) return;
+    sprintf(path, "%s/%s-%ld.trace", traceDir, traceProg, (long)getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); return; }
+    if (ftruncate(fd, (off_t)size) < 0) { perror(path); close(fd); return; }
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) { perror("mmap"); return; }
+    traceHdr = (TraceHdr *)m;
+    traceRing = (TraceRec *)(traceHdr + 1);
+    memcpy(traceHdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    traceHdr->pid = (long)getpid();
+    traceHdr->cap = TRACE_RING;
+    strcpy(traceHdr->prog, traceProg);
+}
+
+static void trace_emit(int ev, char ph, long id, long arg, const char *tag) {
+    struct timespec ts;
+    TraceRec *r;
+    size_t n;
+    if (!traceRing) return;
+    r = &traceRing[traceHdr->head & (TRACE_RING - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->sec = (long)ts.tv_sec;
+    r->nsec = ts.tv_nsec;
+    r->id = id;
+    r->arg = arg;
+    r->ev = (unsigned short)ev;
+    r->ph = ph;
+    n = tag ? strlen(tag) : 0;
+    if (n > TRACE_TAG_LEN) n = TRACE_TAG_LEN;
+    memcpy(r->tag, tag ? tag : "", n);
+    r->tag[n] = '\0';
+    traceHdr->head++;
+}
+
+#define TRACE_OPEN(prog)             trace_open(prog)
+#define TRACE_FORK()                 trace_open(traceProg)
+#define TRACE_BEGIN(ev, arg, tag)    trace_emit(ev, 'B', 0, arg, tag)
+#define TRACE_END(ev, arg)           trace_emit(ev, 'E', 0, arg, NULL)
+#define TRACE_MARK(ev, arg, tag)     trace_emit(ev, 'i', 0, arg, tag)
+#define TRACE_ASYNC(ev, ph, id, arg, tag) trace_emit(ev, ph, id, arg, tag)
+#else
+#define TRACE_OPEN(prog)             ((void)0)
+#define TRACE_FORK()                 ((void)0)
+#define TRACE_BEGIN(ev, arg, tag)    ((void)0)
+#define TRACE_END(ev, arg)           ((void)0)
+#define TRACE_MARK(ev, arg, tag)     ((void)0)
+#define TRACE_ASYNC(ev, ph, id, arg, tag) ((void)0)
+#endif
+
+#endif
+EOF
+
+  cat > "${SRC_DIR}/lz.h" <<'EOF'
+#ifndef LZ_H
+#define LZ_H
+/* Watermark: Krish Patel (KrishAdmin) — lz.h */
+/* Watermark: https://krishadmin.com */
+
+/* Small LZ77 block codec for compressed transfers, LZ4-like format.  A
+   block is a run of sequences: a token byte (literal count in the high
+   nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning more
+   bytes of 255 follow), the literals, then a 2-byte little-endian offset
+   back into the output and the match length bytes.  The last sequence
+   has literals only. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_BOUND(n)  ((n) + (n) / 255 + 16)   /* worst case output size */
+
+static unsigned lz_hash(const unsigned char *p) {
+    unsigned long v = (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+    return (unsigned)(((v * 2654435761UL) & 0xffffffffUL) >> (32 - LZ_HASH_BITS));
+}
+
+static unsigned char *lz_put_len(unsigned char *op, int len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Compresses n bytes (n < 65536) into out; returns the compressed size,
+   or 0 when it would not fit in cap. */
+static int lz_compress(const unsigned char *in, int n, unsigned char *out, int cap) {
+    int table[1 << LZ_HASH_BITS];
+    const unsigned char *ip = in, *anchor = in, *end = in + n;
+    const unsigned char *mlimit = n > 12 ? end - 5 : in;   /* keep a literal tail */
+    unsigned char *op = out, *oend = out + cap;
+    int i;
+
+    for (i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+    while (ip + LZ_MIN_MATCH <= mlimit) {
+        unsigned h = lz_hash(ip);
+        int cand = table[h];
+        const unsigned char *ref;
+        int lit, mlen;
+        unsigned char *token;
+
+        table[h] = (int)(ip - in);
+        if (cand < 0 || ip - in - cand > 65535) { ip++; continue; }
+        ref = in + cand;
+        if (memcmp(ref, ip, LZ_MIN_MATCH) != 0) { ip++; continue; }
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen < mlimit && ref[mlen] == ip[mlen]) mlen++;
+
+        lit = (int)(ip - anchor);
+        if (op + 1 + lit / 255 + 1 + lit + 2 + (mlen - LZ_MIN_MATCH) / 255 + 1 > oend) return 0;
+        token = op++;
+        *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15) op = lz_put_len(op, lit - 15);
+        memcpy(op, anchor, (size_t)lit);
+        op += lit;
+        *op++ = (unsigned char)((ip - ref) & 0xff);
+        *op++ = (unsigned char)((ip - ref) >> 8);
+        *token |= (unsigned char)(mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15);
+        if (mlen - LZ_MIN_MATCH >= 15) op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+    i = (int)(end - anchor);
+    if (op + 1 + i / 255 + 1 + i > oend) return 0;
+    *op++ = (unsigned char)((i < 15 ? i : 15) << 4);
+    if (i >= 15) op = lz_put_len(op, i - 15);
+    memcpy(op, anchor, (size_t)i);
+    op += i;
+    return (int)(op - out);
+}
+
+static int lz_get_len(const unsigned char **ip, const unsigned char *end, int len) {
+    int b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/* Expands a block into out; returns the output size, or -1 if the block
+   is corrupt or would not fit in cap. */
+static int lz_decompress(const unsigned char *in, int n, unsigned char *out, int cap) {
+    const unsigned char *ip = in, *end = in + n;
+    unsigned char *op = out, *oend = out + cap;
+
+    while (ip < end) {
+        int token = *ip++, lit = token >> 4, mlen = token & 15, off;
+        const unsigned char *ref;
+        if (lit == 15 && (lit = lz_get_len(&ip, end, lit)) < 0) return -1;
+        if (lit > end - ip || lit > oend - op) return -1;
+        memcpy(op, ip, (size_t)lit);
+        op += lit;
+        ip += lit;
+        if (ip == end) break;
+        if (end - ip < 2) return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (mlen == 15 && (mlen = lz_get_len(&ip, end, mlen)) < 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > op - out || mlen > oend - op) return -1;
+        for (ref = op - off; mlen > 0; mlen--) *op++ = *ref++;   /* may overlap */
+    }
+    return (int)(op - out);
+}
+
+#endif
+EOF
+
+  cat > "${SRC_DIR}/trace_decode.c" <<'EOF'
+/* Watermark: Krish Patel (KrishAdmin) — trace_decode.c */
+/* Watermark: https://krishadmin.com */
+
+/* Turns the .trace rings written by a P2P_TRACE build into Chrome-trace
+   JSON (chrome://tracing, Perfetto, speedscope), or with -f into folded
+   stacks with self time in microseconds for flamegraph.pl.
+   Usage: trace_decode [-f] file.trace... > out.json */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef P2P_TRACE   /* only the record layout is needed here */
+#include "trace.h"
+
+#define MAX_DEPTH 16
+
+static const char *names[TR_EVENTS] = {
+    "pdu", "parse", "lookup", "reply", "request",
+    "upload", "frame", "blocked", "throttled", "download", "chunk"
+};
+
+typedef struct {
+    TraceHdr hdr;
+    TraceRec *recs;   /* oldest first */
+    long n;
+} TraceFile;
+
+/* Reads the ring and unrolls it; only the newest cap records survive. */
+static int load(const char *path, TraceFile *tf) {
+    FILE *fp = fopen(path, "rb");
+    TraceRec *ring;
+    long i, start;
+
+    memset(tf, 0, sizeof(*tf));
+    if (!fp) { perror(path); return 0; }
+    if (fread(&tf->hdr, sizeof(tf->hdr), 1, fp) != 1 || memcmp(tf->hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        tf->hdr.cap <= 0 || (tf->hdr.cap & (tf->hdr.cap - 1)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(fp);
+        return 0;
+    }
+    ring = malloc((size_t)tf->hdr.cap * sizeof(*ring));
+    tf->n = tf->hdr.head < (unsigned long)tf->hdr.cap ? (long)tf->hdr.head : tf->hdr.cap;
+    tf->recs = malloc((size_t)(tf->n ? tf->n : 1) * sizeof(*tf->recs));
+    if (!ring || !tf->recs || fread(ring, sizeof(*ring), (size_t)tf->hdr.cap, fp) != (size_t)tf->hdr.cap) {
+        fprintf(stderr, "%s: truncated\n", path);
+        free(ring);
+        free(tf->recs);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    start = (long)(tf->hdr.head - (unsigned long)tf->n);
+    for (i = 0; i < tf->n; i++) tf->recs[i] = ring[(start + i) & (tf->hdr.cap - 1)];
+    free(ring);
+    return 1;
+}
+
+static double usec(const TraceRec *r, long base) {
+    return (double)(r->sec - base) * 1e6 + (double)r->nsec / 1e3;
+}
+
+static void put_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", (unsigned char)*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+static int pdu_typed(const TraceRec *r) {
+    return (r->ev == TR_PDU || r->ev == TR_REQUEST || r->ev == TR_REPLY) && r->arg > 32 && r->arg < 127;
+}
+
+static void emit_json(TraceFile *tf, int nfiles, long base) {
+    int f, first = 1;
+    long i;
+    printf("{\"traceEvents\":[\n");
+    for (f = 0; f < nfiles; f++) {
+        long pid = tf[f].hdr.pid;
+        int depth = 0;
+        printf("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":", first ? "" : ",\n", pid, pid);
+        put_json_string(tf[f].hdr.prog);
+        printf("}}");
+        first = 0;
+        for (i = 0; i < tf[f].n; i++) {
+            const TraceRec *r = &tf[f].recs[i];
+            if (r->ev >= TR_EVENTS) continue;
+            /* the ring may have dropped the B of an early E */
+            if (r->ph == 'B') depth++;
+            else if (r->ph == 'E' && depth-- <= 0) { depth = 0; continue; }
+            printf(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%ld",
+                   names[r->ev], r->ph == 'b' || r->ph == 'e' || r->ph == 'n' ? "upload" : "p2p", r->ph, usec(r, base), pid, pid);
+            if (r->ph == 'b' || r->ph == 'e' || r->ph == 'n') printf(",\"id\":%ld", r->id);
+            if (r->ph == 'i') printf(",\"s\":\"t\"");
+            printf(",\"args\":{\"arg\":%ld", r->arg);
+            if (pdu_typed(r)) printf(",\"type\":\"%c\"", (char)r->arg);
+            if (r->tag[0]) { printf(",\"name\":"); put_json_string(r->tag); }
+            printf("}}");
+        }
+    }
+    printf("\n]}\n");
+}
+
+/* One line per closed span: "prog;outer;inner self_us". */
+static void emit_folded(TraceFile *tf, int nfiles, long base) {
+    int f;
+    long i;
+    for (f = 0; f < nfiles; f++) {
+        int stack[MAX_DEPTH], depth = 0, k;
+        double start[MAX_DEPTH], child[MAX_DEPTH];
+        for (i = 0; i < tf[f].n; i++) {
+            const TraceRec *r = &tf[f].recs[i];
+            double t = usec(r, base);
+            if (r->ev >= TR_EVENTS) continue;
+            if (r->ph == 'B') {
+                if (depth == MAX_DEPTH) continue;
+                stack[depth] = r->ev;
+                start[depth] = t;
+                child[depth] = 0;
+                depth++;
+            } else if (r->ph == 'E' && depth > 0) {
+                double dur = t - start[--depth];
+                long self = (long)(dur - child[depth] + 0.5);
+                if (depth > 0) child[depth - 1] += dur;
+                if (self <= 0) continue;
+                printf("%s", tf[f].hdr.prog);
+                for (k = 0; k <= depth; k++) printf(";%s", names[stack[k]]);
+                printf(" %ld\n", self);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    TraceFile *tf;
+    int folded = 0, nfiles = 0, i;
+    long base = -1;
+
+    if (argc > 1 && strcmp(argv[1], "-f") == 0) { folded = 1; argv++; argc--; }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [-f] file.trace... > trace.json\n", argv[0]);
+        return 1;
+    }
+    tf = malloc((size_t)(argc - 1) * sizeof(*tf));
+    if (!tf) { perror("malloc"); return 1; }
+    for (i = 1; i < argc; i++) {
+        if (!load(argv[i], &tf[nfiles])) continue;
+        if (tf[nfiles].n && (base < 0 || tf[nfiles].recs[0].sec < base)) base = tf[nfiles].recs[0].sec;
+        nfiles++;
+    }
+    if (!nfiles) return 1;
+    if (base < 0) base = 0;
+    if (folded) emit_folded(tf, nfiles, base);
+    else emit_json(tf, nfiles, base);
+    return 0;
+}
+/* Watermark: End of trace_decode.c — KrishAdmin */
+EOF
+
+  cat > "${SRC_DIR}/upload_cap_test.sh" <<'EOF'
+#!/bin/sh
+# make check: two downloads from a peer with P2P_UPLOAD_CAP=1m must share
+# the cap, so both 3 MB files finish close together (about 6 s) instead of
+# one after the other.  Needs index port 15000 free.
+B=$(cd "$(dirname "$0")" && pwd)
+T=$(mktemp -d) || exit 1
+trap 'kill $SP 2>/dev/null; rm -rf "$T"' EXIT
+cd "$T" && mkdir A B C logs
+P2P_LOG_DIR=logs "$B/directory_server" 15000 > srv.out 2>&1 & SP=$!
+head -c 3000000 /dev/urandom > A/one.bin
+head -c 3000000 /dev/urandom > A/two.bin
+sleep 0.3
+( cd A; (printf 'REG one.bin\nREG two.bin\n#up WAIT\n'; sleep 14; printf 'QUIT\n') | P2P_UPLOAD_CAP=1m "$B/peer_node" 127.0.0.1 Alice -b - > ../a.out 2> ../a.log ) & AP=$!
+t=0
+while [ $t -lt 50 ] && ! grep -q "^#up " a.out 2>/dev/null; do sleep 0.1; t=$((t + 1)); done
+( cd B; (printf 'GET one.bin\n'; sleep 10; printf 'QUIT\n') | "$B/peer_node" 127.0.0.1 Bob -b - > ../b.out 2> ../b.log ) & BP=$!
+( cd C; (printf 'GET two.bin\n'; sleep 10; printf 'QUIT\n') | "$B/peer_node" 127.0.0.1 Carol -b - > ../c.out 2> ../c.log ) & CP=$!
+t=0; first=0; second=0
+while [ $t -lt 100 ]; do
+    sleep 0.1; t=$((t + 1)); n=0
+    cmp -s A/one.bin B/one.bin && n=$((n + 1))
+    cmp -s A/two.bin C/two.bin && n=$((n + 1))
+    [ $n -ge 1 ] && [ $first -eq 0 ] && first=$t
+    [ $n -eq 2 ] && { second=$t; break; }
+done
+wait $AP $BP $CP
+echo "first done after ${first}00 ms, second after ${second}00 ms"
+[ $second -gt 0 ] && [ $((second - first)) -le 10 ] && { echo "PASS"; exit 0; }
+echo "FAIL"; exit 1
 EOF
 
   cat > "${SRC_DIR}/Makefile" <<'EOF'
 # Watermark: Krish Patel (KrishAdmin) — Makefile
-# Watermark: https://krishadmin.com
-CC=gcc
-CFLAGS=-Wall -Wextra -O2 -std=c89
+CC = gcc
+CFLAGS = -Wall -Wextra -O2 -std=c89
+
+# make TRACE=1 compiles in the trace.h probes (enable with P2P_TRACE_DIR)
+ifeq ($(TRACE),1)
+CFLAGS += -DP2P_TRACE
+endif
+
+TARGETS := directory_server peer_node trace_decode
 
-all: directory_server peer_node
+.PHONY: all check clean help
 
-directory_server: directory_server.c protocol.h
-	$(CC) $(CFLAGS) directory_server.c -o ../bin/directory_server
+all: $(TARGETS)
 
-peer_node: peer_node.c protocol.h
-	$(CC) $(CFLAGS) peer_node.c -o ../bin/peer_node
+directory_server: directory_server.c protocol.h shard.h trace.h
+	$(CC) $(CFLAGS) directory_server.c -o directory_server
+
+peer_node: peer_node.c protocol.h shard.h trace.h lz.h
+	$(CC) $(CFLAGS) peer_node.c -o peer_node
+
+trace_decode: trace_decode.c trace.h
+	$(CC) $(CFLAGS) trace_decode.c -o trace_decode
+
+check: all
+	sh ./upload_cap_test.sh
 
 clean:
-	rm -f ../bin/directory_server ../bin/peer_node
+	rm -f $(TARGETS)
+
+help:
+	@echo "make        Build directory_server, peer_node and trace_decode in current directory"
+	@echo "make TRACE=1  Same, with tracing probes compiled in"
+	@echo "make check  Build, then check two capped uploads share the cap"
+	@echo "make clean  Remove binaries"
 # Watermark: End of Makefile — KrishAdmin
 EOF
 }
 
 build_all() {
-  (cd "${SRC_DIR}" && make -s clean && make -s)
+  (cd "${SRC_DIR}" && make -s clean && make -s TRACE="${TRACE:-0}")
 }
 
 start_index() {
@@ -976,6 +4455,36 @@ start_index() {
   echo "Logs in ${LOG_DIR}/index-YYYYMMDD-HHMMSS.log"
 }
 
+# Index shards on 127.0.0.1:15000 and up.  15000 seeds the ring and the
+# others join through it; peers still talk to 15000 and get the shard map.
+start_shards() {
+  local want="${1:-3}" port=15000 have=0
+  mkdir -p "${LOG_DIR}" "${PID_DIR}"
+  if [[ -f "${PID_DIR}/index.pid" ]] && kill -0 "$(cat "${PID_DIR}/index.pid")" 2>/dev/null \
+     && [[ ! -f "${PID_DIR}/shard-15000.pid" ]]; then
+    echo "An unsharded index is running, stop it first."
+    return 1
+  fi
+  while (( have < want )); do
+    if [[ -f "${PID_DIR}/shard-${port}.pid" ]] && kill -0 "$(cat "${PID_DIR}/shard-${port}.pid")" 2>/dev/null; then
+      have=$((have + 1)); port=$((port + 1)); continue
+    fi
+    mkdir -p "${LOG_DIR}/shard-${port}"
+    if (( port == 15000 )); then
+      P2P_LOG_DIR="${LOG_DIR}/shard-${port}" nohup "${BIN_DIR}/directory_server" 15000 --self 127.0.0.1:15000 >/dev/null 2>&1 &
+      echo $! > "${PID_DIR}/index.pid"
+      sleep 0.2
+    else
+      P2P_LOG_DIR="${LOG_DIR}/shard-${port}" nohup "${BIN_DIR}/directory_server" "${port}" \
+        --self "127.0.0.1:${port}" --join 127.0.0.1:15000 >/dev/null 2>&1 &
+    fi
+    echo $! > "${PID_DIR}/shard-${port}.pid"
+    echo "Shard 127.0.0.1:${port} started. PID $!"
+    have=$((have + 1)); port=$((port + 1))
+  done
+  echo "Logs in ${LOG_DIR}/shard-PORT/"
+}
+
 stop_all() {
   if [[ -f "${PID_DIR}/index.pid" ]] && kill -0 "$(cat "${PID_DIR}/index.pid")" 2>/dev/null; then
     kill "$(cat "${PID_DIR}/index.pid")" || true
@@ -983,7 +4492,7 @@ stop_all() {
   fi
   pkill -f "${BIN_DIR}/directory_server" >/dev/null 2>&1 || true
   pkill -f "${BIN_DIR}/peer_node"  >/dev/null 2>&1 || true
-  rm -f "${PID_DIR}/index.pid" || true
+  rm -f "${PID_DIR}/index.pid" "${PID_DIR}"/shard-*.pid || true
   echo "Stopped index and peers."
 }
 
@@ -1002,8 +4511,17 @@ run_peer() {
   ( cd "${PEERS_DIR}/${name}" && "${BIN_DIR}/peer_node" 127.0.0.1 "${name}" )
 }
 
+run_daemon() {
+  local name="${1:-Peer1}"
+  mkdir -p "${PEERS_DIR}/${name}" "${LOG_DIR}"
+  ( cd "${PEERS_DIR}/${name}" && nohup "${BIN_DIR}/peer_node" 127.0.0.1 "${name}" -c control.sock \
+      >/dev/null 2>>"${LOG_DIR}/peer-${name}.log" & )
+  echo "Headless peer '${name}'. Control socket: ${PEERS_DIR}/${name}/control.sock"
+  echo "Log: ${LOG_DIR}/peer-${name}.log"
+}
+
 usage() {
-  echo "Usage: $0 {setup|build|start|peer <NAME>|stop|clean}"
+  echo "Usage: $0 {setup|build|start|shards <N>|peer <NAME>|daemon <NAME>|stop|clean}"
 }
 
 cmd="${1:-build}"
@@ -1012,7 +4530,9 @@ case "${cmd}" in
   setup) write_sources; echo "Sources written to ${SRC_DIR}" ;;
   build) write_sources; build_all; echo "Built to ${BIN_DIR}" ;;
   start) [[ -x "${BIN_DIR}/directory_server" ]] || { write_sources; build_all; }; start_index ;;
+  shards) shift || true; [[ -x "${BIN_DIR}/directory_server" ]] || { write_sources; build_all; }; start_shards "${1:-3}" ;;
   peer)  shift || true; [[ -x "${BIN_DIR}/peer_node"  ]] || { write_sources; build_all; }; run_peer "${1:-Peer1}" ;;
+  daemon) shift || true; [[ -x "${BIN_DIR}/peer_node" ]] || { write_sources; build_all; }; run_daemon "${1:-Peer1}" ;;
   stop)  stop_all ;;
   clean) clean_all ;;
   *) usage; exit 1 ;;
@@ -1,5 +1,6 @@
 /* Watermark: Krish Patel (KrishAdmin) — directory_server.c */
 /* Watermark: https://krishadmin.com */
+#define _XOPEN_SOURCE 600
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,30 +9,143 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "protocol.h"
+#include "shard.h"
+#include "trace.h"
 
 #ifndef INDEX_PORT
 #define INDEX_PORT 15000
 #endif
 
+/* Catalog changes kept for delta sync; older replicas get a snapshot. */
+#ifndef CATALOG_LOG_LEN
+#define CATALOG_LOG_LEN 1024
+#endif
+
+/* Index-to-index requests are resent every MESH_RETRY_MS, MESH_TRIES times.
+   A pull that runs out of tries waits MESH_BACKOFF_MS, doubling up to
+   MESH_BACKOFF_MAX_MS, and starts another round. */
+#define MESH_RETRY_MS       200
+#define MESH_TRIES          25
+#define MESH_BACKOFF_MS     1000
+#define MESH_BACKOFF_MAX_MS 30000
+
 typedef struct {
     char  name[NAME_LEN + 1];
     char  ip[INET_ADDRSTRLEN];
     u16   tcp_port;
     int   ncontent;
-    char  contents[MAX_CONTENT][NAME_LEN + 1];
-    int   sent_count[MAX_CONTENT];
+    int   cap;                       /* room in contents / sent_count */
+    char  (*contents)[NAME_LEN + 1];
+    int   *sent_count;
+    int   *index;                    /* hash of contents: position + 1, 0 empty */
+    int   nindex;                    /* power of two, 2 * cap */
     int   in_use;
 } Peer;
 
+typedef struct {
+    unsigned long version;
+    char  op;                        /* '+' registered, '-' removed */
+    char  content[NAME_LEN + 1];
+    char  peer[NAME_LEN + 1];
+} CatalogChange;
+
+/* Builds the T_DELTA / T_DELTAEND page answering one T_SYNC. */
+typedef struct {
+    char  kind;                      /* 'D' delta, 'S' snapshot */
+    unsigned long from, to;
+    unsigned long seq;               /* echoed so the client can match it */
+    int   bytes;
+    UdpPDU page;
+} SyncWriter;
+
+/* One entry of the sorted catalog copy snapshot pages are cut from. */
+typedef struct {
+    char  content[NAME_LEN + 1];
+    char  peer[NAME_LEN + 1];
+} SnapEntry;
+
+/* An index-to-index request awaiting its reply on the mesh socket. */
+typedef struct {
+    int    active;
+    UdpPDU req;
+    struct sockaddr_in to;
+    int    tries;
+    double deadline;
+} MeshCall;
+
+/* One entry handed to another shard; port 0 forwards a removal. */
+typedef struct {
+    char  peer[NAME_LEN + 1];
+    char  ip[INET_ADDRSTRLEN];
+    u16   port;
+    char  gone;                      /* removed here before it was cut */
+    char  content[NAME_LEN + 1];
+} HandoffRec;
+
+/* What one shard is pulling from here: the entries it owns, sorted by
+   (peer, content) when it asked for page 0.  Pages are cut from the front
+   as they are asked for and never recut, so a resent page is the same
+   page.  Entries removed here meanwhile are skipped if not yet cut, or
+   follow in a later page as removal records. */
+typedef struct {
+    int   active;
+    HandoffRec *recs;
+    int   nrecs, cap;
+    int   nsnap;                     /* recs[0, nsnap) is the sorted snapshot */
+    int   cut;                       /* recs[0, cut) went into pages */
+    int   npages;
+    int   *pagestart;                /* npages + 1 entries, the last is cut */
+} Handoff;
+
+/* A removal seen here while a pull runs, so the pull does not bring the
+   entry back.  An empty content stands for every entry of the peer. */
+typedef struct {
+    char  peer[NAME_LEN + 1];        /* empty: any peer at ip */
+    char  ip[INET_ADDRSTRLEN];
+    char  content[NAME_LEN + 1];
+} Tomb;
+
 static Peer peers[MAX_PEERS];
 static int  npeers = 0;
 static FILE *glog = NULL;
 
+static unsigned long catalog_epoch = 0;
+static unsigned long catalog_version = 0;
+static CatalogChange catalog_log[CATALOG_LOG_LEN];
+static int  catalog_log_count = 0;
+static SnapEntry *syncSnap = NULL;     /* sorted by (content, peer) */
+static int  nSyncSnap = 0, capSyncSnap = 0;
+static unsigned long syncSnapVersion = 0;
+static int  syncSnapBuilt = 0;
+
+/* Sharded mode (--self): this index owns the names that hash to it. */
+static ShardMap smap;                  /* n == 0: unsharded, owns every name */
+static char self_addr[SHARD_ADDR_LEN];
+static int  self_shard = -1;
+static int  mesh = -1;                 /* sends index-to-index requests */
+static MeshCall joinCall;
+static MeshCall pushCall[MAX_SHARDS];
+static MeshCall pullCall;
+static int  pullPending[MAX_SHARDS];
+static int  pullSavedPage[MAX_SHARDS]; /* where a deferred pull resumes */
+static int  pullSavedReleasing[MAX_SHARDS];
+static double pullRetryAt[MAX_SHARDS]; /* mono_ms() a deferred pull may go on */
+static int  pullBackoff[MAX_SHARDS];   /* ms; 0 until a round goes unanswered */
+static int  pullTarget = -1;
+static int  pullPage = 0;
+static int  pullReleasing = 0;
+static Handoff handoffs[MAX_SHARDS];   /* by the asker's shard number */
+static Tomb *tombs = NULL;
+static int  ntombs = 0, tombcap = 0;
+static int  *tombIndex = NULL;         /* position + 1, 0 empty */
+static int  ntombIndex = 0;            /* power of two, 2 * tombcap */
+
 static void mklogdir_if_missing(const char *dir) {
     struct stat st;
     if (stat(dir, &st) == -1) {
@@ -98,12 +212,89 @@ static int first_free_peer_slot(void) {
     for (i = 0; i < MAX_PEERS; i++) if (!peers[i].in_use) return i;
     return -1;
 }
+static unsigned long name_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619UL; }
+    return h;
+}
+
+/* Linear probing: the slot holding content, or the empty slot ending its run. */
+static int peer_slot(const Peer *p, const char *content) {
+    int mask = p->nindex - 1;
+    int i = (int)(name_hash(content) & (unsigned long)mask);
+    while (p->index[i] && strcmp(p->contents[p->index[i] - 1], content) != 0) i = (i + 1) & mask;
+    return i;
+}
+
 static int find_content_index_in_peer(const Peer *p, const char *content) {
-    int i;
-    for (i = 0; i < p->ncontent; i++) {
-        if (strcmp(p->contents[i], content) == 0) return i;
+    if (p->nindex == 0) return -1;
+    return p->index[peer_slot(p, content)] - 1;
+}
+
+static int name_ptr_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int peer_grow(Peer *p) {
+    int ncap = p->cap ? p->cap * 2 : 16, i;
+    char (*nc)[NAME_LEN + 1] = realloc(p->contents, (size_t)ncap * sizeof(*nc));
+    int *ns, *ni;
+    if (!nc) return 0;
+    p->contents = nc;
+    ns = (int *)realloc(p->sent_count, (size_t)ncap * sizeof(int));
+    if (!ns) return 0;
+    p->sent_count = ns;
+    ni = (int *)calloc((size_t)ncap * 2, sizeof(int));
+    if (!ni) return 0;
+    free(p->index);
+    p->index = ni;
+    p->nindex = ncap * 2;
+    p->cap = ncap;
+    for (i = 0; i < p->ncontent; i++) p->index[peer_slot(p, p->contents[i])] = i + 1;
+    return 1;
+}
+
+static int peer_add_content(Peer *p, const char *content) {
+    if (p->ncontent == p->cap && !peer_grow(p)) return 0;
+    strncpy(p->contents[p->ncontent], content, NAME_LEN);
+    p->contents[p->ncontent][NAME_LEN] = '\0';
+    p->sent_count[p->ncontent] = 0;
+    p->index[peer_slot(p, p->contents[p->ncontent])] = p->ncontent + 1;
+    p->ncontent++;
+    return 1;
+}
+
+/* Removes contents[ci]: empties its slot, shifts back later entries of the
+   probe run that may no longer be reached, then moves the last entry into
+   position ci so removal stays O(1). */
+static void peer_remove_content(Peer *p, int ci) {
+    int mask = p->nindex - 1, last = p->ncontent - 1;
+    int i = peer_slot(p, p->contents[ci]), j = i;
+    p->index[i] = 0;
+    while (1) {
+        int k;
+        j = (j + 1) & mask;
+        if (!p->index[j]) break;
+        k = (int)(name_hash(p->contents[p->index[j] - 1]) & (unsigned long)mask);
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            p->index[i] = p->index[j];
+            p->index[j] = 0;
+            i = j;
+        }
     }
-    return -1;
+    if (ci != last) {
+        p->index[peer_slot(p, p->contents[last])] = ci + 1;
+        memcpy(p->contents[ci], p->contents[last], sizeof(p->contents[ci]));
+        p->sent_count[ci] = p->sent_count[last];
+    }
+    p->ncontent--;
+}
+
+static void peer_free(Peer *p) {
+    free(p->contents);
+    free(p->sent_count);
+    free(p->index);
+    memset(p, 0, sizeof(*p));
 }
 
 static int parse_fields(const char *buf, size_t buflen, const char **out, int max_out) {
@@ -126,6 +317,7 @@ static void send_err(int sock, const struct sockaddr_in *cli, socklen_t clen, co
     p.type = T_ERR;
     sprintf(p.data, "%s", msg);
     sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)cli, clen);
+    TRACE_MARK(TR_REPLY, T_ERR, NULL);
 }
 static void send_ack(int sock, const struct sockaddr_in *cli, socklen_t clen, const char *msg) {
     UdpPDU p;
@@ -133,14 +325,795 @@ static void send_ack(int sock, const struct sockaddr_in *cli, socklen_t clen, co
     p.type = T_ACK;
     sprintf(p.data, "%s", msg ? msg : "OK");
     sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)cli, clen);
+    TRACE_MARK(TR_REPLY, T_ACK, NULL);
+}
+
+static void catalog_note(char op, const char *content, const char *peer) {
+    CatalogChange *c;
+    catalog_version++;
+    c = &catalog_log[catalog_version % CATALOG_LOG_LEN];
+    c->version = catalog_version;
+    c->op = op;
+    strncpy(c->content, content, NAME_LEN);
+    c->content[NAME_LEN] = '\0';
+    strncpy(c->peer, peer, NAME_LEN);
+    c->peer[NAME_LEN] = '\0';
+    if (catalog_log_count < CATALOG_LOG_LEN) catalog_log_count++;
+}
+
+static void sync_header(SyncWriter *w) {
+    memset(&w->page, 0, sizeof(w->page));
+    w->bytes = sprintf(w->page.data, "%c %lu %lu %lu %lu",
+                       w->kind, catalog_epoch, w->from, w->to, w->seq) + 1;
+}
+
+/* Appends one record; returns 0 when the page has no room for it. */
+static int sync_add(SyncWriter *w, char op, const char *content, const char *peer) {
+    int clen = (int)strlen(content) + 1;
+    int plen = (int)strlen(peer) + 1;
+    if (w->bytes + 1 + clen + plen > UDP_BUFLEN) return 0;
+    w->page.data[w->bytes++] = op;
+    memcpy(w->page.data + w->bytes, content, clen);
+    w->bytes += clen;
+    memcpy(w->page.data + w->bytes, peer, plen);
+    w->bytes += plen;
+    return 1;
+}
+
+static int snap_cmp(const void *a, const void *b) {
+    const SnapEntry *x = (const SnapEntry *)a, *y = (const SnapEntry *)b;
+    int c = strcmp(x->content, y->content);
+    return c ? c : strcmp(x->peer, y->peer);
+}
+
+/* Re-sorts the catalog copy if the catalog changed since it was made. */
+static int sync_snapshot(void) {
+    int total = 0, i, j;
+    if (syncSnapBuilt && syncSnapVersion == catalog_version) return 1;
+    for (i = 0; i < MAX_PEERS; i++) if (peers[i].in_use) total += peers[i].ncontent;
+    if (total > capSyncSnap) {
+        SnapEntry *ns = (SnapEntry *)realloc(syncSnap, (size_t)total * sizeof(*ns));
+        if (!ns) return 0;
+        syncSnap = ns;
+        capSyncSnap = total;
+    }
+    nSyncSnap = 0;
+    for (i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].in_use) continue;
+        for (j = 0; j < peers[i].ncontent; j++, nSyncSnap++) {
+            memcpy(syncSnap[nSyncSnap].content, peers[i].contents[j], sizeof(syncSnap[0].content));
+            memcpy(syncSnap[nSyncSnap].peer, peers[i].name, sizeof(syncSnap[0].peer));
+        }
+    }
+    qsort(syncSnap, (size_t)nSyncSnap, sizeof(*syncSnap), snap_cmp);
+    syncSnapVersion = catalog_version;
+    syncSnapBuilt = 1;
+    return 1;
+}
+
+/* One page of a catalog sync.  A first T_SYNC, "since\0epoch\0seq\0",
+   gets the changes after since when the log still holds them, otherwise
+   (log wrapped, index restarted, or since == 0) a snapshot.  The client
+   asks for every next page, adding "kind\0to\0" and where the last page
+   ended: the version for a delta, "content\0peer\0" for a snapshot, so
+   a lost page is simply asked for again.  T_DELTAEND ends the range.
+   Snapshot pages are cut from the catalog as it is then, so the client
+   catches up with the changes since the version of its first page. */
+static void send_sync(int sock, const struct sockaddr_in *cli, socklen_t clen, const char **f, int nf) {
+    SyncWriter w;
+    unsigned long oldest = catalog_version - (unsigned long)catalog_log_count + 1;
+    unsigned long since = strtoul(f[0], NULL, 10), epoch = strtoul(f[1], NULL, 10), v;
+    char kind = nf >= 5 ? f[3][0] : 0;
+    int i = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.seq = nf >= 3 ? strtoul(f[2], NULL, 10) : 0;
+    if (kind == 0) {
+        int delta = since != 0 && epoch == catalog_epoch && since <= catalog_version && since + 1 >= oldest;
+        kind = delta ? 'D' : 'S';
+        v = since;
+        w.to = catalog_version;
+    } else {
+        if (epoch != catalog_epoch || (kind == 'D' ? nf < 6 : nf < 7)) { send_err(sock, cli, clen, "Sync expired"); return; }
+        w.to = strtoul(f[4], NULL, 10);
+        v = strtoul(f[5], NULL, 10);
+        if (kind == 'D' && (w.to > catalog_version || v > w.to || v + 1 < oldest)) { send_err(sock, cli, clen, "Sync expired"); return; }
+    }
+    w.kind = kind;
+    if (kind == 'D') {
+        w.from = since;
+        sync_header(&w);
+        for (; v < w.to; v++) {
+            const CatalogChange *c = &catalog_log[(v + 1) % CATALOG_LOG_LEN];
+            if (!sync_add(&w, c->op, c->content, c->peer)) break;
+        }
+        w.page.type = v == w.to ? T_DELTAEND : T_DELTA;
+    } else {
+        if (!sync_snapshot()) { send_err(sock, cli, clen, "Out of memory"); return; }
+        w.to = syncSnapVersion;
+        if (nf >= 7 && f[3][0]) {
+            /* first entry after (content, peer) */
+            SnapEntry key;
+            int lo = 0, hi = nSyncSnap;
+            strncpy(key.content, f[5], NAME_LEN);
+            key.content[NAME_LEN] = '\0';
+            strncpy(key.peer, f[6], NAME_LEN);
+            key.peer[NAME_LEN] = '\0';
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (snap_cmp(&syncSnap[mid], &key) <= 0) lo = mid + 1;
+                else hi = mid;
+            }
+            i = lo;
+        }
+        sync_header(&w);
+        for (; i < nSyncSnap; i++) if (!sync_add(&w, '+', syncSnap[i].content, syncSnap[i].peer)) break;
+        w.page.type = i == nSyncSnap ? T_DELTAEND : T_DELTA;
+    }
+    sendto(sock, &w.page, sizeof(w.page), 0, (const struct sockaddr *)cli, clen);
+}
+
+/* Adds content for a peer (creating the peer on first use); msg gets the
+   reply text.  Shared by T_REG and by entries handed over from a shard. */
+static int register_entry(const char *peerName, const char *ip, int tcp_port, const char *contentName,
+                          char *msg, const char *why) {
+    int idx, freei, cidx;
+    Peer *p;
+    char logb[256];
+
+    idx = find_peer_by_name(peerName);
+    if (idx >= 0) {
+        if (strcmp(peers[idx].ip, ip) != 0) { strcpy(msg, "Peer name already in use"); return 0; }
+        cidx = find_content_index_in_peer(&peers[idx], contentName);
+        if (cidx >= 0) { strcpy(msg, "Content already registered by this peer"); return 0; }
+        if (peers[idx].ncontent >= MAX_CONTENT || !peer_add_content(&peers[idx], contentName)) {
+            strcpy(msg, "Peer content table full");
+            return 0;
+        }
+        peers[idx].tcp_port = (u16)tcp_port;
+        catalog_note('+', contentName, peerName);
+        sprintf(msg, "Registered content '%s' for peer '%s'", contentName, peerName);
+        sprintf(logb, "%s existing name=%s ip=%s tcp=%d content=%s", why, peerName, ip, tcp_port, contentName);
+        log_msg(logb);
+    } else {
+        freei = first_free_peer_slot();
+        if (freei < 0) { strcpy(msg, "Peer table full"); return 0; }
+        p = &peers[freei];
+        memset(p, 0, sizeof(*p));
+        p->in_use = 1;
+        strncpy(p->name, peerName, NAME_LEN);
+        p->name[NAME_LEN] = '\0';
+        strncpy(p->ip, ip, sizeof(p->ip) - 1);
+        p->tcp_port = (u16)tcp_port;
+        if (!peer_add_content(p, contentName)) { peer_free(p); strcpy(msg, "Out of memory"); return 0; }
+        npeers++;
+        catalog_note('+', contentName, peerName);
+        sprintf(msg, "Peer '%s' registered with content '%s'", peerName, contentName);
+        sprintf(logb, "%s new name=%s ip=%s tcp=%d content=%s", why, peerName, ip, tcp_port, contentName);
+        log_msg(logb);
+    }
+    return 1;
+}
+
+/* Drops one content of a peer; returns 1 when that was its last one and
+   the peer is gone too. */
+static void handoff_forget(const char *peer, const char *content);
+
+static int remove_entry(int pi, int ci, const char *why) {
+    Peer *p = &peers[pi];
+    char logb[256];
+
+    if (strcmp(why, "HANDOFF") != 0) handoff_forget(p->name, p->contents[ci]);
+    catalog_note('-', p->contents[ci], p->name);
+    sprintf(logb, "%s peer %s removed content '%s'", why, p->name, p->contents[ci]);
+    peer_remove_content(p, ci);
+
+    if (p->ncontent == 0) {
+        sprintf(logb, "%s peer %s removed entirely", why, p->name);
+        log_msg(logb);
+        peer_free(p);
+        npeers--;
+        return 1;
+    }
+    log_msg(logb);
+    return 0;
+}
+
+/* ---- Sharding ---- */
+
+static double mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static int owns(const char *content) {
+    return smap.n == 0 || shard_owner(&smap, content) == self_shard;
+}
+
+/* A name that moved to another shard stays here until that shard has
+   pulled and released it; SEARCH keeps being answered for it till then. */
+static int held_here(const char *content) {
+    int i;
+    for (i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use && find_content_index_in_peer(&peers[i], content) >= 0) return 1;
+    }
+    return 0;
+}
+
+static int shard_map_encode(const ShardMap *m, char *buf) {
+    int off = sprintf(buf, "%lu", m->version) + 1, i;
+    off += sprintf(buf + off, "%d", m->n) + 1;
+    for (i = 0; i < m->n; i++) off += sprintf(buf + off, "%s", m->addr[i]) + 1;
+    return off;
+}
+
+static int shard_find(const ShardMap *m, const char *addr) {
+    int i;
+    for (i = 0; i < m->n; i++) if (strcmp(m->addr[i], addr) == 0) return i;
+    return -1;
+}
+
+static void send_map(int sock, const struct sockaddr_in *cli, socklen_t clen) {
+    UdpPDU p;
+    memset(&p, 0, sizeof(p));
+    p.type = T_MAP;
+    shard_map_encode(&smap, p.data);
+    sendto(sock, &p, sizeof(p), 0, (const struct sockaddr *)cli, clen);
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void mesh_send(MeshCall *c) {
+    sendto(mesh, &c->req, sizeof(c->req), 0, (struct sockaddr *)&c->to, sizeof(c->to));
+    c->tries++;
+    c->deadline = mono_ms() + MESH_RETRY_MS;
+}
+
+/* Sets up a request to shard `addr` without sending it; data is len
+   bytes of payload.  Returns 0 if addr does not parse. */
+static int mesh_prepare(MeshCall *c, const char *addr, char type, const char *data, int len) {
+    memset(c, 0, sizeof(*c));
+    if (!shard_addr_parse(addr, &c->to)) return 0;
+    c->active = 1;
+    c->req.type = type;
+    memcpy(c->req.data, data, (size_t)len);
+    return 1;
+}
+
+/* Starts a request to shard `addr`. */
+static void mesh_call(MeshCall *c, const char *addr, char type, const char *data, int len) {
+    if (mesh_prepare(c, addr, type, data, len)) mesh_send(c);
+}
+
+/* T_MAPSET carries the map, then who sends it. */
+static void push_map(int i) {
+    char buf[UDP_BUFLEN];
+    int len = shard_map_encode(&smap, buf);
+    len += sprintf(buf + len, "%s", self_addr) + 1;
+    mesh_call(&pushCall[i], smap.addr[i], T_MAPSET, buf, len);
+}
+
+/* Index-to-index requests are only taken from a shard in map m, coming
+   from that shard's IP (the mesh socket is bound to its --self address).
+   This is a source-address check, not authentication: anyone who can
+   send from a shard's IP passes it. */
+static int from_shard(const ShardMap *m, const char *addr, const struct sockaddr_in *cli) {
+    struct sockaddr_in sa;
+    return shard_find(m, addr) >= 0 && shard_addr_parse(addr, &sa) && sa.sin_addr.s_addr == cli->sin_addr.s_addr;
+}
+
+/* A T_MAPSET is taken from a shard in the current map, or before this
+   shard has one, from the shard it asked to join. */
+static int map_sender_ok(const char *sender, const struct sockaddr_in *cli) {
+    struct sockaddr_in sa;
+    if (strcmp(sender, self_addr) == 0) return 0;
+    if (smap.n > 0) return from_shard(&smap, sender, cli);
+    return shard_addr_parse(sender, &sa) && same_addr(&sa, &joinCall.to) && sa.sin_addr.s_addr == cli->sin_addr.s_addr;
+}
+
+/* Asks for page pullPage (or the release) now, or when `at` comes. */
+static void pull_request_at(double at) {
+    char buf[UDP_BUFLEN];
+    int len = sprintf(buf, "%lu", smap.version) + 1;
+    len += sprintf(buf + len, "%s", self_addr) + 1;
+    len += sprintf(buf + len, "%d", pullPage) + 1;
+    if (!mesh_prepare(&pullCall, smap.addr[pullTarget], pullReleasing ? T_RELEASE : T_HANDOFF, buf, len)) return;
+    if (at > mono_ms()) pullCall.deadline = at;
+    else mesh_send(&pullCall);
+}
+
+static void pull_request(void) {
+    pull_request_at(0);
+}
+
+/* Removals seen while pulling, hashed on content (or on the peer name for
+   a whole peer) like a peer's contents. */
+static const char *tomb_key(const Tomb *t) {
+    return t->content[0] ? t->content : t->peer;
+}
+
+static int tomb_slot(const char *key, int want_content, const char *peer, const char *ip, const char *content) {
+    int mask = ntombIndex - 1;
+    int i = (int)(name_hash(key) & (unsigned long)mask);
+    while (tombIndex[i]) {
+        const Tomb *t = &tombs[tombIndex[i] - 1];
+        if (want_content ? (strcmp(t->content, content) == 0 && strcmp(t->ip, ip) == 0 &&
+                            (!t->peer[0] || strcmp(t->peer, peer) == 0))
+                         : (!t->content[0] && strcmp(t->peer, peer) == 0)) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Records that peer (at ip) dropped content, or everything when content
+   is NULL.  Only while a pull runs; returns 1 if recorded. */
+static int tomb_add(const char *peer, const char *ip, const char *content) {
+    Tomb *t;
+    if (pullTarget < 0) return 0;
+    if (ntombs == tombcap) {
+        int ncap = tombcap ? tombcap * 2 : 64, i;
+        Tomb *nt = (Tomb *)realloc(tombs, (size_t)ncap * sizeof(*nt));
+        int *ni;
+        if (!nt) return 0;
+        tombs = nt;
+        ni = (int *)calloc((size_t)ncap * 2, sizeof(int));
+        if (!ni) return 0;
+        free(tombIndex);
+        tombIndex = ni;
+        ntombIndex = ncap * 2;
+        tombcap = ncap;
+        for (i = 0; i < ntombs; i++) {
+            t = &tombs[i];
+            tombIndex[tomb_slot(tomb_key(t), t->content[0] != 0, t->peer, t->ip, t->content)] = i + 1;
+        }
+    }
+    t = &tombs[ntombs];
+    memset(t, 0, sizeof(*t));
+    strncpy(t->peer, peer ? peer : "", NAME_LEN);
+    strncpy(t->ip, ip ? ip : "", sizeof(t->ip) - 1);
+    strncpy(t->content, content ? content : "", NAME_LEN);
+    tombIndex[tomb_slot(tomb_key(t), t->content[0] != 0, t->peer, t->ip, t->content)] = ++ntombs;
+    return 1;
+}
+
+static int tomb_covers(const char *peer, const char *ip, const char *content) {
+    if (ntombs == 0) return 0;
+    return tombIndex[tomb_slot(content, 1, peer, ip, content)] || tombIndex[tomb_slot(peer, 0, peer, ip, content)];
+}
+
+static void tomb_clear(void) {
+    free(tombs);
+    free(tombIndex);
+    tombs = NULL;
+    tombIndex = NULL;
+    ntombs = tombcap = ntombIndex = 0;
+}
+
+/* Pulls, one shard at a time, the entries this shard owns under the new
+   map, then tells that shard to drop them.  A shard that stopped answering
+   stays pending: the others go first, then its pull resumes where it was
+   once its backoff runs out. */
+static void pull_next(void) {
+    double now = mono_ms();
+    int i, wait = -1;
+    pullCall.active = 0;
+    pullTarget = -1;
+    for (i = 0; i < smap.n; i++) {
+        if (!pullPending[i]) continue;
+        if (pullRetryAt[i] <= now) { pullTarget = i; break; }
+        if (wait < 0 || pullRetryAt[i] < pullRetryAt[wait]) wait = i;
+    }
+    if (pullTarget < 0) pullTarget = wait;
+    if (pullTarget < 0) { tomb_clear(); return; }
+    pullPage = pullSavedPage[pullTarget];
+    pullReleasing = pullSavedReleasing[pullTarget];
+    pull_request_at(pullRetryAt[pullTarget]);
+}
+
+/* The shard pulled from went MESH_TRIES sends without answering: set its
+   pull aside for a while and go on with the others. */
+static void pull_defer(void) {
+    int t = pullTarget;
+    char logb[160];
+    pullBackoff[t] = pullBackoff[t] ? pullBackoff[t] * 2 : MESH_BACKOFF_MS;
+    if (pullBackoff[t] > MESH_BACKOFF_MAX_MS) pullBackoff[t] = MESH_BACKOFF_MAX_MS;
+    pullRetryAt[t] = mono_ms() + pullBackoff[t];
+    pullSavedPage[t] = pullPage;
+    pullSavedReleasing[t] = pullReleasing;
+    sprintf(logb, "Handoff from %s not answering, retrying in %d ms", smap.addr[t], pullBackoff[t]);
+    log_msg(logb);
+    pull_next();
+}
+
+static void handoff_free(Handoff *h) {
+    free(h->recs);
+    free(h->pagestart);
+    memset(h, 0, sizeof(*h));
+}
+
+static void shard_install(const ShardMap *m) {
+    char logb[128];
+    int i;
+    for (i = 0; i < MAX_SHARDS; i++) handoff_free(&handoffs[i]);
+    smap = *m;
+    self_shard = shard_find(&smap, self_addr);
+    sprintf(logb, "Shard map v%lu installed, %d shard(s), this is shard %d", smap.version, smap.n, self_shard);
+    log_msg(logb);
+    printf("%s\n", logb);
+    for (i = 0; i < MAX_SHARDS; i++) {
+        pullPending[i] = i < smap.n && i != self_shard && self_shard >= 0;
+        pullSavedPage[i] = pullSavedReleasing[i] = pullBackoff[i] = 0;
+        pullRetryAt[i] = 0;
+        if (i >= smap.n) pushCall[i].active = 0;
+    }
+    pull_next();
+}
+
+/* T_JOIN from a new shard: grow the ring, install, and push it to all. */
+static void shard_join(const char *addr) {
+    ShardMap m = smap;
+    int i;
+    if (shard_find(&m, addr) >= 0 || m.n >= MAX_SHARDS) return;
+    strcpy(m.addr[m.n++], addr);
+    m.version++;
+    shard_map_build(&m);
+    shard_install(&m);
+    for (i = 0; i < smap.n; i++) if (i != self_shard) push_map(i);
+}
+
+static int handoff_rec_cmp(const void *a, const void *b) {
+    const HandoffRec *x = (const HandoffRec *)a, *y = (const HandoffRec *)b;
+    int c = strcmp(x->peer, y->peer);
+    return c ? c : strcmp(x->content, y->content);
+}
+
+static int handoff_push(Handoff *h, const char *peer, const char *ip, u16 port, const char *content) {
+    HandoffRec *r;
+    if (h->nrecs == h->cap) {
+        int ncap = h->cap ? h->cap * 2 : 64;
+        HandoffRec *nr = (HandoffRec *)realloc(h->recs, (size_t)ncap * sizeof(*nr));
+        if (!nr) return 0;
+        h->recs = nr;
+        h->cap = ncap;
+    }
+    r = &h->recs[h->nrecs++];
+    memset(r, 0, sizeof(*r));
+    strcpy(r->peer, peer);
+    strcpy(r->ip, ip);
+    r->port = port;
+    strcpy(r->content, content);
+    return 1;
+}
+
+/* Snapshot of the entries shard `want` owns, taken on its page 0. */
+static int handoff_start(Handoff *h, int want) {
+    int i, j;
+    handoff_free(h);
+    h->active = 1;
+    h->pagestart = (int *)calloc(1, sizeof(int));
+    if (!h->pagestart) { handoff_free(h); return 0; }
+    for (i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].in_use) continue;
+        for (j = 0; j < peers[i].ncontent; j++) {
+            if (shard_owner(&smap, peers[i].contents[j]) != want) continue;
+            if (!handoff_push(h, peers[i].name, peers[i].ip, peers[i].tcp_port, peers[i].contents[j])) { handoff_free(h); return 0; }
+        }
+    }
+    qsort(h->recs, (size_t)h->nrecs, sizeof(*h->recs), handoff_rec_cmp);
+    h->nsnap = h->nrecs;
+    return 1;
+}
+
+/* Called before an entry leaves this index other than by a release. */
+static void handoff_forget(const char *peer, const char *content) {
+    HandoffRec key, *r;
+    Handoff *h;
+    if (smap.n == 0) return;
+    h = &handoffs[shard_owner(&smap, content)];
+    if (!h->active) return;
+    strcpy(key.peer, peer);
+    strcpy(key.content, content);
+    r = (HandoffRec *)bsearch(&key, h->recs, (size_t)h->nsnap, sizeof(*h->recs), handoff_rec_cmp);
+    if (!r) return;
+    if (r - h->recs >= h->cut) r->gone = 1;
+    else handoff_push(h, r->peer, r->ip, 0, r->content);
+}
+
+static int handoff_reclen(const HandoffRec *r) {
+    char port[8];
+    return (int)(strlen(r->peer) + strlen(r->ip) + strlen(r->content)) + sprintf(port, "%u", (unsigned)r->port) + 4;
+}
+
+/* Cuts the next page from what is left. */
+static int handoff_cut(Handoff *h) {
+    int *np = (int *)realloc(h->pagestart, (size_t)(h->npages + 2) * sizeof(int));
+    int used = 0;
+    if (!np) return 0;
+    h->pagestart = np;
+    while (h->cut < h->nrecs) {
+        const HandoffRec *r = &h->recs[h->cut];
+        if (!r->gone) {
+            int rlen = handoff_reclen(r);
+            if (used + rlen > UDP_BUFLEN - 24) break;
+            used += rlen;
+        }
+        h->cut++;
+    }
+    h->pagestart[++h->npages] = h->cut;
+    return 1;
+}
+
+static int handoff_left(const Handoff *h) {
+    int i;
+    for (i = h->cut; i < h->nrecs; i++) if (!h->recs[i].gone) return 1;
+    return 0;
+}
+
+/* Forgets what shard `want` has pulled: the records that went out in
+   pages, nothing cut later. */
+static void handoff_release(int want) {
+    Handoff *h = &handoffs[want];
+    int i;
+    for (i = 0; i < h->cut; i++) {
+        const HandoffRec *r = &h->recs[i];
+        int pi, ci;
+        if (r->gone || r->port == 0) continue;
+        pi = find_peer_by_name(r->peer);
+        ci = pi >= 0 && strcmp(peers[pi].ip, r->ip) == 0 ? find_content_index_in_peer(&peers[pi], r->content) : -1;
+        if (ci >= 0) remove_entry(pi, ci, "HANDOFF");
+    }
+    handoff_free(h);
+}
+
+/* T_HANDOFF / T_RELEASE from shard `want`, which has every page before
+   `pageno`.  Answers with page `pageno` ("pageno\0last\0" then
+   "peer\0ip\0port\0content\0" records) or, on a release with nothing
+   left to send, drops what was sent and acks. */
+static void serve_handoff(int sock, const struct sockaddr_in *cli, socklen_t clen, int want, int pageno, int release) {
+    Handoff *h = &handoffs[want];
+    UdpPDU out;
+    int off, i;
+
+    memset(&out, 0, sizeof(out));
+    if (want == self_shard) { send_err(sock, cli, clen, "Cannot hand off to itself"); return; }
+    if (!h->active && !release && pageno == 0 && !handoff_start(h, want)) { send_err(sock, cli, clen, "Out of memory"); return; }
+    if (!h->active && release) {
+        out.type = T_ACK;
+        out.data[0] = T_RELEASE;
+        sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+        return;
+    }
+    if (!h->active || pageno < 0 || pageno > h->npages) { send_err(sock, cli, clen, "No such handoff page"); return; }
+    if (pageno == h->npages) {
+        if (release && !handoff_left(h)) {
+            handoff_release(want);
+            out.type = T_ACK;
+            out.data[0] = T_RELEASE;
+            sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+            return;
+        }
+        if (!handoff_cut(h)) { send_err(sock, cli, clen, "Out of memory"); return; }
+    }
+    out.type = T_HANDOFF;
+    off = sprintf(out.data, "%d", pageno) + 1;
+    off += sprintf(out.data + off, "%d", pageno == h->npages - 1 && !handoff_left(h)) + 1;
+    for (i = h->pagestart[pageno]; i < h->pagestart[pageno + 1]; i++) {
+        const HandoffRec *r = &h->recs[i];
+        if (r->gone) continue;
+        off += sprintf(out.data + off, "%s", r->peer) + 1;
+        off += sprintf(out.data + off, "%s", r->ip) + 1;
+        off += sprintf(out.data + off, "%u", (unsigned)r->port) + 1;
+        off += sprintf(out.data + off, "%s", r->content) + 1;
+    }
+    sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+}
+
+/* Takes one page of a pull: registers its entries unless a removal of
+   them was seen here meanwhile, and applies forwarded removals. */
+static void pull_page(const UdpPDU *in) {
+    const char *f[4];
+    char msg[160];
+    int off, last;
+
+    if (parse_fields(in->data, sizeof(in->data), f, 2) < 2 || atoi(f[0]) != pullPage) return;
+    last = atoi(f[1]);
+    off = (int)(f[1] - in->data) + (int)strlen(f[1]) + 1;
+    while (off < UDP_BUFLEN && in->data[off] != '\0') {
+        if (parse_fields(in->data + off, (size_t)(UDP_BUFLEN - off), f, 4) < 4) break;
+        if (atoi(f[2]) == 0) {
+            int pi = find_peer_by_name(f[0]);
+            int ci = pi >= 0 && strcmp(peers[pi].ip, f[1]) == 0 ? find_content_index_in_peer(&peers[pi], f[3]) : -1;
+            if (ci >= 0) remove_entry(pi, ci, "HANDOFF");
+        } else if (!tomb_covers(f[0], f[1], f[3])) {
+            register_entry(f[0], f[1], atoi(f[2]), f[3], msg, "HANDOFF");
+        }
+        off = (int)(f[3] - in->data) + (int)strlen(f[3]) + 1;
+    }
+    pullPage++;
+    pullReleasing = last;
+    pullBackoff[pullTarget] = 0;
+    pull_request();
+}
+
+/* Replies arriving on the mesh socket. */
+static void mesh_receive(void) {
+    UdpPDU in;
+    struct sockaddr_in from;
+    socklen_t flen = sizeof(from);
+    ShardMap m;
+    int i;
+
+    memset(&in, 0, sizeof(in));
+    if (recvfrom(mesh, &in, sizeof(in), 0, (struct sockaddr *)&from, &flen) < 0) return;
+    if (joinCall.active && same_addr(&from, &joinCall.to) && in.type == T_ACK && in.data[0] == T_JOIN) joinCall.active = 0;
+    for (i = 0; i < smap.n; i++) {
+        if (pushCall[i].active && same_addr(&from, &pushCall[i].to) && in.type == T_ACK && in.data[0] == T_MAPSET) pushCall[i].active = 0;
+    }
+    if (!pullCall.active || !same_addr(&from, &pullCall.to)) return;
+    if (in.type == T_HANDOFF) pull_page(&in);
+    else if (in.type == T_ACK && in.data[0] == T_RELEASE && pullReleasing) { pullPending[pullTarget] = 0; pull_next(); }
+    else if (in.type == T_ERR) {
+        char logb[UDP_BUFLEN + 64];
+        sprintf(logb, "Handoff from %s refused: %.*s", smap.addr[pullTarget], UDP_BUFLEN - 1, in.data);
+        log_msg(logb);
+        pullPending[pullTarget] = 0;
+        pull_next();
+    }
+    else if (in.type == T_MAP && shard_map_decode(&m, in.data, UDP_BUFLEN) && shard_find(&m, self_addr) >= 0) {
+        /* The other side has a different map: take it if newer, else send ours. */
+        if (m.version > smap.version) shard_install(&m);
+        else if (!pushCall[pullTarget].active) push_map(pullTarget);
+    }
+}
+
+static void mesh_timers(void) {
+    double now = mono_ms();
+    char logb[128];
+    int i;
+    if (joinCall.active && now >= joinCall.deadline) {
+        if (joinCall.tries < MESH_TRIES) mesh_send(&joinCall);
+        else { joinCall.active = 0; log_msg("Join got no answer"); fprintf(stderr, "Join got no answer\n"); }
+    }
+    for (i = 0; i < smap.n; i++) {
+        if (!pushCall[i].active || now < pushCall[i].deadline) continue;
+        if (pushCall[i].tries < MESH_TRIES) mesh_send(&pushCall[i]);
+        else { pushCall[i].active = 0; sprintf(logb, "Shard %s did not take map v%lu", smap.addr[i], smap.version); log_msg(logb); }
+    }
+    if (pullCall.active && now >= pullCall.deadline) {
+        if (pullCall.tries < MESH_TRIES) mesh_send(&pullCall);
+        else pull_defer();
+    }
+}
+
+/* Runs mesh traffic and retries until a PDU is waiting on the index socket. */
+static void wait_index_socket(int s) {
+    while (1) {
+        fd_set rfds;
+        struct timeval tv;
+        double next = -1, now;
+        int i, maxfd = s;
+        MeshCall *calls[MAX_SHARDS + 2];
+        int ncalls = 0;
+
+        if (mesh < 0) return;
+        calls[ncalls++] = &joinCall;
+        calls[ncalls++] = &pullCall;
+        for (i = 0; i < smap.n; i++) calls[ncalls++] = &pushCall[i];
+        now = mono_ms();
+        for (i = 0; i < ncalls; i++) {
+            double left;
+            if (!calls[i]->active) continue;
+            left = calls[i]->deadline - now;
+            if (left < 0) left = 0;
+            if (next < 0 || left < next) next = left;
+        }
+        FD_ZERO(&rfds);
+        FD_SET(s, &rfds);
+        FD_SET(mesh, &rfds);
+        if (mesh > maxfd) maxfd = mesh;
+        if (next >= 0) {
+            tv.tv_sec = (long)(next / 1000);
+            tv.tv_usec = (long)((next - (double)tv.tv_sec * 1000) * 1000);
+        }
+        if (select(maxfd + 1, &rfds, NULL, NULL, next >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            return;
+        }
+        if (FD_ISSET(mesh, &rfds)) mesh_receive();
+        mesh_timers();
+        if (FD_ISSET(s, &rfds)) return;
+    }
+}
+
+/* T_REGN / T_DEREGN: many names in one PDU.  The T_ACK carries
+   "done\0failed\0", the names another shard owns for the peer to send
+   there, an empty string, then the names that failed.  Repeats count as
+   done, so a batch whose reply was lost can simply be sent again. */
+static void handle_batch(int sock, const UdpPDU *in, const struct sockaddr_in *cli, socklen_t clen, const char *cip) {
+    const char *f[2];
+    int hdr = in->type == T_REGN ? 2 : 1;
+    int off, done = 0, failed = 0, mlen = 0, flen = 0, n, tcp_port = 0;
+    char moved[UDP_BUFLEN], failn[UDP_BUFLEN];
+    char msg[160];
+    UdpPDU out;
+
+    if (parse_fields(in->data, sizeof(in->data), f, hdr) < hdr) { send_err(sock, cli, clen, "Malformed batch PDU"); return; }
+    if (strlen(f[0]) == 0 || strlen(f[0]) > NAME_LEN) { send_err(sock, cli, clen, "Name too long or empty"); return; }
+    if (hdr == 2) {
+        tcp_port = atoi(f[1]);
+        if (tcp_port <= 0 || tcp_port > 65535) { send_err(sock, cli, clen, "Invalid TCP port"); return; }
+    }
+    off = (int)(f[hdr - 1] - in->data) + (int)strlen(f[hdr - 1]) + 1;
+    TRACE_MARK(TR_PARSE, hdr, NULL);
+    TRACE_BEGIN(TR_LOOKUP, 0, NULL);
+    while (off < UDP_BUFLEN && in->data[off] != '\0') {
+        const char *name = in->data + off;
+        int pi, ci, nlen;
+        if (!memchr(name, '\0', (size_t)(UDP_BUFLEN - off))) break;
+        nlen = (int)strlen(name);
+        off += nlen + 1;
+        if (nlen > NAME_LEN) { failed++; continue; }
+        if (!owns(name)) {
+            if (mlen + flen + nlen + 2 <= UDP_BUFLEN - 32) { memcpy(moved + mlen, name, (size_t)nlen + 1); mlen += nlen + 1; }
+            continue;
+        }
+        pi = find_peer_by_name(f[0]);
+        ci = pi >= 0 && strcmp(peers[pi].ip, cip) == 0 ? find_content_index_in_peer(&peers[pi], name) : -1;
+        if ((pi >= 0 && strcmp(peers[pi].ip, cip) != 0) ||
+            (in->type == T_REGN && ci < 0 && !register_entry(f[0], cip, tcp_port, name, msg, "REG"))) {
+            failed++;
+            if (mlen + flen + nlen + 2 <= UDP_BUFLEN - 32) { memcpy(failn + flen, name, (size_t)nlen + 1); flen += nlen + 1; }
+            continue;
+        }
+        if (in->type == T_DEREGN) {
+            tomb_add(f[0], cip, name);
+            if (ci >= 0) remove_entry(pi, ci, "DEREG");
+        }
+        done++;
+    }
+    TRACE_END(TR_LOOKUP, done);
+    memset(&out, 0, sizeof(out));
+    out.type = T_ACK;
+    n = sprintf(out.data, "%d", done) + 1;
+    n += sprintf(out.data + n, "%d", failed) + 1;
+    memcpy(out.data + n, moved, (size_t)mlen);
+    memcpy(out.data + n + mlen + 1, failn, (size_t)flen);
+    sendto(sock, &out, sizeof(out), 0, (const struct sockaddr *)cli, clen);
+    TRACE_MARK(TR_REPLY, T_ACK, NULL);
+}
+
+/* Content name a REG / SEARCH / DEREG is about, for the ownership check. */
+static const char *pdu_content(const UdpPDU *in) {
+    const char *f[2];
+    int want = in->type == T_REG ? 2 : 1;
+    if (parse_fields(in->data, sizeof(in->data), f, want) < want) return NULL;
+    return f[want - 1];
 }
 
 int main(int argc, char **argv) {
     int port = (argc >= 2) ? atoi(argv[1]) : INDEX_PORT;
-    int s;
+    int s, i;
     struct sockaddr_in srv;
+    const char *join = NULL;
 
     memset(peers, 0, sizeof(peers));
+    memset(&smap, 0, sizeof(smap));
+    catalog_epoch = (unsigned long)time((time_t*)0);
+
+    /* [port] [--self ip:port [--join ip:port]] */
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--self") == 0 && i + 1 < argc && strlen(argv[i + 1]) < SHARD_ADDR_LEN) strcpy(self_addr, argv[++i]);
+        else if (strcmp(argv[i], "--join") == 0 && i + 1 < argc) join = argv[++i];
+        else break;
+    }
+    if (i < argc || (join && !self_addr[0]) || (self_addr[0] && !shard_addr_parse(self_addr, &srv))) {
+        fprintf(stderr, "Usage: %s [port] [--self ip:port [--join ip:port]]\n", argv[0]);
+        exit(1);
+    }
 
     s = socket(AF_INET, SOCK_DGRAM, 0);
     if (s < 0) { perror("socket"); exit(1); }
@@ -156,9 +1129,32 @@ int main(int argc, char **argv) {
     }
 
     open_log_file(port);
+    TRACE_OPEN("directory_server");
     printf("Index server listening on UDP port %d\n", port);
     log_msg("Listening for peers");
 
+    if (self_addr[0]) {
+        struct sockaddr_in ma;
+        mesh = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mesh < 0) { perror("socket"); exit(1); }
+        /* Other shards check that mesh traffic comes from this IP. */
+        shard_addr_parse(self_addr, &ma);
+        ma.sin_port = 0;
+        if (bind(mesh, (struct sockaddr *)&ma, sizeof(ma)) < 0) { perror("bind --self address"); exit(1); }
+        if (join) {
+            mesh_call(&joinCall, join, T_JOIN, self_addr, (int)strlen(self_addr) + 1);
+            if (!joinCall.active) { fprintf(stderr, "Bad --join address %s\n", join); exit(1); }
+        } else {
+            ShardMap m;
+            memset(&m, 0, sizeof(m));
+            m.version = 1;
+            m.n = 1;
+            strcpy(m.addr[0], self_addr);
+            shard_map_build(&m);
+            shard_install(&m);
+        }
+    }
+
     while (1) {
         UdpPDU in;
         UdpPDU out;
@@ -172,26 +1168,39 @@ int main(int argc, char **argv) {
         memset(&cli, 0, sizeof(cli));
         memset(cip, 0, sizeof(cip));
 
+        TRACE_END(TR_PDU, 0);
+        wait_index_socket(s);
         n = recvfrom(s, &in, sizeof(in), 0, (struct sockaddr *)&cli, &clen);
         if (n < 0) { perror("recvfrom"); continue; }
+        TRACE_BEGIN(TR_PDU, in.type, pdu_content(&in));
 
         strcpy(cip, inet_ntoa(cli.sin_addr));
 
+        /* Index-to-index PDUs mean nothing to an index run without --self. */
+        if (!self_addr[0] && (in.type == T_MAPSET || in.type == T_JOIN || in.type == T_HANDOFF || in.type == T_RELEASE)) continue;
+
+        if (in.type == T_REG || in.type == T_SEARCH || in.type == T_DEREG) {
+            const char *contentName = pdu_content(&in);
+            if (contentName && !owns(contentName) && !(in.type == T_SEARCH && held_here(contentName))) {
+                memset(&out, 0, sizeof(out));
+                out.type = T_MOVED;
+                sprintf(out.data, "%lu", smap.version);
+                sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+                continue;
+            }
+        }
+
         if (in.type == T_REG) {
             const char *fields[3];
             int nf;
             const char *peerName;
             const char *contentName;
             const char *portStr;
-            int tcp_port;
-            int idx;
-            int freei;
-            Peer *p;
-            int cidx;
+            int tcp_port, ok;
             char msg[160];
-            char logb[256];
 
             nf = parse_fields(in.data, sizeof(in.data), fields, 3);
+            TRACE_MARK(TR_PARSE, nf, NULL);
             if (nf < 3) { send_err(s, &cli, clen, "Malformed R PDU"); continue; }
 
             peerName = fields[0];
@@ -206,44 +1215,11 @@ int main(int argc, char **argv) {
             tcp_port = atoi(portStr);
             if (tcp_port <= 0 || tcp_port > 65535) { send_err(s, &cli, clen, "Invalid TCP port"); continue; }
 
-            idx = find_peer_by_name(peerName);
-            if (idx >= 0) {
-                if (strcmp(peers[idx].ip, cip) != 0) {
-                    send_err(s, &cli, clen, "Peer name already in use");
-                    continue;
-                }
-                if (peers[idx].ncontent >= MAX_CONTENT) { send_err(s, &cli, clen, "Peer content table full"); continue; }
-                cidx = find_content_index_in_peer(&peers[idx], contentName);
-                if (cidx >= 0) { send_err(s, &cli, clen, "Content already registered by this peer"); continue; }
-                strncpy(peers[idx].contents[peers[idx].ncontent], contentName, NAME_LEN);
-                peers[idx].contents[peers[idx].ncontent][NAME_LEN] = '\0';
-                peers[idx].sent_count[peers[idx].ncontent] = 0;
-                peers[idx].ncontent++;
-                peers[idx].tcp_port = (u16)tcp_port;
-                sprintf(msg, "Registered content '%s' for peer '%s'", contentName, peerName);
-                send_ack(s, &cli, clen, msg);
-                sprintf(logb, "REG existing name=%s ip=%s tcp=%d content=%s", peerName, cip, tcp_port, contentName);
-                log_msg(logb);
-            } else {
-                freei = first_free_peer_slot();
-                if (freei < 0) { send_err(s, &cli, clen, "Peer table full"); continue; }
-                p = &peers[freei];
-                memset(p, 0, sizeof(*p));
-                p->in_use = 1;
-                strncpy(p->name, peerName, NAME_LEN);
-                p->name[NAME_LEN] = '\0';
-                strncpy(p->ip, cip, sizeof(p->ip) - 1);
-                p->tcp_port = (u16)tcp_port;
-                p->ncontent = 1;
-                strncpy(p->contents[0], contentName, NAME_LEN);
-                p->contents[0][NAME_LEN] = '\0';
-                p->sent_count[0] = 0;
-                npeers++;
-                sprintf(msg, "Peer '%s' registered with content '%s'", peerName, contentName);
-                send_ack(s, &cli, clen, msg);
-                sprintf(logb, "REG new name=%s ip=%s tcp=%d content=%s", peerName, cip, tcp_port, contentName);
-                log_msg(logb);
-            }
+            TRACE_BEGIN(TR_LOOKUP, 0, NULL);
+            ok = register_entry(peerName, cip, tcp_port, contentName, msg, "REG");
+            TRACE_END(TR_LOOKUP, ok);
+            if (!ok) { send_err(s, &cli, clen, msg); continue; }
+            send_ack(s, &cli, clen, msg);
         }
         else if (in.type == T_SEARCH) {
             const char *fields[1];
@@ -255,6 +1231,7 @@ int main(int argc, char **argv) {
             int i;
 
             nf = parse_fields(in.data, sizeof(in.data), fields, 1);
+            TRACE_MARK(TR_PARSE, nf, NULL);
             if (nf < 1) { send_err(s, &cli, clen, "Malformed S PDU"); continue; }
             contentName = fields[0];
             if (strlen(contentName) == 0 || strlen(contentName) > NAME_LEN) {
@@ -262,6 +1239,7 @@ int main(int argc, char **argv) {
                 continue;
             }
 
+            TRACE_BEGIN(TR_LOOKUP, 0, NULL);
             for (i = 0; i < MAX_PEERS; i++) {
                 if (!peers[i].in_use) continue;
                 {
@@ -276,6 +1254,7 @@ int main(int argc, char **argv) {
                     }
                 }
             }
+            TRACE_END(TR_LOOKUP, best_peer);
             if (best_peer < 0) {
                 send_err(s, &cli, clen, "Content not found");
             } else {
@@ -292,6 +1271,7 @@ int main(int argc, char **argv) {
                 plen = (int)strlen(pbuf) + 1;
                 memcpy(out.data + off, pbuf, plen);
                 sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+                TRACE_MARK(TR_REPLY, T_SEARCH, NULL);
 
                 if (best_content_idx >= 0 &&
                     peers[best_peer].sent_count[best_content_idx] < 0x7fffffff) {
@@ -307,44 +1287,25 @@ int main(int argc, char **argv) {
             int nf;
             const char *contentName;
             int pi;
-            Peer *p;
             int ci;
-            int k;
-            char logb[256];
+            int gone = 0;
 
             nf = parse_fields(in.data, sizeof(in.data), fields, 1);
+            TRACE_MARK(TR_PARSE, nf, NULL);
             if (nf < 1) { send_err(s, &cli, clen, "Malformed T PDU"); continue; }
             contentName = fields[0];
 
+            TRACE_BEGIN(TR_LOOKUP, 0, NULL);
             pi = find_peer_by_ip(cip);
-            if (pi < 0) { send_err(s, &cli, clen, "You are not registered"); continue; }
-
-            p = &peers[pi];
-            ci = find_content_index_in_peer(p, contentName);
-            if (ci < 0) { send_err(s, &cli, clen, "Content not hosted by you"); continue; }
-
-            for (k = ci + 1; k < p->ncontent; k++) {
-                strcpy(p->contents[k - 1], p->contents[k]);
-                p->sent_count[k - 1] = p->sent_count[k];
-            }
-            if (p->ncontent > 0) {
-                memset(p->contents[p->ncontent - 1], 0, sizeof(p->contents[p->ncontent - 1]));
-                p->sent_count[p->ncontent - 1] = 0;
-                p->ncontent--;
-            }
-
-            if (p->ncontent == 0) {
-                sprintf(logb, "DEREG peer %s removed entirely", p->name);
-                log_msg(logb);
-                memset(p, 0, sizeof(*p));
-                p->in_use = 0;
-                npeers--;
-                send_ack(s, &cli, clen, "Content removed and peer de-registered");
-            } else {
-                sprintf(logb, "DEREG peer %s removed content '%s'", p->name, contentName);
-                log_msg(logb);
-                send_ack(s, &cli, clen, "Content de-registered");
-            }
+            ci = pi >= 0 ? find_content_index_in_peer(&peers[pi], contentName) : -1;
+            if (ci >= 0) gone = remove_entry(pi, ci, "DEREG");
+            TRACE_END(TR_LOOKUP, ci);
+            /* mid-pull the entry may still be on its way from the old owner */
+            if (tomb_add(NULL, cip, contentName) && ci < 0) send_ack(s, &cli, clen, "Content de-registered");
+            else if (pi < 0) send_err(s, &cli, clen, "You are not registered");
+            else if (ci < 0) send_err(s, &cli, clen, "Content not hosted by you");
+            else if (gone) send_ack(s, &cli, clen, "Content removed and peer de-registered");
+            else send_ack(s, &cli, clen, "Content de-registered");
         }
         else if (in.type == T_BYE) {
             const char *fields[1];
@@ -355,11 +1316,17 @@ int main(int argc, char **argv) {
             if (nf < 1) { send_err(s, &cli, clen, "Malformed B PDU"); continue; }
             peerName = fields[0];
             pi = find_peer_by_name(peerName);
+            tomb_add(peerName, NULL, NULL);
             if (pi >= 0) {
                 char logb[128];
+                int k;
+                for (k = 0; k < peers[pi].ncontent; k++) {
+                    handoff_forget(peers[pi].name, peers[pi].contents[k]);
+                    catalog_note('-', peers[pi].contents[k], peers[pi].name);
+                }
                 sprintf(logb, "BYE peer %s removed", peers[pi].name);
                 log_msg(logb);
-                memset(&peers[pi], 0, sizeof(peers[pi]));
+                peer_free(&peers[pi]);
                 npeers--;
                 send_ack(s, &cli, clen, "Peer removed");
             } else {
@@ -367,29 +1334,23 @@ int main(int argc, char **argv) {
             }
         }
         else if (in.type == T_LIST) {
-            char uniq[MAX_PEERS * MAX_CONTENT][NAME_LEN + 1];
-            int  ucount = 0;
+            const char **uniq;
+            int  ucount = 0, total = 0;
             int  i, j, k;
             int  bytes;
             UdpPDU page;
 
-            memset(uniq, 0, sizeof(uniq));
-
+            /* Every name once: collect, sort, drop repeats. */
+            for (i = 0; i < MAX_PEERS; i++) if (peers[i].in_use) total += peers[i].ncontent;
+            uniq = (const char **)malloc((size_t)(total ? total : 1) * sizeof(*uniq));
+            if (!uniq) { send_err(s, &cli, clen, "Out of memory"); continue; }
             for (i = 0; i < MAX_PEERS; i++) {
                 if (!peers[i].in_use) continue;
-                for (j = 0; j < peers[i].ncontent; j++) {
-                    const char *nm = peers[i].contents[j];
-                    int seen = 0;
-                    for (k = 0; k < ucount; k++) {
-                        if (strcmp(uniq[k], nm) == 0) { seen = 1; break; }
-                    }
-                    if (!seen && ucount < (int)(sizeof(uniq) / sizeof(uniq[0]))) {
-                        strncpy(uniq[ucount], nm, NAME_LEN);
-                        uniq[ucount][NAME_LEN] = '\0';
-                        ucount++;
-                    }
-                }
+                for (j = 0; j < peers[i].ncontent; j++) uniq[ucount++] = peers[i].contents[j];
             }
+            qsort(uniq, (size_t)ucount, sizeof(*uniq), name_ptr_cmp);
+            for (i = 0, k = 0; i < ucount; i++) if (k == 0 || strcmp(uniq[k - 1], uniq[i]) != 0) uniq[k++] = uniq[i];
+            ucount = k;
 
             if (ucount == 0) {
                 memset(&page, 0, sizeof(page));
@@ -437,6 +1398,60 @@ int main(int argc, char **argv) {
                 page.type = T_LISTEND;
                 sendto(s, &page, sizeof(page), 0, (struct sockaddr *)&cli, clen);
             }
+            free(uniq);
+        }
+        else if (in.type == T_SYNC) {
+            const char *fields[7];
+            int nf = parse_fields(in.data, sizeof(in.data), fields, 7);
+            if (nf < 2) { send_err(s, &cli, clen, "Malformed V PDU"); continue; }
+            send_sync(s, &cli, clen, fields, nf);
+        }
+        else if (in.type == T_REGN || in.type == T_DEREGN) {
+            handle_batch(s, &in, &cli, clen, cip);
+        }
+        else if (in.type == T_MAP) {
+            send_map(s, &cli, clen);
+        }
+        else if (in.type == T_MAPSET) {
+            ShardMap m;
+            char enc[UDP_BUFLEN];
+            const char *sender;
+            int len;
+            if (!shard_map_decode(&m, in.data, UDP_BUFLEN)) { send_err(s, &cli, clen, "Malformed I PDU"); continue; }
+            len = shard_map_encode(&m, enc);
+            sender = in.data + len;
+            if (len >= UDP_BUFLEN || !memchr(sender, '\0', (size_t)(UDP_BUFLEN - len)) || !map_sender_ok(sender, &cli) ||
+                shard_find(&m, sender) < 0 || shard_find(&m, self_addr) < 0) {
+                char logb[128];
+                sprintf(logb, "Ignored map v%lu from %s", m.version, cip);
+                log_msg(logb);
+                continue;
+            }
+            if (m.version > smap.version) shard_install(&m);
+            out.type = T_ACK;
+            out.data[0] = T_MAPSET;
+            sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+        }
+        else if (in.type == T_JOIN) {
+            const char *fields[1];
+            struct sockaddr_in ja;
+            if (parse_fields(in.data, sizeof(in.data), fields, 1) < 1 || strlen(fields[0]) >= SHARD_ADDR_LEN ||
+                !shard_addr_parse(fields[0], &ja)) { send_err(s, &cli, clen, "Malformed J PDU"); continue; }
+            if (ja.sin_addr.s_addr != cli.sin_addr.s_addr) continue;
+            if (smap.n == 0) { send_err(s, &cli, clen, "Index is not sharded"); continue; }
+            if (smap.n >= MAX_SHARDS && shard_find(&smap, fields[0]) < 0) { send_err(s, &cli, clen, "Shard map full"); continue; }
+            out.type = T_ACK;
+            out.data[0] = T_JOIN;
+            sendto(s, &out, sizeof(out), 0, (struct sockaddr *)&cli, clen);
+            if (shard_find(&smap, fields[0]) < 0) shard_join(fields[0]);
+            else push_map(shard_find(&smap, fields[0]));
+        }
+        else if (in.type == T_HANDOFF || in.type == T_RELEASE) {
+            const char *fields[3];
+            if (parse_fields(in.data, sizeof(in.data), fields, 3) < 3) { send_err(s, &cli, clen, in.type == T_HANDOFF ? "Malformed K PDU" : "Malformed L PDU"); continue; }
+            if (strtoul(fields[0], NULL, 10) != smap.version) { send_map(s, &cli, clen); continue; }
+            if (!from_shard(&smap, fields[1], &cli)) continue;
+            serve_handoff(s, &cli, clen, shard_find(&smap, fields[1]), atoi(fields[2]), in.type == T_RELEASE);
         }
         else {
             send_err(s, &cli, clen, "Unknown PDU type");
@@ -0,0 +1,111 @@
+#ifndef LZ_H
+#define LZ_H
+/* Watermark: Krish Patel (KrishAdmin) — lz.h */
+/* Watermark: https://krishadmin.com */
+
+/* Small LZ77 block codec for compressed transfers, LZ4-like format.  A
+   block is a run of sequences: a token byte (literal count in the high
+   nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning more
+   bytes of 255 follow), the literals, then a 2-byte little-endian offset
+   back into the output and the match length bytes.  The last sequence
+   has literals only. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_BOUND(n)  ((n) + (n) / 255 + 16)   /* worst case output size */
+
+static unsigned lz_hash(const unsigned char *p) {
+    unsigned long v = (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+    return (unsigned)(((v * 2654435761UL) & 0xffffffffUL) >> (32 - LZ_HASH_BITS));
+}
+
+static unsigned char *lz_put_len(unsigned char *op, int len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Compresses n bytes (n < 65536) into out; returns the compressed size,
+   or 0 when it would not fit in cap. */
+static int lz_compress(const unsigned char *in, int n, unsigned char *out, int cap) {
+    int table[1 << LZ_HASH_BITS];
+    const unsigned char *ip = in, *anchor = in, *end = in + n;
+    const unsigned char *mlimit = n > 12 ? end - 5 : in;   /* keep a literal tail */
+    unsigned char *op = out, *oend = out + cap;
+    int i;
+
+    for (i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+    while (ip + LZ_MIN_MATCH <= mlimit) {
+        unsigned h = lz_hash(ip);
+        int cand = table[h];
+        const unsigned char *ref;
+        int lit, mlen;
+        unsigned char *token;
+
+        table[h] = (int)(ip - in);
+        if (cand < 0 || ip - in - cand > 65535) { ip++; continue; }
+        ref = in + cand;
+        if (memcmp(ref, ip, LZ_MIN_MATCH) != 0) { ip++; continue; }
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen < mlimit && ref[mlen] == ip[mlen]) mlen++;
+
+        lit = (int)(ip - anchor);
+        if (op + 1 + lit / 255 + 1 + lit + 2 + (mlen - LZ_MIN_MATCH) / 255 + 1 > oend) return 0;
+        token = op++;
+        *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15) op = lz_put_len(op, lit - 15);
+        memcpy(op, anchor, (size_t)lit);
+        op += lit;
+        *op++ = (unsigned char)((ip - ref) & 0xff);
+        *op++ = (unsigned char)((ip - ref) >> 8);
+        *token |= (unsigned char)(mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15);
+        if (mlen - LZ_MIN_MATCH >= 15) op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+    i = (int)(end - anchor);
+    if (op + 1 + i / 255 + 1 + i > oend) return 0;
+    *op++ = (unsigned char)((i < 15 ? i : 15) << 4);
+    if (i >= 15) op = lz_put_len(op, i - 15);
+    memcpy(op, anchor, (size_t)i);
+    op += i;
+    return (int)(op - out);
+}
+
+static int lz_get_len(const unsigned char **ip, const unsigned char *end, int len) {
+    int b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/* Expands a block into out; returns the output size, or -1 if the block
+   is corrupt or would not fit in cap. */
+static int lz_decompress(const unsigned char *in, int n, unsigned char *out, int cap) {
+    const unsigned char *ip = in, *end = in + n;
+    unsigned char *op = out, *oend = out + cap;
+
+    while (ip < end) {
+        int token = *ip++, lit = token >> 4, mlen = token & 15, off;
+        const unsigned char *ref;
+        if (lit == 15 && (lit = lz_get_len(&ip, end, lit)) < 0) return -1;
+        if (lit > end - ip || lit > oend - op) return -1;
+        memcpy(op, ip, (size_t)lit);
+        op += lit;
+        ip += lit;
+        if (ip == end) break;
+        if (end - ip < 2) return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (mlen == 15 && (mlen = lz_get_len(&ip, end, mlen)) < 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > op - out || mlen > oend - op) return -1;
+        for (ref = op - off; mlen > 0; mlen--) *op++ = *ref++;   /* may overlap */
+    }
+    return (int)(op - out);
+}
+
+#endif
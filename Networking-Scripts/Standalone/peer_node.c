@@ -1,6 +1,6 @@
 /* Watermark: Krish Patel (KrishAdmin) — peer_node.c */
 /* Watermark: https://krishadmin.com */
-#define _POSIX_C_SOURCE 200112L
+#define _XOPEN_SOURCE 600
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,32 +9,223 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <dirent.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include "protocol.h"
+#include "shard.h"
+#include "trace.h"
+#include "lz.h"
 
 #ifndef INDEX_PORT
 #define INDEX_PORT 15000
 #endif
 
+/* Concurrent downloads served by the hosting loop. */
+#ifndef HOST_MAX_CONN
+#define HOST_MAX_CONN 32
+#endif
+/* Open descriptors kept by the hosting loop for popular content; one per
+   connection at most, so never smaller than HOST_MAX_CONN. */
+#ifndef HOST_FD_CACHE
+#define HOST_FD_CACHE HOST_MAX_CONN
+#endif
+/* Seconds a cached descriptor is trusted before the path is re-stat()ed. */
+#ifndef HOST_REVALIDATE_SEC
+#define HOST_REVALIDATE_SEC 2
+#endif
+#define HOST_READ_BLOCK  (UDP_BUFLEN * 16)   /* also the unit compressed, <= ZBLOCK_MAX */
+#define HOST_FRAME_MAX   ((int)(sizeof(char) + sizeof(u16)) + UDP_BUFLEN)
+#define CONTENT_INIT     256   /* first contentList allocation, doubles as needed */
+
+/* Compressed transfers.  A block goes out packed only if that saves an
+   eighth; after LZ_MISS_LIMIT blocks in a row that do not, the next
+   LZ_SKIP_BLOCKS go raw untried, and one more miss after that skips
+   again.  P2P_COMPRESS=0 turns it off. */
+#define LZ_MISS_LIMIT  4
+#define LZ_SKIP_BLOCKS 16
+#define ZHDR_LEN       ((int)(2 * sizeof(u16)))
+#define ZBUF_LEN       (ZHDR_LEN + LZ_BOUND(ZBLOCK_MAX))
+
+/* How long a REG/DEREG/SEARCH round trip waits for the index. */
+#ifndef INDEX_TIMEOUT_MS
+#define INDEX_TIMEOUT_MS 3000
+#endif
+
+/* T_REGN / T_DEREGN names per PDU stop here so the T_ACK, which may echo
+   all of them back as moved, still fits. */
+#define BATCH_PAYLOAD (UDP_BUFLEN - 32)
+
+/* Shared directory (-s): inotify events are coalesced and flushed to the
+   index once nothing has changed for WATCH_QUIET_MS, or WATCH_MAX_MS after
+   the first one at the latest.  Names the index did not take are tried
+   again WATCH_RETRY_MS later. */
+#define WATCH_QUIET_MS 250
+#define WATCH_MAX_MS   1000
+#define WATCH_RETRY_MS 5000
+/* Catalog sync asks for one page at a time, again every SYNC_RETRY_MS up
+   to SYNC_TRIES times; it starts over at most SYNC_ROUNDS times when the
+   index no longer has the changes it was reading. */
+#define SYNC_RETRY_MS 500
+#define SYNC_TRIES    6
+#define SYNC_ROUNDS   4
+/* Daemon mode: control connections, downloads in flight, command size. */
+#define CTL_MAX_CLIENTS 16
+#define CTL_MAX_WORKERS 16
+#define CTL_BUF         1024
+#define CTL_TAG_LEN     31
+/* "content : host, host, ..." with every peer hosting it. */
+#define REPLICA_LINE_MAX (NAME_LEN + 3 + MAX_PEERS * (NAME_LEN + 2))
+
+/* Upload priority classes a downloader may ask for; DRR weights below. */
+#define PRIO_HIGH    0
+#define PRIO_NORMAL  1
+#define PRIO_BULK    2
+#define PRIO_CLASSES 3
+
+typedef struct {
+    char   name[NAME_LEN + 1];
+    int    fd;
+    int    refs;             /* connections streaming from it */
+    dev_t  dev;
+    ino_t  ino;
+    time_t checked;
+    unsigned long used;
+} HostFile;
+
+/* Bytes per second with a small burst; rate <= 0 means unlimited. */
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+} TokenBucket;
+
+/* One (content, host) pair of the local catalog replica. */
+typedef struct {
+    char op;                          /* '+' / '-' while a sync is pending */
+    char content[NAME_LEN + 1];
+    char peer[NAME_LEN + 1];
+    int  shard;                       /* index shard it was synced from */
+} CatalogEntry;
+
+#define CONN_FREE 0
+#define CONN_REQ  1
+#define CONN_SEND 2
+
+/* A control connection, or the batch file (in = file, out = stdout). */
+typedef struct {
+    int  in, out;              /* -1 when the slot is free */
+    long id;                   /* never reused, workers report to it */
+    char buf[CTL_BUF];
+    int  len;
+    int  eof;
+    int  stalled;              /* a command waits for a free worker */
+    int  waiting;              /* WAIT until its commands finish */
+    char wtag[CTL_TAG_LEN + 1];
+} CtlClient;
+
+/* A forked command, so the index round trip or download never blocks the
+   loop.  It writes "* " reply lines and "=" lines replaying its shard map
+   and replica changes, then one "OK ..." / "ERR ..." line, and exits. */
+typedef struct {
+    pid_t pid;                 /* 0 when the slot is free */
+    int   fd;
+    char  kind;                /* 'G' GET, 'R' REG, 'T' DEREG, 'S' SEARCH, 'O' LIST,
+                                  'W' share flush (no client) */
+    long  owner;
+    unsigned long gen;         /* replicaGen when it was forked */
+    char  tag[CTL_TAG_LEN + 1];
+    char  name[NAME_LEN + 1];  /* LIST: the filter */
+    char  line[REPLICA_LINE_MAX + 64];
+    int   len;
+    char  result[2 * UDP_BUFLEN];
+} CtlWorker;
+
+typedef struct {
+    int      fd;
+    int      state;
+    char     cip[INET_ADDRSTRLEN];
+    char     req[HOST_FRAME_MAX + 1];
+    int      req_got;
+    HostFile *hf;
+    off_t    off;                     /* file offset of block[] */
+    char     block[HOST_READ_BLOCK];
+    int      blen, bpos;
+    char     frame[HOST_FRAME_MAX];
+    int      flen, fsent;
+    int      last;                    /* frame[] is the final one */
+    int      blocked;                 /* socket buffer full, wait for writable */
+    int      throttled;               /* out of tokens */
+    int      prio;
+    long     deficit;
+    TokenBucket tb;
+    int      lz;                      /* downloader takes T_ZCHUNK */
+    int      zmiss, zskip;            /* adaptive bypass, see LZ_MISS_LIMIT */
+    char     zbuf[ZBUF_LEN];          /* packed block being framed */
+    int      zlen, zpos;
+    long     zraw, zsent;             /* bytes packed and what they became */
+} HostConn;
+
 static char peerName[NAME_LEN + 1];
-static char contentList[MAX_CONTENT][NAME_LEN + 1];
-static int  nContent = 0;
+static char (*contentList)[NAME_LEN + 1] = NULL;
+static int  nContent = 0, contentCap = 0;
+static int *contentSet = NULL;      /* contentList index + 1, 0 = empty */
+static int  contentSetSize = 0;     /* power of two, 2 * contentCap */
+
+static HostFile fileCache[HOST_FD_CACHE];
+static unsigned long fileCacheTick = 0;
+
+static HostConn hostConns[HOST_MAX_CONN];
+static int  hostRR = 0;             /* slot host_schedule() serves first */
+static int  hostRRFed = 0;          /* it already got this round's quantum */
+static TokenBucket hostBucket;
+static const int prioWeight[PRIO_CLASSES] = { 4, 2, 1 };
+
+/* Parent -> hosting child: "+name\n" / "-name\n" as contentList changes. */
+static int  host_ctl[2] = { -1, -1 };
+static char host_ctl_buf[4 * (NAME_LEN + 2)];
+static int  host_ctl_len = 0;
+
+/* Local replica of the index catalog, kept current with T_SYNC deltas. */
+static CatalogEntry *replica = NULL;
+static int  nReplica = 0, capReplica = 0;
+static int  *replicaSet = NULL;       /* hash of replica: position + 1, 0 empty */
+static int  replicaSetSize = 0;       /* power of two, 2 * capReplica */
+static unsigned long replicaGen = 0;  /* bumped whenever the replica is dropped */
+static unsigned long replicaVersion[MAX_SHARDS];   /* per shard; [0] unsharded */
+static unsigned long replicaEpoch[MAX_SHARDS];
 
 static int  udp_sock = -1;
 static struct sockaddr_in index_addr;
 static socklen_t index_addrlen;
+static ShardMap shardMap;                  /* n == 0: everything goes to index_addr */
+static struct sockaddr_in shardAddr[MAX_SHARDS];
 
 static int  tcp_listen = -1;
 static u16  listen_port = 0;
 static pid_t host_pid = -1;
 
+static CtlClient ctlClients[CTL_MAX_CLIENTS];
+static CtlWorker ctlWorkers[CTL_MAX_WORKERS];
+static long ctlNextId = 1;
+static int  ctl_listen = -1;
+static const char *ctl_path = NULL;
+static int  ctl_out = 1;                       /* stdout before logs moved to stderr */
+static volatile sig_atomic_t ctl_stop = 0;
+static int  ctl_worker = -1;                   /* in a command worker: pipe to the daemon */
+
 static void die(const char *msg) { perror(msg); exit(1); }
 
 static void print_menu(void) {
@@ -42,6 +233,7 @@ static void print_menu(void) {
     printf("  R : Register content\n");
     printf("  D : Download content\n");
     printf("  O : List available content (content : hosts)\n");
+    printf("  L : Search the local catalog copy (no network)\n");
     printf("  T : De register content\n");
     printf("  Q : Quit (de register all)\n");
     printf("Choice: ");
@@ -59,6 +251,167 @@ static int recv_n(int fd, void *buf, size_t len) {
     return 1;
 }
 
+static unsigned long name_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619UL; }
+    return h;
+}
+
+/* contentSet slot holding name, or the empty slot where it would go. */
+static unsigned long content_slot(const char *name) {
+    unsigned long mask = (unsigned long)contentSetSize - 1, slot = name_hash(name) & mask;
+    while (contentSet[slot] && strcmp(contentList[contentSet[slot] - 1], name) != 0) slot = (slot + 1) & mask;
+    return slot;
+}
+
+static int content_find(const char *name) {
+    if (!contentSetSize) return -1;
+    return contentSet[content_slot(name)] - 1;
+}
+
+static int content_grow(void) {
+    int cap = contentCap ? contentCap * 2 : CONTENT_INIT, i;
+    char (*list)[NAME_LEN + 1] = realloc(contentList, (size_t)cap * sizeof(*list));
+    int *set;
+    if (!list) return 0;
+    contentList = list;
+    set = calloc((size_t)cap * 2, sizeof(*set));
+    if (!set) return 0;
+    free(contentSet);
+    contentSet = set;
+    contentSetSize = cap * 2;
+    contentCap = cap;
+    for (i = 0; i < nContent; i++) contentSet[content_slot(contentList[i])] = i + 1;
+    return 1;
+}
+
+static void host_file_forget(const char *name);
+
+/* Keeps a forked hosting loop's copy of contentList in step with ours. */
+static void host_notify(char op, const char *name) {
+    char line[NAME_LEN + 3];
+    int n;
+    if (host_pid <= 0 || host_ctl[1] < 0) return;
+    n = sprintf(line, "%c%.*s\n", op, NAME_LEN, name);
+    if (write(host_ctl[1], line, (size_t)n) < 0) perror("write(host ctl)");
+}
+
+static int content_add(const char *name) {
+    if (content_find(name) >= 0) return 1;
+    if (nContent >= MAX_CONTENT) return 0;
+    if (nContent == contentCap && !content_grow()) return 0;
+    memset(contentList[nContent], 0, sizeof(contentList[nContent]));
+    strncpy(contentList[nContent], name, sizeof(contentList[nContent]) - 1);
+    contentSet[content_slot(contentList[nContent])] = nContent + 1;
+    nContent++;
+    host_notify('+', name);
+    return 1;
+}
+
+/* Backward-shift delete keeps every probe run unbroken, then the last
+   entry moves into the freed contentList position. */
+static void content_remove(const char *name) {
+    unsigned long mask = (unsigned long)contentSetSize - 1, hole, j;
+    int pos = content_find(name);
+    if (pos < 0) return;
+    host_file_forget(name);
+    host_notify('-', name);
+    hole = j = content_slot(name);
+    for (;;) {
+        unsigned long home;
+        j = (j + 1) & mask;
+        if (!contentSet[j]) break;
+        home = name_hash(contentList[contentSet[j] - 1]) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            contentSet[hole] = contentSet[j];
+            hole = j;
+        }
+    }
+    contentSet[hole] = 0;
+    nContent--;
+    if (pos != nContent) {
+        memcpy(contentList[pos], contentList[nContent], sizeof(contentList[pos]));
+        contentSet[content_slot(contentList[pos])] = pos + 1;
+    }
+    memset(contentList[nContent], 0, sizeof(contentList[nContent]));
+}
+
+static void host_file_close(HostFile *hf) {
+    if (hf->fd >= 0) close(hf->fd);
+    memset(hf, 0, sizeof(*hf));
+    hf->fd = -1;
+}
+
+static void host_file_init(void) {
+    int i;
+    memset(fileCache, 0, sizeof(fileCache));
+    for (i = 0; i < HOST_FD_CACHE; i++) fileCache[i].fd = -1;
+}
+
+/* Entries still being streamed are only unlinked from the name lookup and
+   closed by host_file_put() once the last connection finishes. */
+static void host_file_forget(const char *name) {
+    int i;
+    for (i = 0; i < HOST_FD_CACHE; i++) {
+        if (fileCache[i].fd >= 0 && strcmp(fileCache[i].name, name) == 0) {
+            if (fileCache[i].refs > 0) fileCache[i].name[0] = '\0';
+            else host_file_close(&fileCache[i]);
+        }
+    }
+}
+
+static void host_file_put(HostFile *hf) {
+    if (--hf->refs == 0 && hf->name[0] == '\0') host_file_close(hf);
+}
+
+/* Returns an open descriptor for name from the LRU, opening it on a miss;
+   release it with host_file_put().  A hit only goes back to the path once
+   every HOST_REVALIDATE_SEC, and the entry is dropped when the path now
+   names a different inode. */
+static HostFile *host_file_get(const char *name) {
+    struct stat st;
+    time_t now = time((time_t*)0);
+    HostFile *hf = NULL;
+    int i, fd;
+
+    for (i = 0; i < HOST_FD_CACHE; i++) {
+        if (fileCache[i].fd >= 0 && strcmp(fileCache[i].name, name) == 0) { hf = &fileCache[i]; break; }
+    }
+    if (hf) {
+        if (now - hf->checked < HOST_REVALIDATE_SEC ||
+            (stat(name, &st) == 0 && st.st_dev == hf->dev && st.st_ino == hf->ino)) {
+            hf->checked = now;
+            hf->used = ++fileCacheTick;
+            hf->refs++;
+            return hf;
+        }
+        if (hf->refs > 0) hf->name[0] = '\0';
+        else host_file_close(hf);
+    }
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) { close(fd); return NULL; }
+
+    hf = NULL;
+    for (i = 0; i < HOST_FD_CACHE; i++) {
+        if (fileCache[i].fd < 0) { hf = &fileCache[i]; break; }
+        if (fileCache[i].refs == 0 && (!hf || fileCache[i].used < hf->used)) hf = &fileCache[i];
+    }
+    if (!hf) { close(fd); return NULL; }
+    host_file_close(hf);
+    strncpy(hf->name, name, NAME_LEN);
+    hf->fd = fd;
+    hf->dev = st.st_dev;
+    hf->ino = st.st_ino;
+    hf->checked = now;
+    hf->used = ++fileCacheTick;
+    hf->refs = 1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    return hf;
+}
+
 static void create_udp_and_index(const char *host, int port) {
     struct hostent *he;
     udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -101,60 +454,496 @@ static void send_tcp_err(int cs, const char *msg) {
     send(cs, &err, tosend, 0);
 }
 
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* "256k", "10m" or plain bytes per second; unset or 0 means unlimited. */
+static double parse_rate(const char *s) {
+    char *end;
+    double v;
+    if (!s || !*s) return 0;
+    v = strtod(s, &end);
+    if (*end == 'k' || *end == 'K') v *= 1024;
+    else if (*end == 'm' || *end == 'M') v *= 1024 * 1024;
+    return v > 0 ? v : 0;
+}
+
+static void bucket_init(TokenBucket *b, double rate, double now) {
+    b->rate = rate;
+    b->burst = rate / 20;
+    if (b->burst < 4 * HOST_FRAME_MAX) b->burst = 4 * HOST_FRAME_MAX;
+    b->tokens = b->burst;
+    b->last = now;
+}
+
+static void bucket_refill(TokenBucket *b, double now) {
+    if (b->rate <= 0) return;
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+}
+
+/* Seconds until n bytes may go out, 0 if they may go now. */
+static double bucket_wait(const TokenBucket *b, int n) {
+    if (b->rate <= 0 || b->tokens >= n) return 0;
+    return (n - b->tokens) / b->rate;
+}
+
+static void bucket_take(TokenBucket *b, int n) {
+    if (b->rate > 0) b->tokens -= n;
+}
+
+static void host_conn_close(HostConn *c) {
+    if (c->state == CONN_SEND) TRACE_ASYNC(TR_UPLOAD, 'e', (long)(c - hostConns), c->off + c->bpos, NULL);
+    if (c->zraw) printf("Upload to %s: %ld bytes packed into %ld\n", c->cip, c->zraw, c->zsent);
+    if (c->fd >= 0) close(c->fd);
+    if (c->hf) host_file_put(c->hf);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void host_conn_fail(HostConn *c, const char *msg) {
+    send_tcp_err(c->fd, msg);
+    host_conn_close(c);
+}
+
+/* P2P_COMPRESS=0 turns compression off on either side. */
+static int compress_enabled(void) {
+    const char *e = getenv("P2P_COMPRESS");
+    return !e || strcmp(e, "0") != 0;
+}
+
+/* Names of formats that are compressed already; those always go raw. */
+static int packed_format(const char *name) {
+    static const char *ext[] = {
+        "gz", "tgz", "bz2", "xz", "zst", "zip", "7z", "rar", "jar",
+        "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "m4a", "mkv",
+        "avi", "mov", "webm", "ogg", "flac", "pdf", NULL
+    };
+    const char *dot = strrchr(name, '.');
+    int i, k;
+    if (!dot) return 0;
+    for (i = 0; ext[i]; i++) {
+        for (k = 0; ext[i][k] && tolower((unsigned char)dot[1 + k]) == ext[i][k]; k++) {}
+        if (!ext[i][k] && !dot[1 + k]) return 1;
+    }
+    return 0;
+}
+
+/* Packs block[] into zbuf[] unless the bypass says not to try or it
+   would not save an eighth; returns 1 when zbuf[] holds the block. */
+static int host_conn_pack(HostConn *c) {
+    u16 raw = (u16)c->blen, packed;
+    int zl;
+    if (c->zskip > 0) { c->zskip--; return 0; }
+    zl = lz_compress((const unsigned char *)c->block, c->blen, (unsigned char *)c->zbuf + ZHDR_LEN, ZBUF_LEN - ZHDR_LEN);
+    if (zl == 0 || zl > c->blen - c->blen / 8) {
+        if (++c->zmiss >= LZ_MISS_LIMIT) { c->zmiss = LZ_MISS_LIMIT - 1; c->zskip = LZ_SKIP_BLOCKS; }
+        return 0;
+    }
+    c->zmiss = 0;
+    packed = (u16)zl;
+    memcpy(c->zbuf, &raw, sizeof(raw));
+    memcpy(c->zbuf + sizeof(raw), &packed, sizeof(packed));
+    c->zlen = ZHDR_LEN + zl;
+    c->zpos = 0;
+    c->bpos = c->blen;
+    c->zraw += c->blen;
+    c->zsent += c->zlen;
+    return 1;
+}
+
+/* Builds the next frame from the connection's block buffer, refilling it
+   from the cached descriptor.  A frame shorter than UDP_BUFLEN is final,
+   and a file that is a multiple of UDP_BUFLEN ends with an empty T_FINAL. */
+static int host_conn_next_frame(HostConn *c) {
+    TcpPDU *f = (TcpPDU *)c->frame;
+    int flen;
+    if (c->bpos == c->blen && c->zpos == c->zlen) {
+        ssize_t nr;
+        c->off += c->blen;
+        c->bpos = c->blen = 0;
+        c->zpos = c->zlen = 0;
+        nr = pread(c->hf->fd, c->block, sizeof(c->block), c->off);
+        if (nr < 0) { perror("pread"); return 0; }
+        c->blen = (int)nr;
+        if (c->lz && c->blen > 0) host_conn_pack(c);
+    }
+    if (c->zpos < c->zlen) {
+        flen = c->zlen - c->zpos;
+        if (flen > UDP_BUFLEN) flen = UDP_BUFLEN;
+        f->type = T_ZCHUNK;
+        f->len  = (u16)flen;
+        memcpy(f->data, c->zbuf + c->zpos, (size_t)flen);
+        c->zpos += flen;
+        c->flen = (int)(sizeof(char) + sizeof(u16)) + flen;
+        c->fsent = 0;
+        c->last = 0;
+        return 1;
+    }
+    flen = c->blen - c->bpos;
+    if (flen > UDP_BUFLEN) flen = UDP_BUFLEN;
+    f->type = (flen < UDP_BUFLEN) ? T_FINAL : T_CHUNK;
+    f->len  = (u16)flen;
+    if (flen) memcpy(f->data, c->block + c->bpos, (size_t)flen);
+    c->bpos += flen;
+    c->flen = (int)(sizeof(char) + sizeof(u16)) + flen;
+    c->fsent = 0;
+    c->last = (f->type == T_FINAL);
+    return 1;
+}
+
+/* Request: T_REQ, u16 len, "name\0" with an optional "prio\0" field after it. */
+static void host_conn_read_req(HostConn *c) {
+    char hdr_type;
+    u16 hdr_len;
+    const char *reqname, *field, *end;
+    ssize_t r;
+    int want = (int)(sizeof(char) + sizeof(u16));
+
+    if (c->req_got >= want) {
+        memcpy(&hdr_len, c->req + 1, sizeof(hdr_len));
+        want += hdr_len;
+    }
+    r = recv(c->fd, c->req + c->req_got, (size_t)(want - c->req_got), 0);
+    if (r <= 0) { host_conn_close(c); return; }
+    c->req_got += (int)r;
+    if (c->req_got == (int)(sizeof(char) + sizeof(u16))) {
+        hdr_type = c->req[0];
+        memcpy(&hdr_len, c->req + 1, sizeof(hdr_len));
+        if (hdr_type != T_REQ || hdr_len == 0 || hdr_len > UDP_BUFLEN) { host_conn_fail(c, "Bad request"); return; }
+        return;
+    }
+    if (c->req_got < want) return;
+
+    c->req[c->req_got] = '\0';
+    reqname = c->req + sizeof(char) + sizeof(u16);
+    end = c->req + c->req_got;
+    field = reqname + strlen(reqname) + 1;
+    c->prio = PRIO_NORMAL;
+    if (field < end && *field) {
+        int p = atoi(field);
+        if (p >= PRIO_HIGH && p < PRIO_CLASSES) c->prio = p;
+    }
+    if (field < end) field += strlen(field) + 1;
+    c->lz = field < end && strcmp(field, "lz") == 0 && compress_enabled() && !packed_format(reqname);
+    printf("Incoming download from %s for '%s'\n", c->cip, reqname);
+
+    if (content_find(reqname) < 0) { host_conn_fail(c, "Content not hosted here"); return; }
+    c->hf = host_file_get(reqname);
+    if (!c->hf) { host_conn_fail(c, "File open failed"); return; }
+
+    bucket_init(&c->tb, parse_rate(getenv("P2P_CONN_CAP")), mono_now());
+    c->state = CONN_SEND;
+    c->deficit = 0;
+    TRACE_ASYNC(TR_UPLOAD, 'b', (long)(c - hostConns), c->prio, reqname);
+}
+
+static void host_accept(void) {
+    struct sockaddr_in cli;
+    socklen_t clen = sizeof(cli);
+    HostConn *c = NULL;
+    int cs, i;
+
+    memset(&cli, 0, sizeof(cli));
+    cs = accept(tcp_listen, (struct sockaddr *)&cli, &clen);
+    if (cs < 0) { perror("accept"); return; }
+    for (i = 0; i < HOST_MAX_CONN && !c; i++) if (hostConns[i].state == CONN_FREE) c = &hostConns[i];
+    if (!c) { send_tcp_err(cs, "Host busy"); close(cs); return; }
+    fcntl(cs, F_SETFL, fcntl(cs, F_GETFL, 0) | O_NONBLOCK);
+    memset(c, 0, sizeof(*c));
+    c->fd = cs;
+    c->state = CONN_REQ;
+    strcpy(c->cip, inet_ntoa(cli.sin_addr));
+}
+
+static void host_read_ctl(void) {
+    ssize_t r = read(host_ctl[0], host_ctl_buf + host_ctl_len, sizeof(host_ctl_buf) - (size_t)host_ctl_len);
+    char *line, *nl;
+    if (r <= 0) { close(host_ctl[0]); host_ctl[0] = -1; return; }
+    host_ctl_len += (int)r;
+    line = host_ctl_buf;
+    while ((nl = memchr(line, '\n', (size_t)(host_ctl_buf + host_ctl_len - line))) != NULL) {
+        *nl = '\0';
+        if (line[0] == '+') content_add(line + 1);
+        else if (line[0] == '-') content_remove(line + 1);
+        line = nl + 1;
+    }
+    host_ctl_len -= (int)(line - host_ctl_buf);
+    memmove(host_ctl_buf, line, (size_t)host_ctl_len);
+}
+
+/* Deficit round robin over the active downloads.  Each turn a connection's
+   deficit grows by one frame times its class weight and it may send while
+   the deficit, its own bucket (P2P_CONN_CAP) and the global bucket
+   (P2P_UPLOAD_CAP) all cover the next frame.  When the global bucket runs
+   dry the round stops there and resumes at that connection, without a new
+   quantum, once it refills; so the cap is shared by class weight. */
+static void host_schedule(void) {
+    double now = mono_now();
+    int k, first = -1;
+
+    bucket_refill(&hostBucket, now);
+    for (k = 0; k < HOST_MAX_CONN; k++) {
+        int slot = (hostRR + k) % HOST_MAX_CONN;
+        HostConn *c = &hostConns[slot];
+        long quantum;
+        if (c->state != CONN_SEND || c->blocked) continue;
+        if (first < 0) first = slot;
+        quantum = (long)HOST_FRAME_MAX * prioWeight[c->prio];
+        bucket_refill(&c->tb, now);
+        c->throttled = 0;
+        if (k > 0 || !hostRRFed) c->deficit += quantum;
+        while (c->state == CONN_SEND) {
+            int need;
+            ssize_t w;
+            if (c->fsent == c->flen) {
+                if (c->flen && c->last) { host_conn_close(c); break; }
+                if (!host_conn_next_frame(c)) { host_conn_close(c); break; }
+            }
+            need = c->flen - c->fsent;
+            if (c->deficit < need) break;
+            if (bucket_wait(&hostBucket, need) > 0) {
+                c->throttled = 1;
+                TRACE_ASYNC(TR_THROTTLE, 'n', (long)(c - hostConns), need, NULL);
+                hostRR = slot;
+                hostRRFed = 1;
+                for (k = 0; k < HOST_MAX_CONN; k++) if (hostConns[k].state == CONN_SEND) hostConns[k].throttled = 1;
+                return;
+            }
+            if (bucket_wait(&c->tb, need) > 0) {
+                c->throttled = 1;
+                TRACE_ASYNC(TR_THROTTLE, 'n', (long)(c - hostConns), need, NULL);
+                break;
+            }
+            w = send(c->fd, c->frame + c->fsent, (size_t)need, 0);
+            if (w < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    c->blocked = 1;
+                    TRACE_ASYNC(TR_BLOCKED, 'n', (long)(c - hostConns), need, NULL);
+                }
+                else host_conn_close(c);
+                break;
+            }
+            TRACE_ASYNC(TR_FRAME, 'n', (long)(c - hostConns), (long)w, NULL);
+            c->fsent += (int)w;
+            c->deficit -= (long)w;
+            bucket_take(&hostBucket, (int)w);
+            bucket_take(&c->tb, (int)w);
+        }
+        if (c->deficit > 2 * quantum) c->deficit = 2 * quantum;
+    }
+    if (first >= 0) hostRR = (first + 1) % HOST_MAX_CONN;
+    hostRRFed = 0;
+}
+
+/* Adds the hosting sockets to the sets and returns how long select() may
+   sleep in seconds: 0 when a download can move now, -1 for no limit. */
+static double host_fill_fds(fd_set *rfds, fd_set *wfds, int *maxfd) {
+    double wait = -1;
+    int i, nfree = 0;
+    for (i = 0; i < HOST_MAX_CONN; i++) {
+        HostConn *c = &hostConns[i];
+        if (c->state == CONN_FREE) { nfree++; continue; }
+        if (c->fd > *maxfd) *maxfd = c->fd;
+        if (c->state == CONN_REQ) { FD_SET(c->fd, rfds); continue; }
+        if (c->blocked) { FD_SET(c->fd, wfds); continue; }
+        if (c->throttled) {
+            int need = c->flen - c->fsent;
+            double t = bucket_wait(&hostBucket, need);
+            if (bucket_wait(&c->tb, need) > t) t = bucket_wait(&c->tb, need);
+            if (wait < 0 || t < wait) wait = t;
+        } else {
+            wait = 0;
+        }
+    }
+    if (nfree && tcp_listen >= 0) {
+        FD_SET(tcp_listen, rfds);
+        if (tcp_listen > *maxfd) *maxfd = tcp_listen;
+    }
+    if (host_ctl[0] >= 0) {
+        FD_SET(host_ctl[0], rfds);
+        if (host_ctl[0] > *maxfd) *maxfd = host_ctl[0];
+    }
+    return wait;
+}
+
+static void host_service(fd_set *rfds, fd_set *wfds) {
+    int i;
+    if (host_ctl[0] >= 0 && FD_ISSET(host_ctl[0], rfds)) host_read_ctl();
+    if (tcp_listen >= 0 && FD_ISSET(tcp_listen, rfds)) host_accept();
+    for (i = 0; i < HOST_MAX_CONN; i++) {
+        HostConn *c = &hostConns[i];
+        if (c->state == CONN_REQ && FD_ISSET(c->fd, rfds)) host_conn_read_req(c);
+        else if (c->state == CONN_SEND && c->blocked && FD_ISSET(c->fd, wfds)) c->blocked = 0;
+    }
+    host_schedule();
+}
+
+static void host_init(void) {
+    int i;
+    memset(hostConns, 0, sizeof(hostConns));
+    for (i = 0; i < HOST_MAX_CONN; i++) hostConns[i].fd = -1;
+    bucket_init(&hostBucket, parse_rate(getenv("P2P_UPLOAD_CAP")), mono_now());
+    signal(SIGPIPE, SIG_IGN);
+}
+
 static void hosting_loop(void) {
     printf("Content hosting started\n");
+    host_init();
     while (1) {
-        struct sockaddr_in cli; socklen_t clen = sizeof(cli); int cs;
-        char cip[INET_ADDRSTRLEN]; char hdr_type; u16 hdr_len; char reqname[UDP_BUFLEN+1];
-        int i, allowed, fd; char out_type; u16 out_len; char buf[UDP_BUFLEN]; ssize_t nr;
+        fd_set rfds, wfds;
+        struct timeval tv;
+        int maxfd = -1;
+        double wait;
 
-        memset(&cli, 0, sizeof(cli));
-        cs = accept(tcp_listen, (struct sockaddr *)&cli, &clen);
-        if (cs < 0) { perror("accept"); continue; }
-        strcpy(cip, inet_ntoa(cli.sin_addr));
-
-        if (!recv_n(cs, &hdr_type, sizeof(hdr_type)) || !recv_n(cs, &hdr_len, sizeof(hdr_len))) {
-            send_tcp_err(cs, "Bad request"); close(cs); continue;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        wait = host_fill_fds(&rfds, &wfds, &maxfd);
+        if (wait >= 0) {
+            tv.tv_sec = (long)wait;
+            tv.tv_usec = (long)((wait - (double)tv.tv_sec) * 1e6);
         }
-        if (hdr_type != T_REQ || hdr_len == 0 || hdr_len > UDP_BUFLEN) {
-            send_tcp_err(cs, "Bad request"); close(cs); continue;
+        if (select(maxfd + 1, &rfds, &wfds, NULL, wait >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
         }
-        memset(reqname, 0, sizeof(reqname));
-        if (!recv_n(cs, reqname, hdr_len)) { close(cs); continue; }
+        host_service(&rfds, &wfds);
+    }
+}
 
-        printf("Incoming download from %s for '%s'\n", cip, reqname);
+/* Forks the hosting loop once; contentList changes reach it over host_ctl. */
+static void start_hosting(void) {
+    ensure_tcp_listen();
+    if (host_pid > 0) return;
+    if (pipe(host_ctl) < 0) die("pipe");
+    host_pid = fork();
+    if (host_pid == 0) {
+        close(host_ctl[1]);
+        host_ctl[1] = -1;
+        TRACE_FORK();
+        hosting_loop();
+        _exit(0);
+    }
+    close(host_ctl[0]);
+    host_ctl[0] = -1;
+}
 
-        allowed = 0;
-        for (i = 0; i < nContent; i++) {
-            if (strcmp(contentList[i], reqname) == 0) { allowed = 1; break; }
-        }
-        if (!allowed) { send_tcp_err(cs, "Content not hosted here"); close(cs); continue; }
+static int wait_readable(int fd, int ms) {
+    fd_set rfds;
+    struct timeval tv;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return select(fd + 1, &rfds, NULL, NULL, &tv) > 0;
+}
 
-        fd = open(reqname, O_RDONLY);
-        if (fd < 0) { send_tcp_err(cs, "File open failed"); close(cs); continue; }
+static int shard_count(void) { return shardMap.n ? shardMap.n : 1; }
 
-        while (1) {
-            nr = read(fd, buf, sizeof(buf));
-            if (nr < 0) { perror("read"); break; }
-            if (nr == 0) {
-                out_type = T_FINAL; out_len = 0;
-                send(cs, &out_type, sizeof(out_type), 0);
-                send(cs, &out_len, sizeof(out_len), 0);
-                break;
-            }
-            out_type = (nr < (ssize_t)sizeof(buf)) ? T_FINAL : T_CHUNK;
-            out_len = (u16)nr;
-            send(cs, &out_type, sizeof(out_type), 0);
-            send(cs, &out_len, sizeof(out_len), 0);
-            if (out_len) send(cs, buf, out_len, 0);
-            if (out_type == T_FINAL) break;
-        }
-        close(fd);
-        close(cs);
+static const struct sockaddr_in *shard_addr(int k) { return shardMap.n ? &shardAddr[k] : &index_addr; }
+
+static int replica_reindex(void);
+static void write_all(int fd, const char *buf, size_t len);
+
+/* In a command worker, passes a shard map or replica change on to the
+   daemon so its copy follows. */
+static void worker_note(const char *fmt, ...) {
+    char line[2 * NAME_LEN + MAX_SHARDS * (SHARD_ADDR_LEN + 1) + 64];
+    va_list ap;
+    int n;
+    if (ctl_worker < 0) return;
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(line) - 1) return;
+    line[n++] = '\n';
+    write_all(ctl_worker, line, (size_t)n);
+}
+
+/* Installs map m.  A new version invalidates the per-shard replica. */
+static int shard_map_use(const ShardMap *m) {
+    char note[MAX_SHARDS * (SHARD_ADDR_LEN + 1) + 32];
+    int i, n;
+    for (i = 0; i < m->n; i++) if (!shard_addr_parse(m->addr[i], &shardAddr[i])) return 0;
+    if (m->version != shardMap.version) {
+        nReplica = 0;
+        replica_reindex();
+        memset(replicaVersion, 0, sizeof(replicaVersion));
+        memset(replicaEpoch, 0, sizeof(replicaEpoch));
+        replicaGen++;
+        n = sprintf(note, "=M\t%lu\t%d", m->version, m->n);
+        for (i = 0; i < m->n; i++) n += sprintf(note + n, "\t%s", m->addr[i]);
+        worker_note("%s", note);
+    }
+    shardMap = *m;
+    return 1;
+}
+
+/* Asks the index (or, failing that, any known shard) for the shard map.
+   An unsharded or older index leaves shardMap.n at 0. */
+static void fetch_shard_map(void) {
+    UdpPDU p, r;
+    ShardMap m;
+    int k;
+    for (k = -1; k < shardMap.n; k++) {
+        const struct sockaddr_in *to = k < 0 ? &index_addr : &shardAddr[k];
+        while (recv(udp_sock, &r, sizeof(r), MSG_DONTWAIT) > 0) {}
+        memset(&p, 0, sizeof(p));
+        p.type = T_MAP;
+        if (sendto(udp_sock, &p, sizeof(p), 0, (const struct sockaddr *)to, sizeof(*to)) < 0) continue;
+        if (!wait_readable(udp_sock, 1000)) continue;
+        memset(&r, 0, sizeof(r));
+        if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) continue;
+        if (r.type == T_ERR) return;
+        if (r.type != T_MAP || !shard_map_decode(&m, r.data, UDP_BUFLEN)) continue;
+        shard_map_use(&m);
+        return;
+    }
+}
+
+static int index_exchange(UdpPDU *p, UdpPDU *r, const char *content, char *msg) {
+    int tries;
+    for (tries = 0; tries < 2; tries++) {
+        const struct sockaddr_in *to = shardMap.n ? &shardAddr[shard_owner(&shardMap, content)] : &index_addr;
+        while (recv(udp_sock, r, sizeof(*r), MSG_DONTWAIT) > 0) {}
+        if (sendto(udp_sock, p, sizeof(*p), 0, (const struct sockaddr *)to, sizeof(*to)) < 0) {
+            sprintf(msg, "sendto: %s", strerror(errno));
+            return 0;
+        }
+        if (!wait_readable(udp_sock, INDEX_TIMEOUT_MS)) { strcpy(msg, "Index did not answer"); return 0; }
+        memset(r, 0, sizeof(*r));
+        if (recvfrom(udp_sock, r, sizeof(*r), 0, NULL, NULL) < 0) {
+            sprintf(msg, "recvfrom: %s", strerror(errno));
+            return 0;
+        }
+        r->data[UDP_BUFLEN - 1] = '\0';
+        if (r->type != T_MOVED) break;
+        fetch_shard_map();
     }
+    if (r->type == T_MOVED) { strcpy(msg, "Shard map keeps changing, try again"); return 0; }
+    strcpy(msg, r->data);
+    return r->type != T_ERR;
 }
 
-static int register_content_udp(const char *content) {
+/* One request/reply with the index shard that owns content.  msg
+   (UDP_BUFLEN bytes) gets the reply text or what went wrong; returns 0
+   unless the index answered without T_ERR.  Stale replies from an earlier
+   timed-out request are dropped; T_MOVED refetches the map and retries. */
+static int index_request(UdpPDU *p, UdpPDU *r, const char *content, char *msg) {
+    int ok;
+    TRACE_BEGIN(TR_REQUEST, p->type, content);
+    ok = index_exchange(p, r, content, msg);
+    TRACE_END(TR_REQUEST, r->type);
+    return ok;
+}
+
+static int register_content_udp(const char *content, char *msg) {
     UdpPDU p, r;
     int off = 0;
     int n1, n2, n3;
@@ -169,49 +958,426 @@ static int register_content_udp(const char *content) {
     sprintf(pbuf, "%u", (unsigned)listen_port);
     n3 = (int)strlen(pbuf) + 1;
 
-    if (n1 + n2 + n3 > UDP_BUFLEN) { fprintf(stderr, "Register payload too large\n"); return 0; }
+    if (n1 + n2 + n3 > UDP_BUFLEN) { strcpy(msg, "Register payload too large"); return 0; }
     memcpy(p.data + off, peerName, n1); off += n1;
     memcpy(p.data + off, content,  n2); off += n2;
     memcpy(p.data + off, pbuf,     n3);
-
-    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return 0; }
-    memset(&r, 0, sizeof(r));
-    if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); return 0; }
-    if (r.type == T_ERR) { printf("Register error: %s\n", r.data); return 0; }
-    printf("%s\n", r.data);
-    return 1;
+    return index_request(&p, &r, content, msg);
 }
 
-static int dereg_content_udp(const char *content) {
+static int dereg_content_udp(const char *content, char *msg) {
     UdpPDU p, r;
     memset(&p, 0, sizeof(p)); p.type = T_DEREG; sprintf(p.data, "%s", content);
-    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return 0; }
-    memset(&r, 0, sizeof(r));
-    if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); return 0; }
-    if (r.type == T_ERR) { printf("%s\n", r.data); return 0; }
-    printf("%s\n", r.data);
-    return 1;
+    return index_request(&p, &r, content, msg);
 }
 
-static int search_udp(const char *content, char *out_ip, size_t iplen, u16 *out_port) {
+/* Registers (T_REGN) or de-registers (T_DEREGN) names in as few PDUs as
+   they fit in, one shard at a time.  A lost reply resends the PDU, which
+   the index treats as a repeat; a shard that stays silent gets nothing
+   more this time.  Names a shard does not own go again after the map is
+   refetched.  done (if not NULL) gets 1 for every name the index took.
+   Returns how many were not accepted. */
+static int index_batch(char type, char (*names)[NAME_LEN + 1], int n, char *done) {
+    int *todo, *owner, *again, sent[BATCH_PAYLOAD / 2];
+    char mark[BATCH_PAYLOAD / 2];
+    int ntodo = n, failed = 0, round, i, k;
+    char msg[UDP_BUFLEN];
+
+    if (done) memset(done, 0, (size_t)(n > 0 ? n : 0));
+    if (n <= 0) return 0;
+    todo = malloc((size_t)n * sizeof(int));
+    owner = malloc((size_t)n * sizeof(int));
+    again = malloc((size_t)n * sizeof(int));
+    if (!todo || !owner || !again) { free(todo); free(owner); free(again); return n; }
+    if (type == T_REGN) ensure_tcp_listen();
+    for (i = 0; i < n; i++) todo[i] = i;
+
+    for (round = 0; round < 3 && ntodo > 0; round++) {
+        int nagain = 0;
+        if (round) fetch_shard_map();
+        for (i = 0; i < ntodo; i++) owner[i] = shardMap.n ? shard_owner(&shardMap, names[todo[i]]) : 0;
+        for (k = 0; k < shard_count(); k++) {
+            int pos = 0, down = 0;
+            while (pos < ntodo) {
+                UdpPDU p, r;
+                const char *f;
+                int off, nsent = 0, tries, ok = 0, nfail, j;
+
+                memset(&p, 0, sizeof(p));
+                p.type = type;
+                off = sprintf(p.data, "%s", peerName) + 1;
+                if (type == T_REGN) off += sprintf(p.data + off, "%u", (unsigned)listen_port) + 1;
+                for (; pos < ntodo; pos++) {
+                    int len = (int)strlen(names[todo[pos]]) + 1;
+                    if (owner[pos] != k) continue;
+                    if (down) { failed++; continue; }
+                    if (off + len > BATCH_PAYLOAD) break;
+                    memcpy(p.data + off, names[todo[pos]], (size_t)len);
+                    off += len;
+                    sent[nsent++] = todo[pos];
+                }
+                if (!nsent) break;
+                for (tries = 0; tries < 3 && !ok; tries++) {
+                    memset(&r, 0, sizeof(r));
+                    ok = index_request(&p, &r, names[sent[0]], msg);
+                    if (r.type == T_ERR) break;
+                }
+                if (!ok || r.type != T_ACK) {
+                    printf("Batch %s: %s\n", type == T_REGN ? "register" : "de register", msg);
+                    failed += nsent;
+                    down = 1;
+                    continue;
+                }
+                /* "done\0failed\0", the moved names, "", then the failed
+                   names, each list in the order sent */
+                memset(mark, 0, sizeof(mark));
+                f = r.data + strlen(r.data) + 1;
+                nfail = atoi(f);
+                failed += nfail;
+                f += strlen(f) + 1;
+                for (j = 0; f < r.data + UDP_BUFLEN && *f; f += strlen(f) + 1) {
+                    while (j < nsent && strcmp(names[sent[j]], f) != 0) j++;
+                    if (j < nsent) { mark[j] = 1; again[nagain++] = sent[j++]; }
+                }
+                for (j = 0, f++; f < r.data + UDP_BUFLEN && *f; f += strlen(f) + 1) {
+                    while (j < nsent && strcmp(names[sent[j]], f) != 0) j++;
+                    if (j < nsent) { mark[j++] = 2; nfail--; }
+                }
+                /* an index that does not list its failures confirms nothing */
+                for (j = 0; done && nfail <= 0 && j < nsent; j++) if (!mark[j]) done[sent[j]] = 1;
+            }
+        }
+        memcpy(todo, again, (size_t)nagain * sizeof(int));
+        ntodo = nagain;
+    }
+    free(todo);
+    free(owner);
+    free(again);
+    return failed + ntodo;
+}
+
+static int search_udp(const char *content, char *out_ip, size_t iplen, u16 *out_port, char *msg) {
     UdpPDU p, r;
     int i;
     memset(&p, 0, sizeof(p)); p.type = T_SEARCH; sprintf(p.data, "%s", content);
-    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return 0; }
-    memset(&r, 0, sizeof(r));
-    if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); return 0; }
-    if (r.type == T_ERR) { printf("%s\n", r.data); return 0; }
+    if (!index_request(&p, &r, content, msg)) return 0;
     i = 0;
     strncpy(out_ip, r.data, iplen - 1);
     out_ip[iplen - 1] = '\0';
     while (i < UDP_BUFLEN && r.data[i] != '\0') i++;
-    if (i >= UDP_BUFLEN) return 0;
+    if (i >= UDP_BUFLEN - 1) { strcpy(msg, "Bad search reply"); return 0; }
     i++;
     *out_port = (u16)atoi(&r.data[i]);
     return 1;
 }
 
-static int tcp_download(const char *server_ip, u16 server_port, const char *content) {
+static int catalog_push(CatalogEntry **arr, int *n, int *cap, char op, const char *content, const char *peer) {
+    CatalogEntry *e;
+    if (*n == *cap) {
+        int ncap = *cap ? *cap * 2 : 256;
+        CatalogEntry *na = (CatalogEntry *)realloc(*arr, (size_t)ncap * sizeof(**arr));
+        if (!na) return 0;
+        *arr = na;
+        *cap = ncap;
+    }
+    e = &(*arr)[(*n)++];
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    strncpy(e->content, content, NAME_LEN);
+    strncpy(e->peer, peer, NAME_LEN);
+    return 1;
+}
+
+static unsigned long replica_hash(const char *content, const char *peer, int shard) {
+    return (name_hash(content) * 31 + name_hash(peer)) ^ (unsigned long)shard;
+}
+
+/* replicaSet slot holding (content, peer) from shard, or the empty slot
+   where it would go. */
+static unsigned long replica_slot(const char *content, const char *peer, int shard) {
+    unsigned long mask = (unsigned long)replicaSetSize - 1, slot = replica_hash(content, peer, shard) & mask;
+    while (replicaSet[slot]) {
+        const CatalogEntry *e = &replica[replicaSet[slot] - 1];
+        if (e->shard == shard && strcmp(e->content, content) == 0 && strcmp(e->peer, peer) == 0) break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int replica_find(const char *content, const char *peer, int shard) {
+    if (!replicaSetSize) return -1;
+    return replicaSet[replica_slot(content, peer, shard)] - 1;
+}
+
+/* Rebuilds replicaSet after the replica moved around or grew; on failure
+   the old one is kept. */
+static int replica_reindex(void) {
+    int size = capReplica * 2, i;
+    if (size != replicaSetSize) {
+        int *set = calloc((size_t)(size ? size : 1), sizeof(*set));
+        if (!set) return 0;
+        free(replicaSet);
+        replicaSet = set;
+        replicaSetSize = size;
+    } else if (size) {
+        memset(replicaSet, 0, (size_t)size * sizeof(*replicaSet));
+    }
+    for (i = 0; i < nReplica; i++) replicaSet[replica_slot(replica[i].content, replica[i].peer, replica[i].shard)] = i + 1;
+    return 1;
+}
+
+static void replica_add(const char *content, const char *peer, int shard) {
+    int grow = nReplica == capReplica;
+    if (!catalog_push(&replica, &nReplica, &capReplica, ' ', content, peer)) return;
+    replica[nReplica - 1].shard = shard;
+    if (!grow) replicaSet[replica_slot(content, peer, shard)] = nReplica;
+    else if (!replica_reindex()) nReplica--;
+}
+
+/* Backward-shift delete, then the last entry moves into position pos. */
+static void replica_del(int pos) {
+    unsigned long mask = (unsigned long)replicaSetSize - 1, hole, j;
+    hole = j = replica_slot(replica[pos].content, replica[pos].peer, replica[pos].shard);
+    for (;;) {
+        const CatalogEntry *e;
+        unsigned long home;
+        j = (j + 1) & mask;
+        if (!replicaSet[j]) break;
+        e = &replica[replicaSet[j] - 1];
+        home = replica_hash(e->content, e->peer, e->shard) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            replicaSet[hole] = replicaSet[j];
+            hole = j;
+        }
+    }
+    replicaSet[hole] = 0;
+    nReplica--;
+    if (pos != nReplica) {
+        replica[pos] = replica[nReplica];
+        replicaSet[replica_slot(replica[pos].content, replica[pos].peer, replica[pos].shard)] = pos + 1;
+    }
+}
+
+static void replica_apply(const CatalogEntry *e, int shard) {
+    int i = replica_find(e->content, e->peer, shard);
+    if (e->op == '+' && i < 0) replica_add(e->content, e->peer, shard);
+    else if (e->op == '-' && i >= 0) replica_del(i);
+    worker_note("=%c\t%d\t%s\t%s", e->op, shard, e->content, e->peer);
+}
+
+/* Drops shard k's part of the replica ahead of a snapshot. */
+static void replica_clear(int k) {
+    int i;
+    for (i = nReplica - 1; i >= 0; i--) if (replica[i].shard == k) replica[i] = replica[--nReplica];
+    replica_reindex();
+    worker_note("=C\t%d", k);
+}
+
+/* Sends sync request p to shard k and waits for the page answering seq,
+   asking again when it does not come.  Returns the page type, T_ERR, or
+   0 when the shard stays silent. */
+static char sync_request(int k, const UdpPDU *p, unsigned long seq, UdpPDU *r) {
+    int tries;
+    for (tries = 0; tries < SYNC_TRIES; tries++) {
+        double deadline = mono_now() + SYNC_RETRY_MS / 1000.0, left;
+        if (sendto(udp_sock, p, sizeof(*p), 0, (const struct sockaddr *)shard_addr(k), sizeof(struct sockaddr_in)) < 0) { perror("sendto"); return 0; }
+        while ((left = deadline - mono_now()) > 0 && wait_readable(udp_sock, (int)(left * 1000) + 1)) {
+            char kind;
+            unsigned long epoch, from, to, rseq;
+            memset(r, 0, sizeof(*r));
+            if (recvfrom(udp_sock, r, sizeof(*r), 0, NULL, NULL) < 0) break;
+            r->data[UDP_BUFLEN - 1] = '\0';
+            if (r->type == T_ERR) return T_ERR;
+            if ((r->type == T_DELTA || r->type == T_DELTAEND) &&
+                sscanf(r->data, "%c %lu %lu %lu %lu", &kind, &epoch, &from, &to, &rseq) == 5 && rseq == seq) return r->type;
+        }
+    }
+    return 0;
+}
+
+/* Brings shard k's part of the replica up to date.  A round asks for the
+   changes since our version (or a snapshot) one page at a time, naming
+   where the last page ended, and stages the records until the last page
+   so a failed round leaves the replica as it was.  A snapshot is read
+   while the catalog keeps changing, so another round then catches up
+   from the version of its first page.  Returns 1 on success, 0 on
+   failure, -1 when the index does not know T_SYNC. */
+static int sync_shard(int k) {
+    UdpPDU p, r;
+    CatalogEntry *staged = NULL;
+    int nstaged = 0, capstaged = 0, ok = 0, round, i;
+    unsigned long seq = 0;
+
+    while (recv(udp_sock, &r, sizeof(r), MSG_DONTWAIT) > 0) {}
+    for (round = 0; round < SYNC_ROUNDS && ok == 0; round++) {
+        char kind = 0, type;
+        char lastContent[NAME_LEN + 1], lastPeer[NAME_LEN + 1];
+        unsigned long epoch = replicaEpoch[k], to = 0, cursor = 0;
+
+        nstaged = 0;
+        lastContent[0] = lastPeer[0] = '\0';
+        do {
+            char rkind;
+            unsigned long repoch, from, rto, rseq;
+            int off;
+
+            memset(&p, 0, sizeof(p));
+            p.type = T_SYNC;
+            off = sprintf(p.data, "%lu", replicaVersion[k]) + 1;
+            off += sprintf(p.data + off, "%lu", epoch) + 1;
+            off += sprintf(p.data + off, "%lu", ++seq) + 1;
+            if (kind) {
+                off += sprintf(p.data + off, "%c", kind) + 1;
+                off += sprintf(p.data + off, "%lu", to) + 1;
+                if (kind == 'D') sprintf(p.data + off, "%lu", cursor);
+                else {
+                    off += sprintf(p.data + off, "%s", lastContent) + 1;
+                    sprintf(p.data + off, "%s", lastPeer);
+                }
+            }
+            type = sync_request(k, &p, seq, &r);
+            if (type == 0 || type == T_ERR) break;
+            sscanf(r.data, "%c %lu %lu %lu %lu", &rkind, &repoch, &from, &rto, &rseq);
+            if (!kind) { kind = rkind; epoch = repoch; to = rto; cursor = from; }
+            off = (int)strlen(r.data) + 1;
+            while (off < UDP_BUFLEN && r.data[off] != '\0') {
+                char op = r.data[off++];
+                const char *content = r.data + off;
+                const char *peer;
+                off += (int)strlen(content) + 1;
+                if (off >= UDP_BUFLEN) break;
+                peer = r.data + off;
+                off += (int)strlen(peer) + 1;
+                catalog_push(&staged, &nstaged, &capstaged, op, content, peer);
+                cursor++;
+                strcpy(lastContent, content);
+                strcpy(lastPeer, peer);
+            }
+        } while (type == T_DELTA);
+
+        if (type == 0) { fprintf(stderr, "Catalog sync timed out\n"); break; }
+        if (type == T_ERR) { if (!kind) ok = -1; continue; }
+        if (kind == 'S') replica_clear(k);
+        for (i = 0; i < nstaged; i++) replica_apply(&staged[i], k);
+        replicaVersion[k] = to;
+        replicaEpoch[k] = epoch;
+        worker_note("=V\t%d\t%lu\t%lu", k, to, epoch);
+        if (kind == 'D') ok = 1;
+    }
+    free(staged);
+    return ok;
+}
+
+/* Syncs every shard of the current map and merges them in the replica.
+   Returns 1 when all synced, 0 if any failed, -1 for an unsharded index
+   without T_SYNC. */
+static int sync_catalog(void) {
+    int k, rc, ok = 1;
+    fetch_shard_map();
+    for (k = 0; k < shard_count(); k++) {
+        rc = sync_shard(k);
+        if (rc < 0 && !shardMap.n) return -1;
+        if (rc != 1) ok = 0;
+    }
+    return ok;
+}
+
+static int replica_cmp(const void *a, const void *b) {
+    const CatalogEntry *x = (const CatalogEntry *)a, *y = (const CatalogEntry *)b;
+    int c = strcmp(x->content, y->content);
+    return c ? c : strcmp(x->peer, y->peer);
+}
+
+/* Formats the next "content : host, host" line of the sorted replica for
+   entries whose content name contains filter (all when NULL), starting at
+   *pos.  Returns 0 when there are no more lines. */
+static int replica_line(int *pos, const char *filter, char *line, size_t len) {
+    int i = *pos;
+    size_t used;
+    while (i < nReplica && filter && !strstr(replica[i].content, filter)) i++;
+    if (i >= nReplica) { *pos = i; return 0; }
+    used = (size_t)sprintf(line, "%s : %s", replica[i].content, replica[i].peer);
+    for (i++; i < nReplica && strcmp(replica[i].content, replica[i - 1].content) == 0; i++) {
+        /* While a shard hands entries over, both old and new owner list them. */
+        if (strcmp(replica[i].peer, replica[i - 1].peer) == 0) continue;
+        if (used + strlen(replica[i].peer) + 3 > len) continue;
+        used += (size_t)sprintf(line + used, ", %s", replica[i].peer);
+    }
+    *pos = i;
+    return 1;
+}
+
+static void replica_sort(void) {
+    qsort(replica, (size_t)nReplica, sizeof(*replica), replica_cmp);
+    replica_reindex();
+}
+
+static void print_replica(const char *filter) {
+    char line[REPLICA_LINE_MAX + 1];
+    int pos = 0, shown = 0;
+    replica_sort();
+    while (replica_line(&pos, filter, line, sizeof(line))) { printf(" - %s\n", line); shown++; }
+    if (!shown) printf("(none)\n");
+}
+
+/* T_LIST fallback for an index without T_SYNC. */
+static void list_full_udp(void) {
+    UdpPDU p, r;
+    int i;
+    memset(&p, 0, sizeof(p)); p.type = T_LIST;
+    if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) { perror("sendto"); return; }
+    while (1) {
+        if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); break; }
+        if (r.type == T_LISTEND && r.data[0] == '\0') { printf("(none)\n"); break; }
+        for (i = 0; i < UDP_BUFLEN; ) {
+            if (r.data[i] == '\0') break;
+            printf(" - %s\n", &r.data[i]);
+            while (i < UDP_BUFLEN && r.data[i] != '\0') i++;
+            if (i < UDP_BUFLEN && r.data[i] == '\0') i++;
+        }
+        if (r.type == T_LISTEND) break;
+    }
+}
+
+/* A download is written to ".name.part" and renamed once complete, so
+   neither the share watcher nor an uploader ever sees a partial file. */
+static void part_name(char *out, const char *content) {
+    sprintf(out, ".%s.part", content);
+}
+
+static int download_abort(int cs, FILE *fp, const char *part) {
+    if (fp) { fclose(fp); unlink(part); }
+    if (cs >= 0) close(cs);
+    return 0;
+}
+
+static int download_fail(char *msg, const char *what, int cs, FILE *fp, const char *part) {
+    sprintf(msg, "%s: %s", what, strerror(errno));
+    return download_abort(cs, fp, part);
+}
+
+/* Collects T_ZCHUNK frames in zbuf until the packed block is complete,
+   then writes it out expanded; returns 0 on a malformed block. */
+static int unpack_frame(char *zbuf, int *zgot, const char *data, int len, FILE *fp) {
+    unsigned char raw[ZBLOCK_MAX];
+    u16 rawlen, packed;
+    if (*zgot + len > ZBUF_LEN) return 0;
+    memcpy(zbuf + *zgot, data, (size_t)len);
+    *zgot += len;
+    if (*zgot < ZHDR_LEN) return 1;
+    memcpy(&rawlen, zbuf, sizeof(rawlen));
+    memcpy(&packed, zbuf + sizeof(rawlen), sizeof(packed));
+    if (rawlen > ZBLOCK_MAX || ZHDR_LEN + packed > ZBUF_LEN || *zgot > ZHDR_LEN + packed) return 0;
+    if (*zgot < ZHDR_LEN + packed) return 1;
+    if (lz_decompress((const unsigned char *)zbuf + ZHDR_LEN, packed, raw, rawlen) != rawlen) return 0;
+    fwrite(raw, 1, rawlen, fp);
+    *zgot = 0;
+    return 1;
+}
+
+/* Fetches content from a hosting peer into the current directory; msg
+   (UDP_BUFLEN bytes) says what happened either way. */
+static int tcp_fetch(const char *server_ip, u16 server_port, const char *content, char *msg) {
     int cs;
     struct sockaddr_in sa;
     char hdr_type;
@@ -220,48 +1386,779 @@ static int tcp_download(const char *server_ip, u16 server_port, const char *cont
     char rh_type;
     u16 rh_len;
     char buf[UDP_BUFLEN];
+    char part[NAME_LEN + 8];
+    char zbuf[ZBUF_LEN];
+    int zgot = 0;
+    const char *prio = getenv("P2P_DL_PRIO");
 
-    cs = socket(AF_INET, SOCK_STREAM, 0); if (cs < 0) { perror("socket"); return 0; }
+    part_name(part, content);
+    cs = socket(AF_INET, SOCK_STREAM, 0); if (cs < 0) return download_fail(msg, "socket", -1, NULL, part);
     memset(&sa, 0, sizeof(sa)); sa.sin_family = AF_INET; sa.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) != 1) { perror("inet_pton"); close(cs); return 0; }
-    if (connect(cs, (struct sockaddr *)&sa, sizeof(sa)) < 0) { perror("connect"); close(cs); return 0; }
+    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) != 1) { strcpy(msg, "Bad host address"); close(cs); return 0; }
+    if (connect(cs, (struct sockaddr *)&sa, sizeof(sa)) < 0) return download_fail(msg, "connect", cs, NULL, part);
 
+    /* "name\0", the upload class to ask for (P2P_DL_PRIO, normal by
+       default) and "lz\0" unless P2P_COMPRESS=0. */
     hdr_type = T_REQ; hdr_len = (u16)(strlen(content) + 1);
+    memcpy(buf, content, hdr_len);
+    if (!(prio && *prio && strlen(prio) < 8)) prio = NULL;
+    hdr_len = (u16)(hdr_len + 1 + (prio ? sprintf(buf + hdr_len, "%s", prio) : sprintf(buf + hdr_len, "%d", PRIO_NORMAL)));
+    if (compress_enabled()) hdr_len = (u16)(hdr_len + 1 + sprintf(buf + hdr_len, "lz"));
     if (send(cs, &hdr_type, sizeof(hdr_type), 0) < 0 ||
         send(cs, &hdr_len, sizeof(hdr_len), 0) < 0 ||
-        send(cs, content, hdr_len, 0) < 0) { perror("send"); close(cs); return 0; }
+        send(cs, buf, hdr_len, 0) < 0) return download_fail(msg, "send", cs, NULL, part);
 
-    fp = fopen(content, "wb"); if (!fp) { perror("fopen"); close(cs); return 0; }
+    fp = fopen(part, "wb"); if (!fp) return download_fail(msg, "fopen", cs, NULL, part);
 
     while (1) {
-        if (!recv_n(cs, &rh_type, sizeof(rh_type)) || !recv_n(cs, &rh_len, sizeof(rh_len))) { perror("recv"); fclose(fp); close(cs); return 0; }
+        if (!recv_n(cs, &rh_type, sizeof(rh_type)) || !recv_n(cs, &rh_len, sizeof(rh_len))) return download_fail(msg, "recv", cs, fp, part);
         if (rh_type == T_ERR) {
-            if (rh_len > 0 && rh_len <= UDP_BUFLEN) {
-                if (!recv_n(cs, buf, rh_len)) perror("recv");
-                fwrite(buf, 1, rh_len, stdout); fputc('\n', stdout);
-            }
-            fclose(fp); close(cs); return 0;
+            strcpy(msg, "Host refused");
+            if (rh_len > 0 && rh_len < UDP_BUFLEN && recv_n(cs, msg, rh_len)) msg[rh_len] = '\0';
+            return download_abort(cs, fp, part);
         }
-        if (rh_len > UDP_BUFLEN) { fprintf(stderr, "Bad length\n"); fclose(fp); close(cs); return 0; }
+        if (rh_len > UDP_BUFLEN) { strcpy(msg, "Bad length"); return download_abort(cs, fp, part); }
         if (rh_len > 0) {
-            if (!recv_n(cs, buf, rh_len)) { perror("recv"); fclose(fp); close(cs); return 0; }
-            fwrite(buf, 1, rh_len, fp);
+            if (!recv_n(cs, buf, rh_len)) return download_fail(msg, "recv", cs, fp, part);
+            if (rh_type != T_ZCHUNK) fwrite(buf, 1, rh_len, fp);
+            else if (!unpack_frame(zbuf, &zgot, buf, rh_len, fp)) { strcpy(msg, "Bad compressed block"); return download_abort(cs, fp, part); }
         }
+        TRACE_MARK(TR_CHUNK, rh_len, NULL);
         if (rh_type == T_FINAL) break;
     }
+    if (zgot) { strcpy(msg, "Transfer ended inside a compressed block"); return download_abort(cs, fp, part); }
 
-    fclose(fp);
+    if (fclose(fp) != 0) { download_fail(msg, "fclose", cs, NULL, part); unlink(part); return 0; }
+    if (rename(part, content) != 0) { download_fail(msg, "rename", cs, NULL, part); unlink(part); return 0; }
     close(cs);
-    printf("File '%s' received\n", content);
+    sprintf(msg, "File '%s' received", content);
+    return 1;
+}
+
+static int tcp_download(const char *server_ip, u16 server_port, const char *content, char *msg) {
+    int ok;
+    TRACE_BEGIN(TR_DOWNLOAD, server_port, content);
+    ok = tcp_fetch(server_ip, server_port, content, msg);
+    TRACE_END(TR_DOWNLOAD, ok);
+    return ok;
+}
+
+/* Sends the T_DEREG for everything hosted here and says T_BYE. */
+static void leave_index(void) {
+    UdpPDU bye;
+    int i, failed;
+    if (nContent > 0) {
+        failed = index_batch(T_DEREGN, contentList, nContent, NULL);
+        printf("De registered %d content(s)", nContent - failed);
+        if (failed) printf(", %d failed", failed);
+        printf("\n");
+    }
+    memset(&bye, 0, sizeof(bye)); bye.type = T_BYE;
+    strncpy(bye.data, peerName, sizeof(bye.data) - 1);
+    for (i = 0; i < shard_count(); i++) sendto(udp_sock, &bye, sizeof(bye), 0, (const struct sockaddr *)shard_addr(i), sizeof(struct sockaddr_in));
+}
+
+/* ---- Daemon mode: commands over a Unix socket or from a batch file ---- */
+
+static void ctl_on_signal(int sig) { (void)sig; ctl_stop = 1; }
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+static CtlClient *ctl_client(long id) {
+    int i;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) if (id && ctlClients[i].id == id) return &ctlClients[i];
+    return NULL;
+}
+
+static int ctl_downloads(long owner) {
+    int i, n = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid && ctlWorkers[i].kind == 'G' && (!owner || ctlWorkers[i].owner == owner)) n++;
+    return n;
+}
+
+/* Commands of owner still running in a worker. */
+static int ctl_pending(long owner) {
+    int i, n = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid && ctlWorkers[i].owner == owner) n++;
+    return n;
+}
+
+/* Every reply is one line, "[#tag ]OK text", "[#tag ]ERR text" or, ahead of
+   an OK, "[#tag ]* data".  A client that went away is skipped. */
+static void ctl_reply(long id, const char *tag, const char *status, const char *fmt, ...) {
+    CtlClient *cl = ctl_client(id);
+    char line[REPLICA_LINE_MAX + 2 * CTL_TAG_LEN];
+    int n = 0, i;
+    va_list ap;
+    if (!cl) return;
+    if (tag[0]) n = sprintf(line, "#%s ", tag);
+    n += sprintf(line + n, "%s ", status);
+    va_start(ap, fmt);
+    vsnprintf(line + n, sizeof(line) - (size_t)n - 1, fmt, ap);
+    va_end(ap);
+    for (i = n; line[i]; i++) if (line[i] == '\n' || line[i] == '\r') line[i] = ' ';
+    line[i++] = '\n';
+    write_all(cl->out, line, (size_t)i);
+}
+
+static CtlClient *ctl_open(int in, int out) {
+    int i;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        CtlClient *cl = &ctlClients[i];
+        if (cl->id) continue;
+        memset(cl, 0, sizeof(*cl));
+        cl->in = in;
+        cl->out = out;
+        cl->id = ctlNextId++;
+        return cl;
+    }
+    return NULL;
+}
+
+/* Frees a client once its input is done and nothing it started is pending. */
+static void ctl_release(CtlClient *cl) {
+    if (!cl->id || !cl->eof || cl->len || cl->stalled || cl->waiting || ctl_pending(cl->id)) return;
+    if (cl->in >= 0) close(cl->in);
+    if (cl->out >= 0 && cl->out != cl->in && cl->out != ctl_out) close(cl->out);
+    memset(cl, 0, sizeof(*cl));
+}
+
+static void ctl_listen_unix(const char *path) {
+    struct sockaddr_un a;
+    struct stat st;
+    if (strlen(path) >= sizeof(a.sun_path)) { fprintf(stderr, "Control socket path too long\n"); exit(1); }
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, path);
+    ctl_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl_listen < 0) die("socket(control)");
+    /* A socket left by an earlier run is replaced unless a daemon answers on it. */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(ctl_listen, (struct sockaddr *)&a, sizeof(a)) == 0) { fprintf(stderr, "%s is in use\n", path); exit(1); }
+        close(ctl_listen);
+        ctl_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (ctl_listen < 0) die("socket(control)");
+        unlink(path);
+    }
+    if (bind(ctl_listen, (struct sockaddr *)&a, sizeof(a)) < 0) die("bind(control)");
+    chmod(path, 0600);
+    if (listen(ctl_listen, CTL_MAX_CLIENTS) < 0) die("listen(control)");
+}
+
+static void ctl_accept(void) {
+    int cs = accept(ctl_listen, NULL, NULL);
+    if (cs < 0) { perror("accept(control)"); return; }
+    if (!ctl_open(cs, cs)) {
+        const char *busy = "ERR Too many control connections\n";
+        write_all(cs, busy, strlen(busy));
+        close(cs);
+    }
+}
+
+static int  watch_worker(char *msg);
+static void watch_note(const char *line);
+static void watch_done(void);
+
+/* LIST in a worker: syncs (its "=" lines bring the daemon's replica along)
+   and writes the matching catalog lines. */
+static int ctl_worker_list(const char *filter, char *msg) {
+    char line[REPLICA_LINE_MAX + 4];
+    int pos = 0, shown = 0, rc = sync_catalog();
+    if (rc != 1) { strcpy(msg, rc < 0 ? "Index does not support catalog sync" : "Catalog sync failed"); return 0; }
+    replica_sort();
+    line[0] = '*';
+    line[1] = ' ';
+    while (replica_line(&pos, filter[0] ? filter : NULL, line + 2, sizeof(line) - 3)) {
+        size_t n = strlen(line);
+        line[n++] = '\n';
+        write_all(ctl_worker, line, n);
+        shown++;
+    }
+    sprintf(msg, "%d entries from %d index shard(s)", shown, shard_count());
+    return 1;
+}
+
+/* Command worker: its own UDP socket for the index; a GET then fetches
+   over TCP and registers the file, so the daemon only has to host it. */
+static void ctl_worker_main(int fd, char kind, const char *name) {
+    char msg[2 * UDP_BUFLEN], rmsg[UDP_BUFLEN], ip[INET_ADDRSTRLEN], line[2 * UDP_BUFLEN + 8];
+    u16 port = 0;
+    int i, ok = 0;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    if (ctl_listen >= 0) close(ctl_listen);
+    if (tcp_listen >= 0) close(tcp_listen);
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (!ctlClients[i].id) continue;
+        if (ctlClients[i].in >= 0) close(ctlClients[i].in);
+        if (ctlClients[i].out != ctlClients[i].in && ctlClients[i].out != ctl_out) close(ctlClients[i].out);
+    }
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid) close(ctlWorkers[i].fd);
+    for (i = 0; i < HOST_MAX_CONN; i++) if (hostConns[i].fd >= 0) close(hostConns[i].fd);
+    ctl_worker = fd;
+
+    close(udp_sock);
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sock < 0) sprintf(msg, "socket: %s", strerror(errno));
+    else if (kind == 'R') ok = register_content_udp(name, msg);
+    else if (kind == 'T') ok = dereg_content_udp(name, msg);
+    else if (kind == 'O') ok = ctl_worker_list(name, msg);
+    else if (kind == 'W') ok = watch_worker(msg);
+    else if ((ok = search_udp(name, ip, sizeof(ip), &port, msg)) != 0) {
+        if (kind == 'S') sprintf(msg, "%s %u", ip, (unsigned)port);
+        else if (!tcp_download(ip, port, name, msg)) ok = 0;
+        else if (!register_content_udp(name, rmsg)) { ok = 0; sprintf(msg, "Downloaded %s but register failed: %s", name, rmsg); }
+        else sprintf(msg, "%s from %s:%u", name, ip, (unsigned)port);
+    }
+    sprintf(line, "%s %s\n", ok ? "OK" : "ERR", msg);
+    write_all(fd, line, strlen(line));
+    _exit(ok ? 0 : 1);
+}
+
+/* 1 when a command has to wait: every worker is busy, a LIST is already
+   running, or a command on the same name has not answered yet.  REG, DEREG
+   and GET also wait for a share flush, which may hold any name. */
+static int ctl_busy(char kind, const char *name) {
+    int i, idle = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) {
+        const CtlWorker *w = &ctlWorkers[i];
+        if (!w->pid) { idle = 1; continue; }
+        if (kind == 'O' ? w->kind == 'O' : (w->kind != 'O' && strcmp(w->name, name) == 0)) return 1;
+        if (w->kind == 'W' && (kind == 'R' || kind == 'T' || kind == 'G')) return 1;
+    }
+    return !idle;
+}
+
+/* Names a REG or GET in flight will add to contentList. */
+static int ctl_adding(void) {
+    int i, n = 0;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) if (ctlWorkers[i].pid && (ctlWorkers[i].kind == 'R' || ctlWorkers[i].kind == 'G')) n++;
+    return n;
+}
+
+/* Forks the worker for a command ctl_busy() let through; 0 if it could
+   not (owner has been told). */
+static int ctl_spawn(long owner, const char *tag, char kind, const char *name) {
+    CtlWorker *w = NULL;
+    int i, fds[2];
+    pid_t pid;
+
+    for (i = 0; i < CTL_MAX_WORKERS && !w; i++) if (!ctlWorkers[i].pid) w = &ctlWorkers[i];
+    if (pipe(fds) < 0) { ctl_reply(owner, tag, "ERR", "pipe: %s", strerror(errno)); return 0; }
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        ctl_reply(owner, tag, "ERR", "fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        TRACE_FORK();
+        ctl_worker_main(fds[1], kind, name);
+    }
+    close(fds[1]);
+    memset(w, 0, sizeof(*w));
+    w->pid = pid;
+    w->fd = fds[0];
+    w->kind = kind;
+    w->owner = owner;
+    w->gen = replicaGen;
+    strcpy(w->tag, tag);
+    strcpy(w->name, name);
+    return 1;
+}
+
+static void ctl_drain(CtlClient *cl);
+
+/* Clients blocked on WAIT or on a worker slot get another go. */
+static void ctl_wake(void) {
+    int i;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        CtlClient *cl = &ctlClients[i];
+        if (!cl->id) continue;
+        if (cl->waiting && !ctl_pending(cl->id)) {
+            cl->waiting = 0;
+            ctl_reply(cl->id, cl->wtag, "OK", "Commands finished");
+        }
+        cl->stalled = 0;
+        ctl_drain(cl);
+    }
+}
+
+/* A "=" line from a worker: replays its shard map or replica change here.
+   Replica changes are dropped once this replica was reset after the fork,
+   unless the worker went through the same reset. */
+static void ctl_worker_note(CtlWorker *w, char *line) {
+    char *f[MAX_SHARDS + 4];
+    int n = 0, k;
+    char *p = line;
+    while (n < MAX_SHARDS + 4) {
+        f[n++] = p;
+        if ((p = strchr(p, '\t')) == NULL) break;
+        *p++ = '\0';
+    }
+    if (line[1] == 'M' && n >= 3) {
+        ShardMap m;
+        unsigned long gen = replicaGen;
+        memset(&m, 0, sizeof(m));
+        m.version = strtoul(f[1], NULL, 10);
+        m.n = atoi(f[2]);
+        if (m.n < 0 || m.n > MAX_SHARDS || n != m.n + 3) return;
+        for (k = 0; k < m.n; k++) {
+            if (strlen(f[k + 3]) >= SHARD_ADDR_LEN) return;
+            strcpy(m.addr[k], f[k + 3]);
+        }
+        shard_map_build(&m);
+        if (shard_map_use(&m) && w->gen == gen) w->gen = replicaGen;
+        return;
+    }
+    if (n < 2 || w->gen != replicaGen || (k = atoi(f[1])) < 0 || k >= MAX_SHARDS) return;
+    if (line[1] == 'C') replica_clear(k);
+    else if (line[1] == 'V' && n == 4) {
+        replicaVersion[k] = strtoul(f[2], NULL, 10);
+        replicaEpoch[k] = strtoul(f[3], NULL, 10);
+    } else if ((line[1] == '+' || line[1] == '-') && n == 4) {
+        CatalogEntry e;
+        memset(&e, 0, sizeof(e));
+        e.op = line[1];
+        strncpy(e.content, f[2], NAME_LEN);
+        strncpy(e.peer, f[3], NAME_LEN);
+        replica_apply(&e, k);
+    }
+}
+
+/* Reads what a worker wrote; at its end applies the result and replies. */
+static void ctl_worker_read(CtlWorker *w) {
+    ssize_t r = read(w->fd, w->line + w->len, sizeof(w->line) - 1 - (size_t)w->len);
+    const char *text;
+    char *start, *nl;
+    int ok;
+
+    if (r > 0) {
+        w->len += (int)r;
+        start = w->line;
+        while ((nl = memchr(start, '\n', (size_t)(w->line + w->len - start))) != NULL) {
+            *nl = '\0';
+            if (start[0] == '*' && start[1] == ' ' && w->kind == 'W') watch_note(start + 2);
+            else if (start[0] == '*' && start[1] == ' ') ctl_reply(w->owner, w->tag, "*", "%s", start + 2);
+            else if (start[0] == '=') ctl_worker_note(w, start);
+            else { strncpy(w->result, start, sizeof(w->result) - 1); w->result[sizeof(w->result) - 1] = '\0'; }
+            start = nl + 1;
+        }
+        w->len -= (int)(start - w->line);
+        memmove(w->line, start, (size_t)w->len);
+        if (w->len == (int)sizeof(w->line) - 1) w->len = 0;
+        return;
+    }
+    close(w->fd);
+    waitpid(w->pid, NULL, 0);
+    if (w->kind == 'W') {
+        memset(w, 0, sizeof(*w));
+        watch_done();
+        ctl_wake();
+        return;
+    }
+    ok = strncmp(w->result, "OK ", 3) == 0;
+    text = ok ? w->result + 3 : strncmp(w->result, "ERR ", 4) == 0 ? w->result + 4 : "Worker died";
+    if (!ok && w->kind == 'G') {
+        char part[NAME_LEN + 8];
+        part_name(part, w->name);
+        unlink(part);
+    }
+    if (ok && (w->kind == 'R' || w->kind == 'G') && !content_add(w->name)) { ok = 0; text = "Content table full"; }
+    if (ok && w->kind == 'T') content_remove(w->name);
+    ctl_reply(w->owner, w->tag, ok ? "OK" : "ERR", "%s", text);
+    memset(w, 0, sizeof(*w));
+    ctl_wake();
+}
+
+/* Runs one command line; returns 0 if it has to be retried later. */
+static int ctl_exec(CtlClient *cl, const char *text) {
+    char buf[CTL_BUF + 1], tag[CTL_TAG_LEN + 1], cmd[16], arg[CTL_BUF], extra[2];
+    char *line = buf;
+    int n, i;
+    long id = cl->id;
+
+    strcpy(buf, text);
+    tag[0] = '\0';
+    while (isspace((unsigned char)*line)) line++;
+    if (*line == '\0') return 1;
+    if (*line == '#') {
+        for (i = 0, line++; *line && !isspace((unsigned char)*line); line++) if (i < CTL_TAG_LEN) tag[i++] = *line;
+        tag[i] = '\0';
+    }
+    arg[0] = '\0';
+    n = sscanf(line, "%15s %1023s %1s", cmd, arg, extra);
+    if (n < 1) { ctl_reply(id, tag, "ERR", "Missing command"); return 1; }
+    for (i = 0; cmd[i]; i++) cmd[i] = (char)toupper((unsigned char)cmd[i]);
+    if (n == 3) { ctl_reply(id, tag, "ERR", "Too many arguments"); return 1; }
+    if (strlen(arg) > NAME_LEN) { ctl_reply(id, tag, "ERR", "Name longer than %d chars", NAME_LEN); return 1; }
+
+    if (strcmp(cmd, "REG") == 0 || strcmp(cmd, "DEREG") == 0 || strcmp(cmd, "SEARCH") == 0 || strcmp(cmd, "GET") == 0) {
+        if (n < 2) { ctl_reply(id, tag, "ERR", "%s needs a file name", cmd); return 1; }
+    }
+
+    /* Index commands and downloads run in workers and answer when done;
+       one on a name that already has a command running waits for it, so
+       a second GET of a name answers once the first has it hosted. */
+    if (strcmp(cmd, "REG") == 0 || strcmp(cmd, "DEREG") == 0 || strcmp(cmd, "SEARCH") == 0 ||
+        strcmp(cmd, "GET") == 0 || strcmp(cmd, "LIST") == 0) {
+        char kind = cmd[0] == 'D' ? 'T' : cmd[0] == 'L' ? 'O' : cmd[0];
+        struct stat st;
+        if (ctl_busy(kind, arg)) return 0;
+        if (kind == 'R' && (stat(arg, &st) != 0 || !S_ISREG(st.st_mode))) ctl_reply(id, tag, "ERR", "File not found in this directory, cannot host");
+        else if (kind == 'R' && content_find(arg) >= 0) ctl_reply(id, tag, "ERR", "Already registered locally");
+        else if (kind == 'G' && content_find(arg) >= 0) ctl_reply(id, tag, "ERR", "%s is already hosted here", arg);
+        else if ((kind == 'R' || kind == 'G') && nContent + ctl_adding() >= MAX_CONTENT) ctl_reply(id, tag, "ERR", "Content table full");
+        else ctl_spawn(id, tag, kind, arg);
+    }
+    else if (strcmp(cmd, "STATUS") == 0) {
+        int up = 0;
+        for (i = 0; i < HOST_MAX_CONN; i++) if (hostConns[i].state != CONN_FREE) up++;
+        ctl_reply(id, tag, "OK", "peer=%s port=%u hosted=%d downloads=%d uploads=%d shards=%d",
+                  peerName, (unsigned)listen_port, nContent, ctl_downloads(0), up, shard_count());
+    }
+    else if (strcmp(cmd, "WAIT") == 0) {
+        if (!ctl_pending(id)) ctl_reply(id, tag, "OK", "Commands finished");
+        else { cl->waiting = 1; strcpy(cl->wtag, tag); }
+    }
+    else if (strcmp(cmd, "QUIT") == 0) {
+        ctl_reply(id, tag, "OK", "Goodbye");
+        ctl_stop = 1;
+    }
+    else {
+        ctl_reply(id, tag, "ERR", "Unknown command %s", cmd);
+    }
     return 1;
 }
 
+/* Runs the complete lines in a client's buffer until it has to wait. */
+static void ctl_drain(CtlClient *cl) {
+    while (cl->id && !cl->stalled && !cl->waiting && !ctl_stop) {
+        char *nl = memchr(cl->buf, '\n', (size_t)cl->len);
+        int used;
+        if (!nl) {
+            if (cl->len == CTL_BUF) { ctl_reply(cl->id, "", "ERR", "Command too long"); cl->len = 0; continue; }
+            if (!cl->eof || cl->len == 0) break;
+            cl->buf[cl->len++] = '\n';          /* last line without a newline */
+            continue;
+        }
+        *nl = '\0';
+        if (nl > cl->buf && nl[-1] == '\r') nl[-1] = '\0';
+        if (!ctl_exec(cl, cl->buf)) { *nl = '\n'; cl->stalled = 1; break; }
+        used = (int)(nl + 1 - cl->buf);
+        cl->len -= used;
+        memmove(cl->buf, cl->buf + used, (size_t)cl->len);
+    }
+    ctl_release(cl);
+}
+
+static void ctl_read(CtlClient *cl) {
+    ssize_t r = read(cl->in, cl->buf + cl->len, (size_t)(CTL_BUF - cl->len));
+    if (r <= 0) cl->eof = 1;
+    else cl->len += (int)r;
+    ctl_drain(cl);
+}
+
+/* ---- Shared directory ---- */
+
+static const char *share_dir = NULL;
+static int    watch_fd = -1;
+static char (*watchDirty)[NAME_LEN + 1] = NULL;   /* names to reconcile */
+static int    nDirty = 0, dirtyCap = 0;
+static int    watchRescan = 0;                    /* inotify queue overflowed */
+static double watchFirst, watchLast;              /* first / latest pending event */
+static double watchRetry = 0;                     /* no flush before this */
+/* The flush a 'W' worker is running: names to register (the first
+   nWatchSend are sent, the rest wait for room) and to de-register. */
+static char (*watchReg)[NAME_LEN + 1] = NULL, (*watchDereg)[NAME_LEN + 1] = NULL;
+static int    nWatchReg = 0, nWatchSend = 0, nWatchDereg = 0;
+static int    watchFlushing = 0;
+static int    watchAdded, watchRemoved;
+
+static void watch_mark(const char *name) {
+    if (name[0] == '.' || strlen(name) > NAME_LEN) return;
+    if (nDirty && strcmp(watchDirty[nDirty - 1], name) == 0) return;
+    if (nDirty == dirtyCap) {
+        int cap = dirtyCap ? dirtyCap * 2 : CONTENT_INIT;
+        char (*d)[NAME_LEN + 1] = realloc(watchDirty, (size_t)cap * sizeof(*d));
+        if (!d) { watchRescan = 1; return; }
+        watchDirty = d;
+        dirtyCap = cap;
+    }
+    strcpy(watchDirty[nDirty++], name);
+}
+
+/* Marks every file in the directory and everything registered, so the
+   next flush reconciles the whole share. */
+static void share_scan(void) {
+    DIR *d = opendir(".");
+    struct dirent *de;
+    int i;
+    if (!d) { perror(share_dir); return; }
+    while ((de = readdir(d)) != NULL) watch_mark(de->d_name);
+    closedir(d);
+    for (i = 0; i < nContent; i++) watch_mark(contentList[i]);
+}
+
+static int name_cmp(const void *a, const void *b) { return strcmp((const char *)a, (const char *)b); }
+
+/* Hands the names that changed to a 'W' worker: it de-registers files
+   that went away, then registers new regular files.  contentList only
+   changes for names the index acknowledged; the rest stay dirty and go
+   again after WATCH_RETRY_MS.  Names another worker is busy with are
+   left to it. */
+static void watch_flush(void) {
+    int i, j, idle = 0;
+
+    if (watchRescan) { watchRescan = 0; share_scan(); }
+    if (!nDirty || watchFlushing) return;
+    for (i = 0; i < CTL_MAX_WORKERS; i++) idle |= !ctlWorkers[i].pid;
+    if (!idle) { watchRetry = mono_now() + WATCH_QUIET_MS / 1000.0; return; }
+    qsort(watchDirty, (size_t)nDirty, sizeof(watchDirty[0]), name_cmp);
+    watchReg = malloc((size_t)nDirty * sizeof(*watchReg));
+    watchDereg = malloc((size_t)nDirty * sizeof(*watchDereg));
+    if (!watchReg || !watchDereg) { free(watchReg); free(watchDereg); watchReg = watchDereg = NULL; watchRescan = 1; return; }
+    nWatchReg = nWatchDereg = 0;
+    for (i = 0; i < nDirty; i++) {
+        struct stat st;
+        int present, busy = 0;
+        if (i && strcmp(watchDirty[i], watchDirty[i - 1]) == 0) continue;
+        for (j = 0; j < CTL_MAX_WORKERS; j++) busy |= ctlWorkers[j].pid && strcmp(ctlWorkers[j].name, watchDirty[i]) == 0;
+        if (busy) continue;
+        present = stat(watchDirty[i], &st) == 0 && S_ISREG(st.st_mode);
+        if (present && content_find(watchDirty[i]) < 0) strcpy(watchReg[nWatchReg++], watchDirty[i]);
+        else if (!present && content_find(watchDirty[i]) >= 0) strcpy(watchDereg[nWatchDereg++], watchDirty[i]);
+    }
+    nDirty = 0;
+    nWatchSend = nWatchReg;
+    if (nWatchSend > MAX_CONTENT - nContent - ctl_adding()) nWatchSend = MAX_CONTENT - nContent - ctl_adding();   /* full: the rest wait */
+    if (nWatchSend < 0) nWatchSend = 0;
+    watchAdded = watchRemoved = 0;
+    watchFlushing = 1;
+    if (!nWatchReg && !nWatchDereg) watch_done();
+    else if (!ctl_spawn(0, "", 'W', "")) watch_done();
+}
+
+/* In the 'W' worker: the index round trips, reporting "+name" for each
+   name registered and "-name" for each one de-registered. */
+static int watch_worker(char *msg) {
+    char line[NAME_LEN + 8], *done = malloc((size_t)(nWatchReg > nWatchDereg ? nWatchReg : nWatchDereg) + 1);
+    int i, failed;
+
+    if (!done) { strcpy(msg, "Out of memory"); return 0; }
+    failed = index_batch(T_DEREGN, watchDereg, nWatchDereg, done);
+    for (i = 0; i < nWatchDereg; i++) {
+        if (!done[i]) continue;
+        sprintf(line, "* -%s\n", watchDereg[i]);
+        write_all(ctl_worker, line, strlen(line));
+    }
+    failed += index_batch(T_REGN, watchReg, nWatchSend, done);
+    for (i = 0; i < nWatchSend; i++) {
+        if (!done[i]) continue;
+        sprintf(line, "* +%s\n", watchReg[i]);
+        write_all(ctl_worker, line, strlen(line));
+    }
+    sprintf(msg, "%d not taken", failed);
+    free(done);
+    return 1;
+}
+
+/* A "+name" / "-name" line from the 'W' worker. */
+static void watch_note(const char *line) {
+    if (line[0] == '+' && content_add(line + 1)) watchAdded++;
+    else if (line[0] == '-' && content_find(line + 1) >= 0) { content_remove(line + 1); watchRemoved++; }
+}
+
+/* The flush ended: whatever did not get through is marked again. */
+static void watch_done(void) {
+    int i, before = nDirty, retry;
+    for (i = 0; i < nWatchReg; i++) if (content_find(watchReg[i]) < 0) watch_mark(watchReg[i]);
+    for (i = 0; i < nWatchDereg; i++) if (content_find(watchDereg[i]) >= 0) watch_mark(watchDereg[i]);
+    retry = nDirty - before;
+    if (retry) {
+        watchRetry = mono_now() + WATCH_RETRY_MS / 1000.0;
+        if (!before) watchFirst = watchLast = mono_now();
+    }
+    if (watchAdded || watchRemoved || retry) printf("Share %s: %d registered, %d de registered, %d to retry\n", share_dir, watchAdded, watchRemoved, retry);
+    free(watchReg);
+    free(watchDereg);
+    watchReg = watchDereg = NULL;
+    nWatchReg = nWatchSend = nWatchDereg = 0;
+    watchFlushing = 0;
+}
+
+/* Shutdown with a flush in flight: its names may be registered already,
+   so they are withdrawn with the rest. */
+static void watch_abort(void) {
+    int i;
+    for (i = 0; i < nWatchSend; i++) content_add(watchReg[i]);
+    nWatchReg = nWatchSend = 0;
+}
+
+static void watch_read(void) {
+    union { struct inotify_event ev; char buf[4096]; } u;
+    ssize_t r;
+    char *p;
+    double now = mono_now();
+    while ((r = read(watch_fd, u.buf, sizeof(u.buf))) > 0) {
+        for (p = u.buf; p < u.buf + r; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (!nDirty && !watchRescan) watchFirst = now;
+            if (ev->mask & IN_Q_OVERFLOW) watchRescan = 1;
+            else if (ev->len) watch_mark(ev->name);
+        }
+    }
+    watchLast = now;
+}
+
+/* Seconds until the pending changes are due, -1 if there are none. */
+static double watch_due(void) {
+    double now = mono_now(), t;
+    if ((!nDirty && !watchRescan) || watchFlushing) return -1;
+    t = watchLast + WATCH_QUIET_MS / 1000.0;
+    if (watchFirst + WATCH_MAX_MS / 1000.0 < t) t = watchFirst + WATCH_MAX_MS / 1000.0;
+    if (t < watchRetry) t = watchRetry;
+    return t > now ? t - now : 0;
+}
+
+/* Watches before scanning, so a file that lands mid-scan is not missed. */
+static void share_start(void) {
+    watch_fd = inotify_init();
+    if (watch_fd < 0) die("inotify_init");
+    fcntl(watch_fd, F_SETFL, fcntl(watch_fd, F_GETFL, 0) | O_NONBLOCK);
+    if (inotify_add_watch(watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) die("inotify_add_watch");
+    share_scan();
+    watch_flush();
+}
+
+/* Hosting, control clients and command workers share one select loop, so
+   registrations take effect for uploads at once and nothing ever sleeps:
+   every index round trip, share flushes included, runs in a worker.
+   Logs go to stderr; stdout carries only the batch file's replies. */
+static int daemon_main(const char *batch) {
+    struct sigaction sa;
+    char part[NAME_LEN + 8];
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ctl_on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    fflush(stdout);
+    ctl_out = dup(1);
+    if (ctl_out < 0 || dup2(2, 1) < 0) die("dup");
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    ensure_tcp_listen();
+    host_init();
+    if (ctl_path) ctl_listen_unix(ctl_path);
+    if (share_dir) share_start();
+    if (batch) {
+        int fd = strcmp(batch, "-") == 0 ? dup(0) : open(batch, O_RDONLY);
+        if (fd < 0) die(batch);
+        ctl_open(fd, ctl_out);
+    }
+    printf("Peer %s running headless%s%s%s%s\n", peerName, ctl_path ? ", control socket " : "", ctl_path ? ctl_path : "",
+           share_dir ? ", sharing " : "", share_dir ? share_dir : "");
+
+    while (!ctl_stop) {
+        fd_set rfds, wfds;
+        struct timeval tv;
+        int maxfd = -1;
+        double wait;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        wait = host_fill_fds(&rfds, &wfds, &maxfd);
+        if (watch_fd >= 0) {
+            double due = watch_due();
+            FD_SET(watch_fd, &rfds);
+            if (watch_fd > maxfd) maxfd = watch_fd;
+            if (due >= 0 && (wait < 0 || due < wait)) wait = due;
+        }
+        if (ctl_listen >= 0) { FD_SET(ctl_listen, &rfds); if (ctl_listen > maxfd) maxfd = ctl_listen; }
+        for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+            CtlClient *cl = &ctlClients[i];
+            if (!cl->id || cl->eof || cl->stalled || cl->waiting) continue;
+            FD_SET(cl->in, &rfds);
+            if (cl->in > maxfd) maxfd = cl->in;
+        }
+        for (i = 0; i < CTL_MAX_WORKERS; i++) {
+            if (!ctlWorkers[i].pid) continue;
+            FD_SET(ctlWorkers[i].fd, &rfds);
+            if (ctlWorkers[i].fd > maxfd) maxfd = ctlWorkers[i].fd;
+        }
+        if (wait >= 0) {
+            tv.tv_sec = (long)wait;
+            tv.tv_usec = (long)((wait - (double)tv.tv_sec) * 1e6);
+        }
+        if (select(maxfd + 1, &rfds, &wfds, NULL, wait >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+        }
+        for (i = 0; i < CTL_MAX_WORKERS; i++) {
+            if (ctlWorkers[i].pid && FD_ISSET(ctlWorkers[i].fd, &rfds)) ctl_worker_read(&ctlWorkers[i]);
+        }
+        for (i = 0; i < CTL_MAX_CLIENTS && !ctl_stop; i++) {
+            CtlClient *cl = &ctlClients[i];
+            if (cl->id && !cl->eof && !cl->stalled && !cl->waiting && FD_ISSET(cl->in, &rfds)) ctl_read(cl);
+        }
+        if (ctl_listen >= 0 && FD_ISSET(ctl_listen, &rfds)) ctl_accept();
+        if (watch_fd >= 0 && FD_ISSET(watch_fd, &rfds)) watch_read();
+        if (watch_due() == 0) watch_flush();
+        host_service(&rfds, &wfds);
+    }
+
+    /* Unfinished commands are told so; a REG or GET may have reached the
+       index already, so its name is withdrawn with the rest. */
+    for (i = 0; i < CTL_MAX_WORKERS; i++) {
+        CtlWorker *w = &ctlWorkers[i];
+        if (!w->pid) continue;
+        kill(w->pid, SIGTERM);
+        waitpid(w->pid, NULL, 0);
+        close(w->fd);
+        if (w->kind == 'G') { part_name(part, w->name); unlink(part); }
+        if (w->kind == 'R' || w->kind == 'G') content_add(w->name);
+        if (w->kind == 'W') watch_abort();
+        ctl_reply(w->owner, w->tag, "ERR", "Peer shutting down");
+    }
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (ctlClients[i].id && ctlClients[i].waiting) ctl_reply(ctlClients[i].id, ctlClients[i].wtag, "ERR", "Peer shutting down");
+    }
+    leave_index();
+    if (ctl_listen >= 0) { close(ctl_listen); unlink(ctl_path); }
+    printf("Goodbye\n");
+    return 0;
+}
+
 int main(int argc, char **argv) {
     const char *host;
-    int c;
+    const char *batch = NULL;
+    char msg[UDP_BUFLEN];
+    int c, i;
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <index_host> <peer_name>\n", argv[0]);
+    for (i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) ctl_path = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) batch = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) share_dir = argv[++i];
+        else break;
+    }
+    if (argc < 3 || i < argc) {
+        fprintf(stderr, "Usage: %s <index_host> <peer_name> [-c control_socket] [-b batch_file|-] [-s share_dir]\n", argv[0]);
         return 1;
     }
 
@@ -273,7 +2170,12 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    TRACE_OPEN(peerName);
+    if (share_dir && chdir(share_dir) < 0) die(share_dir);
+    host_file_init();
     create_udp_and_index(host, INDEX_PORT);
+    fetch_shard_map();
+    if (ctl_path || batch || share_dir) return daemon_main(batch);
     print_menu();
 
     while (1) {
@@ -284,8 +2186,6 @@ int main(int argc, char **argv) {
         if (c == 'R' || c == 'r') {
             char fname[NAME_LEN + 2];
             int ch;
-            int i;
-            int dup = 0;
             struct stat st;
 
             memset(fname, 0, sizeof(fname));
@@ -299,20 +2199,13 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            for (i = 0; i < nContent; i++) if (strcmp(contentList[i], fname) == 0) dup = 1;
-            if (dup) { printf("Already registered locally\n"); print_menu_delayed(); continue; }
+            if (content_find(fname) >= 0) { printf("Already registered locally\n"); print_menu_delayed(); continue; }
 
-            if (!register_content_udp(fname)) { print_menu_delayed(); continue; }
+            if (!register_content_udp(fname, msg)) { printf("Register error: %s\n", msg); print_menu_delayed(); continue; }
+            printf("%s\n", msg);
 
-            if (nContent < MAX_CONTENT) {
-                strncpy(contentList[nContent], fname, sizeof(contentList[nContent]) - 1);
-                nContent++;
-            }
-            ensure_tcp_listen();
-            if (host_pid <= 0) {
-                host_pid = fork();
-                if (host_pid == 0) { hosting_loop(); _exit(0); }
-            }
+            content_add(fname);
+            start_hosting();
             print_menu_delayed();
         }
         else if (c == 'D' || c == 'd') {
@@ -320,8 +2213,6 @@ int main(int argc, char **argv) {
             char ip[INET_ADDRSTRLEN];
             u16 port;
             int ch;
-            int already = 0;
-            int i;
 
             memset(query, 0, sizeof(query));
             memset(ip, 0, sizeof(ip));
@@ -329,70 +2220,53 @@ int main(int argc, char **argv) {
             if (scanf("%50s", query) != 1) { printf("Input error\n"); print_menu_delayed(); continue; }
             while ((ch = getchar()) != '\n' && ch != EOF) {}
 
-            if (!search_udp(query, ip, sizeof(ip), &port)) { print_menu_delayed(); continue; }
-            if (!tcp_download(ip, port, query)) { print_menu_delayed(); continue; }
+            if (!search_udp(query, ip, sizeof(ip), &port, msg)) { printf("%s\n", msg); print_menu_delayed(); continue; }
+            c = tcp_download(ip, port, query, msg);
+            printf("%s\n", msg);
+            if (!c) { print_menu_delayed(); continue; }
 
-            for (i = 0; i < nContent; i++) if (strcmp(contentList[i], query) == 0) { already = 1; break; }
-            if (!already && nContent < MAX_CONTENT) {
-                strncpy(contentList[nContent], query, sizeof(contentList[nContent]) - 1);
-                nContent++;
-            }
-            if (!register_content_udp(query)) {
-            } else {
-                ensure_tcp_listen();
-                if (host_pid <= 0) { host_pid = fork(); if (host_pid == 0) { hosting_loop(); _exit(0); } }
-            }
+            content_add(query);
+            if (register_content_udp(query, msg)) { printf("%s\n", msg); start_hosting(); }
+            else printf("Register error: %s\n", msg);
             print_menu_delayed();
         }
         else if (c == 'O' || c == 'o') {
-            UdpPDU p, r;
-            int i;
-
-            memset(&p, 0, sizeof(p)); p.type = T_LIST;
-            if (sendto(udp_sock, &p, sizeof(p), 0, (struct sockaddr *)&index_addr, index_addrlen) < 0) {
-                perror("sendto"); print_menu_delayed(); continue;
-            }
-            printf("\nAvailable content on network (content : hosts):\n");
-            while (1) {
-                if (recvfrom(udp_sock, &r, sizeof(r), 0, NULL, NULL) < 0) { perror("recvfrom"); break; }
-                if (r.type == T_LISTEND && r.data[0] == '\0') { printf("(none)\n"); break; }
-                for (i = 0; i < UDP_BUFLEN; ) {
-                    if (r.data[i] == '\0') break;
-                    printf(" - %s\n", &r.data[i]);
-                    while (i < UDP_BUFLEN && r.data[i] != '\0') i++;
-                    if (i < UDP_BUFLEN && r.data[i] == '\0') i++;
-                }
-                if (r.type == T_LISTEND) break;
+            int rc = sync_catalog();
+            if (rc == 0) printf("Catalog sync failed, try again\n");
+            else {
+                printf("\nAvailable content on network (content : hosts):\n");
+                if (rc < 0) list_full_udp();
+                else print_replica(NULL);
             }
             print_menu_delayed();
         }
+        else if (c == 'L' || c == 'l') {
+            char query[NAME_LEN + 2];
+            int ch;
+
+            memset(query, 0, sizeof(query));
+            printf("Enter part of a content name: ");
+            if (scanf("%50s", query) != 1) { printf("Input error\n"); print_menu_delayed(); continue; }
+            while ((ch = getchar()) != '\n' && ch != EOF) {}
+            if (replicaEpoch[0] == 0) printf("(catalog not synced yet, use O first)\n");
+            print_replica(query);
+            print_menu_delayed();
+        }
         else if (c == 'T' || c == 't') {
             char fname[NAME_LEN + 2];
-            int ch, i, pos;
+            int ch;
 
             memset(fname, 0, sizeof(fname));
             printf("Enter file name to de register: ");
             if (scanf("%50s", fname) != 1) { printf("Input error\n"); print_menu_delayed(); continue; }
             while ((ch = getchar()) != '\n' && ch != EOF) {}
 
-            if (dereg_content_udp(fname)) {
-                pos = -1;
-                for (i = 0; i < nContent; i++) if (strcmp(contentList[i], fname) == 0) { pos = i; break; }
-                if (pos >= 0) {
-                    for (i = pos + 1; i < nContent; i++) strcpy(contentList[i - 1], contentList[i]);
-                    nContent--;
-                    if (nContent >= 0) memset(contentList[nContent], 0, sizeof(contentList[nContent]));
-                }
-            }
+            if (dereg_content_udp(fname, msg)) content_remove(fname);
+            printf("%s\n", msg);
             print_menu_delayed();
         }
         else if (c == 'Q' || c == 'q') {
-            int i;
-            UdpPDU bye;
-            for (i = nContent - 1; i >= 0; i--) dereg_content_udp(contentList[i]);
-            memset(&bye, 0, sizeof(bye)); bye.type = T_BYE;
-            strncpy(bye.data, peerName, sizeof(bye.data) - 1);
-            sendto(udp_sock, &bye, sizeof(bye), 0, (struct sockaddr *)&index_addr, index_addrlen);
+            leave_index();
             if (host_pid > 0) { kill(host_pid, SIGKILL); host_pid = -1; }
             if (tcp_listen != -1) close(tcp_listen);
             printf("Goodbye\n");
@@ -8,7 +8,7 @@ typedef unsigned short u16;
 #define UDP_BUFLEN   512
 #define NAME_LEN     50
 #define MAX_PEERS    100
-#define MAX_CONTENT  100
+#define MAX_CONTENT  65536   /* per peer */
 
 #define T_REG      'R'
 #define T_SEARCH   'S'
@@ -19,10 +19,29 @@ typedef unsigned short u16;
 #define T_ACK      'A'
 #define T_ERR      'E'
 #define T_BYE      'B'
+#define T_SYNC     'V'   /* "since\0epoch\0seq\0", then cursor -> one sync page */
+#define T_DELTA    'W'   /* sync page, ask for the next */
+#define T_DELTAEND 'X'   /* last sync page */
+#define T_MAP      'H'   /* "" -> "version\0count\0ip:port\0..." shard map */
+#define T_MOVED    'G'   /* name belongs to another shard, refetch the map */
+#define T_MAPSET   'I'   /* index to index: newer map, then the sender's ip:port */
+#define T_JOIN     'J'   /* index to index: "ip:port" joins the ring */
+#define T_HANDOFF  'K'   /* index to index: "version\0asker\0page\0" -> entries it now owns */
+#define T_RELEASE  'L'   /* index to index: same, after the last page: drop what was sent */
+#define T_REGN     'U'   /* "peer\0port\0name\0name\0..." many registrations */
+#define T_DEREGN   'Y'   /* "peer\0name\0name\0..." many removals */
 
 #define T_REQ      'D'
 #define T_CHUNK    'C'
 #define T_FINAL    'Z'
+#define T_ZCHUNK   'P'   /* piece of a compressed block, see below */
+
+/* A T_REQ is "name\0" optionally followed by "prio\0" and "lz\0".  With
+   "lz" the host may send a block as T_ZCHUNK frames carrying u16 raw
+   length, u16 packed length and the lz.h data, raw length at most
+   ZBLOCK_MAX.  Blocks start on a frame boundary; T_FINAL still ends the
+   transfer. */
+#define ZBLOCK_MAX 8192
 
 #pragma pack(push, 1)
 typedef struct {
@@ -0,0 +1,105 @@
+#ifndef SHARD_H
+#define SHARD_H
+/* Watermark: Krish Patel (KrishAdmin) — shard.h */
+/* Watermark: https://krishadmin.com */
+
+/* Consistent hashing of content names onto index shards.  Every shard
+   puts SHARD_VNODES points on a 32-bit ring; a name belongs to the first
+   point at or after its own hash, so adding a shard only moves the names
+   that now land on its points. */
+
+#define MAX_SHARDS     16
+#define SHARD_VNODES   64
+#define SHARD_ADDR_LEN 24   /* "255.255.255.255:65535" */
+
+typedef struct {
+    unsigned long hash;
+    int shard;
+} ShardPoint;
+
+typedef struct {
+    unsigned long version;           /* 0: unsharded index */
+    int  n;
+    char addr[MAX_SHARDS][SHARD_ADDR_LEN];
+    ShardPoint ring[MAX_SHARDS * SHARD_VNODES];
+} ShardMap;
+
+/* FNV-1a with a final mix, so "host:port#1" and "#2" land far apart. */
+static unsigned long shard_hash(const char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) { h ^= (unsigned char)*s++; h = (h * 16777619UL) & 0xffffffffUL; }
+    h ^= h >> 16; h = (h * 0x85ebca6bUL) & 0xffffffffUL;
+    h ^= h >> 13; h = (h * 0xc2b2ae35UL) & 0xffffffffUL;
+    h ^= h >> 16;
+    return h;
+}
+
+static int shard_point_cmp(const void *a, const void *b) {
+    const ShardPoint *x = (const ShardPoint *)a, *y = (const ShardPoint *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->shard - y->shard;
+}
+
+static void shard_map_build(ShardMap *m) {
+    char key[SHARD_ADDR_LEN + 8];
+    int i, v;
+    for (i = 0; i < m->n; i++) {
+        for (v = 0; v < SHARD_VNODES; v++) {
+            sprintf(key, "%s#%d", m->addr[i], v);
+            m->ring[i * SHARD_VNODES + v].hash = shard_hash(key);
+            m->ring[i * SHARD_VNODES + v].shard = i;
+        }
+    }
+    qsort(m->ring, (size_t)(m->n * SHARD_VNODES), sizeof(m->ring[0]), shard_point_cmp);
+}
+
+static int shard_owner(const ShardMap *m, const char *content) {
+    unsigned long h = shard_hash(content);
+    int lo = 0, hi = m->n * SHARD_VNODES;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return m->ring[lo == m->n * SHARD_VNODES ? 0 : lo].shard;
+}
+
+/* T_MAP payload: "version\0count\0ip:port\0..."; builds the ring. */
+static int shard_map_decode(ShardMap *m, const char *buf, int len) {
+    int off = 0, i;
+    memset(m, 0, sizeof(*m));
+    if (!memchr(buf, '\0', (size_t)len)) return 0;
+    m->version = strtoul(buf, NULL, 10);
+    off = (int)strlen(buf) + 1;
+    if (off >= len || !memchr(buf + off, '\0', (size_t)(len - off))) return 0;
+    m->n = atoi(buf + off);
+    off += (int)strlen(buf + off) + 1;
+    if (m->n < 0 || m->n > MAX_SHARDS) return 0;
+    for (i = 0; i < m->n; i++) {
+        size_t alen;
+        if (off >= len || !memchr(buf + off, '\0', (size_t)(len - off))) return 0;
+        alen = strlen(buf + off);
+        if (alen == 0 || alen >= SHARD_ADDR_LEN) return 0;
+        strcpy(m->addr[i], buf + off);
+        off += (int)alen + 1;
+    }
+    shard_map_build(m);
+    return 1;
+}
+
+static int shard_addr_parse(const char *addr, struct sockaddr_in *sa) {
+    char ip[SHARD_ADDR_LEN];
+    const char *colon = strrchr(addr, ':');
+    int port;
+    if (!colon || colon == addr || (size_t)(colon - addr) >= sizeof(ip)) return 0;
+    memcpy(ip, addr, (size_t)(colon - addr));
+    ip[colon - addr] = '\0';
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) return 0;
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons((unsigned short)port);
+    return inet_pton(AF_INET, ip, &sa->sin_addr) == 1;
+}
+
+#endif
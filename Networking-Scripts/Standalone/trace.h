@@ -0,0 +1,127 @@
+#ifndef TRACE_H
+#define TRACE_H
+/* Watermark: Krish Patel (KrishAdmin) — trace.h */
+/* Watermark: https://krishadmin.com */
+
+/* Flight-recorder tracing.  Built with -DP2P_TRACE (make TRACE=1) and run
+   with P2P_TRACE_DIR set, each process maps <dir>/<prog>-<pid>.trace and
+   appends fixed-size records to a ring in it: no syscalls, no locks, the
+   newest TRACE_RING events survive a crash.  trace_decode turns the files
+   into Chrome-trace JSON.  Without -DP2P_TRACE the TRACE_* macros expand
+   to nothing. */
+
+#define TRACE_MAGIC   "P2PTRC1"
+#define TRACE_RING    65536   /* records per process, power of two */
+#define TRACE_TAG_LEN 23
+
+/* Events; the names in trace_decode.c follow this order. */
+#define TR_PDU      0   /* index: one request, receive to reply (span) */
+#define TR_PARSE    1   /* index: fields parsed */
+#define TR_LOOKUP   2   /* index: table lookup or update (span) */
+#define TR_REPLY    3   /* index: reply sent */
+#define TR_REQUEST  4   /* peer: request/reply with an index shard (span) */
+#define TR_UPLOAD   5   /* peer: one download served (async, id = conn) */
+#define TR_FRAME    6   /* peer: frame handed to send(), arg = bytes */
+#define TR_BLOCKED  7   /* peer: socket buffer full */
+#define TR_THROTTLE 8   /* peer: rate limit reached */
+#define TR_DOWNLOAD 9   /* peer: tcp_download (span) */
+#define TR_CHUNK    10  /* peer: frame received, arg = bytes */
+#define TR_EVENTS   11
+
+typedef struct {
+    long sec, nsec;     /* CLOCK_MONOTONIC */
+    long id;            /* async events: which upload */
+    long arg;           /* PDU type, byte count, ... */
+    unsigned short ev;  /* TR_* */
+    char ph;            /* Chrome phase: B E i b e n */
+    char tag[TRACE_TAG_LEN + 1];   /* content name, truncated */
+} TraceRec;
+
+typedef struct {
+    char magic[8];
+    long pid;
+    long cap;
+    unsigned long head;            /* records written so far */
+    char prog[32];
+} TraceHdr;
+
+#ifdef P2P_TRACE
+#include <fcntl.h>
+#include <sys/mman.h>
+
+static TraceHdr *traceHdr = NULL;
+static TraceRec *traceRing = NULL;
+static char traceProg[32];
+static char traceDir[400];   /* absolute, so a child after chdir() agrees */
+
+/* Maps this process's trace file; a forked child calls it again so it
+   does not write into its parent's ring. */
+static void trace_open(const char *prog) {
+    char path[512], *c;
+    size_t size = sizeof(TraceHdr) + TRACE_RING * sizeof(TraceRec);
+    void *m;
+    int fd;
+
+    if (prog != traceProg) {
+        const char *dir = getenv("P2P_TRACE_DIR");
+        sprintf(traceProg, "%.31s", prog);
+        for (c = traceProg; *c; c++) if (*c == ' ' || *c == '/') *c = '_';
+        traceDir[0] = '\0';
+        if (dir && *dir && dir[0] != '/' && getcwd(traceDir, 200)) strcat(traceDir, "/");
+        if (dir) strncat(traceDir, dir, sizeof(traceDir) - strlen(traceDir) - 1);
+    }
+    if (traceHdr) munmap(traceHdr, size);
+    traceHdr = NULL;
+    traceRing = NULL;
+    if (!traceDir[0]) return;
+    sprintf(path, "%s/%s-%ld.trace", traceDir, traceProg, (long)getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); return; }
+    if (ftruncate(fd, (off_t)size) < 0) { perror(path); close(fd); return; }
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) { perror("mmap"); return; }
+    traceHdr = (TraceHdr *)m;
+    traceRing = (TraceRec *)(traceHdr + 1);
+    memcpy(traceHdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    traceHdr->pid = (long)getpid();
+    traceHdr->cap = TRACE_RING;
+    strcpy(traceHdr->prog, traceProg);
+}
+
+static void trace_emit(int ev, char ph, long id, long arg, const char *tag) {
+    struct timespec ts;
+    TraceRec *r;
+    size_t n;
+    if (!traceRing) return;
+    r = &traceRing[traceHdr->head & (TRACE_RING - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->sec = (long)ts.tv_sec;
+    r->nsec = ts.tv_nsec;
+    r->id = id;
+    r->arg = arg;
+    r->ev = (unsigned short)ev;
+    r->ph = ph;
+    n = tag ? strlen(tag) : 0;
+    if (n > TRACE_TAG_LEN) n = TRACE_TAG_LEN;
+    memcpy(r->tag, tag ? tag : "", n);
+    r->tag[n] = '\0';
+    traceHdr->head++;
+}
+
+#define TRACE_OPEN(prog)             trace_open(prog)
+#define TRACE_FORK()                 trace_open(traceProg)
+#define TRACE_BEGIN(ev, arg, tag)    trace_emit(ev, 'B', 0, arg, tag)
+#define TRACE_END(ev, arg)           trace_emit(ev, 'E', 0, arg, NULL)
+#define TRACE_MARK(ev, arg, tag)     trace_emit(ev, 'i', 0, arg, tag)
+#define TRACE_ASYNC(ev, ph, id, arg, tag) trace_emit(ev, ph, id, arg, tag)
+#else
+#define TRACE_OPEN(prog)             ((void)0)
+#define TRACE_FORK()                 ((void)0)
+#define TRACE_BEGIN(ev, arg, tag)    ((void)0)
+#define TRACE_END(ev, arg)           ((void)0)
+#define TRACE_MARK(ev, arg, tag)     ((void)0)
+#define TRACE_ASYNC(ev, ph, id, arg, tag) ((void)0)
+#endif
+
+#endif
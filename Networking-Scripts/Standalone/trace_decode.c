@@ -0,0 +1,160 @@
+/* Watermark: Krish Patel (KrishAdmin) — trace_decode.c */
+/* Watermark: https://krishadmin.com */
+
+/* Turns the .trace rings written by a P2P_TRACE build into Chrome-trace
+   JSON (chrome://tracing, Perfetto, speedscope), or with -f into folded
+   stacks with self time in microseconds for flamegraph.pl.
+   Usage: trace_decode [-f] file.trace... > out.json */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef P2P_TRACE   /* only the record layout is needed here */
+#include "trace.h"
+
+#define MAX_DEPTH 16
+
+static const char *names[TR_EVENTS] = {
+    "pdu", "parse", "lookup", "reply", "request",
+    "upload", "frame", "blocked", "throttled", "download", "chunk"
+};
+
+typedef struct {
+    TraceHdr hdr;
+    TraceRec *recs;   /* oldest first */
+    long n;
+} TraceFile;
+
+/* Reads the ring and unrolls it; only the newest cap records survive. */
+static int load(const char *path, TraceFile *tf) {
+    FILE *fp = fopen(path, "rb");
+    TraceRec *ring;
+    long i, start;
+
+    memset(tf, 0, sizeof(*tf));
+    if (!fp) { perror(path); return 0; }
+    if (fread(&tf->hdr, sizeof(tf->hdr), 1, fp) != 1 || memcmp(tf->hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        tf->hdr.cap <= 0 || (tf->hdr.cap & (tf->hdr.cap - 1)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(fp);
+        return 0;
+    }
+    ring = malloc((size_t)tf->hdr.cap * sizeof(*ring));
+    tf->n = tf->hdr.head < (unsigned long)tf->hdr.cap ? (long)tf->hdr.head : tf->hdr.cap;
+    tf->recs = malloc((size_t)(tf->n ? tf->n : 1) * sizeof(*tf->recs));
+    if (!ring || !tf->recs || fread(ring, sizeof(*ring), (size_t)tf->hdr.cap, fp) != (size_t)tf->hdr.cap) {
+        fprintf(stderr, "%s: truncated\n", path);
+        free(ring);
+        free(tf->recs);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    start = (long)(tf->hdr.head - (unsigned long)tf->n);
+    for (i = 0; i < tf->n; i++) tf->recs[i] = ring[(start + i) & (tf->hdr.cap - 1)];
+    free(ring);
+    return 1;
+}
+
+static double usec(const TraceRec *r, long base) {
+    return (double)(r->sec - base) * 1e6 + (double)r->nsec / 1e3;
+}
+
+static void put_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", (unsigned char)*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+static int pdu_typed(const TraceRec *r) {
+    return (r->ev == TR_PDU || r->ev == TR_REQUEST || r->ev == TR_REPLY) && r->arg > 32 && r->arg < 127;
+}
+
+static void emit_json(TraceFile *tf, int nfiles, long base) {
+    int f, first = 1;
+    long i;
+    printf("{\"traceEvents\":[\n");
+    for (f = 0; f < nfiles; f++) {
+        long pid = tf[f].hdr.pid;
+        int depth = 0;
+        printf("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":", first ? "" : ",\n", pid, pid);
+        put_json_string(tf[f].hdr.prog);
+        printf("}}");
+        first = 0;
+        for (i = 0; i < tf[f].n; i++) {
+            const TraceRec *r = &tf[f].recs[i];
+            if (r->ev >= TR_EVENTS) continue;
+            /* the ring may have dropped the B of an early E */
+            if (r->ph == 'B') depth++;
+            else if (r->ph == 'E' && depth-- <= 0) { depth = 0; continue; }
+            printf(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%ld",
+                   names[r->ev], r->ph == 'b' || r->ph == 'e' || r->ph == 'n' ? "upload" : "p2p", r->ph, usec(r, base), pid, pid);
+            if (r->ph == 'b' || r->ph == 'e' || r->ph == 'n') printf(",\"id\":%ld", r->id);
+            if (r->ph == 'i') printf(",\"s\":\"t\"");
+            printf(",\"args\":{\"arg\":%ld", r->arg);
+            if (pdu_typed(r)) printf(",\"type\":\"%c\"", (char)r->arg);
+            if (r->tag[0]) { printf(",\"name\":"); put_json_string(r->tag); }
+            printf("}}");
+        }
+    }
+    printf("\n]}\n");
+}
+
+/* One line per closed span: "prog;outer;inner self_us". */
+static void emit_folded(TraceFile *tf, int nfiles, long base) {
+    int f;
+    long i;
+    for (f = 0; f < nfiles; f++) {
+        int stack[MAX_DEPTH], depth = 0, k;
+        double start[MAX_DEPTH], child[MAX_DEPTH];
+        for (i = 0; i < tf[f].n; i++) {
+            const TraceRec *r = &tf[f].recs[i];
+            double t = usec(r, base);
+            if (r->ev >= TR_EVENTS) continue;
+            if (r->ph == 'B') {
+                if (depth == MAX_DEPTH) continue;
+                stack[depth] = r->ev;
+                start[depth] = t;
+                child[depth] = 0;
+                depth++;
+            } else if (r->ph == 'E' && depth > 0) {
+                double dur = t - start[--depth];
+                long self = (long)(dur - child[depth] + 0.5);
+                if (depth > 0) child[depth - 1] += dur;
+                if (self <= 0) continue;
+                printf("%s", tf[f].hdr.prog);
+                for (k = 0; k <= depth; k++) printf(";%s", names[stack[k]]);
+                printf(" %ld\n", self);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    TraceFile *tf;
+    int folded = 0, nfiles = 0, i;
+    long base = -1;
+
+    if (argc > 1 && strcmp(argv[1], "-f") == 0) { folded = 1; argv++; argc--; }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [-f] file.trace... > trace.json\n", argv[0]);
+        return 1;
+    }
+    tf = malloc((size_t)(argc - 1) * sizeof(*tf));
+    if (!tf) { perror("malloc"); return 1; }
+    for (i = 1; i < argc; i++) {
+        if (!load(argv[i], &tf[nfiles])) continue;
+        if (tf[nfiles].n && (base < 0 || tf[nfiles].recs[0].sec < base)) base = tf[nfiles].recs[0].sec;
+        nfiles++;
+    }
+    if (!nfiles) return 1;
+    if (base < 0) base = 0;
+    if (folded) emit_folded(tf, nfiles, base);
+    else emit_json(tf, nfiles, base);
+    return 0;
+}
+/* Watermark: End of trace_decode.c — KrishAdmin */
\ No newline at end of file
@@ -0,0 +1,29 @@
+#!/bin/sh
+# make check: two downloads from a peer with P2P_UPLOAD_CAP=1m must share
+# the cap, so both 3 MB files finish close together (about 6 s) instead of
+# one after the other.  Needs index port 15000 free.
+B=$(cd "$(dirname "$0")" && pwd)
+T=$(mktemp -d) || exit 1
+trap 'kill $SP 2>/dev/null; rm -rf "$T"' EXIT
+cd "$T" && mkdir A B C logs
+P2P_LOG_DIR=logs "$B/directory_server" 15000 > srv.out 2>&1 & SP=$!
+head -c 3000000 /dev/urandom > A/one.bin
+head -c 3000000 /dev/urandom > A/two.bin
+sleep 0.3
+( cd A; (printf 'REG one.bin\nREG two.bin\n#up WAIT\n'; sleep 14; printf 'QUIT\n') | P2P_UPLOAD_CAP=1m "$B/peer_node" 127.0.0.1 Alice -b - > ../a.out 2> ../a.log ) & AP=$!
+t=0
+while [ $t -lt 50 ] && ! grep -q "^#up " a.out 2>/dev/null; do sleep 0.1; t=$((t + 1)); done
+( cd B; (printf 'GET one.bin\n'; sleep 10; printf 'QUIT\n') | "$B/peer_node" 127.0.0.1 Bob -b - > ../b.out 2> ../b.log ) & BP=$!
+( cd C; (printf 'GET two.bin\n'; sleep 10; printf 'QUIT\n') | "$B/peer_node" 127.0.0.1 Carol -b - > ../c.out 2> ../c.log ) & CP=$!
+t=0; first=0; second=0
+while [ $t -lt 100 ]; do
+    sleep 0.1; t=$((t + 1)); n=0
+    cmp -s A/one.bin B/one.bin && n=$((n + 1))
+    cmp -s A/two.bin C/two.bin && n=$((n + 1))
+    [ $n -ge 1 ] && [ $first -eq 0 ] && first=$t
+    [ $n -eq 2 ] && { second=$t; break; }
+done
+wait $AP $BP $CP
+echo "first done after ${first}00 ms, second after ${second}00 ms"
+[ $second -gt 0 ] && [ $((second - first)) -le 10 ] && { echo "PASS"; exit 0; }
+echo "FAIL"; exit 1